@@ -0,0 +1,328 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "script.h"
+#include "logging.h"
+
+extern char **environ;
+
+#define INITIAL_CAPACITY 16384
+
+/**
+ * make sure the buffer has room for another length bytes
+ *
+ * \return 0 on success, -1 if there was no memory
+ */
+static int reserve(struct Batch *batch, size_t length)
+{
+    size_t capacity = batch->capacity;
+    char *buffer;
+    while (capacity < batch->length + length) {
+        capacity *= 2;
+    }
+    if (capacity == batch->capacity) {
+        return 0;
+    }
+    buffer = realloc(batch->buffer, capacity);
+    if (buffer == NULL) {
+        return -1;
+    }
+    batch->buffer = buffer;
+    batch->capacity = capacity;
+    return 0;
+}
+
+static void appendText(struct Batch *batch, char const *text)
+{
+    size_t length = strlen(text);
+    if (reserve(batch, length) == 0) {
+        memcpy(batch->buffer + batch->length, text, length);
+        batch->length += length;
+    }
+}
+
+/**
+ * start a new document
+ */
+static void beginDocument(struct Batch *batch)
+{
+    batch->length = 0;
+    batch->count = 0;
+    if (batch->format == OUTPUT_JSON) {
+        appendText(batch, "[\n");
+    }
+    else {
+        batch->length = formatOutputHeader(batch->format, batch->buffer, batch->capacity);
+    }
+}
+
+struct Batch *initBatch(char const * const program, int format, unsigned int maxCount, int maxAge, int useFile)
+{
+    unsigned int count = 0;
+    unsigned int i;
+    struct Batch *batch = calloc(1, sizeof(struct Batch));
+    if (batch == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return NULL;
+    }
+    errno = initSpawnAttributes(&(batch->attributes));
+    if (errno != 0) {
+        log_output(LOG_ERR, "Could not prepare running %s. %s\n", program, strerror(errno));
+        free(batch);
+        return NULL;
+    }
+    while (environ[count] != NULL) {
+        ++count;
+    }
+    batch->program = strdup(program);
+    batch->buffer = malloc(INITIAL_CAPACITY);
+    batch->envp = malloc((count + 2) * sizeof(char *));
+    if (batch->program == NULL || batch->buffer == NULL || batch->envp == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        posix_spawnattr_destroy(&(batch->attributes));
+        free(batch->program);
+        free(batch->buffer);
+        free(batch->envp);
+        free(batch);
+        return NULL;
+    }
+    // the environment is taken over once, like the script runner does
+    for (i = 0; environ[i] != NULL; ++i) {
+        if (strncmp(environ[i], "UVR_BATCH_FILE=", 15) != 0) {
+            batch->envp[batch->inherited++] = environ[i];
+        }
+    }
+    batch->envp[batch->inherited] = NULL;
+    batch->capacity = INITIAL_CAPACITY;
+    batch->format = format;
+    batch->maxCount = maxCount;
+    batch->maxAge = maxAge;
+    batch->useFile = useFile;
+    batch->timeout = DEFAULT_SCRIPT_TIMEOUT * 1000;
+    // a program exiting without reading everything must not kill us
+    signal(SIGPIPE, SIG_IGN);
+    beginDocument(batch);
+    return batch;
+}
+
+int batchAdd(struct Batch *batch, struct Sample *sample)
+{
+    size_t separator = batch->format == OUTPUT_JSON && batch->count > 0 ? 1 : 0;
+    size_t length;
+    if (batch->count == 0) {
+        batch->started = time(NULL);
+    }
+    if (reserve(batch, separator + OUTPUT_BUFFER_SIZE) != 0) {
+        log_output(LOG_ERR, "Could not add sample to batch. %s\n", strerror(errno));
+        return -1;
+    }
+    // the separator is only added once the record was written
+    length = formatOutputRecord(batch->format, batch->buffer + batch->length + separator,
+                                batch->capacity - batch->length - separator, sample);
+    if (length == 0) {
+        return 0;
+    }
+    if (separator) {
+        batch->buffer[batch->length] = ',';
+    }
+    batch->length += separator + length;
+    ++batch->count;
+    ++batch->samples;
+    if (batch->count >= batch->maxCount * BATCH_MAX_KEPT) {
+        // the program keeps failing, make room instead of growing without bounds
+        log_output(LOG_ERR, "%s did not accept the last %u samples, dropping them\n", batch->program, batch->count);
+        batch->lost += batch->count;
+        beginDocument(batch);
+        return -1;
+    }
+    if ((batch->count >= batch->maxCount || time(NULL) - batch->started >= batch->maxAge) && time(NULL) >= batch->retryAt) {
+        return batchFlush(batch);
+    }
+    return 0;
+}
+
+int batchDeadline(struct Batch *batch, struct timespec *deadline)
+{
+    if (batch->count == 0) {
+        return 0;
+    }
+    deadline->tv_sec = batch->started + batch->maxAge;
+    if (deadline->tv_sec < batch->retryAt) {
+        deadline->tv_sec = batch->retryAt;
+    }
+    deadline->tv_nsec = 0;
+    return 1;
+}
+
+void batchCheckAge(struct Batch *batch)
+{
+    time_t now = time(NULL);
+    if (batch->count > 0 && now - batch->started >= batch->maxAge && now >= batch->retryAt) {
+        batchFlush(batch);
+    }
+}
+
+/**
+ * write the whole document to the fd
+ *
+ * \return 0 on success, -1 else
+ */
+static int writeDocument(int fd, char const *buffer, size_t length)
+{
+    size_t offset = 0;
+    while (offset < length) {
+        ssize_t ret = write(fd, buffer+offset, length-offset);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        offset += ret;
+    }
+    return 0;
+}
+
+/**
+ * run the program with the document in a temporary file, named in
+ * UVR_BATCH_FILE or connected to its stdin
+ *
+ * \return the exit status of the program, -1 if it could not be run or was killed
+ */
+static int runProgram(struct Batch *batch)
+{
+    char path[] = "/tmp/dlogg-batch-XXXXXX";
+    char *argv[4];
+    posix_spawn_file_actions_t actions;
+    int fd;
+    int status;
+    int ret;
+    pid_t child = -1;
+    argv[0] = "/bin/sh";
+    argv[1] = "-c";
+    argv[2] = batch->program;
+    argv[3] = NULL;
+    batch->envp[batch->inherited] = NULL;
+    fd = mkstemp(path);
+    if (fd < 0 || writeDocument(fd, batch->buffer, batch->length) != 0 || lseek(fd, 0, SEEK_SET) != 0) {
+        log_output(LOG_ERR, "Could not write batch file %s. %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(path);
+        }
+        return -1;
+    }
+    // other programs started meanwhile must not inherit the file
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (batch->useFile) {
+        snprintf(batch->fileVariable, sizeof(batch->fileVariable), "UVR_BATCH_FILE=%s", path);
+        batch->envp[batch->inherited] = batch->fileVariable;
+        batch->envp[batch->inherited + 1] = NULL;
+    }
+    ret = posix_spawn_file_actions_init(&actions);
+    if (ret == 0) {
+        if (!batch->useFile) {
+            ret = posix_spawn_file_actions_adddup2(&actions, fd, STDIN_FILENO);
+        }
+        if (ret == 0) {
+            ret = posix_spawn(&child, argv[0], &actions, &(batch->attributes), argv, batch->envp);
+        }
+        posix_spawn_file_actions_destroy(&actions);
+    }
+    close(fd);
+    status = -1;
+    if (ret != 0) {
+        log_output(LOG_ERR, "Could not start %s. %s\n", batch->program, strerror(ret));
+    }
+    else if (waitForChild(child, &status, batch->timeout) != 0) {
+        if (errno == ETIMEDOUT) {
+            log_output(LOG_ERR, "%s did not finish within %d ms, killed it\n", batch->program, batch->timeout);
+            ++batch->timeouts;
+        }
+        status = -1;
+    }
+    else {
+        status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+    unlink(path);
+    return status;
+}
+
+int batchFlush(struct Batch *batch)
+{
+    size_t length = batch->length;
+    int status;
+    if (batch->count == 0) {
+        return 0;
+    }
+    if (batch->format == OUTPUT_JSON) {
+        appendText(batch, "]\n");
+    }
+    log_output(LOG_DEBUG, "Handing %u samples to %s\n", batch->count, batch->program);
+    status = runProgram(batch);
+    ++batch->flushes;
+    if (status != 0) {
+        ++batch->failures;
+        // keep the samples and try again later, together with the ones arriving meanwhile
+        batch->length = length;
+        batch->retryDelay = batch->retryDelay == 0 ? 1 : batch->retryDelay * 2;
+        if (batch->retryDelay > BATCH_MAX_RETRY_DELAY) {
+            batch->retryDelay = BATCH_MAX_RETRY_DELAY;
+        }
+        batch->retryAt = time(NULL) + batch->retryDelay;
+        log_output(LOG_WARNING, "%s failed on a batch of %u samples (status %d), retrying in %d s\n",
+                   batch->program, batch->count, status, batch->retryDelay);
+        return -1;
+    }
+    batch->retryDelay = 0;
+    batch->retryAt = 0;
+    beginDocument(batch);
+    return 0;
+}
+
+void cleanupBatch(struct Batch *batch)
+{
+    if (batch == NULL) {
+        return;
+    }
+    if (batchFlush(batch) != 0) {
+        log_output(LOG_ERR, "%s did not accept the last %u samples, they are lost\n", batch->program, batch->count);
+        batch->lost += batch->count;
+    }
+    log_output(LOG_INFO, "Handed %lu samples to %s in %lu runs, %lu runs failed, %lu timed out, %lu samples lost\n",
+               batch->samples, batch->program, batch->flushes, batch->failures, batch->timeouts, batch->lost);
+    posix_spawnattr_destroy(&(batch->attributes));
+    free(batch->program);
+    free(batch->buffer);
+    free(batch->envp);
+    free(batch);
+}
@@ -0,0 +1,129 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <time.h>
+#include <spawn.h>
+
+#include "datatypes.h"
+#include "output.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DEFAULT_BATCH_AGE 60
+#define BATCH_MAX_KEPT 16           /* full batches kept while the program fails */
+#define BATCH_MAX_RETRY_DELAY 60    /* seconds */
+
+/**
+ * collects samples and hands them to a program as one document.
+ *
+ * The batch is flushed when it holds count samples, when its oldest sample
+ * is age seconds old or when the batch is cleaned up. The program gets the
+ * document on its stdin or, with useFile, in a temporary file named in
+ * UVR_BATCH_FILE. Either way the document is written to the temporary file
+ * first, so a program which does not read cannot block the reader. A
+ * program running longer than timeout is killed. A batch the program failed
+ * on is kept and handed over again after a growing delay together with the
+ * samples added meanwhile, up to BATCH_MAX_KEPT times the batch size.
+ */
+struct Batch
+{
+    char *program;
+    int format;             /* OUTPUT_CSV, OUTPUT_JSON or OUTPUT_INFLUX */
+    int useFile;
+    unsigned int maxCount;
+    int maxAge;             /* seconds */
+    char *buffer;           /* the rows of the document collected so far */
+    size_t length;
+    size_t capacity;
+    unsigned int count;     /* number of samples in buffer */
+    time_t started;         /* when the first sample of the batch was added */
+    time_t retryAt;         /* no flush before this time after a failure */
+    int retryDelay;         /* seconds, 0 after a success */
+    int timeout;            /* ms a run may take before the program is killed */
+    posix_spawnattr_t attributes;
+    char **envp;            /* the inherited environment followed by room for UVR_BATCH_FILE */
+    unsigned int inherited;
+    char fileVariable[64];
+    unsigned long flushes;
+    unsigned long samples;
+    unsigned long failures; /* number of runs the program failed */
+    unsigned long timeouts; /* number of runs the program was killed */
+    unsigned long lost;     /* samples dropped because the program kept failing */
+};
+
+/**
+ * create a batch
+ *
+ * \param program the command line to run via /bin/sh -c for every batch
+ * \param format OUTPUT_CSV, OUTPUT_JSON or OUTPUT_INFLUX
+ * \param maxCount the number of samples to flush at
+ * \param maxAge the age of the oldest sample to flush at in seconds
+ * \param useFile hand the document over in a temporary file instead of stdin
+ * \return a pointer to the batch on success, NULL else. errno will be set accordingly
+ */
+struct Batch *initBatch(char const * const program, int format, unsigned int maxCount, int maxAge, int useFile);
+
+/**
+ * add a sample to the batch, flushing it if it is full or old enough.
+ * Unchanged values of the delta mode are left empty.
+ *
+ * \return 0 on success, -1 if the sample could not be stored or the flush failed
+ */
+int batchAdd(struct Batch *batch, struct Sample *sample);
+
+/**
+ * get the time the batch has to be flushed at, which is later while a failed
+ * batch waits for its retry
+ *
+ * \param deadline set to the CLOCK_REALTIME flush time
+ * \return 1 if deadline was set, 0 if the batch is empty
+ */
+int batchDeadline(struct Batch *batch, struct timespec *deadline);
+
+/**
+ * flush the batch if its oldest sample reached the maximum age
+ */
+void batchCheckAge(struct Batch *batch);
+
+/**
+ * hand the collected samples to the program now. Does nothing for an empty batch.
+ * On failure the samples stay in the batch.
+ *
+ * \return 0 on success, -1 on error
+ */
+int batchFlush(struct Batch *batch);
+
+/**
+ * flush the remaining samples and clean up. Samples the program does not
+ * accept now are lost and logged.
+ */
+void cleanupBatch(struct Batch *batch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BATCH_H */
@@ -0,0 +1,233 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "capture.h"
+#include "communication.h"
+#include "parsing.h"
+#include "logging.h"
+
+/* longest sleep between two checks for a stop request during a paced replay, in ns */
+#define REPLAY_STOP_CHECK 100000000LL
+
+static void putNumber(unsigned char *buffer, unsigned long long value, int bytes)
+{
+    int i;
+    for (i = 0; i < bytes; ++i) {
+        buffer[i] = (value >> (8*i)) & 0xFF;
+    }
+}
+
+static unsigned long long getNumber(unsigned char const *buffer, int bytes)
+{
+    unsigned long long value = 0;
+    int i;
+    for (i = bytes-1; i >= 0; --i) {
+        value = (value << 8) | buffer[i];
+    }
+    return value;
+}
+
+struct CaptureWriter *openCaptureWriter(char const *path)
+{
+    struct CaptureWriter *writer;
+    writer = malloc(sizeof(struct CaptureWriter));
+    if (writer == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return NULL;
+    }
+    writer->frames = 0;
+    writer->file = fopen(path, "ab");
+    if (writer->file == NULL) {
+        log_output(LOG_ERR, "Could not open capture file %s. %s\n", path, strerror(errno));
+        free(writer);
+        return NULL;
+    }
+    if (ftell(writer->file) == 0) {
+        unsigned char header[CAPTURE_FILE_HEADER];
+        memcpy(header, CAPTURE_MAGIC, 8);
+        putNumber(header+8, CAPTURE_VERSION, 4);
+        if (fwrite(header, CAPTURE_FILE_HEADER, 1, writer->file) != 1) {
+            log_output(LOG_ERR, "Could not write capture file %s. %s\n", path, strerror(errno));
+            fclose(writer->file);
+            free(writer);
+            return NULL;
+        }
+    }
+    return writer;
+}
+
+int captureFrame(struct CaptureWriter *writer, struct USBConnection *conn, unsigned char const *frame, int length)
+{
+    unsigned char header[CAPTURE_FRAME_HEADER];
+    struct timespec now;
+    putNumber(header, length, 2);
+    header[2] = conn->id;
+    header[3] = conn->uvr_mode;
+    putNumber(header+4, monotonicNanoseconds(), 8);
+    clock_gettime(CLOCK_REALTIME, &now);
+    putNumber(header+12, ((unsigned long long)now.tv_sec) * 1000000000ULL + now.tv_nsec, 8);
+    if (fwrite(header, CAPTURE_FRAME_HEADER, 1, writer->file) != 1
+        || fwrite(frame, length, 1, writer->file) != 1
+        || fflush(writer->file) != 0) {
+        log_output(LOG_ERR, "Could not write capture file. %s\n", strerror(errno));
+        return -1;
+    }
+    ++writer->frames;
+    return 0;
+}
+
+void closeCaptureWriter(struct CaptureWriter *writer)
+{
+    if (writer != NULL) {
+        log_output(LOG_DEBUG, "Captured %lu frames\n", writer->frames);
+        fclose(writer->file);
+        free(writer);
+    }
+}
+
+struct CaptureReader *openCaptureReader(char const *path)
+{
+    struct CaptureReader *reader;
+    unsigned char header[CAPTURE_FILE_HEADER];
+    reader = malloc(sizeof(struct CaptureReader));
+    if (reader == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return NULL;
+    }
+    reader->frames = 0;
+    reader->file = fopen(path, "rb");
+    if (reader->file == NULL) {
+        log_output(LOG_ERR, "Could not open capture file %s. %s\n", path, strerror(errno));
+        free(reader);
+        return NULL;
+    }
+    if (fread(header, CAPTURE_FILE_HEADER, 1, reader->file) != 1
+        || memcmp(header, CAPTURE_MAGIC, 8) != 0
+        || getNumber(header+8, 4) != CAPTURE_VERSION) {
+        log_output(LOG_ERR, "%s is not a capture file\n", path);
+        fclose(reader->file);
+        free(reader);
+        errno = EINVAL;
+        return NULL;
+    }
+    return reader;
+}
+
+int readCapturedFrame(struct CaptureReader *reader, struct CapturedFrame *frame)
+{
+    unsigned char header[CAPTURE_FRAME_HEADER];
+    unsigned long long realtime;
+    if (fread(header, CAPTURE_FRAME_HEADER, 1, reader->file) != 1) {
+        return feof(reader->file) ? 0 : -1;
+    }
+    frame->length = getNumber(header, 2);
+    frame->deviceID = header[2];
+    frame->mode = header[3];
+    frame->monotonic = getNumber(header+4, 8);
+    realtime = getNumber(header+12, 8);
+    frame->received.tv_sec = realtime / 1000000000ULL;
+    frame->received.tv_nsec = realtime % 1000000000ULL;
+    if (frame->length <= 0 || frame->length > UVR1611_DUAL_FRAME_SIZE) {
+        log_output(LOG_ERR, "Invalid frame length %d in capture file\n", frame->length);
+        errno = EINVAL;
+        return -1;
+    }
+    if (fread(frame->frame, frame->length, 1, reader->file) != 1) {
+        // a truncated last frame, e.g. the reader was killed while writing
+        return feof(reader->file) ? 0 : -1;
+    }
+    ++reader->frames;
+    return 1;
+}
+
+void closeCaptureReader(struct CaptureReader *reader)
+{
+    if (reader != NULL) {
+        fclose(reader->file);
+        free(reader);
+    }
+}
+
+/**
+ * check whether the replay was asked to stop
+ */
+static int replayStopped(int *stop)
+{
+    return stop != NULL && __atomic_load_n(stop, __ATOMIC_ACQUIRE);
+}
+
+int replayCapture(char const *path, double speed, SampleHandler handler, void *context, int *stop)
+{
+    struct CaptureReader *reader;
+    struct CapturedFrame frame;
+    struct Sample sample;
+    long long firstFrame = 0;
+    long long start;
+    int ret = 0;
+    reader = openCaptureReader(path);
+    if (reader == NULL) {
+        return -1;
+    }
+    start = monotonicNanoseconds();
+    while (!replayStopped(stop) && (ret = readCapturedFrame(reader, &frame)) == 1) {
+        unsigned int i;
+        if (reader->frames == 1) {
+            firstFrame = frame.monotonic;
+        }
+        if (speed > 0) {
+            // keep the recorded distance between the frames, divided by the speed-up
+            long long due = start + (long long)((frame.monotonic - firstFrame) / speed);
+            long long wait;
+            // sleep in short steps, a stop request should not wait for a long gap in the recording
+            while ((wait = due - monotonicNanoseconds()) > 0 && !replayStopped(stop)) {
+                struct timespec delay;
+                if (wait > REPLAY_STOP_CHECK) {
+                    wait = REPLAY_STOP_CHECK;
+                }
+                delay.tv_sec = wait / 1000000000LL;
+                delay.tv_nsec = wait % 1000000000LL;
+                nanosleep(&delay, NULL);
+            }
+        }
+        sample.timestamp = frame.received;
+        sample.deviceID = frame.deviceID;
+        for (i = 0; i < dataFrameControllerCount(frame.length); ++i) {
+            sample.controllerID = i+1;
+            if (parseDataFrame(frame.frame, frame.length, i, &(sample.state)) == 0) {
+                handler(context, &sample);
+            }
+        }
+    }
+    if (ret < 0) {
+        log_output(LOG_ERR, "Could not read capture file %s. %s\n", path, strerror(errno));
+    }
+    else {
+        double seconds = (monotonicNanoseconds() - start) / 1e9;
+        log_output(LOG_INFO, "Replayed %lu frames in %.3f s, %.0f frames/s\n", reader->frames, seconds,
+                   seconds > 0 ? reader->frames / seconds : 0.0);
+    }
+    closeCaptureReader(reader);
+    return ret < 0 ? -1 : 0;
+}
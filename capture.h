@@ -0,0 +1,134 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+
+#include "datatypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A capture file starts with the 8 bytes "DLOGGCAP" and a 4 byte version.
+ * Every frame follows as a record of
+ *   - length of the frame (2 bytes)
+ *   - device id (1 byte)
+ *   - device mode as returned by GET_MODE (1 byte)
+ *   - monotonic time of reception in ns (8 bytes)
+ *   - real time of reception in ns since the epoch (8 bytes)
+ *   - the frame
+ * All numbers are little endian.
+ */
+#define CAPTURE_MAGIC        "DLOGGCAP"
+#define CAPTURE_VERSION      1
+#define CAPTURE_FILE_HEADER  12
+#define CAPTURE_FRAME_HEADER 20
+
+/**
+ * a frame read from a capture file
+ */
+struct CapturedFrame
+{
+    unsigned int deviceID;
+    unsigned char mode;
+    long long monotonic;       /* ns */
+    struct timespec received;  /* CLOCK_REALTIME */
+    int length;
+    unsigned char frame[UVR1611_DUAL_FRAME_SIZE+1];
+};
+
+/**
+ * appends raw frames to a capture file
+ */
+struct CaptureWriter
+{
+    FILE *file;
+    unsigned long frames;
+};
+
+/**
+ * reads raw frames from a capture file
+ */
+struct CaptureReader
+{
+    FILE *file;
+    unsigned long frames;
+};
+
+/**
+ * open a capture file for appending. A new file gets the file header.
+ *
+ * \return a pointer to the writer on success, NULL else. errno will be set accordingly
+ */
+struct CaptureWriter *openCaptureWriter(char const *path);
+
+/**
+ * append the frame just received on the connection
+ *
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+int captureFrame(struct CaptureWriter *writer, struct USBConnection *conn, unsigned char const *frame, int length);
+
+/**
+ * close the capture file
+ */
+void closeCaptureWriter(struct CaptureWriter *writer);
+
+/**
+ * open a capture file for reading
+ *
+ * \return a pointer to the reader on success, NULL else. errno will be set accordingly
+ */
+struct CaptureReader *openCaptureReader(char const *path);
+
+/**
+ * read the next frame of the capture file
+ *
+ * \return 1 if a frame was read, 0 at the end of the file, -1 on error. errno will be set accordingly
+ */
+int readCapturedFrame(struct CaptureReader *reader, struct CapturedFrame *frame);
+
+/**
+ * close the capture file
+ */
+void closeCaptureReader(struct CaptureReader *reader);
+
+/**
+ * feed all frames of a capture file through the parser to the handler
+ *
+ * \param path the capture file
+ * \param speed the speed-up factor relative to the recorded timing, 0 replays as fast as possible
+ * \param handler the callback receiving the samples
+ * \param context passed to the callback
+ * \param stop the replay ends after the current frame once another thread sets it to non-zero, may be NULL
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+int replayCapture(char const *path, double speed, SampleHandler handler, void *context, int *stop);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CAPTURE_H */
@@ -18,21 +18,75 @@
 */
 
 
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <termios.h>
 #include <unistd.h>
 
 #include "communication.h"
 #include "parsing.h"
+#include "capture.h"
+#include "latency.h"
 #include "logging.h"
 
+/**
+ * the backoff before the first retry in ms. It is doubled for every further retry.
+ */
+#define RETRY_BACKOFF 50
+/**
+ * the number of consecutive failed transactions after which the device is reopened
+ */
+#define REOPEN_THRESHOLD 3
+
+long long monotonicNanoseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((long long)now.tv_sec) * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * wait until the device is ready for the given poll events or the deadline passed
+ *
+ * \param deadline the deadline on the monotonic clock in ns
+ * \return 0 if the device is ready, -1 else. errno is ETIMEDOUT if the deadline passed
+ */
+static int waitForDevice(int fd, short events, long long deadline)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    for (;;) {
+        long long remaining;
+        int ret;
+        remaining = deadline - monotonicNanoseconds();
+        if (remaining <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        ret = poll(&pfd, 1, (int)((remaining + 999999) / 1000000));
+        if (ret > 0) {
+            if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                errno = EIO;
+                return -1;
+            }
+            return 0;
+        }
+        if (ret < 0 && errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
 /**
  * send a command to the device
  * 
@@ -42,14 +96,136 @@
  */
 int sendCommand(struct USBConnection *conn, unsigned char command)
 {
-    if (conn != NULL) {
-        if (write(conn->fd, &command, 1) != 1) {
-            log_output(LOG_ERR, "Could not write to device. %s\n", strerror(errno));
-            return -1;
+    return sendBytes(conn, &command, 1);
+}
+
+/**
+ * send a command with parameters to the device
+ *
+ * \param conn the connection to the device
+ * \param bytes the command and its parameters
+ * \param count the number of bytes to send
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+int sendBytes(struct USBConnection *conn, unsigned char const *bytes, int count)
+{
+    if (conn != NULL && conn->fd >= 0) {
+        long long start = stageClock();
+        long long deadline = start + ((long long)conn->timeout) * 1000000LL;
+        int written = 0;
+        for (;;) {
+            ssize_t ret;
+            ret = write(conn->fd, bytes+written, count-written);
+            if (ret > 0) {
+                written += ret;
+                if (written == count) {
+                    recordStageSince(STAGE_SEND, start);
+                    return 0;
+                }
+                continue;
+            }
+            if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                break;
+            }
+            if (waitForDevice(conn->fd, POLLOUT, deadline) != 0) {
+                break;
+            }
         }
-        return 0;
+        log_output(LOG_ERR, "Could not write to device. %s\n", strerror(errno));
+        return -1;
     }
     log_output(LOG_ERR, "Write to device failed. Connection is invalid.\n");
+    errno = EINVAL;
+    return -1;
+}
+
+/**
+ * restore the serial settings and close the device
+ */
+static void closeDevice(struct USBConnection *conn)
+{
+    if (conn->_success) {
+        tcsetattr(conn->fd, TCSANOW, &(conn->_savedattrs));
+        conn->_success = 0;
+    }
+    if (conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+/**
+ * open the device, setup the serial line and send the query of the device mode.
+ * The reply is due at conn->deadline.
+ *
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+static int setupDevice(struct USBConnection *conn)
+{
+    conn->fd = open(conn->device, O_NOCTTY | O_RDWR | O_NONBLOCK);
+    if (conn->fd >= 0) {
+        log_output(LOG_DEBUG, "Successfully opened USB device\n");
+        fcntl(conn->fd, F_SETFD, FD_CLOEXEC);
+        // the opening has been successful
+        // -> setup the serial connection (D-LOGG is a serial connector)
+        if (tcgetattr(conn->fd, &(conn->_savedattrs)) == 0) {
+            memset(&(conn->_newattrs), 0, sizeof(struct termios));
+            conn->_newattrs.c_cflag     = B115200 | CS8 | CLOCAL | CREAD;
+#ifdef CRTSCTS
+            conn->_newattrs.c_cflag    |= CRTSCTS;
+#endif
+#ifdef CNEW_RTSCTS
+            conn->_newattrs.c_cflag    |= CNEW_RTSCTS;
+#endif
+            conn->_newattrs.c_iflag     = IGNPAR;
+            conn->_newattrs.c_oflag     = 0;
+            conn->_newattrs.c_lflag     = 0;
+            conn->_newattrs.c_cc[VTIME] = 0;   /* the fd is non-blocking, timeouts are handled by poll() */
+            conn->_newattrs.c_cc[VMIN]  = 1;   /* minimum 1 character to be read */
+            tcflush(conn->fd, TCIFLUSH);
+            if (tcsetattr(conn->fd, TCSANOW, &(conn->_newattrs)) == 0) {
+                log_output(LOG_DEBUG, "Initializing device.\n");
+                conn->_success = 1;  // from now on, the settings have to be restored
+                conn->deadline = monotonicNanoseconds() + ((long long)conn->timeout) * 1000000LL;
+                if (sendCommand(conn, GET_MODE) == 0) {
+                    return 0;
+                }
+            }
+            else {
+                log_output(LOG_ERR, "Could not setup USB device. %s\n", strerror(errno));
+            }
+        }
+        else {
+            log_output(LOG_ERR, "Could not get attributes of serial interface. %s\n", strerror(errno));
+        }
+    }
+    {
+        int error = errno;
+        closeDevice(conn);
+        errno = error;
+    }
+    return -1;
+}
+
+/**
+ * open the device, setup the serial line and query the device mode
+ *
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+static int openDevice(struct USBConnection *conn)
+{
+    if (setupDevice(conn) != 0) {
+        return -1;
+    }
+    if (waitForDevice(conn->fd, POLLIN, conn->deadline) == 0 && read(conn->fd, &(conn->uvr_mode), 1) == 1) {
+        return 0;  // initialization done
+    }
+    log_output(LOG_ERR, "Could not read device reply. %s\n", strerror(errno));
+    {
+        int error = errno;
+        closeDevice(conn);
+        errno = error;
+    }
     return -1;
 }
 
@@ -62,15 +238,10 @@ int sendCommand(struct USBConnection *conn, unsigned char command)
 void cleanupUSBConnection(struct USBConnection *conn)
 {
     if (conn != NULL) {
-        if (conn->_success) {
-            tcsetattr(conn->fd, TCSANOW, &(conn->_savedattrs));
-        }
+        closeDevice(conn);
         if (conn->device != NULL) {
             free(conn->device);
         }
-        if (conn->fd > 0) {
-            close(conn->fd);
-        }
         free(conn);
     }
 }
@@ -87,136 +258,570 @@ struct USBConnection *initUSBConnection(char const * const device)
     struct USBConnection *conn;
     conn = malloc(sizeof(struct USBConnection));
     if (conn != NULL) {
+        memset(conn, 0, sizeof(struct USBConnection));
         conn->fd = -1;
-        conn->_success = 0;
+        conn->timeout = DEFAULT_FRAME_TIMEOUT;
         conn->device = malloc(strlen(device)+1);
         if (conn->device != 0) {
             strcpy(conn->device, device);
-            conn->fd = open(device, O_NOCTTY | O_RDWR);
-            if (conn->fd >= 0) {
-                log_output(LOG_DEBUG, "Successfully opened USB device\n");
-                // the opening has been successful
-                // -> setup the serial connection (D-LOGG is a serial connector)
-                if (tcgetattr(conn->fd, &(conn->_savedattrs)) == 0) {
-                    memset(&(conn->_newattrs), 0, sizeof(struct termios));
-                    conn->_newattrs.c_cflag     = B115200 | CS8 | CLOCAL | CREAD;
-#ifdef CRTSCTS
-                    conn->_newattrs.c_cflag    |= CRTSCTS;
-#endif
-#ifdef CNEW_RTSCTS
-                    conn->_newattrs.c_cflag    |= CNEW_RTSCTS;
-#endif
-                    conn->_newattrs.c_iflag     = IGNPAR;
-                    conn->_newattrs.c_oflag     = 0;
-                    conn->_newattrs.c_lflag     = 0;
-                    conn->_newattrs.c_cc[VTIME] = 0;   /* read block infinitely */
-                    conn->_newattrs.c_cc[VMIN]  = 1;   /* minimum 1 character to be read */
-                    tcflush(conn->fd, TCIFLUSH);
-                    if (tcsetattr(conn->fd, TCSANOW, &(conn->_newattrs)) == 0) {
-                        log_output(LOG_DEBUG, "Initializing device.\n");
-                        if (sendCommand(conn, GET_MODE) == 0) {
-                            if (read(conn->fd, &(conn->uvr_mode), 1) == 1) {
-                                conn->_success = 1;  // initialization done
-                            }
-                            else {
-                                log_output(LOG_ERR, "Could not read device reply. %s\n", strerror(errno));
-                            }
-                        }
-                    }
-                    else {
-                        log_output(LOG_ERR, "Could not setup USB device. %s\n", strerror(errno));
-                    }
-                }
-                else {
-                    log_output(LOG_ERR, "Could not get attributes of serial interface. %s\n", strerror(errno));
-                }
+            if (openDevice(conn) != 0) {
+                /* somewhere along the way we couldn't successfully initialize -> clean up */
+                log_output(LOG_ERR, "Could not open USB device %s. %s\n", device, strerror(errno));
+                cleanupUSBConnection(conn);
+                conn = NULL;
             }
         }
+        else {
+            log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+            cleanupUSBConnection(conn);
+            conn = NULL;
+        }
     }
     else {
         log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
     }
-    if (conn != NULL && !conn->_success) {
-        /* somewhere along the way we couldn't successfully initialize -> clean up */
-        log_output(LOG_ERR, "Could not open USB device %s. %s\n", device, strerror(errno));
-        cleanupUSBConnection(conn);
-        conn = NULL;
-    }
     log_output(LOG_DEBUG, "Returning connection %p\n", conn);
     return conn;
 }
 
 /**
- * read a set of data into the buffer. This function reads as long as the buffer
- * is not filled to the amount needed or an error occurs.
- * 
- * \return the number of bytes read on success, <0 else. errno will be set accordingly
+ * close and reopen the device of the connection
+ *
+ * \return 0 on success, -1 else. errno will be set accordingly
  */
-int readBuffer(struct USBConnection *conn, unsigned char *buffer)
+int reopenUSBConnection(struct USBConnection *conn)
 {
-    int ret = 0;
-    int numBytes = 0;
-    int bytesToRead = 115;
-    while (bytesToRead != numBytes) {
-        ret = read(conn->fd, buffer+numBytes, bytesToRead-numBytes); // 115 would be if two UVR1611 are connected
+    if (conn == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    log_output(LOG_INFO, "Reopening USB device %s\n", conn->device);
+    closeDevice(conn);
+    ++conn->stats.reconnects;
+    if (openDevice(conn) != 0) {
+        log_output(LOG_ERR, "Could not reopen USB device %s. %s\n", conn->device, strerror(errno));
+        return -1;
+    }
+    conn->failures = 0;
+    return 0;
+}
+
+/**
+ * close the device and start opening it again without waiting for the reply of the device
+ *
+ * \return 0 if the mode query was sent, -1 else. errno will be set accordingly
+ */
+int beginReopen(struct USBConnection *conn)
+{
+    if (conn == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    log_output(LOG_INFO, "Reopening USB device %s\n", conn->device);
+    closeDevice(conn);
+    ++conn->stats.reconnects;
+    if (setupDevice(conn) != 0) {
+        log_output(LOG_ERR, "Could not reopen USB device %s. %s\n", conn->device, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * read the reply to the mode query of beginReopen()
+ *
+ * \return 0 if the device is open again, -1 else. errno is EAGAIN if the reply did not arrive yet,
+ *         the device is closed on any other error
+ */
+int finishReopen(struct USBConnection *conn)
+{
+    ssize_t ret;
+    do {
+        ret = read(conn->fd, &(conn->uvr_mode), 1);
+    } while (ret < 0 && errno == EINTR);
+    if (ret == 1) {
+        conn->failures = 0;
+        return 0;
+    }
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (ret == 0) {
+        errno = EIO;
+    }
+    log_output(LOG_ERR, "Could not reopen USB device %s. %s\n", conn->device, strerror(errno));
+    {
+        int error = errno;
+        closeDevice(conn);
+        errno = error;
+    }
+    return -1;
+}
+
+/**
+ * the reply to the mode query did not arrive before conn->deadline
+ */
+void reopenTimedOut(struct USBConnection *conn)
+{
+    log_output(LOG_ERR, "Could not reopen USB device %s. The device did not reply\n", conn->device);
+    closeDevice(conn);
+}
+
+/**
+ * get the delay before the given retry of a request
+ *
+ * \param attempt the number of the retry (1 for the first retry)
+ * \return the delay in ns
+ */
+long long retryBackoff(int attempt)
+{
+    return ((long long)RETRY_BACKOFF << (attempt - 1)) * 1000000LL;
+}
+
+/**
+ * prepare the connection for receiving a new frame
+ */
+static void beginFrame(struct USBConnection *conn)
+{
+    conn->frameBytes = 0;
+    conn->frameLength = UVR1611_DUAL_FRAME_SIZE; // the maximum, we know better after the first byte
+    conn->requestStart = monotonicNanoseconds();
+    conn->deadline = conn->requestStart + ((long long)conn->timeout) * 1000000LL;
+}
+
+/**
+ * send a GET_CURRENT_DATA request and prepare for receiving the frame
+ *
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+int startRequest(struct USBConnection *conn)
+{
+    if (conn == NULL || !conn->_success) {
+        errno = EINVAL;
+        return -1;
+    }
+    // late replies to a previous request must not prefix the new frame
+    tcflush(conn->fd, TCIFLUSH);
+    beginFrame(conn);
+    if (sendCommand(conn, GET_CURRENT_DATA) != 0) {
+        ++conn->stats.errors;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * record the latency of a received frame
+ */
+static void recordLatency(struct USBConnection *conn)
+{
+    long long latency = monotonicNanoseconds() - conn->requestStart;
+    ++conn->stats.frames;
+    conn->stats.lastLatency = latency;
+    conn->stats.sumLatency += latency;
+    if (latency > conn->stats.maxLatency) {
+        conn->stats.maxLatency = latency;
+    }
+    recordStage(STAGE_ROUNDTRIP, latency);
+}
+
+/**
+ * read whatever part of the frame is available without blocking
+ *
+ * \return FRAME_COMPLETE if the frame in conn->frame is complete, FRAME_INCOMPLETE if
+ *         more bytes are needed, -1 on error. errno will be set accordingly, EAGAIN means
+ *         that the device did not have new data.
+ */
+int receiveFrame(struct USBConnection *conn)
+{
+    ssize_t ret = 0;
+    while (conn->frameLength != conn->frameBytes) {
+        // the device byte alone tells the length, so we never read beyond the frame
+        ret = read(conn->fd, conn->frame+conn->frameBytes, conn->frameBytes == 0 ? 1 : conn->frameLength-conn->frameBytes);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return FRAME_INCOMPLETE;
+        }
         if (ret <= 0) {
-            return ret;
+            if (ret == 0) {
+                errno = EIO;
+            }
+            ++conn->stats.errors;
+            return -1;
         }
-        numBytes += ret;
-        switch (buffer[0]) {
+        conn->frameBytes += ret;
+        switch (conn->frame[0]) {
             case GET_CURRENT_DATA:
                 // this means that we don't have new data
-                log_output(LOG_DEBUG, "No new data currently. (read %d bytes)\n", ret);
+                log_output(LOG_DEBUG, "No new data currently. (read %d bytes)\n", (int)ret);
+                ++conn->stats.noData;
                 errno = EAGAIN;
                 return -1;
             case UVR1611:
                 switch (conn->uvr_mode) {
-                    case 0xA8:
-                        if (bytesToRead == 115) {
-                            bytesToRead = 57; // 57 bytes are to be read in this mode
-                        }
+                    case MODE_1DL:
+                        conn->frameLength = UVR1611_FRAME_SIZE;
+                        break;
+                    case MODE_2DL:
+                        conn->frameLength = UVR1611_DUAL_FRAME_SIZE; // two controllers in one frame
                         break;
                     default:
                         log_output(LOG_ERR, "Unsupported mode %x\n", conn->uvr_mode);
+                        ++conn->stats.unsupported;
                         errno = EINVAL;
                         return -1;
                 }
                 break;
             default:
-                log_output(LOG_ERR, "Unsupported device %x\n", buffer[0]);
+                log_output(LOG_ERR, "Unsupported device %x\n", conn->frame[0]);
+                ++conn->stats.unsupported;
                 errno = EINVAL;
                 return -1;
         }
+        if (conn->frameBytes > conn->frameLength) {
+            log_output(LOG_ERR, "Framing error, got %d bytes of a %d byte frame\n", conn->frameBytes, conn->frameLength);
+            tcflush(conn->fd, TCIFLUSH);
+            ++conn->stats.errors;
+            errno = EIO;
+            return -1;
+        }
+    }
+    recordLatency(conn);
+    conn->failures = 0;
+    if (conn->capture != NULL) {
+        captureFrame(conn->capture, conn, conn->frame, conn->frameBytes);
+    }
+    return FRAME_COMPLETE;
+}
+
+/**
+ * the frame did not arrive before the deadline
+ */
+void requestTimedOut(struct USBConnection *conn)
+{
+    log_output(LOG_ERR, "Timeout while reading from device %s (got %d bytes)\n", conn->device, conn->frameBytes);
+    ++conn->stats.timeouts;
+}
+
+/**
+ * repeat the request after a failure
+ *
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+int retryRequest(struct USBConnection *conn)
+{
+    // startRequest() gets rid of late replies to the previous request
+    ++conn->stats.retries;
+    return startRequest(conn);
+}
+
+/**
+ * count a request of which all attempts failed
+ *
+ * \return 1 if the device has to be reopened, 0 else
+ */
+int requestAbandoned(struct USBConnection *conn)
+{
+    return ++conn->failures >= REOPEN_THRESHOLD || !conn->_success;
+}
+
+/**
+ * all attempts of a request failed. After repeated failures the device is reopened.
+ */
+void requestFailed(struct USBConnection *conn)
+{
+    int error = errno;
+    if (requestAbandoned(conn)) {
+        reopenUSBConnection(conn);
+    }
+    errno = error;
+}
+
+/**
+ * wait until the frame is complete or the deadline passed
+ *
+ * \return FRAME_COMPLETE on success, -1 else. errno will be set accordingly
+ */
+static int awaitFrame(struct USBConnection *conn)
+{
+    for (;;) {
+        int ret;
+        if (waitForDevice(conn->fd, POLLIN, conn->deadline) != 0) {
+            if (errno == ETIMEDOUT) {
+                requestTimedOut(conn);
+            }
+            return -1;
+        }
+        ret = receiveFrame(conn);
+        if (ret != FRAME_INCOMPLETE) {
+            return ret;
+        }
     }
-    return numBytes;
+}
+
+/**
+ * read a set of data into the buffer. This function reads as long as the buffer
+ * is not filled to the amount needed, the frame timeout of the connection passed
+ * or an error occurs.
+ * 
+ * \return the number of bytes read on success, <0 else. errno will be set accordingly
+ */
+int readBuffer(struct USBConnection *conn, unsigned char *buffer)
+{
+    long long start = stageClock();
+    beginFrame(conn);
+    if (awaitFrame(conn) != FRAME_COMPLETE) {
+        return -1;
+    }
+    recordStageSince(STAGE_READ, start);
+    memcpy(buffer, conn->frame, conn->frameBytes);
+    return conn->frameBytes;
+}
+
+/**
+ * request a frame from the device, retrying with an increasing backoff
+ *
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+static int requestFrame(struct USBConnection *conn)
+{
+    int attempt;
+    for (attempt = 0; attempt <= MAX_RETRIES; ++attempt) {
+        int ret;
+        if (attempt > 0) {
+            struct timespec backoff;
+            long long delay = retryBackoff(attempt);
+            backoff.tv_sec = delay / 1000000000LL;
+            backoff.tv_nsec = delay % 1000000000LL;
+            log_output(LOG_DEBUG, "Retrying request in %lld ms\n", delay / 1000000LL);
+            nanosleep(&backoff, NULL);
+            ret = retryRequest(conn);
+        }
+        else {
+            ret = startRequest(conn);
+        }
+        if (ret != 0) {
+            continue;
+        }
+        // depending on the number of bytes read, different results are to be expected
+        if (awaitFrame(conn) == FRAME_COMPLETE) {
+            return 0;
+        }
+        if (errno == EAGAIN) {
+            // no new data is a valid answer, nothing to retry
+            return -1;
+        }
+    }
+    requestFailed(conn);
+    return -1;
+}
+
+/**
+ * get the number of controllers contained in the frame received last
+ */
+unsigned int frameControllerCount(struct USBConnection *conn)
+{
+    return dataFrameControllerCount(conn->frameBytes);
+}
+
+/**
+ * parse the values of one controller from the frame received last
+ *
+ * \param conn the connection which received the frame
+ * \param controller the 0-based index of the controller in the frame
+ * \param state the caller owned state to fill
+ * \return 0 on success, -1 otherwise. errno will be set accordingly.
+ */
+int parseFrameController(struct USBConnection *conn, unsigned int controller, struct SystemState *state)
+{
+    return parseDataFrame(conn->frame, conn->frameBytes, controller, state);
+}
+
+/**
+ * parse the frame received last
+ *
+ * \param conn the connection which received the frame
+ * \param states the caller owned states to fill, one per controller
+ * \param maxStates the number of states available. MAX_CONTROLLERS is always enough.
+ * \return the number of states filled on success, -1 otherwise. errno will be set accordingly.
+ */
+int parseFrame(struct USBConnection *conn, struct SystemState *states, unsigned int maxStates)
+{
+    unsigned int count;
+    log_output(LOG_DEBUG, "Read buffer of size: %d\n", conn->frameBytes);
+    for (count = 0; count < frameControllerCount(conn) && count < maxStates; ++count) {
+        if (parseFrameController(conn, count, &(states[count])) != 0) {
+            return -1;
+        }
+    }
+    return count;
 }
 
 /**
  * read the current data values from the device
  * 
- * \return a pointer to the sensor list on success, NULL otherwise. errno will be set accordingly.
- * \note if the sensor list is no longer needed, release it using freeSensorList()
+ * \param conn the connection to the device
+ * \param states the caller owned states to fill, one per controller
+ * \param maxStates the number of states available. MAX_CONTROLLERS is always enough.
+ * \return the number of states filled on success, -1 otherwise. errno will be set accordingly.
  */
-struct SystemState *readCurrentData(struct USBConnection *conn)
+int readCurrentData(struct USBConnection *conn, struct SystemState *states, unsigned int maxStates)
 {
-    int ret;
-    unsigned char databuffer[116]; // according to the specification there might be 115 bytes max
-    if (conn == 0 || !conn->_success) {
+    if (conn == 0 || states == NULL || maxStates == 0) {
         errno = EINVAL;
-        return NULL;
-    }
-    sendCommand(conn, GET_CURRENT_DATA);
-    // depending on the number of bytes read, different results are to be expected
-    ret = readBuffer(conn, databuffer);
-    if (ret > 0) {
-        log_output(LOG_DEBUG, "Read buffer of size: %d\n", ret);
-        switch(databuffer[0]) {
-            case UVR1611:
-                return parseUVR1611(databuffer);
-            default:
-                return NULL;
-                break;
+        return -1;
+    }
+    if (!conn->_success && reopenUSBConnection(conn) != 0) {
+        // the device is still gone
+        return -1;
+    }
+    if (requestFrame(conn) != 0) {
+        return -1;
+    }
+    return parseFrame(conn, states, maxStates);
+}
+
+/**
+ * read exactly count bytes from the device
+ *
+ * \param deadline the monotonic time in ns the bytes have to be read by
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+static int readBytes(struct USBConnection *conn, unsigned char *buffer, int count, long long deadline)
+{
+    int numBytes = 0;
+    while (numBytes < count) {
+        ssize_t ret;
+        if (waitForDevice(conn->fd, POLLIN, deadline) != 0) {
+            if (errno == ETIMEDOUT) {
+                requestTimedOut(conn);
+            }
+            return -1;
+        }
+        ret = read(conn->fd, buffer+numBytes, count-numBytes);
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            continue;
         }
+        if (ret <= 0) {
+            if (ret == 0) {
+                errno = EIO;
+            }
+            ++conn->stats.errors;
+            return -1;
+        }
+        numBytes += ret;
+    }
+    return 0;
+}
+
+static unsigned long readAddress(unsigned char const *bytes)
+{
+    return ((unsigned long)bytes[2] << 16) | ((unsigned long)bytes[1] << 8) | bytes[0];
+}
+
+/**
+ * read the header of the data logger memory
+ *
+ * \param conn the connection to the device
+ * \param header receives the header
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+int readLoggerHeader(struct USBConnection *conn, struct LoggerHeader *header)
+{
+    unsigned char buffer[LOGGER_HEADER_SIZE_2DL];
+    unsigned char checksum = 0;
+    int size;
+    int i;
+    if (conn == NULL || !conn->_success || header == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    size = conn->uvr_mode == MODE_2DL ? LOGGER_HEADER_SIZE_2DL : LOGGER_HEADER_SIZE_1DL;
+    tcflush(conn->fd, TCIFLUSH);
+    if (sendCommand(conn, GET_HEADER) != 0
+        || readBytes(conn, buffer, size, monotonicNanoseconds() + ((long long)conn->timeout) * 1000000LL) != 0) {
+        return -1;
+    }
+    for (i = 0; i < size-1; ++i) {
+        checksum += buffer[i];
+    }
+    if (checksum != buffer[size-1]) {
+        log_output(LOG_ERR, "Checksum error in logger header\n");
+        errno = EIO;
+        return -1;
+    }
+    header->version = buffer[1];
+    if (conn->uvr_mode == MODE_2DL) {
+        // one record size per controller
+        header->recordSize = buffer[5] + buffer[6];
+        header->startAddress = readAddress(buffer+7);
+        header->endAddress = readAddress(buffer+10);
+    }
+    else {
+        header->recordSize = buffer[5];
+        header->startAddress = readAddress(buffer+6);
+        header->endAddress = readAddress(buffer+9);
+    }
+    if (header->recordSize == 0 || header->recordSize % LOGGER_BLOCK_SIZE != 0) {
+        log_output(LOG_ERR, "Unsupported logger record size %u\n", header->recordSize);
+        errno = EINVAL;
+        return -1;
+    }
+    log_output(LOG_DEBUG, "Logger header: version %u, record size %u, start 0x%lX, end 0x%lX\n",
+               (unsigned int)header->version, header->recordSize, header->startAddress, header->endAddress);
+    return 0;
+}
+
+/**
+ * read consecutive records from the data logger memory
+ *
+ * \param conn the connection to the device
+ * \param header the header read by readLoggerHeader()
+ * \param address the address of the first record
+ * \param count the number of records to read, at most LOGGER_MAX_CHUNK
+ * \param buffer receives the records, it must hold count * header->recordSize bytes
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+int readLoggerRecords(struct USBConnection *conn, struct LoggerHeader const *header, unsigned long address,
+                      unsigned int count, unsigned char *buffer)
+{
+    unsigned char command[6];
+    long long deadline;
+    if (conn == NULL || !conn->_success || count == 0 || count > LOGGER_MAX_CHUNK) {
+        errno = EINVAL;
+        return -1;
+    }
+    command[0] = READ_DATA;
+    command[1] = address & 0xFF;
+    command[2] = (address >> 8) & 0xFF;
+    command[3] = (address >> 16) & 0xFF;
+    command[4] = count;
+    command[5] = command[0] + command[1] + command[2] + command[3] + command[4];
+    if (sendBytes(conn, command, sizeof(command)) != 0) {
+        return -1;
+    }
+    // the timeout applies per record, a chunk takes longer than a single frame
+    deadline = monotonicNanoseconds() + ((long long)conn->timeout) * 1000000LL * count;
+    if (readBytes(conn, buffer, count * header->recordSize, deadline) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * log the timing and error counters of the connection
+ */
+void logConnectionStatistics(struct USBConnection *conn)
+{
+    if (conn != NULL) {
+        struct ConnectionStatistics *stats = &(conn->stats);
+        log_output(LOG_INFO, "Connection statistics for %s: %lu frames, %lu without new data, %lu timeouts, %lu unsupported, %lu errors, %lu retries, %lu reconnects\n",
+                   conn->device, stats->frames, stats->noData, stats->timeouts, stats->unsupported, stats->errors, stats->retries, stats->reconnects);
+        log_output(LOG_INFO, "Frame latency: avg %lld us, max %lld us (timeout %d ms)\n",
+                   stats->frames > 0 ? stats->sumLatency / (long long)stats->frames / 1000 : 0LL,
+                   stats->maxLatency / 1000, conn->timeout);
     }
-    return NULL;
 }
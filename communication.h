@@ -27,6 +27,28 @@ extern "C" {
 
 #include "datatypes.h"
 
+/**
+ * the default time a frame may take to arrive in ms
+ */
+#define DEFAULT_FRAME_TIMEOUT 2000
+
+/**
+ * the number of times GET_CURRENT_DATA is repeated before a transaction fails
+ */
+#define MAX_RETRIES 3
+
+/**
+ * return values of receiveFrame()
+ */
+#define FRAME_INCOMPLETE 0
+#define FRAME_COMPLETE   1
+
+/**
+ * get the current time of the monotonic clock in ns. All deadlines of a
+ * connection are given in this time base.
+ */
+long long monotonicNanoseconds();
+
 /**
  * send a command to the device
  * 
@@ -36,6 +58,16 @@ extern "C" {
  */
 int sendCommand(struct USBConnection *conn, unsigned char command);
 
+/**
+ * send a command with parameters to the device
+ *
+ * \param conn the connection to the device
+ * \param bytes the command and its parameters
+ * \param count the number of bytes to send
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+int sendBytes(struct USBConnection *conn, unsigned char const *bytes, int count);
+
 /**
  * cleanup the USB connection.
  * 
@@ -54,21 +86,173 @@ void cleanupUSBConnection(struct USBConnection *conn);
 struct USBConnection *initUSBConnection(char const * const device);
 
 
+/**
+ * close and reopen the device of the connection, e.g. after the USB-serial
+ * link went away. readCurrentData() does this on its own after repeated failures.
+ *
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+int reopenUSBConnection(struct USBConnection *conn);
+
+/**
+ * The following functions reopen the device without blocking: beginReopen()
+ * opens the device and sends the mode query, finishReopen() is called when
+ * the device is readable. If conn->deadline passes first, the caller reports
+ * it with reopenTimedOut().
+ */
+
+/**
+ * close the device and start opening it again
+ *
+ * \return 0 if the mode query was sent, -1 else. errno will be set accordingly
+ * \note conn->fd changes, the new fd may have the same number as the old one
+ */
+int beginReopen(struct USBConnection *conn);
+
+/**
+ * read the reply to the mode query of beginReopen()
+ *
+ * \return 0 if the device is open again, -1 else. errno is EAGAIN if the reply did
+ *         not arrive yet, the device is closed on any other error
+ */
+int finishReopen(struct USBConnection *conn);
+
+/**
+ * the reply to the mode query did not arrive before conn->deadline, the device is closed
+ */
+void reopenTimedOut(struct USBConnection *conn);
+
 /**
  * read a set of data into the buffer. This function reads as long as the buffer
- * is not filled to the amount needed or an error occurs.
+ * is not filled to the amount needed, the frame timeout of the connection passed
+ * (errno is ETIMEDOUT then) or an error occurs.
  * 
  * \return the number of bytes read on success, <0 else. errno will be set accordingly
  */
 int readBuffer(struct USBConnection *conn, unsigned char *buffer);
 
 /**
- * read the current data values from the device
+ * The following functions implement a GET_CURRENT_DATA transaction step by
+ * step, so that a caller can drive several connections from one event loop:
+ * startRequest() sends the request, receiveFrame() is called whenever the
+ * device is readable until the frame is complete. If conn->deadline passes
+ * first, the caller reports it with requestTimedOut(). Failed attempts are
+ * repeated with retryRequest() after retryBackoff(), and when all attempts
+ * failed requestFailed() reopens the device if necessary.
+ */
+
+/**
+ * send a GET_CURRENT_DATA request and prepare for receiving the frame
+ *
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+int startRequest(struct USBConnection *conn);
+
+/**
+ * read whatever part of the frame is available without blocking
+ *
+ * \return FRAME_COMPLETE if the frame in conn->frame is complete, FRAME_INCOMPLETE if
+ *         more bytes are needed, -1 on error. errno will be set accordingly, EAGAIN means
+ *         that the device did not have new data.
+ */
+int receiveFrame(struct USBConnection *conn);
+
+/**
+ * the frame did not arrive before conn->deadline
+ */
+void requestTimedOut(struct USBConnection *conn);
+
+/**
+ * get the delay before the given retry of a request
+ *
+ * \param attempt the number of the retry (1 for the first retry)
+ * \return the delay in ns
+ */
+long long retryBackoff(int attempt);
+
+/**
+ * repeat the request after a failure
+ *
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+int retryRequest(struct USBConnection *conn);
+
+/**
+ * count a request of which all attempts failed, without reopening the device
+ *
+ * \return 1 if the device has to be reopened, 0 else
+ */
+int requestAbandoned(struct USBConnection *conn);
+
+/**
+ * all attempts of a request failed. After repeated failures the device is reopened.
+ * \note conn->fd may change
+ */
+void requestFailed(struct USBConnection *conn);
+
+/**
+ * get the number of controllers contained in the frame received last
+ */
+unsigned int frameControllerCount(struct USBConnection *conn);
+
+/**
+ * parse the values of one controller from the frame received last
+ *
+ * \param conn the connection which received the frame
+ * \param controller the 0-based index of the controller in the frame
+ * \param state the caller owned state to fill
+ * \return 0 on success, -1 otherwise. errno will be set accordingly.
+ */
+int parseFrameController(struct USBConnection *conn, unsigned int controller, struct SystemState *state);
+
+/**
+ * parse the frame received last. In 2DL mode the frame contains the values
+ * of two controllers.
+ *
+ * \param conn the connection which received the frame
+ * \param states the caller owned states to fill, one per controller
+ * \param maxStates the number of states available. MAX_CONTROLLERS is always enough.
+ * \return the number of states filled on success, -1 otherwise. errno will be set accordingly.
+ */
+int parseFrame(struct USBConnection *conn, struct SystemState *states, unsigned int maxStates);
+
+/**
+ * read the current data values from the device. A failed request is repeated
+ * with an increasing backoff, after repeated failures the device is reopened.
  * 
- * \return a pointer to the sensor list on success, NULL otherwise. errno will be set accordingly.
- * \note if the sensor list is no longer needed, release it using freeSensorList()
+ * \param conn the connection to the device
+ * \param states the caller owned states to fill, one per controller. No memory is allocated.
+ * \param maxStates the number of states available. MAX_CONTROLLERS is always enough.
+ * \return the number of states filled on success, -1 otherwise. errno will be set accordingly.
+ */
+int readCurrentData(struct USBConnection *conn, struct SystemState *states, unsigned int maxStates);
+
+/**
+ * read the header of the data logger memory
+ *
+ * \param conn the connection to the device
+ * \param header receives the header
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+int readLoggerHeader(struct USBConnection *conn, struct LoggerHeader *header);
+
+/**
+ * read consecutive records from the data logger memory
+ *
+ * \param conn the connection to the device
+ * \param header the header read by readLoggerHeader()
+ * \param address the address of the first record
+ * \param count the number of records to read, at most LOGGER_MAX_CHUNK
+ * \param buffer receives the records, it must hold count * header->recordSize bytes
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+int readLoggerRecords(struct USBConnection *conn, struct LoggerHeader const *header, unsigned long address,
+                      unsigned int count, unsigned char *buffer);
+
+/**
+ * log the timing and error counters of the connection
  */
-struct SystemState *readCurrentData(struct USBConnection *conn);
+void logConnectionStatistics(struct USBConnection *conn);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,342 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "consumer.h"
+#include "logging.h"
+
+#define MAX_RESTART_DELAY 60
+/* time a consumer gets to finish after its stdin was closed on shutdown, in ms */
+#define CONSUMER_EXIT_GRACE 5000
+
+/**
+ * append the key=value pairs of a single value to the record buffer
+ *
+ * \return the number of characters written
+ */
+static int formatValue(char *buffer, size_t size, char *prefix, struct Value *value)
+{
+    int id = (int)(value->valueID);
+    switch (value->valueType) {
+        case UNUSED:
+            return snprintf(buffer, size, " %s_%d_TYPE=UNUSED", prefix, id);
+        case DIGITAL:
+            return snprintf(buffer, size, " %s_%d_TYPE=DIGITAL %s_%d_VALUE=%d", prefix, id, prefix, id, value->value.enabled ? 1 : 0);
+        case TEMPERATURE:
+            return snprintf(buffer, size, " %s_%d_TYPE=TEMPERATURE %s_%d_VALUE=%.1f", prefix, id, prefix, id, value->value.temperature);
+        case FLOW:
+            return snprintf(buffer, size, " %s_%d_TYPE=FLOW %s_%d_VALUE=%d", prefix, id, prefix, id, value->value.flow);
+        case ROTATION:
+            return snprintf(buffer, size, " %s_%d_TYPE=ROTATION %s_%d_VALUE=%d", prefix, id, prefix, id, value->value.rotation);
+        case HEAT:
+            return snprintf(buffer, size, " %s_%d_TYPE=HEAT %s_%d_VALUE_CURRENT=%.2f %s_%d_VALUE_TOTAL=%.1f",
+                            prefix, id, prefix, id, value->value.heat.current, prefix, id, value->value.heat.total);
+    }
+    return 0;
+}
+
+/**
+ * append a whole value group to the record buffer
+ *
+ * \return the number of characters written
+ */
+static size_t formatValueList(char *buffer, size_t size, char *prefix, struct Value *values, unsigned int count, unsigned int changed)
+{
+    struct ValueIterator it;
+    struct Value *value;
+    size_t length;
+    unsigned int delivered = 0;
+    initChangedValueIterator(&it, values, count, changed);
+    while ((value = nextValue(&it)) != NULL) {
+        ++delivered;
+    }
+    length = snprintf(buffer, size, " %sS=%u", prefix, delivered);
+    initChangedValueIterator(&it, values, count, changed);
+    while ((value = nextValue(&it)) != NULL && length < size) {
+        length += formatValue(buffer+length, size-length, prefix, value);
+    }
+    return length;
+}
+
+size_t formatSampleRecord(char *buffer, size_t size, struct Sample *sample)
+{
+    struct SystemState *state = &(sample->state);
+    size_t length = 0;
+    length += snprintf(buffer, size, " UVR_TIMESTAMP=%ld.%03ld UVR_DEVICE=%u UVR_CONTROLLER=%u",
+                       (long)sample->timestamp.tv_sec, sample->timestamp.tv_nsec / 1000000, sample->deviceID, sample->controllerID);
+    if (length < size) {
+        length += formatValueList(buffer+length, size-length, "UVR_INPUT", state->inputs, state->inputCount, state->inputsChanged);
+    }
+    if (length < size) {
+        length += formatValueList(buffer+length, size-length, "UVR_OUTPUT", state->outputs, state->outputCount, state->outputsChanged);
+    }
+    if (length < size) {
+        length += formatValueList(buffer+length, size-length, "UVR_HEATREG", state->heatRegisters, state->heatRegisterCount, state->heatRegistersChanged);
+    }
+    if (length < size) {
+        length += formatValueList(buffer+length, size-length, "UVR_ROTATION", state->rotations, state->rotationCount, state->rotationsChanged);
+    }
+    if (length + 1 >= size) {
+        return 0;
+    }
+    memmove(buffer, buffer+1, length-1); // drop the leading blank
+    buffer[length-1] = '\n';
+    return length;
+}
+
+/**
+ * start the consumer process with a pipe connected to its stdin
+ *
+ * \return 0 on success, -1 else
+ */
+static int startConsumer(struct Consumer *consumer)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        log_output(LOG_ERR, "Could not create pipe for consumer. %s\n", strerror(errno));
+        return -1;
+    }
+    consumer->pid = fork();
+    if (consumer->pid < 0) {
+        log_output(LOG_ERR, "Could not start consumer %s. %s\n", consumer->program, strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (consumer->pid == 0) {
+        sigset_t signals;
+        // the consumer gets the default signal handling, whatever the reader blocks or ignores
+        sigemptyset(&signals);
+        sigprocmask(SIG_SETMASK, &signals, NULL);
+        signal(SIGPIPE, SIG_DFL);
+        close(fds[1]);
+        if (fds[0] != STDIN_FILENO) {
+            dup2(fds[0], STDIN_FILENO);
+            close(fds[0]);
+        }
+        execl("/bin/sh", "sh", "-c", consumer->program, (char *)NULL);
+        _exit(127);
+    }
+    close(fds[0]);
+    consumer->fd = fds[1];
+    fcntl(consumer->fd, F_SETFL, fcntl(consumer->fd, F_GETFL) | O_NONBLOCK);
+    fcntl(consumer->fd, F_SETFD, FD_CLOEXEC);
+    consumer->length = 0;
+    consumer->offset = 0;
+    log_output(LOG_DEBUG, "Started consumer %s (pid %d)\n", consumer->program, (int)consumer->pid);
+    return 0;
+}
+
+/**
+ * reap the consumer process, kill it if it did not finish within grace ms
+ */
+static void reapConsumer(struct Consumer *consumer, int grace)
+{
+    struct timespec delay = { 0, 10000000 };
+    int waited;
+    for (waited = 0; waited < grace; waited += 10) {
+        if (waitpid(consumer->pid, NULL, WNOHANG) != 0) {
+            consumer->pid = -1;
+            return;
+        }
+        nanosleep(&delay, NULL);
+    }
+    if (waitpid(consumer->pid, NULL, WNOHANG) == 0) {
+        log_output(LOG_WARNING, "Consumer %s did not finish, killing it.\n", consumer->program);
+        kill(consumer->pid, SIGKILL);
+        waitpid(consumer->pid, NULL, 0);
+    }
+    consumer->pid = -1;
+}
+
+/**
+ * the consumer went away -> close our end and schedule the restart
+ */
+static void consumerDied(struct Consumer *consumer)
+{
+    if (consumer->fd >= 0) {
+        close(consumer->fd);
+        consumer->fd = -1;
+    }
+    if (consumer->pid > 0) {
+        // a consumer which closed its stdin may still be running, do not wait for it to finish
+        reapConsumer(consumer, 0);
+    }
+    consumer->length = 0;
+    consumer->offset = 0;
+    consumer->nextStart = time(NULL) + consumer->restartDelay;
+    log_output(LOG_ERR, "Consumer %s terminated. Restarting in %u s.\n", consumer->program, consumer->restartDelay);
+    consumer->restartDelay = consumer->restartDelay == 0 ? 1 : consumer->restartDelay * 2;
+    if (consumer->restartDelay > MAX_RESTART_DELAY) {
+        consumer->restartDelay = MAX_RESTART_DELAY;
+    }
+}
+
+/**
+ * write as much of the pending record as the pipe takes
+ *
+ * \return 0 if the record is completely written, 1 if something is left, -1 if the consumer died
+ */
+static int flushRecord(struct Consumer *consumer)
+{
+    while (consumer->offset < consumer->length) {
+        ssize_t ret;
+        ret = write(consumer->fd, consumer->buffer + consumer->offset, consumer->length - consumer->offset);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            return -1;
+        }
+        consumer->offset += ret;
+    }
+    return 0;
+}
+
+/**
+ * write the rest of the pending record on shutdown, but wait no longer than grace ms
+ *
+ * \return the time waited in ms
+ */
+static int drainRecord(struct Consumer *consumer, int grace)
+{
+    struct pollfd pfd;
+    int waited = 0;
+    pfd.fd = consumer->fd;
+    pfd.events = POLLOUT;
+    while (flushRecord(consumer) == 1 && waited < grace) {
+        poll(&pfd, 1, 10);
+        waited += 10;
+    }
+    if (consumer->offset < consumer->length) {
+        log_output(LOG_WARNING, "Consumer %s does not read, dropped the last record.\n", consumer->program);
+    }
+    return waited;
+}
+
+struct Consumer *initConsumer(char const * const program)
+{
+    struct Consumer *consumer;
+    consumer = malloc(sizeof(struct Consumer));
+    if (consumer == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return NULL;
+    }
+    consumer->program = malloc(strlen(program)+1);
+    if (consumer->program == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        free(consumer);
+        return NULL;
+    }
+    strcpy(consumer->program, program);
+    consumer->pid = -1;
+    consumer->fd = -1;
+    consumer->length = 0;
+    consumer->offset = 0;
+    consumer->nextStart = 0;
+    consumer->restartDelay = 0;
+    consumer->sent = 0;
+    consumer->skipped = 0;
+    consumer->restarts = 0;
+    // a dead consumer must not kill the reader, we notice it by EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+    if (startConsumer(consumer) != 0) {
+        cleanupConsumer(consumer);
+        return NULL;
+    }
+    return consumer;
+}
+
+int consumerSend(struct Consumer *consumer, struct Sample *sample)
+{
+    int ret;
+    if (consumer == NULL || sample == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (consumer->pid > 0 && waitpid(consumer->pid, NULL, WNOHANG) == consumer->pid) {
+        consumer->pid = -1;
+        consumerDied(consumer);
+    }
+    if (consumer->fd < 0) {
+        if (time(NULL) < consumer->nextStart || startConsumer(consumer) != 0) {
+            ++consumer->skipped;
+            return 1;
+        }
+        ++consumer->restarts;
+    }
+    // finish the previous record first. If the consumer did not take it yet, it is busy.
+    ret = flushRecord(consumer);
+    if (ret != 0) {
+        if (ret < 0) {
+            consumerDied(consumer);
+        }
+        ++consumer->skipped;
+        return 1;
+    }
+    consumer->length = formatSampleRecord(consumer->buffer, CONSUMER_BUFFER_SIZE, sample);
+    consumer->offset = 0;
+    if (consumer->length == 0) {
+        log_output(LOG_ERR, "Record does not fit into the consumer buffer.\n");
+        return -1;
+    }
+    if (flushRecord(consumer) < 0) {
+        consumerDied(consumer);
+        ++consumer->skipped;
+        return 1;
+    }
+    // a record which is written partially is completed on the next call
+    ++consumer->sent;
+    consumer->restartDelay = 0;
+    return 0;
+}
+
+void cleanupConsumer(struct Consumer *consumer)
+{
+    int waited = 0;
+    if (consumer != NULL) {
+        if (consumer->fd >= 0) {
+            // try to get rid of the last record before closing the pipe
+            waited = drainRecord(consumer, CONSUMER_EXIT_GRACE);
+            close(consumer->fd);
+        }
+        if (consumer->pid > 0) {
+            reapConsumer(consumer, CONSUMER_EXIT_GRACE - waited);
+        }
+        log_output(LOG_INFO, "Consumer statistics: %lu records sent, %lu skipped, %lu restarts\n",
+                   consumer->sent, consumer->skipped, consumer->restarts);
+        free(consumer->program);
+        free(consumer);
+    }
+}
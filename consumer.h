@@ -0,0 +1,90 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef CONSUMER_H
+#define CONSUMER_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "datatypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CONSUMER_BUFFER_SIZE 4096
+
+/**
+ * a long running program receiving the system states on its stdin, one
+ * record per line.
+ */
+struct Consumer
+{
+    char *program;
+    pid_t pid;
+    int fd;                            /* write end of the pipe to the consumer's stdin */
+    char buffer[CONSUMER_BUFFER_SIZE]; /* the record currently being written */
+    size_t length;                     /* length of the record in buffer */
+    size_t offset;                     /* number of bytes of the record already written */
+    time_t nextStart;                  /* earliest time for restarting a dead consumer */
+    unsigned int restartDelay;         /* current restart backoff in seconds */
+    unsigned long sent;                /* number of records handed to the consumer */
+    unsigned long skipped;             /* number of records skipped because the consumer was busy or dead */
+    unsigned long restarts;            /* number of times the consumer had to be restarted */
+};
+
+/**
+ * start the consumer program
+ *
+ * \param program the command line to run. It is run via /bin/sh -c
+ * \return a pointer to the consumer on success, NULL else. errno will be set accordingly
+ */
+struct Consumer *initConsumer(char const * const program);
+
+/**
+ * hand a sample to the consumer
+ *
+ * This function never blocks. If the consumer did not yet read the previous
+ * record completely, the state is skipped. A consumer which died is restarted
+ * with an increasing delay.
+ *
+ * \return 0 if the record was handed over, 1 if it was skipped, -1 on error.
+ */
+int consumerSend(struct Consumer *consumer, struct Sample *sample);
+
+/**
+ * format the record for a sample, terminated by a newline. The record uses
+ * the same names as the environment variables handed to the -s programs.
+ *
+ * \return the length of the record, 0 if it did not fit into the buffer
+ */
+size_t formatSampleRecord(char *buffer, size_t size, struct Sample *sample);
+
+/**
+ * close the consumer's stdin, wait for it to terminate and clean up
+ */
+void cleanupConsumer(struct Consumer *consumer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CONSUMER_H */
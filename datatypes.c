@@ -22,30 +22,29 @@
 
 #include "datatypes.h"
 
-struct SystemState *initSystemState()
+/**
+ * reset a system state object so that it does not contain any values
+ */
+void clearSystemState(struct SystemState *state)
 {
-    struct SystemState *ptr;
-    ptr = malloc(sizeof(struct SystemState));
-    if (ptr) {
-        ptr->inputs = NULL;
-        ptr->outputs = NULL;
-        ptr->heatRegisters = NULL;
+    if (state) {
+        state->inputCount = 0;
+        state->outputCount = 0;
+        state->heatRegisterCount = 0;
+        state->rotationCount = 0;
+        state->inputsChanged = ALL_CHANGED;
+        state->outputsChanged = ALL_CHANGED;
+        state->heatRegistersChanged = ALL_CHANGED;
+        state->rotationsChanged = ALL_CHANGED;
     }
-    return ptr;
 }
 
-void freeValueList(struct ValueListNode *head)
+struct SystemState *initSystemState()
 {
-    if (head != NULL) {
-        struct ValueListNode *ptr;
-        ptr = head;
-        while (ptr != NULL) {
-            struct ValueListNode *tmp;
-            tmp = ptr;
-            ptr = ptr->next;
-            free(tmp);
-        }
-    }
+    struct SystemState *ptr;
+    ptr = malloc(sizeof(struct SystemState));
+    clearSystemState(ptr);
+    return ptr;
 }
 
 /**
@@ -53,21 +52,29 @@ void freeValueList(struct ValueListNode *head)
  */
 void freeSystemState(struct SystemState *state)
 {
-    if (state) {
-        freeValueList(state->inputs);
-        freeValueList(state->outputs);
-        freeValueList(state->heatRegisters);
-        free(state);
-    }
+    free(state);
 }
 
-struct ValueListNode *createValueListNode()
+void initValueIterator(struct ValueIterator *it, struct Value *values, unsigned int count)
 {
-    struct ValueListNode *tmp;
-    tmp = malloc(sizeof(struct ValueListNode));
-    if (tmp != NULL) {
-        tmp->next = NULL;
-    }
-    return tmp;
+    initChangedValueIterator(it, values, count, ALL_CHANGED);
 }
 
+void initChangedValueIterator(struct ValueIterator *it, struct Value *values, unsigned int count, unsigned int changed)
+{
+    it->current = values;
+    it->end = values + count;
+    it->first = values;
+    it->changed = changed;
+}
+
+struct Value *nextValue(struct ValueIterator *it)
+{
+    while (it->current != it->end) {
+        struct Value *value = it->current++;
+        if ((it->changed >> (value - it->first)) & 1) {
+            return value;
+        }
+    }
+    return NULL;
+}
@@ -23,6 +23,7 @@
 
 #include <termios.h>
 #include <unistd.h>
+#include <time.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -33,12 +34,75 @@ extern "C" {
  */
 #define GET_MODE          0x81u
 #define GET_CURRENT_DATA  0xABu
+#define GET_HEADER        0xAAu   /* read the header of the data logger memory */
+#define READ_DATA         0xACu   /* read records, followed by address (3 bytes, LSB first), count and checksum */
 
 /**
  * identiers of the different UVRs
  */
 #define UVR1611 0x80
 
+/**
+ * the modes of the D-LOGG as returned by GET_MODE
+ */
+#define MODE_1DL 0xA8   /* one UVR1611 connected */
+#define MODE_2DL 0xD1   /* two UVR1611 connected to the two DL inputs */
+
+/**
+ * frame sizes of GET_CURRENT_DATA. In 2DL mode the frame consists of two
+ * blocks with the layout of a single controller frame plus a trailing byte.
+ */
+#define UVR1611_FRAME_SIZE       57
+#define UVR1611_DUAL_FRAME_SIZE 115
+
+/**
+ * the maximum number of controllers a single D-LOGG reports
+ */
+#define MAX_CONTROLLERS 2
+
+/**
+ * layout of the data logger memory. Every record consists of one 64-byte
+ * block per controller: the 55 value bytes as in the current data frame,
+ * the time stamp (second, minute, hour, day, month, year since 2000),
+ * two reserved bytes and a checksum (sum of the other bytes).
+ */
+#define LOGGER_BLOCK_SIZE    64
+#define LOGGER_TIME_OFFSET   55
+#define LOGGER_MEMORY_SIZE   0x80000   /* the memory is a ring of this many bytes */
+#define LOGGER_HEADER_SIZE_1DL 13
+#define LOGGER_HEADER_SIZE_2DL 14
+#define LOGGER_MAX_CHUNK     32        /* maximum number of records per READ_DATA request */
+
+/**
+ * the header of the data logger memory as returned by GET_HEADER
+ */
+struct LoggerHeader
+{
+    unsigned char version;
+    unsigned int recordSize;      /* size of a record in bytes */
+    unsigned long startAddress;   /* address of the oldest record */
+    unsigned long endAddress;     /* address after the newest record */
+};
+
+/**
+ * timing and error counters of a USB connection
+ */
+struct ConnectionStatistics
+{
+    unsigned long frames;       /* number of frames received successfully */
+    unsigned long noData;       /* number of "no new data" replies */
+    unsigned long timeouts;     /* number of frames which did not arrive in time */
+    unsigned long unsupported;  /* number of frames of an unsupported device or mode */
+    unsigned long errors;       /* number of other failed transactions */
+    unsigned long retries;      /* number of repeated GET_CURRENT_DATA requests */
+    unsigned long reconnects;   /* number of times the device was reopened */
+    long long lastLatency;      /* request to complete frame of the last frame in ns */
+    long long maxLatency;       /* maximum request to frame latency in ns */
+    long long sumLatency;       /* sum of all latencies in ns */
+};
+
+struct CaptureWriter;
+
 /**
  * structure representing a USB connection.
  */
@@ -50,6 +114,16 @@ struct USBConnection
     struct termios _newattrs;
     unsigned char uvr_mode;
     char _success;
+    int timeout;                        /* time a frame may take to arrive in ms */
+    unsigned int failures;              /* number of consecutive failed transactions */
+    unsigned char frame[UVR1611_DUAL_FRAME_SIZE+1]; /* the frame being received, 115 bytes max according to the specification */
+    int frameBytes;                     /* number of bytes of the frame received so far */
+    int frameLength;                    /* expected length of the frame */
+    long long requestStart;             /* monotonic time the request was sent in ns */
+    long long deadline;                 /* monotonic time the frame has to be complete in ns */
+    struct ConnectionStatistics stats;
+    unsigned int id;                    /* 1-based device id, used to tag captured frames */
+    struct CaptureWriter *capture;      /* if not NULL, every received frame is recorded here */
 };
 
 /**
@@ -62,6 +136,7 @@ struct USBConnection
 #define RADIATION 6
 #define ROOM_TEMPERATURE 7
 #define HEAT 100
+#define ROTATION 101
 
 struct Value
 {
@@ -71,6 +146,7 @@ struct Value
         int   enabled;
         int   flow;
         int   radiation;
+        int   rotation;
         struct {
             float current;
             float total;
@@ -80,39 +156,117 @@ struct Value
 };
 
 /**
- * a list node of a sensor list
+ * the maximum number of values a UVR1611 reports per category
  */
-struct ValueListNode
-{
-    struct Value value;
-    struct ValueListNode *next;
-};
+#define UVR1611_INPUTS          16
+#define UVR1611_OUTPUTS         13
+#define UVR1611_HEAT_REGISTERS   2
+#define UVR1611_ROTATIONS        4
 
 /**
  * the whole current system state including inputs and outputs
+ *
+ * The state has a fixed layout sized for the UVR1611 and does not own any
+ * heap memory, so it can be placed on the stack, embedded into other
+ * structures or copied with memcpy. Only the first <em>xxxCount</em> entries
+ * of each array are valid.
  */
 struct SystemState
 {
-    struct ValueListNode *inputs;
-    struct ValueListNode *outputs;
-    struct ValueListNode *heatRegisters;
-    // TODO more values
+    struct Value inputs[UVR1611_INPUTS];
+    struct Value outputs[UVR1611_OUTPUTS];
+    struct Value heatRegisters[UVR1611_HEAT_REGISTERS];
+    struct Value rotations[UVR1611_ROTATIONS];
+    unsigned char inputCount;
+    unsigned char outputCount;
+    unsigned char heatRegisterCount;
+    unsigned char rotationCount;
+    /* bit i is set if value i of the group is to be delivered. A freshly parsed
+       state delivers everything, the delta filter clears the unchanged values. */
+    unsigned int inputsChanged;
+    unsigned int outputsChanged;
+    unsigned int heatRegistersChanged;
+    unsigned int rotationsChanged;
+};
+
+#define ALL_CHANGED 0xFFFFFFFFu
+
+/**
+ * a system state together with the time it was received
+ */
+struct Sample
+{
+    struct timespec timestamp;  /* CLOCK_REALTIME when the frame was received */
+    unsigned int deviceID;      /* the device the sample was read from, 1-based */
+    unsigned int controllerID;  /* the controller on the device, 1-based */
+    struct SystemState state;
+};
+
+/**
+ * callback receiving samples, e.g. from the device poller
+ */
+typedef void (*SampleHandler)(void *context, struct Sample *sample);
+
+/**
+ * iterator over one value group (inputs, outputs, ...) of a system state
+ *
+ * This is meant for consumers that used to walk the value lists, e.g.
+ * \code
+ * struct ValueIterator it;
+ * struct Value *value;
+ * initValueIterator(&it, state->inputs, state->inputCount);
+ * while ((value = nextValue(&it)) != NULL) {
+ *     ...
+ * }
+ * \endcode
+ */
+struct ValueIterator
+{
+    struct Value *current;
+    struct Value *end;
+    struct Value *first;
+    unsigned int changed;   /* only values with their bit set are returned */
 };
 
 /**
- * get a new system state object
+ * reset a system state object so that it does not contain any values
+ */
+void clearSystemState(struct SystemState *state);
+
+/**
+ * get a new heap allocated system state object
+ *
+ * \note Polling code should rather use a caller owned state and clearSystemState()
  */
 struct SystemState *initSystemState();
 
 /**
- * clean up a system state object
+ * clean up a system state object obtained by initSystemState()
  */
 void freeSystemState(struct SystemState *state);
 
 /**
- * create a new ValueListNode
+ * initialize an iterator over the given value array
+ *
+ * \param it the iterator to initialize
+ * \param values the first value of the group
+ * \param count the number of valid values in the group
+ */
+void initValueIterator(struct ValueIterator *it, struct Value *values, unsigned int count);
+
+/**
+ * initialize an iterator returning only the changed values of a group
+ *
+ * \param changed the change mask of the group, e.g. state->inputsChanged
+ */
+void initChangedValueIterator(struct ValueIterator *it, struct Value *values, unsigned int count, unsigned int changed);
+
+/**
+ * get the next value from the iterator
+ *
+ * \return the next value or NULL, if the iterator is exhausted
  */
-struct ValueListNode *createValueListNode();
+struct Value *nextValue(struct ValueIterator *it);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,271 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "delta.h"
+#include "logging.h"
+
+/* values are printed with one decimal, smaller differences are rounding noise */
+#define EPSILON 0.001
+
+void defaultDeadbands(struct Deadbands *bands)
+{
+    bands->temperature = 0.2;
+    bands->flow = 0;
+    bands->rotation = 0;
+    bands->power = 0.1;
+    bands->energy = 1;
+}
+
+int parseDeadbands(struct Deadbands *bands, char const *spec)
+{
+    char buffer[256];
+    char *saveptr = NULL;
+    char *item;
+    if (strlen(spec) >= sizeof(buffer)) {
+        return -1;
+    }
+    strcpy(buffer, spec);
+    for (item = strtok_r(buffer, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(item, '=');
+        char *end;
+        double band;
+        if (value == NULL) {
+            return -1;
+        }
+        *value++ = '\0';
+        band = strtod(value, &end);
+        if (end == value || *end != '\0' || band < 0) {
+            return -1;
+        }
+        if (strcmp(item, "temperature") == 0) {
+            bands->temperature = band;
+        }
+        else if (strcmp(item, "flow") == 0) {
+            bands->flow = band;
+        }
+        else if (strcmp(item, "rotation") == 0) {
+            bands->rotation = band;
+        }
+        else if (strcmp(item, "power") == 0) {
+            bands->power = band;
+        }
+        else if (strcmp(item, "energy") == 0) {
+            bands->energy = band;
+        }
+        else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct DeltaFilter *initDeltaFilter(struct Deadbands const *bands, int heartbeat)
+{
+    struct DeltaFilter *filter = calloc(1, sizeof(struct DeltaFilter));
+    if (filter == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return NULL;
+    }
+    filter->bands = *bands;
+    filter->heartbeat = heartbeat;
+    return filter;
+}
+
+/**
+ * make room for the given device
+ *
+ * \return 0 on success, -1 if there was no memory
+ */
+static int reserveDevice(struct DeltaFilter *filter, unsigned int deviceID)
+{
+    struct DeltaSlot *slots;
+    struct DeltaFrame *frames;
+    unsigned int count = filter->deviceCount;
+    if (deviceID <= count) {
+        return 0;
+    }
+    slots = realloc(filter->slots, deviceID * MAX_CONTROLLERS * sizeof(struct DeltaSlot));
+    if (slots == NULL) {
+        return -1;
+    }
+    filter->slots = slots;
+    frames = realloc(filter->frames, deviceID * sizeof(struct DeltaFrame));
+    if (frames == NULL) {
+        return -1;
+    }
+    filter->frames = frames;
+    memset(filter->slots + count * MAX_CONTROLLERS, 0, (deviceID - count) * MAX_CONTROLLERS * sizeof(struct DeltaSlot));
+    memset(filter->frames + count, 0, (deviceID - count) * sizeof(struct DeltaFrame));
+    filter->deviceCount = deviceID;
+    return 0;
+}
+
+static int heartbeatDue(struct DeltaFilter *filter, struct DeltaSlot *slot, time_t now)
+{
+    return slot->lastSnapshot == 0 || now - slot->lastSnapshot >= filter->heartbeat;
+}
+
+int deltaFrameUnchanged(struct DeltaFilter *filter, unsigned int deviceID, unsigned char const *frame, int length, time_t now)
+{
+    struct DeltaFrame *last;
+    unsigned int i;
+    if (filter == NULL || deviceID == 0 || length > (int)sizeof(last->frame) || reserveDevice(filter, deviceID) != 0) {
+        return 0;
+    }
+    last = &(filter->frames[deviceID-1]);
+    last->unchanged = 0;
+    if (last->length == length && memcmp(last->frame, frame, length) == 0) {
+        for (i = 0; i < MAX_CONTROLLERS; ++i) {
+            if (filter->slots[(deviceID-1) * MAX_CONTROLLERS + i].lastSnapshot != 0 &&
+                heartbeatDue(filter, &(filter->slots[(deviceID-1) * MAX_CONTROLLERS + i]), now)) {
+                return 0;
+            }
+        }
+        ++filter->framesSkipped;
+        last->unchanged = 1;
+        return 1;
+    }
+    memcpy(last->frame, frame, length);
+    last->length = length;
+    return 0;
+}
+
+/**
+ * check whether a value left the deadband around the delivered one
+ */
+static int valueChanged(struct Deadbands const *bands, struct Value const *value, struct Value const *delivered)
+{
+    if (value->valueID != delivered->valueID || value->valueType != delivered->valueType) {
+        return 1;
+    }
+    switch (value->valueType) {
+        case DIGITAL:
+            return value->value.enabled != delivered->value.enabled;
+        case TEMPERATURE:
+            return fabs(value->value.temperature - delivered->value.temperature) > bands->temperature + EPSILON;
+        case FLOW:
+            return abs(value->value.flow - delivered->value.flow) > bands->flow + EPSILON;
+        case ROTATION:
+            return abs(value->value.rotation - delivered->value.rotation) > bands->rotation + EPSILON;
+        case HEAT:
+            return fabs(value->value.heat.current - delivered->value.heat.current) > bands->power + EPSILON ||
+                   fabs(value->value.heat.total - delivered->value.heat.total) > bands->energy + EPSILON;
+    }
+    return 0;
+}
+
+/**
+ * compare one value group, remember the changed values as delivered
+ *
+ * \return the change mask of the group
+ */
+static unsigned int filterGroup(struct Deadbands const *bands, struct Value *values, struct Value *delivered, unsigned int count)
+{
+    unsigned int changed = 0;
+    unsigned int i;
+    for (i = 0; i < count; ++i) {
+        if (valueChanged(bands, &(values[i]), &(delivered[i]))) {
+            changed |= 1u << i;
+            delivered[i] = values[i];
+        }
+    }
+    return changed;
+}
+
+static unsigned int countBits(unsigned int mask)
+{
+    unsigned int count = 0;
+    while (mask != 0) {
+        mask &= mask - 1;
+        ++count;
+    }
+    return count;
+}
+
+int deltaFilterSample(struct DeltaFilter *filter, struct Sample *sample)
+{
+    struct SystemState *state = &(sample->state);
+    struct SystemState *delivered;
+    struct DeltaSlot *slot;
+    unsigned int values = state->inputCount + state->outputCount + state->heatRegisterCount + state->rotationCount;
+    if (filter == NULL) {
+        return 1;
+    }
+    filter->valuesTotal += values;
+    if (sample->deviceID == 0 || sample->controllerID == 0 || sample->controllerID > MAX_CONTROLLERS ||
+        reserveDevice(filter, sample->deviceID) != 0) {
+        ++filter->samplesDelivered;
+        filter->valuesDelivered += values;
+        return 1;
+    }
+    slot = &(filter->slots[(sample->deviceID-1) * MAX_CONTROLLERS + sample->controllerID-1]);
+    delivered = &(slot->delivered);
+    if (filter->frames[sample->deviceID-1].unchanged) {
+        ++filter->samplesSuppressed;
+        return 0;
+    }
+    if (heartbeatDue(filter, slot, sample->timestamp.tv_sec) ||
+        state->inputCount != delivered->inputCount || state->outputCount != delivered->outputCount ||
+        state->heatRegisterCount != delivered->heatRegisterCount || state->rotationCount != delivered->rotationCount) {
+        // full snapshot, the masks of the freshly parsed state already select everything
+        *delivered = *state;
+        slot->lastSnapshot = sample->timestamp.tv_sec;
+        ++filter->samplesDelivered;
+        filter->valuesDelivered += values;
+        return 1;
+    }
+    state->inputsChanged = filterGroup(&(filter->bands), state->inputs, delivered->inputs, state->inputCount);
+    state->outputsChanged = filterGroup(&(filter->bands), state->outputs, delivered->outputs, state->outputCount);
+    state->heatRegistersChanged = filterGroup(&(filter->bands), state->heatRegisters, delivered->heatRegisters, state->heatRegisterCount);
+    state->rotationsChanged = filterGroup(&(filter->bands), state->rotations, delivered->rotations, state->rotationCount);
+    values = countBits(state->inputsChanged) + countBits(state->outputsChanged) +
+             countBits(state->heatRegistersChanged) + countBits(state->rotationsChanged);
+    if (values == 0) {
+        ++filter->samplesSuppressed;
+        return 0;
+    }
+    ++filter->samplesDelivered;
+    filter->valuesDelivered += values;
+    return 1;
+}
+
+void logDeltaStatistics(struct DeltaFilter *filter)
+{
+    if (filter == NULL) {
+        return;
+    }
+    log_output(LOG_INFO, "Delta statistics: %lu identical frames skipped, %lu samples suppressed, %lu samples delivered with %lu of %lu values\n",
+               filter->framesSkipped, filter->samplesSuppressed, filter->samplesDelivered, filter->valuesDelivered, filter->valuesTotal);
+}
+
+void cleanupDeltaFilter(struct DeltaFilter *filter)
+{
+    if (filter == NULL) {
+        return;
+    }
+    free(filter->slots);
+    free(filter->frames);
+    free(filter);
+}
@@ -0,0 +1,142 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <time.h>
+
+#include "datatypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DEFAULT_HEARTBEAT 600
+
+/**
+ * the changes below which a value counts as unchanged. Digital values and
+ * value types always count as changed when they differ.
+ */
+struct Deadbands
+{
+    double temperature;  /* °C */
+    double flow;         /* l/h */
+    double rotation;     /* speed steps */
+    double power;        /* current power of a heat register in kW */
+    double energy;       /* total energy of a heat register in kWh */
+};
+
+/**
+ * what was last delivered for one controller
+ */
+struct DeltaSlot
+{
+    struct SystemState delivered;
+    time_t lastSnapshot;  /* time of the last full snapshot, 0 if there was none */
+};
+
+/**
+ * the last raw frame of one device
+ */
+struct DeltaFrame
+{
+    unsigned char frame[UVR1611_DUAL_FRAME_SIZE+1];
+    int length;
+    int unchanged;  /* the frame equals the one before, its samples are suppressed */
+};
+
+/**
+ * change driven delivery.
+ *
+ * The samples of a frame which is byte-identical to the previous frame of
+ * the device are suppressed without comparing their values. Of the other
+ * samples only the values which moved out of their deadband since they
+ * were last delivered are marked changed, a sample without any change is
+ * suppressed. Every heartbeat seconds a
+ * controller delivers a full snapshot regardless of the changes.
+ */
+struct DeltaFilter
+{
+    struct Deadbands bands;
+    int heartbeat;              /* seconds between two full snapshots */
+    struct DeltaSlot *slots;    /* MAX_CONTROLLERS slots per device */
+    struct DeltaFrame *frames;  /* one per device */
+    unsigned int deviceCount;   /* number of devices the arrays have room for */
+    unsigned long framesSkipped;
+    unsigned long samplesSuppressed;
+    unsigned long samplesDelivered;
+    unsigned long valuesDelivered;
+    unsigned long valuesTotal;
+};
+
+/**
+ * set the default deadbands: 0.2 °C, 0.1 kW, 1 kWh, any flow or speed step change
+ */
+void defaultDeadbands(struct Deadbands *bands);
+
+/**
+ * parse a deadband specification like "temperature=0.5,flow=10" into bands.
+ * Known names are temperature, flow, rotation, power and energy.
+ *
+ * \return 0 on success, -1 on a malformed specification
+ */
+int parseDeadbands(struct Deadbands *bands, char const *spec);
+
+/**
+ * create a delta filter
+ *
+ * \return a pointer to the filter on success, NULL else. errno will be set accordingly
+ */
+struct DeltaFilter *initDeltaFilter(struct Deadbands const *bands, int heartbeat);
+
+/**
+ * check whether a raw frame of a device equals the previous one. The frame
+ * is remembered for the next call and deltaFilterSample() suppresses the
+ * samples of an unchanged frame until the next frame of the device arrives.
+ *
+ * \param deviceID the device number, starting with 1
+ * \param now the current time, a due heartbeat lets the frame pass
+ * \return 1 if the frame is unchanged, 0 else
+ */
+int deltaFrameUnchanged(struct DeltaFilter *filter, unsigned int deviceID, unsigned char const *frame, int length, time_t now);
+
+/**
+ * mark the changed values of a sample and remember them as delivered
+ *
+ * \return 1 if the sample has to be delivered, 0 if nothing changed
+ */
+int deltaFilterSample(struct DeltaFilter *filter, struct Sample *sample);
+
+/**
+ * log the number of frames, samples and values saved by the filter
+ */
+void logDeltaStatistics(struct DeltaFilter *filter);
+
+/**
+ * clean up the filter
+ */
+void cleanupDeltaFilter(struct DeltaFilter *filter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DELTA_H */
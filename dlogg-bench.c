@@ -0,0 +1,564 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Micro-benchmark of the frame parser and the sample formatters.
+ *
+ * Every benchmark runs over a corpus of UVR1611 frames, either the frames
+ * embedded below or the frames of a capture file (-f). The results are
+ * printed one line per benchmark as key=value pairs, so the output of two
+ * builds can be compared with diff or a small script.
+ *
+ * Allocations are counted by wrapping malloc, calloc and realloc at link
+ * time (-Wl,--wrap=...), see CMakeLists.txt.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "datatypes.h"
+#include "parsing.h"
+#include "capture.h"
+#include "consumer.h"
+#include "output.h"
+#include "script.h"
+#include "store.h"
+#include "history.h"
+#include "logging.h"
+
+#define DEFAULT_ITERATIONS 20000
+
+/**
+ * GET_CURRENT_DATA frames of a UVR1611 as recorded from dlogg-emulator,
+ * the last one with both heat registers and a negative temperature
+ */
+static unsigned char embeddedFrames[][UVR1611_FRAME_SIZE] = {
+    {
+        0x80, 0xC8, 0x20, 0xE9, 0x20, 0x0A, 0x21, 0x29, 0x21, 0x47, 0x21, 0x62,
+        0x21, 0x7B, 0x21, 0x92, 0x21, 0xA7, 0x21, 0xB9, 0x21, 0xCB, 0x21, 0xDB,
+        0x21, 0xED, 0x21, 0xFE, 0x21, 0x00, 0x10, 0x78, 0x30, 0x20, 0x00, 0x14,
+        0x80, 0x80, 0x80, 0x01, 0x00, 0x55, 0x00, 0x00, 0x29, 0x09, 0x01, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xCC
+    },
+    {
+        0x80, 0xE0, 0x20, 0xFD, 0x20, 0x17, 0x21, 0x30, 0x21, 0x46, 0x21, 0x59,
+        0x21, 0x6C, 0x21, 0x7D, 0x21, 0x8E, 0x21, 0x9F, 0x21, 0xB1, 0x21, 0xC4,
+        0x21, 0xD8, 0x21, 0xF0, 0x21, 0x00, 0x90, 0x79, 0x30, 0x24, 0x00, 0x1B,
+        0x80, 0x80, 0x80, 0x01, 0x00, 0x57, 0x00, 0x00, 0x2E, 0x09, 0x01, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xEA
+    },
+    {
+        0x80, 0xE2, 0x20, 0xF6, 0x20, 0x09, 0x21, 0x1A, 0x21, 0x2B, 0x21, 0x3C,
+        0x21, 0x4D, 0x21, 0x60, 0x21, 0x75, 0x21, 0x8C, 0x21, 0xA5, 0x21, 0xC1,
+        0x21, 0xDE, 0x21, 0xFE, 0x21, 0x00, 0x10, 0x7B, 0x30, 0x20, 0x10, 0x17,
+        0x80, 0x80, 0x80, 0x01, 0x00, 0x58, 0x00, 0x00, 0x35, 0x09, 0x01, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xB8
+    },
+    {
+        0x80, 0xC3, 0x20, 0xD4, 0x20, 0xE6, 0x20, 0xFA, 0x20, 0x10, 0x21, 0x28,
+        0x21, 0x42, 0x21, 0x5F, 0x21, 0x7D, 0x21, 0x9D, 0x21, 0xBF, 0x21, 0xDF,
+        0x21, 0x00, 0x22, 0x20, 0x22, 0x00, 0x10, 0x7F, 0x30, 0x21, 0x00, 0x1D,
+        0x80, 0x80, 0x80, 0x01, 0x00, 0x59, 0x00, 0x00, 0x3C, 0x09, 0x01, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x91
+    },
+    {
+        0x80, 0xAD, 0x20, 0xC4, 0x20, 0xDD, 0x20, 0xF9, 0x20, 0x17, 0x21, 0x36,
+        0x21, 0x57, 0x21, 0x78, 0x21, 0x99, 0x21, 0xB9, 0x21, 0xD9, 0x21, 0xF6,
+        0x21, 0x11, 0x22, 0x2A, 0x22, 0x00, 0x10, 0x7C, 0x30, 0x25, 0x00, 0x14,
+        0x80, 0x80, 0x80, 0x01, 0x00, 0x55, 0x00, 0x00, 0x43, 0x09, 0x01, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x23
+    },
+    {
+        0x80, 0xB4, 0x20, 0xD4, 0x20, 0xF6, 0x20, 0x16, 0x21, 0x37, 0x21, 0x57,
+        0x21, 0x76, 0x21, 0x93, 0x21, 0xAD, 0x21, 0xC6, 0x21, 0xDB, 0x21, 0xEF,
+        0x21, 0x01, 0x22, 0x12, 0x22, 0x00, 0x90, 0x7D, 0x30, 0x24, 0x10, 0x17,
+        0x80, 0x80, 0x80, 0x01, 0x00, 0x58, 0x00, 0x00, 0x4A, 0x09, 0x01, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7D
+    },
+    {
+        0x80, 0xE0, 0x20, 0xFD, 0x20, 0xCB, 0xAF, 0x30, 0x21, 0x46, 0x21, 0x59,
+        0x21, 0x6C, 0x21, 0x7D, 0x21, 0x8E, 0x21, 0x9F, 0x21, 0xB1, 0x21, 0xC4,
+        0x21, 0xD8, 0x21, 0xF0, 0x21, 0x00, 0x90, 0x79, 0x30, 0x24, 0x00, 0x1B,
+        0x80, 0x80, 0x80, 0x03, 0x00, 0x57, 0x00, 0x00, 0x2E, 0x09, 0x01, 0x00,
+        0x80, 0x10, 0x00, 0x00, 0x39, 0x30, 0x02, 0x00, 0x29
+    }
+};
+
+#define EMBEDDED_FRAMES (sizeof(embeddedFrames) / sizeof(embeddedFrames[0]))
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+
+static unsigned long allocations = 0;
+
+void *__wrap_malloc(size_t size)
+{
+    ++allocations;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    ++allocations;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size)
+{
+    ++allocations;
+    return __real_realloc(pointer, size);
+}
+
+/**
+ * the corpus and the state shared by the benchmarks
+ */
+struct BenchContext
+{
+    unsigned char (*frames)[UVR1611_DUAL_FRAME_SIZE+1];  /* complete frames as received */
+    int *lengths;
+    unsigned int frameCount;
+    unsigned char **blocks;     /* the controller blocks of all frames, starting with the device byte */
+    struct Sample *samples;     /* the parsed blocks */
+    unsigned int blockCount;
+    struct SystemState state;
+    char buffer[OUTPUT_BUFFER_SIZE];
+    FILE *devnull;
+    struct ScriptRunner *runner;
+    unsigned char *records;     /* the samples as store records */
+    struct HistoryEncoder *history;     /* writes to /dev/null */
+    unsigned char *compressed;  /* a history file of all records */
+    size_t compressedSize;
+    unsigned char *decoded;
+    unsigned long sink;         /* keeps the compiler from dropping the work */
+};
+
+/**
+ * run one step of a benchmark on corpus entry i
+ */
+typedef void (*BenchFunction)(struct BenchContext *context, unsigned int i);
+
+struct Benchmark
+{
+    char const *name;
+    BenchFunction run;
+    int perFrame;               /* iterates over the frames instead of the controller blocks */
+};
+
+static void benchParseUVR1611(struct BenchContext *context, unsigned int i)
+{
+    context->sink += parseUVR1611(context->blocks[i], &(context->state));
+}
+
+static void benchParseInputs(struct BenchContext *context, unsigned int i)
+{
+    context->sink += parseInputs(&(context->state), context->blocks[i]+1, UVR1611_INPUTS);
+}
+
+static void benchParseOutputs(struct BenchContext *context, unsigned int i)
+{
+    context->sink += parseOutputs(&(context->state), context->blocks[i]+33, UVR1611_OUTPUTS);
+}
+
+static void benchParseRotations(struct BenchContext *context, unsigned int i)
+{
+    context->sink += parseRotations(&(context->state), context->blocks[i]+35, UVR1611_ROTATIONS);
+}
+
+static void benchParseHeat(struct BenchContext *context, unsigned int i)
+{
+    context->sink += parseHeat(&(context->state), context->blocks[i]+39, UVR1611_HEAT_REGISTERS);
+}
+
+static void benchParseDataFrame(struct BenchContext *context, unsigned int i)
+{
+    unsigned int c;
+    for (c = 0; c < dataFrameControllerCount(context->lengths[i]); ++c) {
+        context->sink += parseDataFrame(context->frames[i], context->lengths[i], c, &(context->state));
+    }
+}
+
+static void benchFormatJSON(struct BenchContext *context, unsigned int i)
+{
+    context->sink += formatOutputRecord(OUTPUT_JSON, context->buffer, sizeof(context->buffer), &(context->samples[i]));
+}
+
+static void benchFormatCSV(struct BenchContext *context, unsigned int i)
+{
+    context->sink += formatOutputRecord(OUTPUT_CSV, context->buffer, sizeof(context->buffer), &(context->samples[i]));
+}
+
+static void benchFormatInflux(struct BenchContext *context, unsigned int i)
+{
+    context->sink += formatOutputRecord(OUTPUT_INFLUX, context->buffer, sizeof(context->buffer), &(context->samples[i]));
+}
+
+static void benchFormatRecord(struct BenchContext *context, unsigned int i)
+{
+    context->sink += formatSampleRecord(context->buffer, sizeof(context->buffer), &(context->samples[i]));
+}
+
+static void benchPrintSample(struct BenchContext *context, unsigned int i)
+{
+    printSample(context->devnull, &(context->samples[i]), 1);
+}
+
+static void benchScriptEnvironment(struct BenchContext *context, unsigned int i)
+{
+    context->sink += buildScriptEnvironment(context->runner, &(context->samples[i]));
+}
+
+static void benchHistoryAppend(struct BenchContext *context, unsigned int i)
+{
+    context->sink += historyAppend(context->history, context->records + i * STORE_RECORD_SIZE);
+}
+
+/**
+ * decodes the whole history file at the start of every pass, the time is
+ * spread over the samples
+ */
+static void benchHistoryDecode(struct BenchContext *context, unsigned int i)
+{
+    struct HistoryReader reader;
+    struct HistoryBlock block;
+    if (i != 0 || openHistoryReader(&reader, context->compressed, context->compressedSize) != 0) {
+        return;
+    }
+    while (nextHistoryBlock(&reader, &block) == 1) {
+        context->sink += decodeHistoryBlock(&block, context->decoded) + block.count;
+    }
+}
+
+static struct Benchmark benchmarks[] = {
+    { "parseUVR1611", benchParseUVR1611, 0 },
+    { "parseInputs", benchParseInputs, 0 },
+    { "parseOutputs", benchParseOutputs, 0 },
+    { "parseRotations", benchParseRotations, 0 },
+    { "parseHeat", benchParseHeat, 0 },
+    { "parseDataFrame", benchParseDataFrame, 1 },
+    { "formatJSON", benchFormatJSON, 0 },
+    { "formatCSV", benchFormatCSV, 0 },
+    { "formatInflux", benchFormatInflux, 0 },
+    { "formatSampleRecord", benchFormatRecord, 0 },
+    { "printSample", benchPrintSample, 0 },
+    { "buildScriptEnvironment", benchScriptEnvironment, 0 },
+    { "historyAppend", benchHistoryAppend, 0 },
+    { "historyDecode", benchHistoryDecode, 0 }
+};
+
+#define BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+void printUsage(char *command)
+{
+    fprintf(stderr, "Usage: %s [-n <iterations>] [-f <capture file>] [-b <benchmark>]\n", command);
+    fprintf(stderr, "  Runs the parser, formatter and history benchmarks and prints one line per benchmark:\n");
+    fprintf(stderr, "  bench=<name> frames=<n> ns_per_frame=<ns> frames_per_s=<n> allocs_per_frame=<n>\n");
+    fprintf(stderr, "  -n    Number of passes over the corpus. (default: %d)\n", DEFAULT_ITERATIONS);
+    fprintf(stderr, "  -f    Use the frames of a capture file (dlogg-reader -r) instead of the embedded ones.\n");
+    fprintf(stderr, "  -b    Only run the benchmarks whose name starts with <benchmark>.\n");
+}
+
+static long long benchClock()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * append a frame to the corpus
+ *
+ * \return 0 on success, -1 else
+ */
+static int addFrame(struct BenchContext *context, unsigned char const *frame, int length)
+{
+    unsigned int controllers = dataFrameControllerCount(length);
+    unsigned int c;
+    void *grown;
+    if ((length != UVR1611_FRAME_SIZE && length != UVR1611_DUAL_FRAME_SIZE) || frame[0] != UVR1611) {
+        return 0; // mode replies, "no data" and other devices are not benchmarked
+    }
+    grown = realloc(context->frames, (context->frameCount+1) * sizeof(*(context->frames)));
+    if (grown == NULL) {
+        return -1;
+    }
+    context->frames = grown;
+    grown = realloc(context->lengths, (context->frameCount+1) * sizeof(int));
+    if (grown == NULL) {
+        return -1;
+    }
+    context->lengths = grown;
+    grown = realloc(context->samples, (context->blockCount+controllers) * sizeof(struct Sample));
+    if (grown == NULL) {
+        return -1;
+    }
+    context->samples = grown;
+    memcpy(context->frames[context->frameCount], frame, length);
+    context->lengths[context->frameCount] = length;
+    for (c = 0; c < controllers; ++c) {
+        struct Sample *sample = &(context->samples[context->blockCount]);
+        memset(sample, 0, sizeof(struct Sample));
+        sample->timestamp.tv_sec = 1700000000 + context->blockCount;
+        sample->deviceID = 1;
+        sample->controllerID = c+1;
+        if (parseDataFrame(context->frames[context->frameCount], length, c, &(sample->state)) != 0) {
+            return -1;
+        }
+        ++context->blockCount;
+    }
+    ++context->frameCount;
+    return 0;
+}
+
+/**
+ * load the embedded frames. Pairs of them are also combined to frames of a
+ * D-LOGG in 2DL mode.
+ */
+static int loadEmbeddedFrames(struct BenchContext *context)
+{
+    unsigned char dual[UVR1611_DUAL_FRAME_SIZE];
+    unsigned int i;
+    unsigned int j;
+    for (i = 0; i < EMBEDDED_FRAMES; ++i) {
+        if (addFrame(context, embeddedFrames[i], UVR1611_FRAME_SIZE) != 0) {
+            return -1;
+        }
+    }
+    for (i = 0; i+1 < EMBEDDED_FRAMES; i += 2) {
+        memcpy(dual, embeddedFrames[i], UVR1611_FRAME_SIZE);
+        memcpy(dual+UVR1611_FRAME_SIZE, embeddedFrames[i+1], UVR1611_FRAME_SIZE);
+        dual[UVR1611_DUAL_FRAME_SIZE-1] = 0;
+        for (j = 0; j < UVR1611_DUAL_FRAME_SIZE-1; ++j) {
+            dual[UVR1611_DUAL_FRAME_SIZE-1] += dual[j];
+        }
+        if (addFrame(context, dual, UVR1611_DUAL_FRAME_SIZE) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * point the block list to the controller blocks of the loaded frames
+ */
+static int indexBlocks(struct BenchContext *context)
+{
+    unsigned int i;
+    unsigned int c;
+    unsigned int block = 0;
+    context->blocks = malloc(context->blockCount * sizeof(unsigned char *));
+    if (context->blocks == NULL) {
+        return -1;
+    }
+    for (i = 0; i < context->frameCount; ++i) {
+        for (c = 0; c < dataFrameControllerCount(context->lengths[i]); ++c) {
+            context->blocks[block++] = context->frames[i] + c * UVR1611_FRAME_SIZE;
+        }
+    }
+    return 0;
+}
+
+/**
+ * convert the samples to store records and compress them once for the
+ * history benchmarks
+ */
+static int prepareHistory(struct BenchContext *context)
+{
+    struct HistoryEncoder *encoder;
+    FILE *file;
+    unsigned int i;
+    int ok;
+    context->records = malloc(context->blockCount * STORE_RECORD_SIZE);
+    context->decoded = malloc(HISTORY_BLOCK_SAMPLES * STORE_RECORD_SIZE);
+    if (context->records == NULL || context->decoded == NULL) {
+        return -1;
+    }
+    for (i = 0; i < context->blockCount; ++i) {
+        encodeStoreRecord(&(context->samples[i]), context->records + i * STORE_RECORD_SIZE);
+    }
+    file = tmpfile();
+    if (file == NULL) {
+        return -1;
+    }
+    encoder = initHistoryEncoder(fileno(file));
+    ok = encoder != NULL;
+    for (i = 0; ok && i < context->blockCount; ++i) {
+        ok = historyAppend(encoder, context->records + i * STORE_RECORD_SIZE) == 0;
+    }
+    if (ok) {
+        ok = flushHistoryEncoder(encoder) == 0;
+    }
+    if (ok) {
+        context->compressedSize = encoder->bytes;
+        context->compressed = malloc(context->compressedSize);
+        ok = context->compressed != NULL
+             && pread(fileno(file), context->compressed, context->compressedSize, 0) == (ssize_t)context->compressedSize;
+    }
+    cleanupHistoryEncoder(encoder);
+    fclose(file);
+    if (ok) {
+        context->history = initHistoryEncoder(fileno(context->devnull));
+        ok = context->history != NULL;
+    }
+    return ok ? 0 : -1;
+}
+
+static int loadCapturedFrames(struct BenchContext *context, char const *path)
+{
+    struct CaptureReader *reader;
+    struct CapturedFrame frame;
+    int ret;
+    reader = openCaptureReader(path);
+    if (reader == NULL) {
+        return -1;
+    }
+    while ((ret = readCapturedFrame(reader, &frame)) == 1) {
+        if (addFrame(context, frame.frame, frame.length) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+    closeCaptureReader(reader);
+    return ret;
+}
+
+/**
+ * run a benchmark and print its result line
+ */
+static void runBenchmark(struct BenchContext *context, struct Benchmark *benchmark, unsigned long iterations)
+{
+    unsigned int count = benchmark->perFrame ? context->frameCount : context->blockCount;
+    unsigned long frames = iterations * count;
+    unsigned long allocated;
+    unsigned long n;
+    unsigned int i;
+    long long start;
+    long long elapsed;
+    // one pass to warm the caches and to get one-time allocations, e.g. stdio buffers, out of the way
+    for (i = 0; i < count; ++i) {
+        benchmark->run(context, i);
+    }
+    allocated = allocations;
+    start = benchClock();
+    for (n = 0; n < iterations; ++n) {
+        for (i = 0; i < count; ++i) {
+            benchmark->run(context, i);
+        }
+    }
+    elapsed = benchClock() - start;
+    allocated = allocations - allocated;
+    if (elapsed <= 0) {
+        elapsed = 1;
+    }
+    printf("bench=%s frames=%lu ns_per_frame=%.1f frames_per_s=%.0f allocs_per_frame=%.3f\n",
+           benchmark->name, frames, (double)elapsed / frames, frames * 1e9 / elapsed, (double)allocated / frames);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    struct BenchContext context;
+    unsigned long iterations = DEFAULT_ITERATIONS;
+    char *file = NULL;
+    char *filter = NULL;
+    unsigned int b;
+    int opt;
+    int ok;
+    while ((opt = getopt(argc, argv, "n:f:b:")) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                file = optarg;
+                break;
+            case 'b':
+                filter = optarg;
+                break;
+            default:
+                printUsage(argv[0]);
+                return -1;
+        }
+    }
+    if (iterations == 0) {
+        printUsage(argv[0]);
+        return -1;
+    }
+    initlog(0);
+    memset(&context, 0, sizeof(context));
+    ok = (file != NULL ? loadCapturedFrames(&context, file) : loadEmbeddedFrames(&context)) == 0;
+    if (!ok) {
+        fprintf(stderr, "Could not load the frames. %s\n", strerror(errno));
+    }
+    else if (context.blockCount == 0) {
+        fprintf(stderr, "No UVR1611 frames in %s\n", file);
+        ok = 0;
+    }
+    if (ok) {
+        ok = indexBlocks(&context) == 0;
+    }
+    if (ok) {
+        context.devnull = fopen("/dev/null", "w");
+        ok = context.devnull != NULL;
+    }
+    if (ok) {
+        context.runner = initScriptRunner("true", 0);
+        ok = context.runner != NULL;
+    }
+    if (ok) {
+        ok = prepareHistory(&context) == 0;
+    }
+    if (ok) {
+        printf("corpus=%s frames=%u controllers=%u iterations=%lu\n",
+               file != NULL ? file : "embedded", context.frameCount, context.blockCount, iterations);
+        for (b = 0; b < BENCHMARKS; ++b) {
+            if (filter == NULL || strncmp(benchmarks[b].name, filter, strlen(filter)) == 0) {
+                runBenchmark(&context, &(benchmarks[b]), iterations);
+            }
+        }
+        if (filter == NULL || strncmp("historySize", filter, strlen(filter)) == 0) {
+            printf("bench=historySize samples=%u bytes=%lu bytes_per_sample=%.2f record_bytes=%d\n", context.blockCount,
+                   (unsigned long)context.compressedSize, (double)context.compressedSize / context.blockCount, STORE_RECORD_SIZE);
+        }
+    }
+    if (context.history != NULL) {
+        cleanupHistoryEncoder(context.history);
+    }
+    if (context.runner != NULL) {
+        cleanupScriptRunner(context.runner);
+    }
+    if (context.devnull != NULL) {
+        fclose(context.devnull);
+    }
+    free(context.frames);
+    free(context.lengths);
+    free(context.blocks);
+    free(context.samples);
+    free(context.records);
+    free(context.compressed);
+    free(context.decoded);
+    endlog();
+    return ok ? 0 : -1;
+}
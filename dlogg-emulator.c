@@ -0,0 +1,529 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Emulates a D-LOGG on a pseudo terminal, so that dlogg-reader can be
+ * tested and benchmarked without hardware. The emulator answers GET_MODE,
+ * GET_CURRENT_DATA, GET_HEADER and READ_DATA with synthetic or recorded
+ * UVR1611 frames and can inject latency, split replies, "no new data"
+ * replies, garbage and lost replies.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "datatypes.h"
+#include "capture.h"
+#include "logging.h"
+
+/**
+ * the recorded frames to answer GET_CURRENT_DATA with
+ */
+struct FrameList
+{
+    struct CapturedFrame *frames;
+    unsigned int count;
+    unsigned int next;
+};
+
+/**
+ * the behaviour of the emulated device
+ */
+struct Emulator
+{
+    int master;
+    unsigned char mode;
+    struct FrameList recorded;
+    unsigned long sequence;      /* number of synthetic frames generated */
+    int hold;                    /* number of requests answered with the same synthetic frame */
+    int held;                    /* number of times the current frame was sent */
+    int latency;                 /* delay before every reply in ms */
+    int chunkSize;               /* split replies into chunks of this size, 0 sends them at once */
+    int chunkGap;                /* delay between two chunks in us */
+    int noDataRate;              /* percentage of "no new data" replies */
+    int garbageRate;             /* percentage of garbage replies */
+    int lossRate;                /* percentage of requests not answered at all */
+    unsigned int loggerRecords;  /* number of records in the emulated logger memory */
+    unsigned long requests;
+    unsigned long frames;
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void stopEmulator(int signal)
+{
+    (void)signal;
+    running = 0;
+}
+
+static int chance(int percent)
+{
+    return percent > 0 && rand() % 100 < percent;
+}
+
+static void sleepMicroseconds(long us)
+{
+    struct timespec delay;
+    delay.tv_sec = us / 1000000;
+    delay.tv_nsec = (us % 1000000) * 1000;
+    nanosleep(&delay, NULL);
+}
+
+/**
+ * send a reply, honouring latency and chunking
+ */
+static void reply(struct Emulator *emulator, unsigned char const *buffer, int length)
+{
+    int offset = 0;
+    if (emulator->latency > 0) {
+        sleepMicroseconds(emulator->latency * 1000L);
+    }
+    while (offset < length) {
+        int chunk = length - offset;
+        ssize_t ret;
+        if (emulator->chunkSize > 0 && chunk > emulator->chunkSize) {
+            chunk = emulator->chunkSize;
+        }
+        ret = write(emulator->master, buffer+offset, chunk);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            log_output(LOG_ERR, "Could not write to pty. %s\n", strerror(errno));
+            return;
+        }
+        offset += ret;
+        if (offset < length && emulator->chunkGap > 0) {
+            sleepMicroseconds(emulator->chunkGap);
+        }
+    }
+}
+
+static void putInput(unsigned char *buffer, int type, int value)
+{
+    value &= 0x0FFF;
+    buffer[0] = value & 0xFF;
+    buffer[1] = ((type & 0x07) << 4) | (value >> 8);
+}
+
+/**
+ * generate the 55 value bytes of a UVR1611 with slowly changing temperatures
+ */
+static void generateValues(unsigned char *data, unsigned long sequence)
+{
+    int i;
+    long power;
+    unsigned long total;
+    memset(data, 0, 55);
+    for (i = 0; i < UVR1611_INPUTS; ++i) {
+        // temperatures in 0.1 °C moving around a per-sensor base value
+        int value = 200 + 25 * i + (int)(30.0 * sin((sequence + 17.0 * i) / 60.0));
+        putInput(data + 2*i, TEMPERATURE, value);
+    }
+    putInput(data + 2*14, DIGITAL, 0);
+    data[2*14+1] |= (sequence / 30) % 2 ? 0x80 : 0x00;
+    putInput(data + 2*15, FLOW, 120 + (int)(sequence % 8));
+    // outputs: some pumps switching every few minutes
+    data[32] = ((sequence / 20) % 2) | (((sequence / 45) % 2) << 2) | (1 << 5);
+    data[33] = ((sequence / 90) % 2) << 4;
+    // rotation speeds of outputs 1, 2, 6 and 7, bit 7 marks them inactive
+    data[34] = 20 + sequence % 10;
+    data[35] = 0x80;
+    data[36] = 0x80;
+    data[37] = 0x80;
+    // heat register 1 enabled
+    data[38] = 0x01;
+    power = 85 + (long)(sequence % 5);           // 0.1 kW, the first byte holds 1/256 of that
+    data[39] = 0;
+    data[40] = power & 0xFF;
+    data[41] = (power >> 8) & 0xFF;
+    data[42] = 0;
+    total = 12345 + sequence / 10;               // 0.1 kWh, the high word counts MWh
+    data[43] = (total % 10000) & 0xFF;
+    data[44] = ((total % 10000) >> 8) & 0xFF;
+    data[45] = (total / 10000) & 0xFF;
+    data[46] = ((total / 10000) >> 8) & 0xFF;
+}
+
+/**
+ * build a GET_CURRENT_DATA frame
+ *
+ * \return the length of the frame
+ */
+static int buildFrame(struct Emulator *emulator, unsigned char *frame)
+{
+    int controllers = emulator->mode == MODE_2DL ? 2 : 1;
+    int length;
+    int i;
+    if (emulator->recorded.count > 0) {
+        struct CapturedFrame *recorded = &(emulator->recorded.frames[emulator->recorded.next]);
+        emulator->recorded.next = (emulator->recorded.next + 1) % emulator->recorded.count;
+        memcpy(frame, recorded->frame, recorded->length);
+        return recorded->length;
+    }
+    for (i = 0; i < controllers; ++i) {
+        unsigned char *block = frame + i * UVR1611_FRAME_SIZE;
+        int j;
+        block[0] = UVR1611;
+        generateValues(block+1, emulator->sequence + 1000 * i);
+        block[UVR1611_FRAME_SIZE-1] = 0;
+        for (j = 0; j < UVR1611_FRAME_SIZE-1; ++j) {
+            block[UVR1611_FRAME_SIZE-1] += block[j];
+        }
+    }
+    if (++emulator->held >= emulator->hold) {
+        emulator->held = 0;
+        ++emulator->sequence;
+    }
+    length = controllers == 2 ? UVR1611_DUAL_FRAME_SIZE : UVR1611_FRAME_SIZE;
+    if (controllers == 2) {
+        frame[length-1] = 0;
+        for (i = 0; i < length-1; ++i) {
+            frame[length-1] += frame[i];
+        }
+    }
+    return length;
+}
+
+static void answerCurrentData(struct Emulator *emulator)
+{
+    unsigned char frame[UVR1611_DUAL_FRAME_SIZE];
+    int length;
+    if (chance(emulator->lossRate)) {
+        return;
+    }
+    if (chance(emulator->noDataRate)) {
+        unsigned char noData = GET_CURRENT_DATA;
+        reply(emulator, &noData, 1);
+        return;
+    }
+    if (chance(emulator->garbageRate)) {
+        int i;
+        length = 1 + rand() % UVR1611_FRAME_SIZE;
+        for (i = 0; i < length; ++i) {
+            frame[i] = rand() & 0xFF;
+        }
+        // the first byte must be neither a device byte nor the no data answer
+        while (frame[0] == UVR1611 || frame[0] == GET_CURRENT_DATA) {
+            frame[0] = rand() & 0xFF;
+        }
+        reply(emulator, frame, length);
+        return;
+    }
+    length = buildFrame(emulator, frame);
+    reply(emulator, frame, length);
+    ++emulator->frames;
+}
+
+static void putAddress(unsigned char *buffer, unsigned long address)
+{
+    buffer[0] = address & 0xFF;
+    buffer[1] = (address >> 8) & 0xFF;
+    buffer[2] = (address >> 16) & 0xFF;
+}
+
+/**
+ * the size of a logger record, one block per controller
+ */
+static unsigned int recordSize(struct Emulator *emulator)
+{
+    return emulator->mode == MODE_2DL ? 2 * LOGGER_BLOCK_SIZE : LOGGER_BLOCK_SIZE;
+}
+
+/**
+ * answer GET_HEADER. The 2DL header carries one record size per controller.
+ */
+static void answerHeader(struct Emulator *emulator)
+{
+    unsigned char header[LOGGER_HEADER_SIZE_2DL];
+    int size;
+    int i;
+    memset(header, 0, sizeof(header));
+    header[0] = UVR1611;
+    header[1] = 1;
+    header[5] = LOGGER_BLOCK_SIZE;
+    if (emulator->mode == MODE_2DL) {
+        size = LOGGER_HEADER_SIZE_2DL;
+        header[6] = LOGGER_BLOCK_SIZE;
+        putAddress(header+7, 0);
+        putAddress(header+10, emulator->loggerRecords * recordSize(emulator));
+    }
+    else {
+        size = LOGGER_HEADER_SIZE_1DL;
+        putAddress(header+6, 0);
+        putAddress(header+9, emulator->loggerRecords * recordSize(emulator));
+    }
+    for (i = 0; i < size-1; ++i) {
+        header[size-1] += header[i];
+    }
+    reply(emulator, header, size);
+}
+
+/**
+ * answer READ_DATA with records logged once a minute
+ */
+static void answerReadData(struct Emulator *emulator, unsigned char const *parameters)
+{
+    unsigned char records[LOGGER_MAX_CHUNK * 2 * LOGGER_BLOCK_SIZE];
+    unsigned long address = parameters[0] | (parameters[1] << 8) | ((unsigned long)parameters[2] << 16);
+    unsigned int count = parameters[3];
+    unsigned int blocks = recordSize(emulator) / LOGGER_BLOCK_SIZE;
+    unsigned int i;
+    unsigned int c;
+    if (count > LOGGER_MAX_CHUNK) {
+        count = LOGGER_MAX_CHUNK;
+    }
+    for (i = 0; i < count; ++i) {
+        unsigned long index = address / recordSize(emulator) + i;
+        for (c = 0; c < blocks; ++c) {
+            unsigned char *block = records + (i * blocks + c) * LOGGER_BLOCK_SIZE;
+            int j;
+            memset(block, 0, LOGGER_BLOCK_SIZE);
+            generateValues(block, index + 1000 * c);
+            block[LOGGER_TIME_OFFSET] = 0;
+            block[LOGGER_TIME_OFFSET+1] = index % 60;
+            block[LOGGER_TIME_OFFSET+2] = (index / 60) % 24;
+            block[LOGGER_TIME_OFFSET+3] = 1 + (index / 1440) % 28;
+            block[LOGGER_TIME_OFFSET+4] = 1;
+            block[LOGGER_TIME_OFFSET+5] = 26;
+            for (j = 0; j < LOGGER_BLOCK_SIZE-1; ++j) {
+                block[LOGGER_BLOCK_SIZE-1] += block[j];
+            }
+        }
+    }
+    reply(emulator, records, count * recordSize(emulator));
+}
+
+/**
+ * read exactly count bytes of command parameters
+ */
+static int readParameters(struct Emulator *emulator, unsigned char *buffer, int count)
+{
+    int offset = 0;
+    while (offset < count) {
+        ssize_t ret = read(emulator->master, buffer+offset, count-offset);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR && running) {
+                continue;
+            }
+            return -1;
+        }
+        offset += ret;
+    }
+    return 0;
+}
+
+/**
+ * load all frames of a capture file into memory
+ */
+static int loadFrames(struct FrameList *list, char const *path)
+{
+    struct CaptureReader *reader;
+    struct CapturedFrame frame;
+    unsigned int capacity = 0;
+    int ret;
+    reader = openCaptureReader(path);
+    if (reader == NULL) {
+        return -1;
+    }
+    while ((ret = readCapturedFrame(reader, &frame)) == 1) {
+        if (list->count == capacity) {
+            struct CapturedFrame *frames;
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            frames = realloc(list->frames, capacity * sizeof(struct CapturedFrame));
+            if (frames == NULL) {
+                closeCaptureReader(reader);
+                return -1;
+            }
+            list->frames = frames;
+        }
+        list->frames[list->count++] = frame;
+    }
+    closeCaptureReader(reader);
+    if (ret < 0 || list->count == 0) {
+        log_output(LOG_ERR, "No frames in capture file %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+void printUsage(char *command)
+{
+    fprintf(stderr, "Usage: %s [-m <mode>] [-f <capture file>] [-l <latency>] [-c <chunk size>] [-g <gap>]\n", command);
+    fprintf(stderr, "       [-n <percent>] [-G <percent>] [-L <percent>] [-N <records>] [-u <count>] [-v]\n");
+    fprintf(stderr, "  Creates a pseudo terminal emulating a D-LOGG and prints the path of its slave.\n");
+    fprintf(stderr, "  -m    Set the device mode: 1dl (one UVR1611) or 2dl (two UVR1611). (default: 1dl)\n");
+    fprintf(stderr, "  -f    Answer with the frames of the given capture file (see dlogg-reader -r)\n");
+    fprintf(stderr, "        in a loop instead of synthetic frames.\n");
+    fprintf(stderr, "  -l    Delay every reply by the given number of ms. (default: 0)\n");
+    fprintf(stderr, "  -c    Send the replies in chunks of the given number of bytes. (default: 0, at once)\n");
+    fprintf(stderr, "  -g    Wait the given number of us between two chunks. (default: 0)\n");
+    fprintf(stderr, "  -n    Answer the given percentage of requests with \"no new data\". (default: 0)\n");
+    fprintf(stderr, "  -G    Answer the given percentage of requests with garbage. (default: 0)\n");
+    fprintf(stderr, "  -L    Do not answer the given percentage of requests at all. (default: 0)\n");
+    fprintf(stderr, "  -N    Set the number of records in the data logger memory. (default: 1000)\n");
+    fprintf(stderr, "  -u    Answer <count> requests with the same synthetic frame before the values change. (default: 1)\n");
+    fprintf(stderr, "  -v    Enable debug output.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct Emulator emulator;
+    struct termios attrs;
+    char *recordedFile = NULL;
+    int slave;
+    int opt;
+    memset(&emulator, 0, sizeof(struct Emulator));
+    emulator.mode = MODE_1DL;
+    emulator.loggerRecords = 1000;
+    emulator.hold = 1;
+    while ((opt = getopt(argc, argv, "m:f:l:c:g:n:G:L:N:u:v")) != -1) {
+        switch (opt) {
+            case 'm':
+                if (strcmp(optarg, "1dl") == 0) {
+                    emulator.mode = MODE_1DL;
+                }
+                else if (strcmp(optarg, "2dl") == 0) {
+                    emulator.mode = MODE_2DL;
+                }
+                else {
+                    fprintf(stderr, "Unknown mode %s.\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'f':
+                recordedFile = optarg;
+                break;
+            case 'l':
+                emulator.latency = atoi(optarg);
+                break;
+            case 'c':
+                emulator.chunkSize = atoi(optarg);
+                break;
+            case 'g':
+                emulator.chunkGap = atoi(optarg);
+                break;
+            case 'n':
+                emulator.noDataRate = atoi(optarg);
+                break;
+            case 'G':
+                emulator.garbageRate = atoi(optarg);
+                break;
+            case 'L':
+                emulator.lossRate = atoi(optarg);
+                break;
+            case 'N':
+                emulator.loggerRecords = atoi(optarg);
+                break;
+            case 'u':
+                emulator.hold = atoi(optarg);
+                if (emulator.hold < 1) {
+                    emulator.hold = 1;
+                }
+                break;
+            case 'v':
+                enable_debug();
+                break;
+            default:
+                printUsage(argv[0]);
+                return -1;
+        }
+    }
+    initlog(0);
+    if (recordedFile != NULL) {
+        if (loadFrames(&(emulator.recorded), recordedFile) != 0) {
+            return -1;
+        }
+        // the mode has to match the recorded frames
+        emulator.mode = emulator.recorded.frames[0].mode;
+    }
+    if (emulator.loggerRecords * recordSize(&emulator) >= LOGGER_MEMORY_SIZE) {
+        fprintf(stderr, "The logger memory holds less than %d records.\n", LOGGER_MEMORY_SIZE / recordSize(&emulator));
+        return -1;
+    }
+    emulator.master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (emulator.master < 0 || grantpt(emulator.master) != 0 || unlockpt(emulator.master) != 0) {
+        fprintf(stderr, "Could not create pseudo terminal. %s\n", strerror(errno));
+        return -1;
+    }
+    // keep the slave open ourselves, so the master stays usable while the reader reopens it
+    slave = open(ptsname(emulator.master), O_RDWR | O_NOCTTY);
+    if (slave < 0) {
+        fprintf(stderr, "Could not open pseudo terminal slave. %s\n", strerror(errno));
+        return -1;
+    }
+    if (tcgetattr(emulator.master, &attrs) == 0) {
+        cfmakeraw(&attrs);
+        tcsetattr(emulator.master, TCSANOW, &attrs);
+    }
+    printf("%s\n", ptsname(emulator.master));
+    fflush(stdout);
+    signal(SIGINT, stopEmulator);
+    signal(SIGTERM, stopEmulator);
+    srand(time(NULL));
+    while (running) {
+        unsigned char command;
+        unsigned char parameters[5];
+        ssize_t ret = read(emulator.master, &command, 1);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        ++emulator.requests;
+        switch (command) {
+            case GET_MODE:
+                reply(&emulator, &(emulator.mode), 1);
+                break;
+            case GET_CURRENT_DATA:
+                answerCurrentData(&emulator);
+                break;
+            case GET_HEADER:
+                answerHeader(&emulator);
+                break;
+            case READ_DATA:
+                if (readParameters(&emulator, parameters, sizeof(parameters)) == 0) {
+                    answerReadData(&emulator, parameters);
+                }
+                break;
+            default:
+                log_output(LOG_DEBUG, "Ignoring unknown command %x\n", (unsigned int)command);
+                break;
+        }
+    }
+    log_output(LOG_INFO, "Answered %lu requests with %lu frames\n", emulator.requests, emulator.frames);
+    close(slave);
+    close(emulator.master);
+    free(emulator.recorded.frames);
+    endlog();
+    return 0;
+}
@@ -0,0 +1,671 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+ * Queries the sample store written by dlogg-reader -W and the rollups of
+ * dlogg-reader -G.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "store.h"
+#include "history.h"
+#include "rollup.h"
+#include "logging.h"
+
+#define MAX_CHANNELS 64
+
+/**
+ * running statistics of a channel for -a
+ */
+struct ChannelStatistics
+{
+    unsigned long count;
+    double min;
+    double max;
+    double sum;
+    int decimals;
+};
+
+/**
+ * what to do with the records
+ */
+struct Query
+{
+    long long from;
+    long long to;               /* -1 for no limit */
+    unsigned int device;
+    unsigned int controller;
+    struct StoreChannel channels[MAX_CHANNELS];
+    struct ChannelStatistics statistics[MAX_CHANNELS];
+    int channelCount;
+    int aggregate;
+    struct HistoryEncoder *history;     /* -z: write the records to a history file */
+    struct RollupWindow total;          /* -g -a: all matching rollup rows merged */
+    unsigned long scanned;
+    unsigned long matched;
+};
+
+void printUsage(char *command)
+{
+    fprintf(stderr, "Usage: %s [-d <store>] [-f <from>] [-t <to>] [-D <device>] [-C <controller>] [-c <channel>[,...]] [-g <tier>] [-a | -z <directory>] [-v]\n", command);
+    fprintf(stderr, "  Prints the samples of a store written by dlogg-reader -W [-Z] as CSV.\n");
+    fprintf(stderr, "  -d    The store directory. (default: .)\n");
+    fprintf(stderr, "  -f    Only samples at or after this time. (default: the first sample)\n");
+    fprintf(stderr, "  -t    Only samples at or before this time. (default: the last sample)\n");
+    fprintf(stderr, "        Times are seconds since the epoch or local times like 2024-01-31T12:00:00.\n");
+    fprintf(stderr, "  -D    Only samples of the given device.\n");
+    fprintf(stderr, "  -C    Only samples of the given controller.\n");
+    fprintf(stderr, "  -c    The channels to print, named like the columns of dlogg-reader -o csv:\n");
+    fprintf(stderr, "        S1-S16, O1-O13, R1-R4, H1_POWER, H1_ENERGY, H2_POWER, H2_ENERGY. (default: all)\n");
+    fprintf(stderr, "  -a    Print the number, minimum, maximum and average of every channel instead.\n");
+    fprintf(stderr, "  -g    Read the rollups of dlogg-reader -G in the store directory instead of the\n");
+    fprintf(stderr, "        samples: 1m, 1h or 1d. Every row is a window starting in the time range\n");
+    fprintf(stderr, "        with the minimum, maximum and average of the inputs, the seconds the\n");
+    fprintf(stderr, "        outputs were on, the average heat power in kW and the energy in kWh\n");
+    fprintf(stderr, "        integrated from it. -a adds up the rows, the total column holds the\n");
+    fprintf(stderr, "        hours of the outputs and the kWh of the heat registers.\n");
+    fprintf(stderr, "  -z    Write the selected samples to a compressed history file in the given\n");
+    fprintf(stderr, "        directory instead, e.g. to compact the segments of a store.\n");
+    fprintf(stderr, "  -v    Print the number of scanned records and the query time to stderr.\n");
+}
+
+/**
+ * parse a time given as seconds since the epoch or as local time
+ *
+ * \return the time in ms since the epoch, -1 if it cannot be parsed
+ */
+static long long parseTime(char const *text)
+{
+    struct tm local;
+    char *end;
+    double seconds;
+    int matched;
+    seconds = strtod(text, &end);
+    if (*end == '\0' && end != text) {
+        return (long long)(seconds * 1000);
+    }
+    memset(&local, 0, sizeof(local));
+    matched = sscanf(text, "%d-%d-%d%*[T ]%d:%d:%d", &local.tm_year, &local.tm_mon, &local.tm_mday,
+                     &local.tm_hour, &local.tm_min, &local.tm_sec);
+    if (matched != 3 && matched < 5) {
+        return -1;
+    }
+    local.tm_year -= 1900;
+    local.tm_mon -= 1;
+    local.tm_isdst = -1;
+    return (long long)mktime(&local) * 1000;
+}
+
+/**
+ * parse the comma separated channel list
+ *
+ * \return the number of channels, -1 on error
+ */
+static int parseChannels(char *list, struct StoreChannel *channels)
+{
+    int count = 0;
+    char *name;
+    for (name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        if (count == MAX_CHANNELS || parseStoreChannel(name, &(channels[count])) != 0) {
+            fprintf(stderr, "Unknown channel %s.\n", name);
+            return -1;
+        }
+        ++count;
+    }
+    return count;
+}
+
+static int allChannels(struct StoreChannel *channels)
+{
+    char name[16];
+    int count = 0;
+    int i;
+    for (i = 1; i <= UVR1611_INPUTS; ++i) {
+        sprintf(name, "S%d", i);
+        parseStoreChannel(name, &(channels[count++]));
+    }
+    for (i = 1; i <= UVR1611_OUTPUTS; ++i) {
+        sprintf(name, "O%d", i);
+        parseStoreChannel(name, &(channels[count++]));
+    }
+    for (i = 1; i <= UVR1611_ROTATIONS; ++i) {
+        sprintf(name, "R%d", i);
+        parseStoreChannel(name, &(channels[count++]));
+    }
+    for (i = 1; i <= UVR1611_HEAT_REGISTERS; ++i) {
+        sprintf(name, "H%d_POWER", i);
+        parseStoreChannel(name, &(channels[count++]));
+        sprintf(name, "H%d_ENERGY", i);
+        parseStoreChannel(name, &(channels[count++]));
+    }
+    return count;
+}
+
+static void printRecord(unsigned char const *record, struct StoreChannel *channels, int count)
+{
+    long long time = storeRecordTime(record);
+    int i;
+    printf("%lld.%03lld,%u,%u", time / 1000, time % 1000, (unsigned int)record[8], (unsigned int)record[9]);
+    for (i = 0; i < count; ++i) {
+        double value;
+        int decimals;
+        if (storeChannelValue(record, &(channels[i]), &value, &decimals)) {
+            printf(",%.*f", decimals, value);
+        }
+        else {
+            putchar(',');
+        }
+    }
+    putchar('\n');
+}
+
+static void addStatistics(unsigned char const *record, struct StoreChannel *channels, int count, struct ChannelStatistics *statistics)
+{
+    int i;
+    for (i = 0; i < count; ++i) {
+        struct ChannelStatistics *current = &(statistics[i]);
+        double value;
+        int decimals;
+        if (!storeChannelValue(record, &(channels[i]), &value, &decimals)) {
+            continue;
+        }
+        if (current->count == 0 || value < current->min) {
+            current->min = value;
+        }
+        if (current->count == 0 || value > current->max) {
+            current->max = value;
+        }
+        current->sum += value;
+        current->decimals = decimals;
+        ++current->count;
+    }
+}
+
+/**
+ * handle a record of a segment
+ *
+ * \return 1 if the record is past the end of the query, 0 else
+ */
+static int queryRecord(struct Query *query, unsigned char const *record)
+{
+    ++query->scanned;
+    if (query->to >= 0 && storeRecordTime(record) > query->to) {
+        return 1;
+    }
+    if (storeRecordTime(record) < query->from
+        || (query->device != 0 && record[8] != query->device) || (query->controller != 0 && record[9] != query->controller)) {
+        return 0;
+    }
+    ++query->matched;
+    if (query->history != NULL) {
+        historyAppend(query->history, record);
+    }
+    else if (query->aggregate) {
+        addStatistics(record, query->channels, query->channelCount, query->statistics);
+    }
+    else {
+        printRecord(record, query->channels, query->channelCount);
+    }
+    return 0;
+}
+
+static int querySegment(struct Query *query, char const *path)
+{
+    struct StoreSegment segment;
+    unsigned long r;
+    if (openStoreSegment(path, &segment) != 0) {
+        return -1;
+    }
+    if (segment.count > 0 && (query->to < 0 || storeRecordTime(segment.records) <= query->to)
+        && storeRecordTime(segment.records + (segment.count-1) * STORE_RECORD_SIZE) >= query->from) {
+        for (r = findStoreRecord(&segment, query->from); r < segment.count; ++r) {
+            if (queryRecord(query, segment.records + r * STORE_RECORD_SIZE) != 0) {
+                break;
+            }
+        }
+    }
+    closeStoreSegment(&segment);
+    return 0;
+}
+
+/**
+ * decode the blocks of a history file which overlap the query
+ */
+static int queryHistory(struct Query *query, char const *path)
+{
+    struct HistoryReader reader;
+    struct HistoryBlock block;
+    struct stat info;
+    unsigned char *records = NULL;
+    void *map;
+    int ret = 0;
+    int fd;
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (info.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    if (openHistoryReader(&reader, map, info.st_size) != 0) {
+        munmap(map, info.st_size);
+        return -1;
+    }
+    records = malloc(HISTORY_BLOCK_SAMPLES * STORE_RECORD_SIZE);
+    if (records == NULL) {
+        munmap(map, info.st_size);
+        return -1;
+    }
+    while (nextHistoryBlock(&reader, &block) == 1) {
+        unsigned int r;
+        if ((query->to >= 0 && block.first > query->to) || block.last < query->from
+            || (query->device != 0 && block.device != query->device)
+            || (query->controller != 0 && block.controller != query->controller)) {
+            continue;
+        }
+        if (decodeHistoryBlock(&block, records) != 0) {
+            fprintf(stderr, "Corrupt block in %s\n", path);
+            ret = -1;
+            break;
+        }
+        for (r = 0; r < block.count; ++r) {
+            if (queryRecord(query, records + r * STORE_RECORD_SIZE) != 0) {
+                break;
+            }
+        }
+    }
+    free(records);
+    munmap(map, info.st_size);
+    return ret;
+}
+
+/**
+ * the scale of an input in a rollup row
+ */
+static double rollupScale(struct RollupWindow const *window, unsigned int input, int *decimals)
+{
+    if (((window->types >> (4 * input)) & 0x0F) == TEMPERATURE) {
+        *decimals = 1;
+        return 0.1;
+    }
+    *decimals = 0;
+    return 1;
+}
+
+static void printRollupHeader(struct Query const *query)
+{
+    int i;
+    printf("start,device,controller,samples");
+    for (i = 0; i < query->channelCount; ++i) {
+        char const *name = query->channels[i].name;
+        switch (query->channels[i].group) {
+            case 'S':
+                printf(",%s_min,%s_max,%s_avg", name, name, name);
+                break;
+            case 'O':
+                printf(",%s_on", name);
+                break;
+            default:
+                printf(query->channels[i].energy ? ",%s_kWh" : ",%s_avg", name);
+                break;
+        }
+    }
+    putchar('\n');
+}
+
+static void printRollupRow(struct Query const *query, struct RollupWindow const *window)
+{
+    int i;
+    printf("%lld,%u,%u,%lu", window->start / 1000, window->device, window->controller, window->samples);
+    for (i = 0; i < query->channelCount; ++i) {
+        unsigned int n = query->channels[i].number - 1;
+        struct RollupInput const *input = &(window->inputs[n]);
+        double scale;
+        int decimals;
+        switch (query->channels[i].group) {
+            case 'S':
+                if (input->count == 0) {
+                    printf(",,,");
+                    break;
+                }
+                scale = rollupScale(window, n, &decimals);
+                printf(",%.*f,%.*f,%.*f", decimals, input->min * scale, decimals, input->max * scale,
+                       decimals + 1, (double)input->sum / input->count * scale);
+                break;
+            case 'O':
+                printf(",%.1f", window->onTime[n] / 1000.0);
+                break;
+            default:
+                if (query->channels[i].energy) {
+                    printf(",%.3f", window->energy[n] / ROLLUP_KWH);
+                }
+                else if (window->covered > 0) {
+                    printf(",%.2f", window->energy[n] / 100.0 / window->covered);
+                }
+                else {
+                    putchar(',');
+                }
+                break;
+        }
+    }
+    putchar('\n');
+}
+
+static void printRollupTotal(struct Query const *query)
+{
+    struct RollupWindow const *total = &(query->total);
+    int i;
+    printf("channel,count,min,max,avg,total\n");
+    for (i = 0; i < query->channelCount; ++i) {
+        unsigned int n = query->channels[i].number - 1;
+        struct RollupInput const *input = &(total->inputs[n]);
+        char const *name = query->channels[i].name;
+        double scale;
+        int decimals;
+        switch (query->channels[i].group) {
+            case 'S':
+                if (input->count == 0) {
+                    printf("%s,0,,,,\n", name);
+                    break;
+                }
+                scale = rollupScale(total, n, &decimals);
+                printf("%s,%lu,%.*f,%.*f,%.*f,\n", name, input->count, decimals, input->min * scale, decimals,
+                       input->max * scale, decimals + 1, (double)input->sum / input->count * scale);
+                break;
+            case 'O':
+                printf("%s,%lu,,,%.3f,%.3f\n", name, total->samples,
+                       total->covered > 0 ? (double)total->onTime[n] / total->covered : 0.0, total->onTime[n] / 3600000.0);
+                break;
+            default:
+                if (query->channels[i].energy) {
+                    printf("%s,%lu,,,,%.3f\n", name, total->samples, total->energy[n] / ROLLUP_KWH);
+                }
+                else {
+                    printf("%s,%lu,,,%.2f,\n", name, total->samples,
+                           total->covered > 0 ? total->energy[n] / 100.0 / total->covered : 0.0);
+                }
+                break;
+        }
+    }
+}
+
+/**
+ * read the rows of a rollup file
+ */
+static int queryRollups(struct Query *query, char const *directory, int tier)
+{
+    struct stat info;
+    char *path;
+    unsigned char const *map;
+    size_t offset;
+    int fd;
+    path = rollupPath(directory, tier);
+    if (path == NULL) {
+        return -1;
+    }
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        fprintf(stderr, "Could not open %s. %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(path);
+        return -1;
+    }
+    map = info.st_size >= ROLLUP_HEADER_SIZE ? mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED || memcmp(map, ROLLUP_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s is not a rollup file.\n", path);
+        if (map != MAP_FAILED) {
+            munmap((void *)map, info.st_size);
+        }
+        free(path);
+        return -1;
+    }
+    free(path);
+    if (!query->aggregate) {
+        printRollupHeader(query);
+    }
+    for (offset = ROLLUP_HEADER_SIZE; offset + ROLLUP_ROW_SIZE <= (size_t)info.st_size; offset += ROLLUP_ROW_SIZE) {
+        struct RollupWindow window;
+        unsigned char const *row = map + offset;
+        long long start = (long long)storeRecordTime(row);
+        ++query->scanned;
+        // rows are appended when their window closes, so they are only roughly ordered by time
+        if (start < query->from || (query->to >= 0 && start > query->to)
+            || (query->device != 0 && row[8] != query->device) || (query->controller != 0 && row[9] != query->controller)) {
+            continue;
+        }
+        ++query->matched;
+        decodeRollupRow(row, &window);
+        if (query->aggregate) {
+            mergeRollupWindow(&(query->total), &window);
+        }
+        else {
+            printRollupRow(query, &window);
+        }
+    }
+    munmap((void *)map, info.st_size);
+    if (query->aggregate) {
+        printRollupTotal(query);
+    }
+    return 0;
+}
+
+/**
+ * run the query on the segment and history files of a store
+ *
+ * \return the number of files, -1 on error
+ */
+static int querySamples(struct Query *query, char const *directory, char const *compactDirectory)
+{
+    char **segments;
+    int segmentCount;
+    int fd = -1;
+    int i;
+    segmentCount = listStoreSegments(directory, &segments);
+    if (segmentCount < 0) {
+        fprintf(stderr, "Could not read store %s. %s\n", directory, strerror(errno));
+        return -1;
+    }
+    if (compactDirectory != NULL) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%013lld-00.hst", compactDirectory, query->from);
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        query->history = fd >= 0 ? initHistoryEncoder(fd) : NULL;
+        if (query->history == NULL) {
+            fprintf(stderr, "Could not create %s. %s\n", path, strerror(errno));
+            freeStoreSegmentList(segments, segmentCount);
+            return -1;
+        }
+    }
+    else if (!query->aggregate) {
+        printf("timestamp,device,controller");
+        for (i = 0; i < query->channelCount; ++i) {
+            printf(",%s", query->channels[i].name);
+        }
+        putchar('\n');
+    }
+    for (i = 0; i < segmentCount; ++i) {
+        size_t length = strlen(segments[i]);
+        int ret;
+        if (strcmp(segments[i] + length - 4, ".hst") == 0) {
+            ret = queryHistory(query, segments[i]);
+        }
+        else {
+            ret = querySegment(query, segments[i]);
+        }
+        if (ret != 0) {
+            fprintf(stderr, "Could not read %s. %s\n", segments[i], strerror(errno));
+        }
+    }
+    freeStoreSegmentList(segments, segmentCount);
+    if (query->history != NULL) {
+        unsigned long long bytes;
+        flushHistoryEncoder(query->history);
+        bytes = query->history->bytes;
+        cleanupHistoryEncoder(query->history);
+        close(fd);
+        fprintf(stderr, "%lu samples compressed to %llu bytes (%.2f bytes/sample)\n", query->matched, bytes,
+                query->matched > 0 ? (double)bytes / query->matched : 0.0);
+    }
+    else if (query->aggregate) {
+        printf("channel,count,min,max,avg\n");
+        for (i = 0; i < query->channelCount; ++i) {
+            struct ChannelStatistics *current = &(query->statistics[i]);
+            if (current->count == 0) {
+                printf("%s,0,,,\n", query->channels[i].name);
+                continue;
+            }
+            printf("%s,%lu,%.*f,%.*f,%.*f\n", query->channels[i].name, current->count, current->decimals, current->min,
+                   current->decimals, current->max, current->decimals + 1, current->sum / current->count);
+        }
+    }
+    return segmentCount;
+}
+
+int main(int argc, char *argv[])
+{
+    struct Query query;
+    char *directory = ".";
+    char *channelList = NULL;
+    char *compactDirectory = NULL;
+    int tier = -1;
+    int verbose = 0;
+    int files;
+    struct timespec started;
+    struct timespec finished;
+    int opt;
+    memset(&query, 0, sizeof(query));
+    query.to = -1;
+    while ((opt = getopt(argc, argv, "d:f:t:D:C:c:g:az:v")) != -1) {
+        switch (opt) {
+            case 'd':
+                directory = optarg;
+                break;
+            case 'f':
+            case 't':
+                if (parseTime(optarg) < 0) {
+                    fprintf(stderr, "Invalid time %s.\n", optarg);
+                    return -1;
+                }
+                if (opt == 'f') {
+                    query.from = parseTime(optarg);
+                }
+                else {
+                    query.to = parseTime(optarg);
+                }
+                break;
+            case 'D':
+                query.device = atoi(optarg);
+                break;
+            case 'C':
+                query.controller = atoi(optarg);
+                break;
+            case 'c':
+                channelList = optarg;
+                break;
+            case 'g':
+                tier = parseRollupTier(optarg);
+                if (tier < 0) {
+                    fprintf(stderr, "Unknown rollup tier %s, use 1m, 1h or 1d.\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'a':
+                query.aggregate = 1;
+                break;
+            case 'z':
+                compactDirectory = optarg;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                printUsage(argv[0]);
+                return -1;
+        }
+    }
+    if (tier >= 0 && compactDirectory != NULL) {
+        fprintf(stderr, "Rollups cannot be compacted, -z cannot be used with -g.\n");
+        return -1;
+    }
+    initlog(0);
+    query.channelCount = channelList != NULL ? parseChannels(channelList, query.channels) : allChannels(query.channels);
+    if (query.channelCount < 0) {
+        return -1;
+    }
+    if (tier >= 0) {
+        int kept = 0;
+        int i;
+        // the speed steps are not aggregated
+        for (i = 0; i < query.channelCount; ++i) {
+            if (query.channels[i].group == 'R') {
+                if (channelList != NULL) {
+                    fprintf(stderr, "There are no rollups of %s.\n", query.channels[i].name);
+                    return -1;
+                }
+                continue;
+            }
+            query.channels[kept++] = query.channels[i];
+        }
+        query.channelCount = kept;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    if (tier >= 0) {
+        files = queryRollups(&query, directory, tier) == 0 ? 1 : -1;
+    }
+    else {
+        files = querySamples(&query, directory, compactDirectory);
+    }
+    if (files < 0) {
+        return -1;
+    }
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    if (verbose) {
+        fprintf(stderr, "%lu records matched, %lu scanned in %d files, %.3f ms\n", query.matched, query.scanned, files,
+                (finished.tv_sec - started.tv_sec) * 1e3 + (finished.tv_nsec - started.tv_nsec) / 1e6);
+    }
+    endlog();
+    return 0;
+}
@@ -22,24 +22,51 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
 
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
 
 #include "communication.h"
+#include "consumer.h"
+#include "ringbuffer.h"
+#include "scheduler.h"
+#include "poller.h"
+#include "download.h"
+#include "capture.h"
+#include "sharedstate.h"
+#include "delta.h"
+#include "batch.h"
+#include "script.h"
+#include "output.h"
+#include "exporter.h"
+#include "subscribers.h"
+#include "store.h"
+#include "history.h"
+#include "rollup.h"
+#include "spool.h"
+#include "latency.h"
 #include "logging.h"
 
 void daemonize()
 {
+    int fd;
     pid_t pid = fork();
     if (pid > 0) {
-        // we're in the parent process -> exit
-        exit(0);
+        // we're in the parent process -> exit without flushing the stdio buffers the child has as well
+        _exit(0);
     }
     // standard UNIX daemon setup
-    umask(0);
+    umask(022);
     pid_t sid = setsid();
     if (sid < 0) {
         fprintf(stderr, "Could not get new session id");
@@ -50,139 +77,365 @@ void daemonize()
         exit(-1);
     }
     log_output(LOG_DEBUG, "Sucessfully daemonized reader.\n");
-    // close STDIO
-    close(STDIN_FILENO);
-    close(STDOUT_FILENO);
-    close(STDERR_FILENO);
+    // detach STDIO, the descriptors stay taken so that files opened later never end up as stdout
+    fd = open("/dev/null", O_RDWR);
+    if (fd >= 0) {
+        dup2(fd, STDIN_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        if (fd > STDERR_FILENO) {
+            close(fd);
+        }
+    }
 }
 
 /**
- * print a sensor value to stdout
+ * make a path given on the command line absolute, the daemon runs in /
+ *
+ * \param path the path to resolve, replaced by the absolute path
+ * \param resolved collects the allocated paths to free them at exit
+ * \return 0 on success, -1 else. errno will be set accordingly
  */
-void printValue(char *prefix, struct Value *value)
+int resolvePath(char **path, char **resolved, unsigned int *count)
 {
-    printf("%s%d: ", prefix, value->valueID);
-    switch (value->valueType) {
-        case UNUSED:
-            printf("---");
-            break;
-        case DIGITAL:
-            printf(value->value.enabled ? "on" : "off");
-            break;
-        case TEMPERATURE:
-            printf("%.1f °C", value->value.temperature);
-            break;
-        case FLOW:
-            printf("%d l/h", value->value.flow);
-            break;
-        case HEAT:
-            printf("%.2f kW (total: %.1f kWh)", value->value.heat.current, value->value.heat.total);
-            break;
-        default:
-            printf("UNKNOWN");
+    char cwd[4096];
+    char *absolute;
+    if (*path == NULL || (*path)[0] == '/') {
+        return 0;
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return -1;
+    }
+    absolute = malloc(strlen(cwd) + strlen(*path) + 2);
+    if (absolute == NULL) {
+        return -1;
+    }
+    sprintf(absolute, "%s/%s", cwd, *path);
+    resolved[(*count)++] = absolute;
+    *path = absolute;
+    return 0;
+}
+
+#define SPOOL_DRAIN_BATCH 64    /* spooled samples handed to the script per new sample */
+#define SPOOL_EXIT_DRAIN 5000   /* ms the spool is drained on shutdown */
+
+/**
+ * the sinks the samples are delivered to. Only used by the delivery thread.
+ */
+struct Delivery
+{
+    struct SampleRing *ring;
+    struct ScriptRunner *script;
+    struct Batch *batch;    /* collects the samples for the script, NULL to run it for every sample */
+    struct Spool *spool;    /* keeps the samples for the script until it accepted them, may be NULL */
+    struct SampleRing *unspooled;   /* samples the spool could not take, they are run right away */
+    struct Consumer *consumer;
+    struct OutputWriter *writer;    /* prints structured records instead of the human format */
+    struct SharedState *shared;
+    struct Exporter *exporter;
+    struct SubscriberServer *subscribers;
+    struct StoreWriter *store;      /* keeps every delivered sample in addition to the sinks below */
+    struct Rollups *rollups;        /* aggregates every sample, also the ones the delta filter drops */
+    struct DeltaFilter *delta;
+    int labelled;   /* print the device and controller of the samples */
+    int live;       /* the samples are read right now, so their age is the end to end latency */
+    unsigned long queued;       /* samples pushed into the ring, written by the poller thread */
+    unsigned long delivered;    /* samples taken from the ring and delivered */
+    long long drainEnd;         /* monotonic ns the spool may be drained until once the ring is closed */
+    int stop;       /* set once a replay or download was asked to stop */
+};
+
+/**
+ * check whether the reader shuts down and the time for the spool is up
+ */
+int drainStopped(struct Delivery *delivery)
+{
+    return ringClosed(delivery->ring) && monotonicNanoseconds() >= delivery->drainEnd;
+}
+
+/**
+ * hand spooled samples to the script until it fails, the limit is reached
+ * or the reader shuts down
+ */
+void drainSpool(struct Delivery *delivery, unsigned int limit)
+{
+    struct Sample sample;
+    struct timespec now = { 0, 0 };
+    if (delivery->spool == NULL) {
+        return;
+    }
+    // samples the spool could not write are run right away, they have no second chance
+    while (ringPopUntil(delivery->unspooled, &sample, &now) == 0) {
+        runScript(delivery->script, &sample);
+    }
+    while (limit-- > 0 && !drainStopped(delivery) && spoolReady(delivery->spool) && spoolPeek(delivery->spool, &sample) == 1) {
+        if (runScript(delivery->script, &sample) != 0) {
+            spoolFailed(delivery->spool);
             break;
+        }
+        spoolAdvance(delivery->spool);
     }
+    spoolCheckSync(delivery->spool);
 }
 
-void printValueList(char *prefix, struct ValueListNode *head)
+void deliverSample(struct Delivery *delivery, struct Sample *sample)
 {
-    struct ValueListNode *tmp;
-    tmp = head;
-    while (tmp != NULL) {
-        printValue(prefix, &(tmp->value));
-        putchar('\n');
-        tmp = tmp->next;
+    storeSample(delivery->store, sample);
+    if (delivery->batch != NULL) {
+        batchAdd(delivery->batch, sample);
+    }
+    else if (delivery->spool != NULL) {
+        // the poller spooled the sample already, it queues up behind the backlog,
+        // which drains a bit with every sample and while idle
+        drainSpool(delivery, SPOOL_DRAIN_BATCH);
+    }
+    else if (delivery->script != NULL) {
+        runScript(delivery->script, sample);
+    }
+    else if (delivery->consumer != NULL) {
+        consumerSend(delivery->consumer, sample);
+    }
+    else if (delivery->writer != NULL) {
+        writeOutputRecord(delivery->writer, sample);
+    }
+    else {
+        printSample(stdout, sample, delivery->labelled);
+        fflush(stdout);
     }
 }
 
-void setEnvValue(char *prefix, struct Value *value)
+/**
+ * drain the sample ring into the sinks until the ring is closed
+ */
+void *deliveryThread(void *arg)
 {
-    char varbuf[100];
-    char valuebuf[100];
-    snprintf(varbuf, 100, "%s_%d_TYPE", prefix, (int)(value->valueID));
-    switch(value->valueType) {
-        case UNUSED:
-            snprintf(valuebuf, 100, "UNUSED");
-            break;
-        case DIGITAL:
-            snprintf(valuebuf, 100, "DIGITAL");
-            break;
-        case TEMPERATURE:
-            snprintf(valuebuf, 100, "TEMPERATURE");
-            break;
-        case FLOW:
-            snprintf(valuebuf, 100, "FLOW");
-            break;
-        case HEAT:
-            snprintf(valuebuf, 100, "HEAT");
+    struct Delivery *delivery = arg;
+    struct Sample sample;
+    struct timespec deadline;
+    long long start;
+    int ret;
+    for (;;) {
+        if (delivery->batch != NULL && batchDeadline(delivery->batch, &deadline)) {
+            ret = ringPopUntil(delivery->ring, &sample, &deadline);
+        }
+        else if (delivery->spool != NULL && spoolDeadline(delivery->spool, &deadline)) {
+            ret = ringPopUntil(delivery->ring, &sample, &deadline);
+        }
+        else {
+            ret = ringPop(delivery->ring, &sample);
+        }
+        if (ret < 0) {
             break;
+        }
+        if (ret > 0) {
+            // no sample for a while, the batch may have become old enough or the spool may be retried
+            if (delivery->batch != NULL) {
+                batchCheckAge(delivery->batch);
+            }
+            drainSpool(delivery, SPOOL_DRAIN_BATCH);
+            continue;
+        }
+        start = stageClock();
+        deliverSample(delivery, &sample);
+        recordStageSince(STAGE_DELIVERY, start);
+        if (delivery->live) {
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            recordStage(STAGE_END_TO_END, (now.tv_sec - sample.timestamp.tv_sec) * 1000000000LL + now.tv_nsec - sample.timestamp.tv_nsec);
+        }
+        __atomic_add_fetch(&(delivery->delivered), 1, __ATOMIC_RELEASE);
     }
-    setenv(varbuf, valuebuf, 1);
-    snprintf(varbuf, 100, "%s_%d_VALUE", prefix, (int)(value->valueID));
-    switch(value->valueType) {
-        case UNUSED:
-            snprintf(valuebuf, 100, "UNUSED");
-            break;
-        case DIGITAL:
-            snprintf(valuebuf, 100, value->value.enabled ? "1" : "0");
-            break;
-        case TEMPERATURE:
-            snprintf(valuebuf, 100, "%.1f", value->value.temperature);
-            break;
-        case FLOW:
-            snprintf(valuebuf, 100, "%d", value->value.flow);
-            break;
-        case HEAT:
-            snprintf(varbuf, 100, "%s_%d_VALUE_CURRENT", prefix, (int)(value->valueID));
-            snprintf(valuebuf, 100, "%.2f", value->value.heat.current);
-            setenv(varbuf, valuebuf, 1);
-            snprintf(varbuf, 100, "%s_%d_VALUE_TOTAL", prefix, (int)(value->valueID));
-            snprintf(valuebuf, 100, "%.1f", value->value.heat.total);
-    }
-    setenv(varbuf, valuebuf, 1);
+    // whatever the script does not take in time is delivered after the next start
+    if (delivery->spool != NULL) {
+        delivery->drainEnd = monotonicNanoseconds() + SPOOL_EXIT_DRAIN * 1000000LL;
+        drainSpool(delivery, UINT_MAX);
+        if (spoolPending(delivery->spool) > 0) {
+            log_output(LOG_INFO, "%llu spooled samples are left for the next start\n", spoolPending(delivery->spool));
+        }
+    }
+    log_output(LOG_DEBUG, "Delivery thread finished\n");
+    return NULL;
 }
 
-void setEnvList(char *prefix, struct ValueListNode *head)
+#define STATS_INTERVAL 10
+#define ASYNC_LOG_CAPACITY 1024
+
+/**
+ * dumps the statistics on SIGUSR1 and keeps the stats file up to date
+ */
+struct StatsDumper
 {
-    struct ValueListNode *it;
-    char valuebuf[100];
-    char varbuf[100];
-    it = head;
-    int counter = 0;
-    while (it != NULL) {
-        setEnvValue(prefix, &(it->value));
-        ++counter;
-        it = it->next;
-    }
-    snprintf(valuebuf, 100, "%d", counter);
-    snprintf(varbuf, 100, "%sS", prefix);
-    setenv(varbuf, valuebuf, 1);    
-}
+    struct USBConnection **connections;
+    unsigned int count;
+    char *path;     /* the stats file, NULL if there is none */
+    int stop;
+    pthread_t thread;
+};
 
-void executeProgram(char *program, struct SystemState *state)
+/**
+ * log the statistics or write them to the stats file
+ */
+void dumpStatistics(struct StatsDumper *dumper, int toFile)
 {
-    pid_t child;
-    if (state != NULL) {
-        child = fork();
-        if (child == 0) {
-            setEnvList("UVR_INPUT", state->inputs);
-            setEnvList("UVR_OUTPUT", state->outputs);
-            setEnvList("UVR_HEATREG", state->heatRegisters);
-            log_output(LOG_DEBUG, "Executing %s\n", program);
-            system(program);
-            log_output(LOG_DEBUG, "%s finished\n", program);
-            exit(0);
+    char line[512];
+    char tmpPath[4096];
+    FILE *file = NULL;
+    unsigned int i;
+    int stage;
+    if (toFile) {
+        snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", dumper->path);
+        file = fopen(tmpPath, "w");
+        if (file == NULL) {
+            log_output(LOG_ERR, "Could not write stats file %s. %s\n", tmpPath, strerror(errno));
+            return;
+        }
+    }
+    for (stage = 0; stage < STAGE_COUNT; ++stage) {
+        formatStageStatistics(line, sizeof(line), stage);
+        if (file != NULL) {
+            fprintf(file, "%s\n", line);
+        }
+        else {
+            log_output(LOG_INFO, "%s\n", line);
+        }
+    }
+    for (i = 0; i < dumper->count; ++i) {
+        struct ConnectionStatistics *stats = &(dumper->connections[i]->stats);
+        snprintf(line, sizeof(line), "device=%s frames=%lu no_data=%lu timeouts=%lu unsupported=%lu errors=%lu retries=%lu reconnects=%lu",
+                 dumper->connections[i]->device, stats->frames, stats->noData, stats->timeouts, stats->unsupported,
+                 stats->errors, stats->retries, stats->reconnects);
+        if (file != NULL) {
+            fprintf(file, "%s\n", line);
         }
         else {
-            waitpid(child, NULL, 0); // sleep until the child returns
-            log_output(LOG_DEBUG, "Child returned\n");
+            log_output(LOG_INFO, "%s\n", line);
+        }
+    }
+    if (file != NULL) {
+        if (fclose(file) != 0 || rename(tmpPath, dumper->path) != 0) {
+            log_output(LOG_ERR, "Could not write stats file %s. %s\n", dumper->path, strerror(errno));
+        }
+    }
+}
+
+/**
+ * wait for SIGUSR1, which the other threads block
+ */
+void *statsThread(void *arg)
+{
+    struct StatsDumper *dumper = arg;
+    struct timespec interval;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    interval.tv_sec = STATS_INTERVAL;
+    interval.tv_nsec = 0;
+    for (;;) {
+        int sig = sigtimedwait(&signals, NULL, &interval);
+        int stop = __atomic_load_n(&(dumper->stop), __ATOMIC_ACQUIRE);
+        if (sig == SIGUSR1 && !stop) {
+            dumpStatistics(dumper, 0);
+        }
+        if (dumper->path != NULL && (sig == SIGUSR1 || errno == EAGAIN)) {
+            dumpStatistics(dumper, 1);
         }
+        if (stop) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * hand a sample read by the poller over to the delivery thread
+ */
+void queueSample(void *context, struct Sample *sample)
+{
+    struct Delivery *delivery = context;
+    int ret;
+    // publish right away, local readers should not wait for a slow sink
+    publishSample(delivery->shared, sample);
+    updateExporter(delivery->exporter, sample);
+    storeSnapshot(delivery->subscribers, sample);
+    rollupSample(delivery->rollups, sample);
+    if (!deltaFilterSample(delivery->delta, sample)) {
+        return;
+    }
+    broadcastSample(delivery->subscribers, sample);
+    // the spool is written here, so a hanging program cannot make the ring drop samples before they are safe
+    if (delivery->spool != NULL && spoolAppend(delivery->spool, sample) != 0) {
+        ringPush(delivery->unspooled, sample);
+    }
+    ret = ringPush(delivery->ring, sample);
+    if (ret >= 0) {
+        ++delivery->queued;
+    }
+    if (ret == 1) {
+        log_output(LOG_DEBUG, "Sample queue full, dropped the oldest sample\n");
+        // the dropped sample never reaches the delivery thread
+        --delivery->queued;
+    }
+}
+
+/**
+ * wait until the delivery thread delivered every queued sample, e.g. before
+ * a download checkpoint is advanced
+ *
+ * \return 0 once the samples are delivered, 1 if the reader is stopping before
+ */
+int waitDelivered(void *context)
+{
+    struct Delivery *delivery = context;
+    struct timespec pause = { 0, 1000000 };
+    while (__atomic_load_n(&(delivery->delivered), __ATOMIC_ACQUIRE) < delivery->queued) {
+        if (__atomic_load_n(&(delivery->stop), __ATOMIC_ACQUIRE)) {
+            return 1;
+        }
+        nanosleep(&pause, NULL);
+    }
+    return __atomic_load_n(&(delivery->stop), __ATOMIC_ACQUIRE) ? 1 : 0;
+}
+
+/**
+ * replay and download run without the poller loop, so SIGTERM and SIGINT
+ * are taken here and only set the stop flag. The regular cleanup then
+ * delivers what is queued and flushes the sinks.
+ */
+void *stopThread(void *arg)
+{
+    struct Delivery *delivery = arg;
+    sigset_t signals;
+    int sig = 0;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigwait(&signals, &sig);
+    // the reader itself sets the flag before it wakes this thread at the end
+    if (__atomic_exchange_n(&(delivery->stop), 1, __ATOMIC_ACQ_REL) == 0) {
+        log_output(LOG_INFO, "Received signal %d, shutting down\n", sig);
+    }
+    return NULL;
+}
+
+/**
+ * SIGTERM or SIGINT arrived -> stop polling, the regular cleanup delivers
+ * what is queued and flushes the sinks
+ */
+void stopSignalled(void *context, int fd, unsigned int events)
+{
+    struct DevicePoller *poller = context;
+    struct signalfd_siginfo info;
+    (void)events;
+    if (read(fd, &info, sizeof(info)) == sizeof(info)) {
+        log_output(LOG_INFO, "Received signal %u, shutting down\n", info.ssi_signo);
+        stopDevicePoller(poller);
     }
 }
 
 void printUsage(char *command)
 {
-    fprintf(stderr, "Usage: %s [-s <program>] [-d <delay>] [-c <count>] <USB device>\n", command);
+    fprintf(stderr, "Usage: %s [-s <program> [-S] [-K <directory>] | -p <program>] [-d <delay>] [-c <count>] [-t <timeout>] [-q <depth>] [-Q <policy>] [-l <checkpoint>] [-r <file>] [-m <name>] [-M [<host>:]<port>] [-U <path>] [-W <directory>] [-G <directory>] <USB device> [<USB device> ...]\n", command);
+    fprintf(stderr, "       %s [-s <program> | -p <program>] -R <file> [-x <factor>] [-m <name>]\n", command);
     fprintf(stderr, "  -s    Execute the program given as a parameter and\n");
     fprintf(stderr, "        hand it the values in the environment instead\n");
     fprintf(stderr, "        of printing them to stdout. The values are handed\n");
@@ -194,32 +447,387 @@ void printUsage(char *command)
     fprintf(stderr, "        to the respective sensor types. Digital sensors may have a value\n");
     fprintf(stderr, "        of 0 or 1, temperature sensors contain the temperature in °C,\n");
     fprintf(stderr, "        flow sensor values are in l/h. The number of inputs is contained\n");
-    fprintf(stderr, "        in UVR_INPUTS.\n");        
+    fprintf(stderr, "        in UVR_INPUTS. UVR_TIMESTAMP contains the time the values were\n");
+    fprintf(stderr, "        received in seconds since the epoch, UVR_DEVICE the number of the\n");
+    fprintf(stderr, "        device in the order given on the command line and UVR_CONTROLLER\n");
+    fprintf(stderr, "        the number of the controller on the device (1 or 2). Outputs, speed steps\n");
+    fprintf(stderr, "        of the speed controlled outputs and heat registers are handed over\n");
+    fprintf(stderr, "        in UVR_OUTPUT_*, UVR_ROTATION_* and UVR_HEATREG_* respectively.\n");
+    fprintf(stderr, "        The program is split at blanks and executed directly.\n");
+    fprintf(stderr, "  -S, --shell\n");
+    fprintf(stderr, "        Run the -s program via /bin/sh -c, e.g. for pipes or quoting.\n");
+    fprintf(stderr, "  -B, --batch <count>\n");
+    fprintf(stderr, "        Collect up to <count> samples and hand them to the -s program in one\n");
+    fprintf(stderr, "        run as one document on its stdin. The batch is also handed\n");
+    fprintf(stderr, "        over when its first sample gets too old and at shutdown.\n");
+    fprintf(stderr, "  -A, --batch-age <seconds>\n");
+    fprintf(stderr, "        Hand a batch over at the latest when its first sample is this old. (default: %d)\n", DEFAULT_BATCH_AGE);
+    fprintf(stderr, "  -F, --batch-format <format>\n");
+    fprintf(stderr, "        The document format of a batch: 'csv', 'json' (an array of the -o json\n");
+    fprintf(stderr, "        objects) or 'influx'. (default: csv)\n");
+    fprintf(stderr, "  -T, --batch-file\n");
+    fprintf(stderr, "        Hand the batch over in a temporary file named in UVR_BATCH_FILE\n");
+    fprintf(stderr, "        instead of stdin. The file is removed when the program finishes.\n");
+    fprintf(stderr, "  -K, --spool <directory>\n");
+    fprintf(stderr, "        Keep the samples for the -s program in a write-ahead log in the given\n");
+    fprintf(stderr, "        directory until the program accepted them with exit status 0. When it\n");
+    fprintf(stderr, "        fails, the delivery is retried with growing delays of up to %d s and\n", SPOOL_RETRY_MAX / 1000);
+    fprintf(stderr, "        the samples wait in the log, also across restarts. On shutdown, the\n");
+    fprintf(stderr, "        log is drained for at most %d s, the rest waits for the next start.\n", SPOOL_EXIT_DRAIN / 1000);
+    fprintf(stderr, "  -k, --spool-size <MB>\n");
+    fprintf(stderr, "        Limit the log to this size, the oldest samples are dropped beyond\n");
+    fprintf(stderr, "        it. (default: %d)\n", DEFAULT_SPOOL_SIZE);
+    fprintf(stderr, "  -X, --script-timeout <seconds>\n");
+    fprintf(stderr, "        Kill the -s program if it runs longer, which counts as a failed\n");
+    fprintf(stderr, "        delivery. With -B this applies to every batch. (default: %d)\n", DEFAULT_SCRIPT_TIMEOUT);
+    fprintf(stderr, "  -p    Start the program given as a parameter once and stream the\n");
+    fprintf(stderr, "        values to its stdin, one line per sample. Every line consists of\n");
+    fprintf(stderr, "        blank separated <name>=<value> pairs using the same names as the\n");
+    fprintf(stderr, "        environment variables of -s. The program is restarted if it dies.\n");
+    fprintf(stderr, "        Samples are skipped while the program is busy with the previous one.\n");
+    fprintf(stderr, "  -o, --output <format>\n");
+    fprintf(stderr, "        The format the values are printed in without -s and -p: 'human',\n");
+    fprintf(stderr, "        'json' with one object per line, 'csv' with a header line and one\n");
+    fprintf(stderr, "        column per value or 'influx' for the InfluxDB line protocol.\n");
+    fprintf(stderr, "        (default: human)\n");
     fprintf(stderr, "  -d    Set the delay between the value updates in seconds. (default: 10)\n");
+    fprintf(stderr, "        The values are read at multiples of the delay since the epoch, e.g.\n");
+    fprintf(stderr, "        at hh:mm:00, hh:mm:10, ... for 10 s. Fractions of a second down to\n");
+    fprintf(stderr, "        %g s are allowed, 0 reads as fast as possible.\n", MIN_SCHEDULER_PERIOD);
     fprintf(stderr, "  -c    Set the repetition counter. A repetition counter of 0 means run infinitely. (default: 0)\n");
+    fprintf(stderr, "  -t    Set the time a reply of the device may take in ms. Failed requests\n");
+    fprintf(stderr, "        are repeated, after repeated failures the device is reopened. (default: %d)\n", DEFAULT_FRAME_TIMEOUT);
+    fprintf(stderr, "  -q    Set the number of samples buffered between reading the device and\n");
+    fprintf(stderr, "        delivering the values. (default: 16)\n");
+    fprintf(stderr, "  -Q    Set what happens if the buffer is full: 'drop' discards the oldest\n");
+    fprintf(stderr, "        sample, 'block' delays reading the device. (default: drop)\n");
+    fprintf(stderr, "  -l    Download the records stored in the data logger memory of the\n");
+    fprintf(stderr, "        device instead of reading the current values, deliver them like\n");
+    fprintf(stderr, "        the current values and exit. The address of the next record is\n");
+    fprintf(stderr, "        stored in the given checkpoint file once the records before it are\n");
+    fprintf(stderr, "        delivered, a later download continues there. With several devices,\n");
+    fprintf(stderr, "        the device number is appended to the file name.\n");
+    fprintf(stderr, "  -r, --record <file>\n");
+    fprintf(stderr, "        Append every frame received from the devices to the given capture file.\n");
+    fprintf(stderr, "  -R, --replay <file>\n");
+    fprintf(stderr, "        Deliver the frames of the given capture file instead of reading a device.\n");
+    fprintf(stderr, "  -x, --replay-speed <factor>\n");
+    fprintf(stderr, "        Replay the frames <factor> times faster than recorded. (default: 0,\n");
+    fprintf(stderr, "        i.e. as fast as possible)\n");
+    fprintf(stderr, "  -m, --shm <name>\n");
+    fprintf(stderr, "        Publish the latest sample of every controller in the POSIX shared\n");
+    fprintf(stderr, "        memory segment <name>, e.g. %s. Use dlogg-shmread to read it.\n", SHARED_STATE_NAME);
+    fprintf(stderr, "  -M, --metrics [<host>:]<port>\n");
+    fprintf(stderr, "        Serve the latest values and the counters of the reader in the Prometheus\n");
+    fprintf(stderr, "        text format at http://<host>:<port>/metrics. Not available with -R and -l.\n");
+    fprintf(stderr, "  -U, --socket <path>\n");
+    fprintf(stderr, "        Stream every sample to the clients of a Unix domain socket at <path>.\n");
+    fprintf(stderr, "        A new client gets the latest sample of every controller first. Clients\n");
+    fprintf(stderr, "        which do not keep up miss samples and are eventually disconnected.\n");
+    fprintf(stderr, "        Not available with -R and -l.\n");
+    fprintf(stderr, "  -O, --socket-format <format>\n");
+    fprintf(stderr, "        The record format of the socket: json, csv or influx. (default: json)\n");
+    fprintf(stderr, "  -W, --store <directory>\n");
+    fprintf(stderr, "        Keep every sample in the binary segment files of the given directory,\n");
+    fprintf(stderr, "        in addition to the other outputs. Use dlogg-query to read them.\n");
+    fprintf(stderr, "  -Z, --store-compressed\n");
+    fprintf(stderr, "        Write compressed history files to the store instead, a tenth or less of\n");
+    fprintf(stderr, "        the size. Samples are kept in memory until %d samples of a controller\n", HISTORY_BLOCK_SAMPLES);
+    fprintf(stderr, "        or %d minutes are complete and at shutdown, a crash loses them.\n", HISTORY_FLUSH_INTERVAL / 60000);
+    fprintf(stderr, "  -G, --rollups <directory>\n");
+    fprintf(stderr, "        Aggregate the samples into windows of 1 minute, 1 hour and 1 day and\n");
+    fprintf(stderr, "        append the closed windows to rollup files in the given directory: the\n");
+    fprintf(stderr, "        minimum, maximum and average of every input, the time the outputs were\n");
+    fprintf(stderr, "        on and the heat energy integrated from the power. Use dlogg-query -g\n");
+    fprintf(stderr, "        to read them.\n");
+    fprintf(stderr, "  -e, --delta\n");
+    fprintf(stderr, "        Only deliver the values which changed by more than their deadband\n");
+    fprintf(stderr, "        since they were last delivered. Samples without any change and samples\n");
+    fprintf(stderr, "        of a frame identical to the previous one are suppressed.\n");
+    fprintf(stderr, "        UVR_INPUTS and friends count the delivered values only.\n");
+    fprintf(stderr, "  -b, --deadband <name>=<value>[,...]\n");
+    fprintf(stderr, "        Set the deadbands of the delta mode, implies -e. Names are temperature\n");
+    fprintf(stderr, "        (°C), flow (l/h), rotation (steps), power (kW) and energy (kWh).\n");
+    fprintf(stderr, "        Digital values are delivered on every change.\n");
+    fprintf(stderr, "        (default: temperature=0.2,flow=0,rotation=0,power=0.1,energy=1)\n");
+    fprintf(stderr, "  -H, --heartbeat <seconds>\n");
+    fprintf(stderr, "        Deliver all values of a controller at least this often in the delta\n");
+    fprintf(stderr, "        mode, implies -e. (default: %d)\n", DEFAULT_HEARTBEAT);
+    fprintf(stderr, "  -P, --stats-file <file>\n");
+    fprintf(stderr, "        Write the latency percentiles of every stage and the error counters\n");
+    fprintf(stderr, "        of every device to the given file every %d seconds. Sending SIGUSR1\n", STATS_INTERVAL);
+    fprintf(stderr, "        logs them right away.\n");
+    fprintf(stderr, "  -a, --async-log\n");
+    fprintf(stderr, "        Write log messages from a background thread, so that reading the devices\n");
+    fprintf(stderr, "        never waits for syslog or the terminal. Messages are dropped if more than\n");
+    fprintf(stderr, "        %d are pending.\n", ASYNC_LOG_CAPACITY);
     fprintf(stderr, "  -D    Run the program as a daemon. The reader forks into the background and detaches from the terminal\n");
-    fprintf(stderr, "        This implies -s as a daemon cannot make any output.\n");
+    fprintf(stderr, "        This implies -s, -p, -m, -M, -U, -W or -G as a daemon cannot make any output,\n");
+    fprintf(stderr, "        -o is refused. The daemon runs in /, relative paths of the options and\n");
+    fprintf(stderr, "        devices are resolved before, the -s and -p programs run in / as well.\n");
     fprintf(stderr, "  -v    Enable debug output.\n");
+    fprintf(stderr, "Several USB devices may be given. They are all read by one process.\n");
+    fprintf(stderr, "SIGTERM and SIGINT stop the reader, queued samples are still delivered.\n");
+    fprintf(stderr, "A download stops after the current chunk and repeats it the next time.\n");
 }
 
 int main(int argc, char *argv[]) {
-    struct USBConnection *connection;
+    struct USBConnection **connections = NULL;
+    unsigned int deviceCount = 0;
+    unsigned int i;
+    struct DevicePoller *poller = NULL;
+    int ret = -1;
+    int ok = 1;
+    long long started = 0;
     int opt;
+    char *recordFile = NULL;
+    char *replayFile = NULL;
+    double replaySpeed = 0;
+    struct CaptureWriter *capture = NULL;
+    char *sharedName = NULL;
+    struct SharedState *shared = NULL;
+    char *metricsAddress = NULL;
+    struct Exporter *exporter = NULL;
+    char *socketPath = NULL;
+    int socketFormat = OUTPUT_JSON;
+    struct SubscriberServer *subscribers = NULL;
+    char *storeDirectory = NULL;
+    int storeCompressed = 0;
+    char *rollupDirectory = NULL;
+    unsigned int batchCount = 0;
+    char *spoolDirectory = NULL;
+    int spoolSize = DEFAULT_SPOOL_SIZE;
+    int scriptTimeout = DEFAULT_SCRIPT_TIMEOUT;
+    int batchAge = DEFAULT_BATCH_AGE;
+    int batchFormat = OUTPUT_CSV;
+    int printFormat = -1;
+    struct OutputWriter *writer = NULL;
+    int batchFile = 0;
+    int shell = 0;
+    struct Batch *batch = NULL;
+    int deltaMode = 0;
+    struct Deadbands deadbands;
+    int heartbeat = DEFAULT_HEARTBEAT;
+    struct DeltaFilter *delta = NULL;
+    static struct option longOptions[] = {
+        { "record", required_argument, NULL, 'r' },
+        { "replay", required_argument, NULL, 'R' },
+        { "replay-speed", required_argument, NULL, 'x' },
+        { "shm", required_argument, NULL, 'm' },
+        { "shell", no_argument, NULL, 'S' },
+        { "output", required_argument, NULL, 'o' },
+        { "batch", required_argument, NULL, 'B' },
+        { "spool", required_argument, NULL, 'K' },
+        { "spool-size", required_argument, NULL, 'k' },
+        { "script-timeout", required_argument, NULL, 'X' },
+        { "batch-age", required_argument, NULL, 'A' },
+        { "batch-format", required_argument, NULL, 'F' },
+        { "batch-file", no_argument, NULL, 'T' },
+        { "stats-file", required_argument, NULL, 'P' },
+        { "delta", no_argument, NULL, 'e' },
+        { "deadband", required_argument, NULL, 'b' },
+        { "heartbeat", required_argument, NULL, 'H' },
+        { "async-log", no_argument, NULL, 'a' },
+        { "metrics", required_argument, NULL, 'M' },
+        { "socket", required_argument, NULL, 'U' },
+        { "socket-format", required_argument, NULL, 'O' },
+        { "store", required_argument, NULL, 'W' },
+        { "store-compressed", no_argument, NULL, 'Z' },
+        { "rollups", required_argument, NULL, 'G' },
+        { NULL, 0, NULL, 0 }
+    };
     int repeatCount = 0;
     char *script = NULL;
-    int delay = 10;
+    char *consumerProgram = NULL;
+    struct Consumer *consumer = NULL;
+    double delay = 10;
+    struct Scheduler *scheduler = NULL;
     int daemon = 0;
-    while ((opt = getopt(argc, argv, "s:d:c:Dv")) != -1) {
+    int outputGiven = 0;
+    char **resolved = NULL;
+    unsigned int resolvedCount = 0;
+    int asyncLog = 0;
+    int timeout = DEFAULT_FRAME_TIMEOUT;
+    unsigned int queueDepth = 16;
+    int queuePolicy = RING_DROP_OLDEST;
+    char *checkpoint = NULL;
+    struct Delivery delivery;
+    pthread_t deliverer;
+    pthread_t stopper;
+    struct StatsDumper dumper;
+    int dumping = 0;
+    int stopping = 0;
+    sigset_t signals;
+    int signalFd = -1;
+    defaultDeadbands(&deadbands);
+    memset(&dumper, 0, sizeof(dumper));
+    while ((opt = getopt_long(argc, argv, "s:Sp:o:d:c:t:q:Q:l:r:R:x:m:M:U:O:W:ZG:B:K:k:X:A:F:TP:eb:H:aDv", longOptions, NULL)) != -1) {
         switch (opt) {
             case 's':
                 script = optarg;
                 break;
+            case 'S':
+                shell = 1;
+                break;
+            case 'p':
+                consumerProgram = optarg;
+                break;
             case 'd':
-                delay = atoi(optarg);
+                delay = strtod(optarg, NULL);
+                if (delay < 0 || (delay > 0 && delay < MIN_SCHEDULER_PERIOD)) {
+                    fprintf(stderr, "Invalid delay %s.\n", optarg);
+                    return -1;
+                }
                 break;
             case 'c':
                 repeatCount = atoi(optarg);
                 break;
+            case 't':
+                timeout = atoi(optarg);
+                if (timeout <= 0) {
+                    fprintf(stderr, "Invalid timeout %s.\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'q':
+                queueDepth = atoi(optarg);
+                if (queueDepth == 0) {
+                    fprintf(stderr, "Invalid queue depth %s.\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'Q':
+                if (strcmp(optarg, "drop") == 0) {
+                    queuePolicy = RING_DROP_OLDEST;
+                }
+                else if (strcmp(optarg, "block") == 0) {
+                    queuePolicy = RING_BLOCK;
+                }
+                else {
+                    fprintf(stderr, "Unknown queue policy %s.\n", optarg);
+                    printUsage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'l':
+                checkpoint = optarg;
+                break;
+            case 'r':
+                recordFile = optarg;
+                break;
+            case 'R':
+                replayFile = optarg;
+                break;
+            case 'x':
+                replaySpeed = strtod(optarg, NULL);
+                if (replaySpeed < 0) {
+                    fprintf(stderr, "Invalid replay speed %s.\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'm':
+                sharedName = optarg;
+                break;
+            case 'K':
+                spoolDirectory = optarg;
+                break;
+            case 'k':
+                spoolSize = atoi(optarg);
+                if (spoolSize <= 0) {
+                    fprintf(stderr, "Invalid spool size %s.\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'X':
+                scriptTimeout = atoi(optarg);
+                if (scriptTimeout <= 0) {
+                    fprintf(stderr, "Invalid script timeout %s.\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'B':
+                batchCount = atoi(optarg);
+                if (batchCount == 0) {
+                    fprintf(stderr, "Invalid batch size %s.\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'A':
+                batchAge = atoi(optarg);
+                if (batchAge <= 0) {
+                    fprintf(stderr, "Invalid batch age %s.\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'F':
+                batchFormat = outputFormat(optarg);
+                if (batchFormat < 0) {
+                    fprintf(stderr, "Unknown batch format %s.\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'o':
+                outputGiven = 1;
+                if (strcmp(optarg, "human") == 0) {
+                    printFormat = -1;
+                }
+                else {
+                    printFormat = outputFormat(optarg);
+                    if (printFormat < 0) {
+                        fprintf(stderr, "Unknown output format %s.\n", optarg);
+                        return -1;
+                    }
+                }
+                break;
+            case 'T':
+                batchFile = 1;
+                break;
+            case 'P':
+                dumper.path = optarg;
+                break;
+            case 'e':
+                deltaMode = 1;
+                break;
+            case 'b':
+                if (parseDeadbands(&deadbands, optarg) != 0) {
+                    fprintf(stderr, "Invalid deadbands %s.\n", optarg);
+                    return -1;
+                }
+                deltaMode = 1;
+                break;
+            case 'H':
+                heartbeat = atoi(optarg);
+                if (heartbeat <= 0) {
+                    fprintf(stderr, "Invalid heartbeat %s.\n", optarg);
+                    return -1;
+                }
+                deltaMode = 1;
+                break;
+            case 'M':
+                metricsAddress = optarg;
+                break;
+            case 'U':
+                socketPath = optarg;
+                break;
+            case 'W':
+                storeDirectory = optarg;
+                break;
+            case 'Z':
+                storeCompressed = 1;
+                break;
+            case 'G':
+                rollupDirectory = optarg;
+                break;
+            case 'O':
+                socketFormat = outputFormat(optarg);
+                if (socketFormat < 0) {
+                    fprintf(stderr, "Unknown socket format %s.\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'a':
+                asyncLog = 1;
+                break;
             case 'D':
                 daemon = 1;
                 break;
@@ -231,15 +839,67 @@ int main(int argc, char *argv[]) {
                 return -1;
         }
     }
-    if (optind >= argc) {
+    if (optind >= argc && replayFile == NULL) {
         fprintf(stderr, "Missing USB device parameter.\n");
         printUsage(argv[0]);
         return -1;
     }
-    if (daemon && script == NULL) {
-        fprintf(stderr, "Missing script parameter. Running the program as a daemon implies -s.\n");
+    if (optind < argc && replayFile != NULL) {
+        fprintf(stderr, "No USB device may be given when replaying a capture file.\n");
+        return -1;
+    }
+    if (script != NULL && consumerProgram != NULL) {
+        fprintf(stderr, "The options -s and -p are mutually exclusive.\n");
+        return -1;
+    }
+    if (batchCount > 0 && script == NULL) {
+        fprintf(stderr, "Batches are handed to the -s program, -B requires -s.\n");
+        return -1;
+    }
+    if (spoolDirectory != NULL && (script == NULL || batchCount > 0)) {
+        fprintf(stderr, "The spool holds the samples for the -s program, -K requires -s and cannot be used with -B.\n");
+        return -1;
+    }
+    if ((metricsAddress != NULL || socketPath != NULL) && (replayFile != NULL || checkpoint != NULL)) {
+        fprintf(stderr, "The metrics and the socket are served while polling the devices, -M and -U cannot be used with -R or -l.\n");
+        return -1;
+    }
+    if (daemon && script == NULL && consumerProgram == NULL && sharedName == NULL && metricsAddress == NULL && socketPath == NULL
+        && storeDirectory == NULL && rollupDirectory == NULL) {
+        fprintf(stderr, "Missing script parameter. Running the program as a daemon implies -s, -p, -m, -M, -U, -W or -G.\n");
+        return -1;
+    }
+    if (daemon && outputGiven) {
+        fprintf(stderr, "A daemon has no stdout, -o cannot be used with -D.\n");
         return -1;
     }
+    if (daemon) {
+        // every path given may be taken from argv
+        resolved = malloc(argc * sizeof(char *));
+        if (resolved == NULL) {
+            fprintf(stderr, "Could not allocate memory. %s\n", strerror(errno));
+            return -1;
+        }
+        for (i = optind; i < (unsigned int)argc; ++i) {
+            ok = ok && resolvePath(&(argv[i]), resolved, &resolvedCount) == 0;
+        }
+        ok = ok && resolvePath(&recordFile, resolved, &resolvedCount) == 0
+                && resolvePath(&replayFile, resolved, &resolvedCount) == 0
+                && resolvePath(&checkpoint, resolved, &resolvedCount) == 0
+                && resolvePath(&storeDirectory, resolved, &resolvedCount) == 0
+                && resolvePath(&rollupDirectory, resolved, &resolvedCount) == 0
+                && resolvePath(&spoolDirectory, resolved, &resolvedCount) == 0
+                && resolvePath(&socketPath, resolved, &resolvedCount) == 0
+                && resolvePath(&(dumper.path), resolved, &resolvedCount) == 0;
+        if (!ok) {
+            fprintf(stderr, "Could not resolve the paths. %s\n", strerror(errno));
+            for (i = 0; i < resolvedCount; ++i) {
+                free(resolved[i]);
+            }
+            free(resolved);
+            return -1;
+        }
+    }
     if (daemon) {
         initlog(1);
         daemonize();
@@ -247,42 +907,307 @@ int main(int argc, char *argv[]) {
     else {
         initlog(0);
     }
-    log_output(LOG_DEBUG, "Opening USB device\n");
-    connection = initUSBConnection(argv[optind]);
-    if (connection != NULL) {
-        int i;
-        int increment = 1;
-        log_output(LOG_INFO, "Connection initialization successful. UVR mode 0x%X\n", (unsigned int)connection->uvr_mode);
-        if (repeatCount == 0) {
-            increment = 0;
-            repeatCount = 1; // prepare the values in a way that the loop below runs infinitely
-        }
-        for (i = 0; i < repeatCount; i+=increment) {
-            struct SystemState *result;
-            result = readCurrentData(connection);
-            if (result != NULL) {
-                if (script != NULL) {
-                    executeProgram(script, result);
+    // only the stats thread takes SIGUSR1 and only the poller loop or the stop thread takes
+    // SIGTERM and SIGINT, so every thread started from here on blocks them
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    // after daemonize(), the drain thread would not survive the fork
+    if (asyncLog && startAsyncLog(ASYNC_LOG_CAPACITY) != 0) {
+        fprintf(stderr, "Could not start the log thread. %s\n", strerror(errno));
+        return -1;
+    }
+    if (consumerProgram != NULL) {
+        consumer = initConsumer(consumerProgram);
+        if (consumer == NULL) {
+            fprintf(stderr, "Could not start consumer %s. %s\n", consumerProgram, strerror(errno));
+            return -1;
+        }
+    }
+    deviceCount = argc - optind;
+    if (deviceCount > 0) {
+        connections = malloc(deviceCount * sizeof(struct USBConnection *));
+        if (connections == NULL) {
+            fprintf(stderr, "Could not allocate memory. %s\n", strerror(errno));
+            cleanupConsumer(consumer);
+            return -1;
+        }
+    }
+    for (i = 0; i < deviceCount; ++i) {
+        log_output(LOG_DEBUG, "Opening USB device %s\n", argv[optind+i]);
+        connections[i] = initUSBConnection(argv[optind+i]);
+        if (connections[i] == NULL) {
+            fprintf(stderr, "Could not initialize connection to UVR on %s. %s\n", argv[optind+i], strerror(errno));
+            deviceCount = i;
+            ok = 0;
+            break;
+        }
+        log_output(LOG_INFO, "Connection to %s successful. UVR mode 0x%X\n", argv[optind+i], (unsigned int)connections[i]->uvr_mode);
+        connections[i]->timeout = timeout;
+        connections[i]->id = i+1;
+    }
+    if (ok && recordFile != NULL) {
+        capture = openCaptureWriter(recordFile);
+        if (capture == NULL) {
+            fprintf(stderr, "Could not open capture file %s. %s\n", recordFile, strerror(errno));
+            ok = 0;
+        }
+        for (i = 0; i < deviceCount; ++i) {
+            connections[i]->capture = capture;
+        }
+    }
+    delivery.script = NULL;
+    if (ok && script != NULL && batchCount == 0) {
+        delivery.script = initScriptRunner(script, shell);
+        if (delivery.script == NULL) {
+            fprintf(stderr, "Could not prepare running %s. %s\n", script, strerror(errno));
+            ok = 0;
+        }
+        else {
+            delivery.script->timeout = scriptTimeout * 1000;
+        }
+    }
+    delivery.spool = NULL;
+    delivery.unspooled = NULL;
+    if (ok && spoolDirectory != NULL) {
+        delivery.spool = initSpool(spoolDirectory, (unsigned long long)spoolSize * 1024 * 1024);
+        if (delivery.spool == NULL) {
+            fprintf(stderr, "Could not open spool %s. %s\n", spoolDirectory, strerror(errno));
+            ok = 0;
+        }
+    }
+    if (ok && spoolDirectory != NULL) {
+        delivery.unspooled = initSampleRing(queueDepth, RING_DROP_OLDEST);
+        if (delivery.unspooled == NULL) {
+            fprintf(stderr, "Could not create sample queue. %s\n", strerror(errno));
+            ok = 0;
+        }
+    }
+    delivery.consumer = consumer;
+    if (ok && sharedName != NULL) {
+        shared = createSharedState(sharedName);
+        if (shared == NULL) {
+            fprintf(stderr, "Could not create shared memory %s. %s\n", sharedName, strerror(errno));
+            ok = 0;
+        }
+    }
+    delivery.shared = shared;
+    delivery.store = NULL;
+    if (ok && storeDirectory != NULL) {
+        delivery.store = initStoreWriter(storeDirectory, storeCompressed);
+        if (delivery.store == NULL) {
+            fprintf(stderr, "Could not open store %s. %s\n", storeDirectory, strerror(errno));
+            ok = 0;
+        }
+    }
+    delivery.rollups = NULL;
+    if (ok && rollupDirectory != NULL) {
+        delivery.rollups = initRollups(rollupDirectory);
+        if (delivery.rollups == NULL) {
+            fprintf(stderr, "Could not open rollups in %s. %s\n", rollupDirectory, strerror(errno));
+            ok = 0;
+        }
+    }
+    if (ok && deltaMode) {
+        delta = initDeltaFilter(&deadbands, heartbeat);
+        if (delta == NULL) {
+            fprintf(stderr, "Could not create delta filter. %s\n", strerror(errno));
+            ok = 0;
+        }
+    }
+    delivery.delta = delta;
+    if (ok && batchCount > 0) {
+        batch = initBatch(script, batchFormat, batchCount, batchAge, batchFile);
+        if (batch == NULL) {
+            fprintf(stderr, "Could not create batch. %s\n", strerror(errno));
+            ok = 0;
+        }
+        else {
+            batch->timeout = scriptTimeout * 1000;
+        }
+    }
+    delivery.batch = batch;
+    if (ok && printFormat >= 0) {
+        writer = initOutputWriter(printFormat, STDOUT_FILENO);
+        if (writer == NULL) {
+            ok = 0;
+        }
+    }
+    delivery.writer = writer;
+    delivery.labelled = deviceCount > 1 || replayFile != NULL;
+    delivery.live = checkpoint == NULL && replayFile == NULL;
+    delivery.queued = 0;
+    delivery.delivered = 0;
+    delivery.drainEnd = 0;
+    delivery.stop = 0;
+    for (i = 0; i < deviceCount; ++i) {
+        if (connections[i]->uvr_mode == MODE_2DL) {
+            delivery.labelled = 1;
+        }
+    }
+    delivery.ring = NULL;
+    if (checkpoint != NULL || replayFile != NULL) {
+        // neither a download nor a replay may lose any sample, they just run as fast as the delivery
+        queuePolicy = RING_BLOCK;
+        delay = 0;
+    }
+    if (ok) {
+        delivery.ring = initSampleRing(queueDepth, queuePolicy);
+        if (delivery.ring == NULL) {
+            fprintf(stderr, "Could not create sample queue. %s\n", strerror(errno));
+            ok = 0;
+        }
+    }
+    if (ok && delay > 0) {
+        scheduler = initScheduler(delay);
+        if (scheduler == NULL) {
+            fprintf(stderr, "Could not create scheduler. %s\n", strerror(errno));
+            ok = 0;
+        }
+    }
+    if (ok && deviceCount > 0) {
+        poller = initDevicePoller(connections, deviceCount, scheduler, queueSample, &delivery);
+        if (poller == NULL) {
+            fprintf(stderr, "Could not create device poller. %s\n", strerror(errno));
+            ok = 0;
+        }
+        else {
+            poller->delta = delta;
+        }
+    }
+    if (ok && replayFile == NULL && checkpoint == NULL) {
+        sigdelset(&signals, SIGUSR1);
+        signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (signalFd < 0 || pollerWatch(poller, signalFd, EPOLLIN, stopSignalled, poller) != 0) {
+            fprintf(stderr, "Could not watch for signals. %s\n", strerror(errno));
+            ok = 0;
+        }
+    }
+    delivery.exporter = NULL;
+    if (ok && metricsAddress != NULL) {
+        exporter = initExporter(metricsAddress, poller, connections, deviceCount, delivery.ring);
+        if (exporter == NULL) {
+            fprintf(stderr, "Could not serve metrics at %s. %s\n", metricsAddress, strerror(errno));
+            ok = 0;
+        }
+        delivery.exporter = exporter;
+    }
+    delivery.subscribers = NULL;
+    if (ok && socketPath != NULL) {
+        subscribers = initSubscriberServer(socketPath, socketFormat, poller, deviceCount);
+        if (subscribers == NULL) {
+            fprintf(stderr, "Could not listen at %s. %s\n", socketPath, strerror(errno));
+            ok = 0;
+        }
+        delivery.subscribers = subscribers;
+    }
+    if (ok) {
+        dumper.connections = connections;
+        dumper.count = deviceCount;
+        if (pthread_create(&(dumper.thread), NULL, statsThread, &dumper) == 0) {
+            dumping = 1;
+        }
+        else {
+            log_output(LOG_WARNING, "Could not start statistics thread, SIGUSR1 is ignored\n");
+        }
+    }
+    if (ok && pthread_create(&deliverer, NULL, deliveryThread, &delivery) != 0) {
+        fprintf(stderr, "Could not start delivery thread.\n");
+        ok = 0;
+    }
+    if (ok && (replayFile != NULL || checkpoint != NULL)) {
+        if (pthread_create(&stopper, NULL, stopThread, &delivery) != 0) {
+            fprintf(stderr, "Could not start the signal thread.\n");
+            closeSampleRing(delivery.ring);
+            pthread_join(deliverer, NULL);
+            ok = 0;
+        }
+        else {
+            stopping = 1;
+        }
+    }
+    if (ok) {
+        started = monotonicNanoseconds();
+        if (replayFile != NULL) {
+            ret = replayCapture(replayFile, replaySpeed, queueSample, &delivery, &(delivery.stop));
+        }
+        else if (checkpoint != NULL) {
+            ret = 0;
+            for (i = 0; i < deviceCount && !__atomic_load_n(&(delivery.stop), __ATOMIC_ACQUIRE); ++i) {
+                char path[4096];
+                if (deviceCount > 1) {
+                    snprintf(path, sizeof(path), "%s.%u", checkpoint, i+1);
                 }
                 else {
-                    printf("Inputs\n");
-                    printValueList("S", result->inputs);
-                    printf("Outputs\n");
-                    printValueList("O", result->outputs);
-                    printf("Heat registers\n");
-                    printValueList("", result->heatRegisters);
+                    snprintf(path, sizeof(path), "%s", checkpoint);
                 }
-                freeSystemState(result);
-                result = NULL;
+                if (downloadLogger(connections[i], i+1, path, queueSample, waitDelivered, &delivery, NULL) != 0) {
+                    ret = -1;
+                }
+            }
+        }
+        else {
+            ret = runDevicePoller(poller, repeatCount);
+        }
+        closeSampleRing(delivery.ring);
+        pthread_join(deliverer, NULL);
+        if (stopping) {
+            if (__atomic_exchange_n(&(delivery.stop), 1, __ATOMIC_ACQ_REL) == 0) {
+                pthread_kill(stopper, SIGTERM);
             }
-            sleep(delay);
+            pthread_join(stopper, NULL);
+        }
+        if (monotonicNanoseconds() > started) {
+            double seconds = (monotonicNanoseconds() - started) / 1e9;
+            log_output(LOG_INFO, "Delivered %lu samples in %.3f s (%.1f samples/s)\n",
+                    delivery.delivered, seconds, delivery.delivered / seconds);
+        }
+        if (ringDropped(delivery.ring) > 0) {
+            log_output(LOG_INFO, "%lu samples were dropped because the delivery was too slow\n", ringDropped(delivery.ring));
+        }
+        logSchedulerStatistics(scheduler);
+        logDeltaStatistics(delta);
+        logStageStatistics();
+        for (i = 0; i < deviceCount; ++i) {
+            logConnectionStatistics(connections[i]);
         }
     }
-    else {
-        fprintf(stderr, "Could not initialize connection to UVR. %s\n", strerror(errno));
-        cleanupUSBConnection(connection);
-        return -1;
+    if (dumping) {
+        // the final state ends up in the stats file
+        __atomic_store_n(&(dumper.stop), 1, __ATOMIC_RELEASE);
+        pthread_kill(dumper.thread, SIGUSR1);
+        pthread_join(dumper.thread, NULL);
     }
-    cleanupUSBConnection(connection);
-    return 0;
-}
\ No newline at end of file
+    cleanupExporter(exporter);
+    cleanupSubscriberServer(subscribers);
+    cleanupDevicePoller(poller);
+    if (signalFd >= 0) {
+        close(signalFd);
+    }
+    cleanupScheduler(scheduler);
+    cleanupSampleRing(delivery.ring);
+    cleanupSampleRing(delivery.unspooled);
+    for (i = 0; i < deviceCount; ++i) {
+        cleanupUSBConnection(connections[i]);
+    }
+    free(connections);
+    closeCaptureWriter(capture);
+    releaseSharedState(shared);
+    cleanupDeltaFilter(delta);
+    cleanupStoreWriter(delivery.store);
+    cleanupRollups(delivery.rollups);
+    cleanupSpool(delivery.spool);
+    cleanupScriptRunner(delivery.script);
+    cleanupOutputWriter(writer);
+    // hands the last samples over
+    cleanupBatch(batch);
+    cleanupConsumer(consumer);
+    for (i = 0; i < resolvedCount; ++i) {
+        free(resolved[i]);
+    }
+    free(resolved);
+    endlog();
+    return ret;
+}
@@ -0,0 +1,122 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Prints the latest samples dlogg-reader published in shared memory (-m).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#include "sharedstate.h"
+#include "consumer.h"
+#include "logging.h"
+
+void printUsage(char *command)
+{
+    fprintf(stderr, "Usage: %s [-n <name>] [-d <device>] [-c <controller>] [-w <interval>]\n", command);
+    fprintf(stderr, "  Prints the latest samples published by dlogg-reader -m, one line per\n");
+    fprintf(stderr, "  controller in the format of dlogg-reader -p.\n");
+    fprintf(stderr, "  -n    The name of the shared memory segment. (default: %s)\n", SHARED_STATE_NAME);
+    fprintf(stderr, "  -d    Only print the given device. (default: all)\n");
+    fprintf(stderr, "  -c    Only print the given controller. (default: all)\n");
+    fprintf(stderr, "  -w    Print the samples again every <interval> seconds until interrupted.\n");
+}
+
+/**
+ * print the samples of all selected controllers
+ *
+ * \return the number of samples printed
+ */
+static int printSamples(struct SharedState *shared, unsigned int device, unsigned int controller)
+{
+    char record[CONSUMER_BUFFER_SIZE];
+    struct Sample sample;
+    unsigned int d;
+    unsigned int c;
+    int printed = 0;
+    for (d = 1; d <= SHARED_STATE_DEVICES; ++d) {
+        if (device != 0 && device != d) {
+            continue;
+        }
+        for (c = 1; c <= MAX_CONTROLLERS; ++c) {
+            size_t length;
+            if ((controller != 0 && controller != c) || readSharedSample(shared, d, c, &sample) != 1) {
+                continue;
+            }
+            length = formatSampleRecord(record, sizeof(record), &sample);
+            if (length > 0) {
+                fwrite(record, 1, length, stdout);
+                ++printed;
+            }
+        }
+    }
+    fflush(stdout);
+    return printed;
+}
+
+int main(int argc, char *argv[])
+{
+    struct SharedState *shared;
+    char *name = SHARED_STATE_NAME;
+    unsigned int device = 0;
+    unsigned int controller = 0;
+    int interval = 0;
+    int printed;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:d:c:w:")) != -1) {
+        switch (opt) {
+            case 'n':
+                name = optarg;
+                break;
+            case 'd':
+                device = atoi(optarg);
+                break;
+            case 'c':
+                controller = atoi(optarg);
+                break;
+            case 'w':
+                interval = atoi(optarg);
+                break;
+            default:
+                printUsage(argv[0]);
+                return -1;
+        }
+    }
+    initlog(0);
+    shared = attachSharedState(name);
+    if (shared == NULL) {
+        fprintf(stderr, "Could not open shared memory %s. %s\n", name, strerror(errno));
+        return -1;
+    }
+    do {
+        printed = printSamples(shared, device, controller);
+        if (interval > 0) {
+            sleep(interval);
+        }
+    } while (interval > 0);
+    releaseSharedState(shared);
+    endlog();
+    return printed > 0 ? 0 : 1;
+}
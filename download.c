@@ -0,0 +1,203 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "download.h"
+#include "communication.h"
+#include "parsing.h"
+#include "logging.h"
+
+/**
+ * check whether the address lies between the oldest and the newest record
+ * and points to the beginning of a record. The memory is a ring, so the end
+ * may be in front of the start.
+ */
+static int addressInRange(struct LoggerHeader const *header, unsigned long address)
+{
+    if (address >= LOGGER_MEMORY_SIZE ||
+        (address + LOGGER_MEMORY_SIZE - header->startAddress) % LOGGER_MEMORY_SIZE % header->recordSize != 0) {
+        return 0;
+    }
+    if (header->startAddress <= header->endAddress) {
+        return address >= header->startAddress && address <= header->endAddress;
+    }
+    return address >= header->startAddress || address <= header->endAddress;
+}
+
+/**
+ * read the address stored in the checkpoint file
+ *
+ * \return 0 on success, -1 if there is no valid checkpoint
+ */
+static int loadCheckpoint(char const *path, unsigned long *address)
+{
+    FILE *file;
+    int ret = -1;
+    file = fopen(path, "r");
+    if (file != NULL) {
+        if (fscanf(file, "%lx", address) == 1) {
+            ret = 0;
+        }
+        fclose(file);
+    }
+    return ret;
+}
+
+/**
+ * atomically replace the checkpoint file
+ *
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+static int saveCheckpoint(char const *path, unsigned long address)
+{
+    char tmpPath[4096];
+    FILE *file;
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    file = fopen(tmpPath, "w");
+    if (file == NULL) {
+        log_output(LOG_ERR, "Could not write checkpoint %s. %s\n", tmpPath, strerror(errno));
+        return -1;
+    }
+    fprintf(file, "0x%06lX\n", address);
+    if (fclose(file) != 0 || rename(tmpPath, path) != 0) {
+        log_output(LOG_ERR, "Could not write checkpoint %s. %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * read a chunk of records, repeating the request on failure
+ */
+static int readChunk(struct USBConnection *conn, struct LoggerHeader const *header, unsigned long address,
+                     unsigned int count, unsigned char *buffer)
+{
+    int attempt;
+    for (attempt = 0; attempt <= MAX_RETRIES; ++attempt) {
+        if (attempt > 0) {
+            struct timespec backoff;
+            long long delay = retryBackoff(attempt);
+            backoff.tv_sec = delay / 1000000000LL;
+            backoff.tv_nsec = delay % 1000000000LL;
+            nanosleep(&backoff, NULL);
+            tcflush(conn->fd, TCIFLUSH);
+            ++conn->stats.retries;
+        }
+        if (readLoggerRecords(conn, header, address, count, buffer) == 0) {
+            return 0;
+        }
+    }
+    log_output(LOG_ERR, "Could not read logger records at 0x%06lX. %s\n", address, strerror(errno));
+    return -1;
+}
+
+int downloadLogger(struct USBConnection *conn, unsigned int deviceID, char const *checkpoint,
+                   SampleHandler handler, DrainHandler drained, void *context, struct DownloadStatistics *stats)
+{
+    struct LoggerHeader header;
+    struct DownloadStatistics local;
+    struct Sample sample;
+    unsigned char *buffer;
+    unsigned long address;
+    long long start;
+    int ret = 0;
+    if (stats == NULL) {
+        stats = &local;
+    }
+    memset(stats, 0, sizeof(struct DownloadStatistics));
+    if (readLoggerHeader(conn, &header) != 0) {
+        log_output(LOG_ERR, "Could not read logger header. %s\n", strerror(errno));
+        return -1;
+    }
+    address = header.startAddress;
+    if (checkpoint != NULL && loadCheckpoint(checkpoint, &address) == 0) {
+        if (addressInRange(&header, address)) {
+            log_output(LOG_INFO, "Resuming download at 0x%06lX\n", address);
+        }
+        else {
+            log_output(LOG_INFO, "Checkpoint 0x%06lX is not a record stored on the device, starting at the oldest record\n", address);
+            address = header.startAddress;
+        }
+    }
+    buffer = malloc(LOGGER_MAX_CHUNK * header.recordSize);
+    if (buffer == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return -1;
+    }
+    sample.deviceID = deviceID;
+    start = monotonicNanoseconds();
+    while (address != header.endAddress) {
+        unsigned long remaining;
+        unsigned int count;
+        unsigned int i;
+        // records never wrap around the end of the memory
+        remaining = (header.endAddress + LOGGER_MEMORY_SIZE - address) % LOGGER_MEMORY_SIZE;
+        if (remaining > LOGGER_MEMORY_SIZE - address) {
+            remaining = LOGGER_MEMORY_SIZE - address;
+        }
+        count = remaining / header.recordSize;
+        if (count == 0) {
+            // a partial record at the end of the memory, continue at its start
+            address = 0;
+            continue;
+        }
+        if (count > LOGGER_MAX_CHUNK) {
+            count = LOGGER_MAX_CHUNK;
+        }
+        if (readChunk(conn, &header, address, count, buffer) != 0) {
+            ret = -1;
+            break;
+        }
+        stats->records += count;
+        for (i = 0; i < count; ++i) {
+            unsigned char *record = buffer + i * header.recordSize;
+            unsigned int controller;
+            for (controller = 0; controller < header.recordSize / LOGGER_BLOCK_SIZE; ++controller) {
+                sample.controllerID = controller+1;
+                if (parseLoggerRecord(record, header.recordSize, controller, &(sample.state), &(sample.timestamp)) == 0) {
+                    handler(context, &sample);
+                    ++stats->samples;
+                }
+                else {
+                    ++stats->errors;
+                }
+            }
+        }
+        address = (address + count * header.recordSize) % LOGGER_MEMORY_SIZE;
+        // the checkpoint must not pass samples which are only queued
+        if (drained != NULL && drained(context) != 0) {
+            log_output(LOG_INFO, "Download stopped, the next download repeats the last chunk\n");
+            break;
+        }
+        if (checkpoint != NULL) {
+            saveCheckpoint(checkpoint, address);
+        }
+    }
+    free(buffer);
+    stats->seconds = (monotonicNanoseconds() - start) / 1e9;
+    log_output(LOG_INFO, "Downloaded %lu records (%lu samples, %lu errors) in %.2f s, %.0f records/s\n",
+               stats->records, stats->samples, stats->errors, stats->seconds,
+               stats->seconds > 0 ? stats->records / stats->seconds : 0.0);
+    return ret;
+}
@@ -0,0 +1,79 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef DOWNLOAD_H
+#define DOWNLOAD_H
+
+#include "datatypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * counters of a data logger download
+ */
+struct DownloadStatistics
+{
+    unsigned long records;   /* number of records read from the device */
+    unsigned long samples;   /* number of samples handed to the handler */
+    unsigned long errors;    /* number of records which could not be parsed */
+    double seconds;          /* duration of the download */
+};
+
+/**
+ * callback returning once every sample handed to the SampleHandler so far
+ * was delivered
+ *
+ * \return 0 if the samples were delivered, non-zero to stop the download
+ */
+typedef int (*DrainHandler)(void *context);
+
+/**
+ * download the records stored in the data logger memory of the device
+ *
+ * The records are read in chunks of LOGGER_MAX_CHUNK records and every
+ * decoded record is handed to the handler right away, so the memory is
+ * never held completely. After each chunk, drained is called and then the
+ * address of the next record is written to the checkpoint file. If drained
+ * asks to stop, the download ends there and the checkpoint stays where it is. A later
+ * download with the same file continues there, as long as that address is
+ * still part of the memory. A handler which only queues the samples has to
+ * pass a drained callback, else the checkpoint may pass samples which were
+ * never delivered.
+ *
+ * \param conn the connection to the device
+ * \param deviceID the device id the samples are tagged with
+ * \param checkpoint the path of the checkpoint file, NULL to always start at the oldest record
+ * \param handler the callback receiving the samples
+ * \param drained waits for the samples of a chunk to be delivered, NULL if the handler delivers them itself
+ * \param context passed to the callbacks
+ * \param stats receives the counters of the download, may be NULL
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+int downloadLogger(struct USBConnection *conn, unsigned int deviceID, char const *checkpoint,
+                   SampleHandler handler, DrainHandler drained, void *context, struct DownloadStatistics *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DOWNLOAD_H */
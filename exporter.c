@@ -0,0 +1,594 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "exporter.h"
+#include "communication.h"
+#include "logging.h"
+
+#define EXPORTER_BACKLOG 16
+
+static char const notFound[] =
+    "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\nConnection: close\r\n\r\nNot found\n";
+static char const badRequest[] =
+    "HTTP/1.0 400 Bad Request\r\nContent-Type: text/plain\r\nContent-Length: 12\r\nConnection: close\r\n\r\nBad request\n";
+
+/**
+ * append to the body of the page, growing it as needed
+ */
+static void appendBody(struct Exporter *exporter, char const *format, ...)
+{
+    va_list ap;
+    int length;
+    for (;;) {
+        size_t space = exporter->bodyCapacity - exporter->bodyLength;
+        char *grown;
+        va_start(ap, format);
+        length = vsnprintf(exporter->body + exporter->bodyLength, space, format, ap);
+        va_end(ap);
+        if (length < 0) {
+            return;
+        }
+        if ((size_t)length < space) {
+            exporter->bodyLength += length;
+            return;
+        }
+        grown = realloc(exporter->body, exporter->bodyCapacity * 2 + length);
+        if (grown == NULL) {
+            log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+            return;
+        }
+        exporter->body = grown;
+        exporter->bodyCapacity = exporter->bodyCapacity * 2 + length;
+    }
+}
+
+static void appendFamily(struct Exporter *exporter, char const *name, char const *type, char const *help)
+{
+    appendBody(exporter, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * append one line per value of the given type of a group of all controllers
+ *
+ * \param group 0 inputs, 1 outputs, 2 rotations, 3 heat registers
+ * \param label the label carrying the value id
+ * \param total for heat registers: export the total instead of the current power
+ */
+static void appendValues(struct Exporter *exporter, char const *name, int group, int type, char const *label, int total)
+{
+    unsigned int slot;
+    for (slot = 0; slot < exporter->count * MAX_CONTROLLERS; ++slot) {
+        struct SystemState const *state = &(exporter->samples[slot].state);
+        struct Value const *values;
+        unsigned int count;
+        unsigned int i;
+        if (!exporter->present[slot]) {
+            continue;
+        }
+        switch (group) {
+            case 0:
+                values = state->inputs;
+                count = state->inputCount;
+                break;
+            case 1:
+                values = state->outputs;
+                count = state->outputCount;
+                break;
+            case 2:
+                values = state->rotations;
+                count = state->rotationCount;
+                break;
+            default:
+                values = state->heatRegisters;
+                count = state->heatRegisterCount;
+                break;
+        }
+        for (i = 0; i < count; ++i) {
+            struct Value const *value = &(values[i]);
+            if (value->valueType != type) {
+                continue;
+            }
+            appendBody(exporter, "%s{device=\"%u\",controller=\"%u\",%s=\"%u\"} ", name,
+                       exporter->samples[slot].deviceID, exporter->samples[slot].controllerID, label, (unsigned int)value->valueID);
+            switch (type) {
+                case TEMPERATURE:
+                    appendBody(exporter, "%.1f\n", value->value.temperature);
+                    break;
+                case DIGITAL:
+                    appendBody(exporter, "%d\n", value->value.enabled ? 1 : 0);
+                    break;
+                case FLOW:
+                    appendBody(exporter, "%d\n", value->value.flow);
+                    break;
+                case ROTATION:
+                    appendBody(exporter, "%d\n", value->value.rotation);
+                    break;
+                case HEAT:
+                    appendBody(exporter, total ? "%.1f\n" : "%.2f\n", total ? value->value.heat.total : value->value.heat.current);
+                    break;
+            }
+        }
+    }
+}
+
+/**
+ * append a health counter of every device
+ */
+static void appendCounter(struct Exporter *exporter, char const *name, char const *help, size_t offset)
+{
+    unsigned int i;
+    appendFamily(exporter, name, "counter", help);
+    for (i = 0; i < exporter->count; ++i) {
+        unsigned long const *counter = (unsigned long const *)((char const *)&(exporter->connections[i]->stats) + offset);
+        appendBody(exporter, "%s{device=\"%u\"} %lu\n", name, i+1, *counter);
+    }
+}
+
+/**
+ * get a number which changes whenever the page would change
+ */
+static unsigned long exporterGeneration(struct Exporter *exporter)
+{
+    unsigned long generation = exporter->updates;
+    unsigned int i;
+    for (i = 0; i < exporter->count; ++i) {
+        struct ConnectionStatistics *stats = &(exporter->connections[i]->stats);
+        generation += stats->frames + stats->noData + stats->timeouts + stats->unsupported
+                      + stats->errors + stats->retries + stats->reconnects;
+    }
+    if (exporter->ring != NULL) {
+        generation += ringDropped(exporter->ring);
+    }
+    return generation;
+}
+
+/**
+ * render the page if anything changed since it was rendered last time
+ *
+ * \return 0 on success, -1 else
+ */
+static int renderPage(struct Exporter *exporter)
+{
+    unsigned long generation = exporterGeneration(exporter);
+    unsigned int slot;
+    unsigned int i;
+    char header[256];
+    int headerLength;
+    if (exporter->page != NULL && generation == exporter->generation) {
+        return 0;
+    }
+    exporter->bodyLength = 0;
+    appendFamily(exporter, "uvr_temperature_celsius", "gauge", "Temperature measured by an input.");
+    appendValues(exporter, "uvr_temperature_celsius", 0, TEMPERATURE, "input", 0);
+    appendFamily(exporter, "uvr_flow_liters_per_hour", "gauge", "Volume flow measured by an input.");
+    appendValues(exporter, "uvr_flow_liters_per_hour", 0, FLOW, "input", 0);
+    appendFamily(exporter, "uvr_digital_input", "gauge", "State of a digital input.");
+    appendValues(exporter, "uvr_digital_input", 0, DIGITAL, "input", 0);
+    appendFamily(exporter, "uvr_output_enabled", "gauge", "State of an output.");
+    appendValues(exporter, "uvr_output_enabled", 1, DIGITAL, "output", 0);
+    appendFamily(exporter, "uvr_rotation_speed_step", "gauge", "Speed step (0-30) of a speed controlled output.");
+    appendValues(exporter, "uvr_rotation_speed_step", 2, ROTATION, "output", 0);
+    appendFamily(exporter, "uvr_heat_power_kilowatts", "gauge", "Current power of a heat register.");
+    appendValues(exporter, "uvr_heat_power_kilowatts", 3, HEAT, "register", 0);
+    appendFamily(exporter, "uvr_heat_energy_kilowatthours_total", "counter", "Energy counted by a heat register.");
+    appendValues(exporter, "uvr_heat_energy_kilowatthours_total", 3, HEAT, "register", 1);
+    appendFamily(exporter, "uvr_sample_timestamp_seconds", "gauge", "Time the latest sample of a controller was received.");
+    for (slot = 0; slot < exporter->count * MAX_CONTROLLERS; ++slot) {
+        struct Sample const *sample = &(exporter->samples[slot]);
+        if (exporter->present[slot]) {
+            appendBody(exporter, "uvr_sample_timestamp_seconds{device=\"%u\",controller=\"%u\"} %ld.%03ld\n",
+                       sample->deviceID, sample->controllerID, (long)sample->timestamp.tv_sec, sample->timestamp.tv_nsec / 1000000);
+        }
+    }
+    appendCounter(exporter, "dlogg_frames_total", "Frames received from a device.", offsetof(struct ConnectionStatistics, frames));
+    appendCounter(exporter, "dlogg_no_data_total", "Replies without new data.", offsetof(struct ConnectionStatistics, noData));
+    appendCounter(exporter, "dlogg_timeouts_total", "Frames which did not arrive in time.", offsetof(struct ConnectionStatistics, timeouts));
+    appendCounter(exporter, "dlogg_unsupported_total", "Frames of an unsupported device or mode.", offsetof(struct ConnectionStatistics, unsupported));
+    appendCounter(exporter, "dlogg_errors_total", "Other failed transactions.", offsetof(struct ConnectionStatistics, errors));
+    appendCounter(exporter, "dlogg_retries_total", "Repeated requests.", offsetof(struct ConnectionStatistics, retries));
+    appendCounter(exporter, "dlogg_reconnects_total", "Times a device was reopened.", offsetof(struct ConnectionStatistics, reconnects));
+    appendFamily(exporter, "dlogg_frame_latency_seconds", "gauge", "Time from the request to the complete frame of the last frame.");
+    for (i = 0; i < exporter->count; ++i) {
+        appendBody(exporter, "dlogg_frame_latency_seconds{device=\"%u\"} %.6f\n", i+1, exporter->connections[i]->stats.lastLatency / 1e9);
+    }
+    appendFamily(exporter, "dlogg_samples_total", "counter", "Samples read from all devices.");
+    appendBody(exporter, "dlogg_samples_total %lu\n", exporter->updates);
+    if (exporter->ring != NULL) {
+        appendFamily(exporter, "dlogg_samples_dropped_total", "counter", "Samples dropped because the delivery was too slow.");
+        appendBody(exporter, "dlogg_samples_dropped_total %lu\n", ringDropped(exporter->ring));
+    }
+    headerLength = snprintf(header, sizeof(header),
+                            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                            "Content-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long)exporter->bodyLength);
+    if (exporter->pageCapacity < headerLength + exporter->bodyLength) {
+        char *grown = realloc(exporter->page, headerLength + exporter->bodyLength);
+        if (grown == NULL) {
+            log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+            return -1;
+        }
+        exporter->page = grown;
+        exporter->pageCapacity = headerLength + exporter->bodyLength;
+    }
+    memcpy(exporter->page, header, headerLength);
+    memcpy(exporter->page + headerLength, exporter->body, exporter->bodyLength);
+    exporter->pageLength = headerLength + exporter->bodyLength;
+    exporter->generation = generation;
+    ++exporter->renders;
+    return 0;
+}
+
+static void closeClient(struct Exporter *exporter, struct ExporterClient *client)
+{
+    pollerUnwatch(exporter->poller, client->fd);
+    close(client->fd);
+    client->fd = -1;
+}
+
+static struct ExporterClient *findClient(struct Exporter *exporter, int fd)
+{
+    unsigned int i;
+    for (i = 0; i < EXPORTER_MAX_CLIENTS; ++i) {
+        if (exporter->clients[i].fd == fd) {
+            return &(exporter->clients[i]);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * find an entry for a new connection. If all are taken, the oldest
+ * connection is closed if it exceeded EXPORTER_IDLE_TIMEOUT, every
+ * connection serves a single request, so it is stuck by then.
+ *
+ * \return the entry, NULL if all connections are busy
+ */
+static struct ExporterClient *freeClient(struct Exporter *exporter, long long now)
+{
+    struct ExporterClient *oldest = NULL;
+    unsigned int i;
+    for (i = 0; i < EXPORTER_MAX_CLIENTS; ++i) {
+        struct ExporterClient *client = &(exporter->clients[i]);
+        if (client->fd < 0) {
+            return client;
+        }
+        if (oldest == NULL || client->accepted < oldest->accepted) {
+            oldest = client;
+        }
+    }
+    if (now - oldest->accepted < EXPORTER_IDLE_TIMEOUT * 1000000LL) {
+        return NULL;
+    }
+    log_output(LOG_DEBUG, "Closing a metrics connection idle for %lld ms\n", (now - oldest->accepted) / 1000000LL);
+    closeClient(exporter, oldest);
+    ++exporter->evicted;
+    return oldest;
+}
+
+/**
+ * write as much of the response as the socket takes. The connection is
+ * closed once everything is written.
+ */
+static void sendResponse(struct Exporter *exporter, struct ExporterClient *client)
+{
+    while (client->sent < client->length) {
+        ssize_t ret = send(client->fd, client->response + client->sent, client->length - client->sent, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                pollerModify(exporter->poller, client->fd, EPOLLOUT);
+                return;
+            }
+            log_output(LOG_DEBUG, "Could not send metrics. %s\n", strerror(errno));
+            break;
+        }
+        client->sent += ret;
+    }
+    closeClient(exporter, client);
+}
+
+/**
+ * take a copy of the response for the request, so that the page may be
+ * rendered again while the response is written
+ */
+static void startResponse(struct Exporter *exporter, struct ExporterClient *client, char const *response, size_t length)
+{
+    if (client->capacity < length) {
+        char *grown = realloc(client->response, length);
+        if (grown == NULL) {
+            log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+            closeClient(exporter, client);
+            return;
+        }
+        client->response = grown;
+        client->capacity = length;
+    }
+    memcpy(client->response, response, length);
+    client->length = length;
+    client->sent = 0;
+    sendResponse(exporter, client);
+}
+
+/**
+ * answer a complete request
+ */
+static void handleRequest(struct Exporter *exporter, struct ExporterClient *client)
+{
+    char const *path;
+    size_t pathLength;
+    if (strncmp(client->request, "GET ", 4) != 0) {
+        startResponse(exporter, client, badRequest, sizeof(badRequest)-1);
+        return;
+    }
+    path = client->request + 4;
+    pathLength = strcspn(path, " ?\r\n");
+    if ((pathLength == 8 && strncmp(path, "/metrics", 8) == 0) || (pathLength == 1 && path[0] == '/')) {
+        if (renderPage(exporter) != 0) {
+            closeClient(exporter, client);
+            return;
+        }
+        ++exporter->scrapes;
+        startResponse(exporter, client, exporter->page, exporter->pageLength);
+    }
+    else {
+        startResponse(exporter, client, notFound, sizeof(notFound)-1);
+    }
+}
+
+static void clientReady(void *context, int fd, unsigned int events)
+{
+    struct Exporter *exporter = context;
+    struct ExporterClient *client = findClient(exporter, fd);
+    if (client == NULL) {
+        return;
+    }
+    if (events & EPOLLOUT) {
+        sendResponse(exporter, client);
+        return;
+    }
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        closeClient(exporter, client);
+        return;
+    }
+    for (;;) {
+        ssize_t ret = read(fd, client->request + client->received, EXPORTER_REQUEST_SIZE - 1 - client->received);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (ret <= 0) {
+            closeClient(exporter, client);
+            return;
+        }
+        client->received += ret;
+        client->request[client->received] = '\0';
+        if (strstr(client->request, "\r\n\r\n") != NULL || strstr(client->request, "\n\n") != NULL) {
+            handleRequest(exporter, client);
+            return;
+        }
+        if (client->received == EXPORTER_REQUEST_SIZE - 1) {
+            startResponse(exporter, client, badRequest, sizeof(badRequest)-1);
+            return;
+        }
+    }
+}
+
+static void listenReady(void *context, int fd, unsigned int events)
+{
+    struct Exporter *exporter = context;
+    (void)events;
+    for (;;) {
+        struct ExporterClient *client;
+        long long now;
+        int clientFd = accept(fd, NULL, NULL);
+        if (clientFd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_output(LOG_ERR, "Could not accept metrics connection. %s\n", strerror(errno));
+            }
+            return;
+        }
+        now = monotonicNanoseconds();
+        client = freeClient(exporter, now);
+        if (client == NULL) {
+            log_output(LOG_DEBUG, "Too many metrics connections, rejected one\n");
+            close(clientFd);
+            continue;
+        }
+        fcntl(clientFd, F_SETFL, fcntl(clientFd, F_GETFL) | O_NONBLOCK);
+        fcntl(clientFd, F_SETFD, FD_CLOEXEC);
+        if (pollerWatch(exporter->poller, clientFd, EPOLLIN, clientReady, exporter) != 0) {
+            log_output(LOG_ERR, "Could not watch metrics connection. %s\n", strerror(errno));
+            close(clientFd);
+            continue;
+        }
+        client->fd = clientFd;
+        client->accepted = now;
+        client->received = 0;
+        client->length = 0;
+        client->sent = 0;
+    }
+}
+
+/**
+ * open the listening socket
+ *
+ * \return the socket, -1 on error
+ */
+static int openListener(char const *address)
+{
+    char host[256];
+    char const *port = address;
+    char const *separator = strrchr(address, ':');
+    struct addrinfo hints;
+    struct addrinfo *addresses;
+    struct addrinfo *current;
+    int fd = -1;
+    int ret;
+    host[0] = '\0';
+    if (separator != NULL) {
+        size_t length = separator - address;
+        if (address[0] == '[' && length >= 2 && address[length-1] == ']') {
+            // [::1]:9100
+            ++address;
+            length -= 2;
+        }
+        if (length >= sizeof(host)) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(host, address, length);
+        host[length] = '\0';
+        port = separator + 1;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    ret = getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &addresses);
+    if (ret != 0) {
+        log_output(LOG_ERR, "Could not resolve %s. %s\n", address, gai_strerror(ret));
+        errno = EINVAL;
+        return -1;
+    }
+    for (current = addresses; current != NULL; current = current->ai_next) {
+        int reuse = 1;
+        fd = socket(current->ai_family, current->ai_socktype, current->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(fd, current->ai_addr, current->ai_addrlen) == 0 && listen(fd, EXPORTER_BACKLOG) == 0) {
+            break;
+        }
+        ret = errno;
+        close(fd);
+        errno = ret;
+        fd = -1;
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+struct Exporter *initExporter(char const *address, struct DevicePoller *poller,
+                              struct USBConnection **connections, unsigned int count, struct SampleRing *ring)
+{
+    struct Exporter *exporter;
+    unsigned int i;
+    exporter = malloc(sizeof(struct Exporter));
+    if (exporter == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return NULL;
+    }
+    memset(exporter, 0, sizeof(struct Exporter));
+    exporter->poller = poller;
+    exporter->connections = connections;
+    exporter->count = count;
+    exporter->ring = ring;
+    for (i = 0; i < EXPORTER_MAX_CLIENTS; ++i) {
+        exporter->clients[i].fd = -1;
+    }
+    exporter->fd = -1;
+    exporter->samples = malloc(count * MAX_CONTROLLERS * sizeof(struct Sample));
+    exporter->present = calloc(count * MAX_CONTROLLERS, 1);
+    exporter->bodyCapacity = 4096;
+    exporter->body = malloc(exporter->bodyCapacity);
+    if (exporter->samples == NULL || exporter->present == NULL || exporter->body == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        cleanupExporter(exporter);
+        return NULL;
+    }
+    exporter->fd = openListener(address);
+    if (exporter->fd < 0) {
+        log_output(LOG_ERR, "Could not listen at %s. %s\n", address, strerror(errno));
+        cleanupExporter(exporter);
+        return NULL;
+    }
+    if (pollerWatch(poller, exporter->fd, EPOLLIN, listenReady, exporter) != 0) {
+        log_output(LOG_ERR, "Could not watch metrics socket. %s\n", strerror(errno));
+        close(exporter->fd);
+        exporter->fd = -1;
+        cleanupExporter(exporter);
+        return NULL;
+    }
+    log_output(LOG_INFO, "Serving metrics at %s\n", address);
+    return exporter;
+}
+
+void updateExporter(struct Exporter *exporter, struct Sample const *sample)
+{
+    unsigned int slot;
+    if (exporter == NULL || sample->deviceID < 1 || sample->deviceID > exporter->count
+        || sample->controllerID < 1 || sample->controllerID > MAX_CONTROLLERS) {
+        return;
+    }
+    slot = (sample->deviceID-1) * MAX_CONTROLLERS + sample->controllerID-1;
+    memcpy(&(exporter->samples[slot]), sample, sizeof(struct Sample));
+    exporter->present[slot] = 1;
+    ++exporter->updates;
+}
+
+void cleanupExporter(struct Exporter *exporter)
+{
+    unsigned int i;
+    if (exporter != NULL) {
+        for (i = 0; i < EXPORTER_MAX_CLIENTS; ++i) {
+            if (exporter->clients[i].fd >= 0) {
+                closeClient(exporter, &(exporter->clients[i]));
+            }
+            free(exporter->clients[i].response);
+        }
+        if (exporter->fd >= 0) {
+            pollerUnwatch(exporter->poller, exporter->fd);
+            close(exporter->fd);
+            log_output(LOG_INFO, "Metrics statistics: %lu scrapes, page rendered %lu times, %lu idle connections closed\n",
+                       exporter->scrapes, exporter->renders, exporter->evicted);
+        }
+        free(exporter->samples);
+        free(exporter->present);
+        free(exporter->body);
+        free(exporter->page);
+        free(exporter);
+    }
+}
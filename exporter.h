@@ -0,0 +1,113 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef EXPORTER_H
+#define EXPORTER_H
+
+#include <stddef.h>
+
+#include "datatypes.h"
+#include "poller.h"
+#include "ringbuffer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define EXPORTER_MAX_CLIENTS   8
+#define EXPORTER_REQUEST_SIZE  2048
+#define EXPORTER_IDLE_TIMEOUT  10000    /* ms a connection may take before a new one may replace it */
+
+/**
+ * a connection to the exporter
+ */
+struct ExporterClient
+{
+    int fd;                                 /* -1 for a free entry */
+    long long accepted;                     /* monotonic time the connection was accepted in ns */
+    char request[EXPORTER_REQUEST_SIZE];
+    size_t received;
+    char *response;                         /* copy of the page taken when the request was complete */
+    size_t length;
+    size_t sent;
+    size_t capacity;
+};
+
+/**
+ * serves the latest sample of every controller and the health counters of
+ * the reader in the Prometheus text format over HTTP.
+ *
+ * The exporter runs in the epoll loop of the device poller, so it does not
+ * need a thread or any locking. The response is kept pre-rendered and is
+ * only rendered again on a scrape after a new sample arrived or a counter
+ * changed, so a scrape usually costs a memcpy and a write.
+ */
+struct Exporter
+{
+    int fd;                                 /* the listening socket */
+    struct DevicePoller *poller;
+    struct USBConnection **connections;
+    unsigned int count;
+    struct SampleRing *ring;                /* reports the dropped samples, may be NULL */
+    struct Sample *samples;                 /* latest sample of every controller */
+    unsigned char *present;
+    unsigned long updates;                  /* number of samples received */
+    unsigned long generation;               /* change count the page was rendered at */
+    char *body;
+    size_t bodyLength;
+    size_t bodyCapacity;
+    char *page;                             /* the complete HTTP response */
+    size_t pageLength;
+    size_t pageCapacity;
+    struct ExporterClient clients[EXPORTER_MAX_CLIENTS];
+    unsigned long scrapes;
+    unsigned long renders;
+    unsigned long evicted;                  /* connections closed to make room for a new one */
+};
+
+/**
+ * start listening and serve the connections from the poller
+ *
+ * \param address the address to listen at, [<host>:]<port>. Without a host all interfaces are used.
+ * \param poller the poller whose epoll loop serves the connections
+ * \param connections the devices whose counters are exported
+ * \param count the number of devices
+ * \param ring the sample queue whose dropped samples are exported, may be NULL
+ * \return a pointer to the exporter on success, NULL else. errno will be set accordingly
+ */
+struct Exporter *initExporter(char const *address, struct DevicePoller *poller,
+                              struct USBConnection **connections, unsigned int count, struct SampleRing *ring);
+
+/**
+ * remember a new sample. Must be called from the thread running the poller.
+ * An exporter of NULL is ignored.
+ */
+void updateExporter(struct Exporter *exporter, struct Sample const *sample);
+
+/**
+ * close all connections and free the exporter
+ */
+void cleanupExporter(struct Exporter *exporter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EXPORTER_H */
@@ -0,0 +1,561 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#include "history.h"
+#include "logging.h"
+
+static void putNumber(unsigned char *buffer, unsigned long long value, int bytes)
+{
+    int i;
+    for (i = 0; i < bytes; ++i) {
+        buffer[i] = (value >> (8*i)) & 0xFF;
+    }
+}
+
+static unsigned long long getNumber(unsigned char const *buffer, int bytes)
+{
+    unsigned long long value = 0;
+    int i;
+    for (i = bytes-1; i >= 0; --i) {
+        value = (value << 8) | buffer[i];
+    }
+    return value;
+}
+
+static long long getSigned(unsigned char const *buffer, int bytes)
+{
+    unsigned long long value = getNumber(buffer, bytes);
+    if (value & (1ULL << (8*bytes - 1))) {
+        return (long long)value - (1LL << (8*bytes));
+    }
+    return (long long)value;
+}
+
+static unsigned long long zigzag(long long value)
+{
+    return ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63);
+}
+
+static long long unzigzag(unsigned long long value)
+{
+    return (long long)(value >> 1) ^ -(long long)(value & 1);
+}
+
+/**
+ * bit stream writing, most significant bit first
+ */
+static void putByte(struct BitWriter *writer, unsigned char byte)
+{
+    if (writer->length == writer->capacity) {
+        size_t capacity = writer->capacity == 0 ? 4096 : writer->capacity * 2;
+        unsigned char *grown = realloc(writer->buffer, capacity);
+        if (grown == NULL) {
+            writer->failed = 1;
+            return;
+        }
+        writer->buffer = grown;
+        writer->capacity = capacity;
+    }
+    writer->buffer[writer->length++] = byte;
+}
+
+static void putBits(struct BitWriter *writer, unsigned long long value, int count)
+{
+    while (count > 0) {
+        int chunk = count > 32 ? 32 : count;
+        count -= chunk;
+        writer->bits = (writer->bits << chunk) | ((value >> count) & ((1ULL << chunk) - 1));
+        writer->count += chunk;
+        while (writer->count >= 8) {
+            writer->count -= 8;
+            putByte(writer, (writer->bits >> writer->count) & 0xFF);
+        }
+    }
+}
+
+/**
+ * Elias gamma code of a value >= 1
+ */
+static void putGamma(struct BitWriter *writer, unsigned long long value)
+{
+    int width = 63 - __builtin_clzll(value);
+    putBits(writer, 0, width);
+    putBits(writer, value, width + 1);
+}
+
+static void finishBits(struct BitWriter *writer)
+{
+    if (writer->count > 0) {
+        putByte(writer, (writer->bits << (8 - writer->count)) & 0xFF);
+        writer->count = 0;
+    }
+}
+
+/**
+ * bit stream reading
+ */
+struct BitReader
+{
+    unsigned char const *data;
+    size_t bits;
+    size_t position;
+    int failed;     /* read beyond the end */
+};
+
+/**
+ * the next 64 bits of the stream, at least 57 of them valid. Bits beyond
+ * the end of the data are 0.
+ */
+static unsigned long long peekBits(struct BitReader const *reader)
+{
+    size_t byte = reader->position >> 3;
+    size_t end = (reader->bits >> 3) - byte;
+    unsigned long long window = 0;
+    size_t i;
+    for (i = 0; i < 8; ++i) {
+        window = (window << 8) | (i < end ? reader->data[byte + i] : 0);
+    }
+    return window << (reader->position & 7);
+}
+
+static unsigned long long getBits(struct BitReader *reader, int count)
+{
+    unsigned long long value;
+    if (count > 32) {
+        value = getBits(reader, count - 32) << 32;
+        return value | getBits(reader, 32);
+    }
+    if (reader->position + count > reader->bits) {
+        reader->failed = 1;
+        return 0;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    value = peekBits(reader) >> (64 - count);
+    reader->position += count;
+    return value;
+}
+
+static unsigned long long getGamma(struct BitReader *reader)
+{
+    unsigned long long window = peekBits(reader);
+    int width;
+    if (window == 0 || (width = __builtin_clzll(window)) > 28) {
+        // long codes only occur for large deltas, count the zeros slowly
+        width = 0;
+        while (reader->position < reader->bits
+               && !(reader->data[reader->position >> 3] & (0x80 >> (reader->position & 7)))) {
+            ++reader->position;
+            ++width;
+        }
+        if (width > 63) {
+            reader->failed = 1;
+            return 1;
+        }
+        return getBits(reader, width + 1);
+    }
+    if (reader->position + 2*width + 1 > reader->bits) {
+        reader->failed = 1;
+        return 1;
+    }
+    reader->position += 2*width + 1;
+    return window >> (63 - 2*width);
+}
+
+/**
+ * code an integer column: the first value, then for every change the
+ * number of unchanged values before it and the delta
+ */
+static void encodeIntColumn(struct BitWriter *writer, long long const *values, unsigned int count)
+{
+    unsigned long zeros = 0;
+    unsigned int i;
+    putGamma(writer, zigzag(values[0]) + 1);
+    for (i = 1; i < count; ++i) {
+        long long delta = values[i] - values[i-1];
+        if (delta == 0) {
+            ++zeros;
+            continue;
+        }
+        putGamma(writer, zeros + 1);
+        putGamma(writer, zigzag(delta));
+        zeros = 0;
+    }
+    if (zeros > 0) {
+        putGamma(writer, zeros + 1);
+    }
+}
+
+static void decodeIntColumn(struct BitReader *reader, long long *values, unsigned int count)
+{
+    unsigned int i = 1;
+    values[0] = unzigzag(getGamma(reader) - 1);
+    while (i < count && !reader->failed) {
+        unsigned long long zeros = getGamma(reader) - 1;
+        if (zeros > count - i) {
+            reader->failed = 1;
+            return;
+        }
+        for (; zeros > 0; --zeros, ++i) {
+            values[i] = values[i-1];
+        }
+        if (i < count) {
+            values[i] = values[i-1] + unzigzag(getGamma(reader));
+            ++i;
+        }
+    }
+}
+
+/**
+ * code a bitmap column: the first value, then for every change the number
+ * of unchanged values before it and the changed bits
+ */
+static void encodeBitmapColumn(struct BitWriter *writer, unsigned long long const *values, unsigned int count, int width)
+{
+    unsigned long zeros = 0;
+    unsigned int i;
+    putBits(writer, values[0], width);
+    for (i = 1; i < count; ++i) {
+        unsigned long long changed = values[i] ^ values[i-1];
+        if (changed == 0) {
+            ++zeros;
+            continue;
+        }
+        putGamma(writer, zeros + 1);
+        putBits(writer, changed, width);
+        zeros = 0;
+    }
+    if (zeros > 0) {
+        putGamma(writer, zeros + 1);
+    }
+}
+
+static void decodeBitmapColumn(struct BitReader *reader, unsigned long long *values, unsigned int count, int width)
+{
+    unsigned int i = 1;
+    values[0] = getBits(reader, width);
+    while (i < count && !reader->failed) {
+        unsigned long long zeros = getGamma(reader) - 1;
+        if (zeros > count - i) {
+            reader->failed = 1;
+            return;
+        }
+        for (; zeros > 0; --zeros, ++i) {
+            values[i] = values[i-1];
+        }
+        if (i < count) {
+            values[i] = values[i-1] ^ getBits(reader, width);
+            ++i;
+        }
+    }
+}
+
+/**
+ * write the pending records of a source as a block
+ */
+static int writeBlock(struct HistoryEncoder *encoder, struct HistorySource *source)
+{
+    long long deltas[HISTORY_BLOCK_SAMPLES];
+    unsigned char header[HISTORY_BLOCK_HEADER];
+    struct BitWriter *bits = &(encoder->bits);
+    unsigned int count = source->count;
+    unsigned int i;
+    size_t offset;
+    if (count == 0) {
+        return 0;
+    }
+    bits->length = 0;
+    bits->count = 0;
+    bits->failed = 0;
+    putBits(bits, (unsigned long long)source->time[0], 64);
+    for (i = 1; i < count; ++i) {
+        deltas[i-1] = source->time[i] - source->time[i-1];
+    }
+    if (count > 1) {
+        encodeIntColumn(bits, deltas, count-1);
+    }
+    encodeBitmapColumn(bits, source->types, count, 64);
+    encodeBitmapColumn(bits, source->outputs, count, UVR1611_OUTPUTS);
+    encodeBitmapColumn(bits, source->heatMask, count, UVR1611_HEAT_REGISTERS);
+    for (i = 0; i < UVR1611_INPUTS; ++i) {
+        encodeIntColumn(bits, source->inputs[i], count);
+    }
+    for (i = 0; i < UVR1611_ROTATIONS; ++i) {
+        encodeIntColumn(bits, source->rotations[i], count);
+    }
+    for (i = 0; i < UVR1611_HEAT_REGISTERS; ++i) {
+        encodeIntColumn(bits, source->power[i], count);
+        encodeIntColumn(bits, source->energy[i], count);
+    }
+    finishBits(bits);
+    if (bits->failed) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(header, HISTORY_BLOCK_MAGIC, 4);
+    putNumber(header + 4, bits->length, 4);
+    putNumber(header + 8, count, 4);
+    header[12] = source->device;
+    header[13] = source->controller;
+    header[14] = 0;
+    header[15] = 0;
+    putNumber(header + 16, (unsigned long long)source->time[0], 8);
+    putNumber(header + 24, (unsigned long long)source->time[count-1], 8);
+    for (offset = 0; offset < HISTORY_BLOCK_HEADER + bits->length; ) {
+        ssize_t ret;
+        if (offset < HISTORY_BLOCK_HEADER) {
+            ret = write(encoder->fd, header + offset, HISTORY_BLOCK_HEADER - offset);
+        }
+        else {
+            ret = write(encoder->fd, bits->buffer + offset - HISTORY_BLOCK_HEADER, bits->length + HISTORY_BLOCK_HEADER - offset);
+        }
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        offset += ret;
+    }
+    encoder->bytes += offset;
+    ++encoder->blocks;
+    source->count = 0;
+    return 0;
+}
+
+struct HistoryEncoder *initHistoryEncoder(int fd)
+{
+    struct HistoryEncoder *encoder;
+    unsigned char header[HISTORY_HEADER_SIZE];
+    memcpy(header, HISTORY_MAGIC, 8);
+    putNumber(header + 8, HISTORY_VERSION, 4);
+    putNumber(header + 12, STORE_RECORD_SIZE, 4);
+    if (write(fd, header, sizeof(header)) != sizeof(header)) {
+        return NULL;
+    }
+    encoder = malloc(sizeof(struct HistoryEncoder));
+    if (encoder == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return NULL;
+    }
+    memset(encoder, 0, sizeof(struct HistoryEncoder));
+    encoder->fd = fd;
+    encoder->bytes = sizeof(header);
+    return encoder;
+}
+
+/**
+ * get the pending records of a controller, a new source is created on first use
+ */
+static struct HistorySource *findSource(struct HistoryEncoder *encoder, unsigned int device, unsigned int controller)
+{
+    struct HistorySource **grown;
+    struct HistorySource *source;
+    unsigned int i;
+    for (i = 0; i < encoder->sourceCount; ++i) {
+        if (encoder->sources[i]->device == device && encoder->sources[i]->controller == controller) {
+            return encoder->sources[i];
+        }
+    }
+    grown = realloc(encoder->sources, (encoder->sourceCount+1) * sizeof(struct HistorySource *));
+    if (grown == NULL) {
+        return NULL;
+    }
+    encoder->sources = grown;
+    source = malloc(sizeof(struct HistorySource));
+    if (source == NULL) {
+        return NULL;
+    }
+    source->device = device;
+    source->controller = controller;
+    source->count = 0;
+    encoder->sources[encoder->sourceCount++] = source;
+    return source;
+}
+
+int historyAppend(struct HistoryEncoder *encoder, unsigned char const *record)
+{
+    struct HistorySource *source = findSource(encoder, record[8], record[9]);
+    unsigned int n;
+    unsigned int i;
+    if (source == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return -1;
+    }
+    n = source->count;
+    source->time[n] = (long long)getNumber(record, 8);
+    source->types[n] = getNumber(record + 10, 8);
+    source->outputs[n] = getNumber(record + 18, 2);
+    source->heatMask[n] = record[56];
+    for (i = 0; i < UVR1611_INPUTS; ++i) {
+        source->inputs[i][n] = getSigned(record + 20 + 2*i, 2);
+    }
+    for (i = 0; i < UVR1611_ROTATIONS; ++i) {
+        source->rotations[i][n] = record[52 + i];
+    }
+    for (i = 0; i < UVR1611_HEAT_REGISTERS; ++i) {
+        source->power[i][n] = getSigned(record + 60 + 4*i, 4);
+        source->energy[i][n] = getSigned(record + 68 + 4*i, 4);
+    }
+    ++source->count;
+    ++encoder->samples;
+    if (source->count == HISTORY_BLOCK_SAMPLES || source->time[n] - source->time[0] >= HISTORY_FLUSH_INTERVAL) {
+        return writeBlock(encoder, source);
+    }
+    return 0;
+}
+
+int flushHistoryEncoder(struct HistoryEncoder *encoder)
+{
+    unsigned int i;
+    int ret = 0;
+    for (i = 0; i < encoder->sourceCount; ++i) {
+        if (writeBlock(encoder, encoder->sources[i]) != 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+void cleanupHistoryEncoder(struct HistoryEncoder *encoder)
+{
+    unsigned int i;
+    if (encoder != NULL) {
+        if (flushHistoryEncoder(encoder) != 0) {
+            log_output(LOG_ERR, "Could not write history blocks. %s\n", strerror(errno));
+        }
+        for (i = 0; i < encoder->sourceCount; ++i) {
+            free(encoder->sources[i]);
+        }
+        free(encoder->sources);
+        free(encoder->bits.buffer);
+        free(encoder);
+    }
+}
+
+int openHistoryReader(struct HistoryReader *reader, unsigned char const *data, size_t size)
+{
+    if (size < HISTORY_HEADER_SIZE || memcmp(data, HISTORY_MAGIC, 8) != 0
+        || getNumber(data + 8, 4) != HISTORY_VERSION || getNumber(data + 12, 4) != STORE_RECORD_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    reader->data = data;
+    reader->size = size;
+    reader->offset = HISTORY_HEADER_SIZE;
+    return 0;
+}
+
+int nextHistoryBlock(struct HistoryReader *reader, struct HistoryBlock *block)
+{
+    unsigned char const *header = reader->data + reader->offset;
+    if (reader->offset + HISTORY_BLOCK_HEADER > reader->size || memcmp(header, HISTORY_BLOCK_MAGIC, 4) != 0) {
+        return 0;
+    }
+    block->length = getNumber(header + 4, 4);
+    block->count = getNumber(header + 8, 4);
+    if (reader->offset + HISTORY_BLOCK_HEADER + block->length > reader->size
+        || block->count == 0 || block->count > HISTORY_BLOCK_SAMPLES) {
+        // a block cut off by a crash ends the file
+        return 0;
+    }
+    block->device = header[12];
+    block->controller = header[13];
+    block->first = (long long)getNumber(header + 16, 8);
+    block->last = (long long)getNumber(header + 24, 8);
+    block->payload = header + HISTORY_BLOCK_HEADER;
+    reader->offset += HISTORY_BLOCK_HEADER + block->length;
+    return 1;
+}
+
+int decodeHistoryBlock(struct HistoryBlock const *block, unsigned char *records)
+{
+    long long values[HISTORY_BLOCK_SAMPLES];
+    unsigned long long bitmap[HISTORY_BLOCK_SAMPLES];
+    struct BitReader reader;
+    unsigned int count = block->count;
+    unsigned int i;
+    unsigned int n;
+    reader.data = block->payload;
+    reader.bits = block->length * 8;
+    reader.position = 0;
+    reader.failed = 0;
+    memset(records, 0, count * STORE_RECORD_SIZE);
+    values[0] = (long long)getBits(&reader, 64);
+    if (count > 1) {
+        decodeIntColumn(&reader, values + 1, count - 1);
+        for (n = 1; n < count; ++n) {
+            values[n] += values[n-1];
+        }
+    }
+    for (n = 0; n < count; ++n) {
+        unsigned char *record = records + n * STORE_RECORD_SIZE;
+        putNumber(record, (unsigned long long)values[n], 8);
+        record[8] = block->device;
+        record[9] = block->controller;
+    }
+    decodeBitmapColumn(&reader, bitmap, count, 64);
+    for (n = 0; n < count; ++n) {
+        putNumber(records + n * STORE_RECORD_SIZE + 10, bitmap[n], 8);
+    }
+    decodeBitmapColumn(&reader, bitmap, count, UVR1611_OUTPUTS);
+    for (n = 0; n < count; ++n) {
+        putNumber(records + n * STORE_RECORD_SIZE + 18, bitmap[n], 2);
+    }
+    decodeBitmapColumn(&reader, bitmap, count, UVR1611_HEAT_REGISTERS);
+    for (n = 0; n < count; ++n) {
+        records[n * STORE_RECORD_SIZE + 56] = bitmap[n];
+    }
+    for (i = 0; i < UVR1611_INPUTS; ++i) {
+        decodeIntColumn(&reader, values, count);
+        for (n = 0; n < count; ++n) {
+            putNumber(records + n * STORE_RECORD_SIZE + 20 + 2*i, (unsigned long long)values[n], 2);
+        }
+    }
+    for (i = 0; i < UVR1611_ROTATIONS; ++i) {
+        decodeIntColumn(&reader, values, count);
+        for (n = 0; n < count; ++n) {
+            records[n * STORE_RECORD_SIZE + 52 + i] = values[n];
+        }
+    }
+    for (i = 0; i < UVR1611_HEAT_REGISTERS; ++i) {
+        decodeIntColumn(&reader, values, count);
+        for (n = 0; n < count; ++n) {
+            putNumber(records + n * STORE_RECORD_SIZE + 60 + 4*i, (unsigned long long)values[n], 4);
+        }
+        decodeIntColumn(&reader, values, count);
+        for (n = 0; n < count; ++n) {
+            putNumber(records + n * STORE_RECORD_SIZE + 68 + 4*i, (unsigned long long)values[n], 4);
+        }
+    }
+    if (reader.failed) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,188 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+
+#include "datatypes.h"
+#include "store.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The compressed history stores the records of the sample store (see
+ * store.h) column by column in blocks of up to HISTORY_BLOCK_SAMPLES
+ * records of one controller.
+ *
+ * A history file starts with "DLOGGHST", the version and the record size
+ * (4 bytes each) and continues with the blocks. A block has a header of
+ * "HBLK", the payload length and the number of records (4 bytes each),
+ * device and controller (1 byte each), 2 reserved bytes and the times of
+ * the first and the last record (8 bytes each). The headers serve as the
+ * time index: blocks outside of a query are skipped without decoding.
+ * All numbers in the headers are little endian.
+ *
+ * The payload is a bit stream with one column after the other:
+ *   - time: the first time, then the deltas coded like an integer column,
+ *     so a steady sampling interval costs almost nothing (delta of delta)
+ *   - sensor types, outputs and present heat registers: bitmaps coded as
+ *     runs of unchanged values followed by the XOR of the change
+ *   - inputs, speed steps, heat power and energy: the fixed point values
+ *     coded as runs of zero deltas followed by the zig-zag coded delta
+ * Run lengths and deltas use Elias gamma codes, so a run of unchanged
+ * values costs a few bits no matter how long it is.
+ */
+#define HISTORY_MAGIC          "DLOGGHST"
+#define HISTORY_BLOCK_MAGIC    "HBLK"
+#define HISTORY_VERSION        1
+#define HISTORY_HEADER_SIZE    16
+#define HISTORY_BLOCK_HEADER   32
+#define HISTORY_BLOCK_SAMPLES  1024
+#define HISTORY_FLUSH_INTERVAL 600000   /* ms of records a block covers at most */
+
+/**
+ * the pending records of one controller, column by column
+ */
+struct HistorySource
+{
+    unsigned int device;
+    unsigned int controller;
+    unsigned int count;
+    long long time[HISTORY_BLOCK_SAMPLES];
+    unsigned long long types[HISTORY_BLOCK_SAMPLES];
+    unsigned long long outputs[HISTORY_BLOCK_SAMPLES];
+    unsigned long long heatMask[HISTORY_BLOCK_SAMPLES];
+    long long inputs[UVR1611_INPUTS][HISTORY_BLOCK_SAMPLES];
+    long long rotations[UVR1611_ROTATIONS][HISTORY_BLOCK_SAMPLES];
+    long long power[UVR1611_HEAT_REGISTERS][HISTORY_BLOCK_SAMPLES];
+    long long energy[UVR1611_HEAT_REGISTERS][HISTORY_BLOCK_SAMPLES];
+};
+
+/**
+ * a bit stream being written
+ */
+struct BitWriter
+{
+    unsigned char *buffer;
+    size_t length;
+    size_t capacity;
+    unsigned long long bits;    /* bits not yet written to the buffer */
+    int count;                  /* number of those bits */
+    int failed;                 /* out of memory */
+};
+
+/**
+ * writes records to a history file. The records are collected per
+ * controller, a block is written whenever one is complete or covers
+ * HISTORY_FLUSH_INTERVAL, so a crash loses at most that much.
+ */
+struct HistoryEncoder
+{
+    int fd;
+    struct HistorySource **sources;
+    unsigned int sourceCount;
+    struct BitWriter bits;
+    unsigned long samples;
+    unsigned long blocks;
+    unsigned long long bytes;   /* written to the file */
+};
+
+/**
+ * a block found in a history file
+ */
+struct HistoryBlock
+{
+    unsigned int device;
+    unsigned int controller;
+    unsigned int count;
+    long long first;            /* ms since the epoch */
+    long long last;
+    unsigned char const *payload;
+    size_t length;
+};
+
+/**
+ * walks the blocks of a history file in memory, e.g. mapped with mmap()
+ */
+struct HistoryReader
+{
+    unsigned char const *data;
+    size_t size;
+    size_t offset;
+};
+
+/**
+ * start a history file: the header is written right away
+ *
+ * \param fd the file to write to, it is not closed by the encoder
+ * \return a pointer to the encoder on success, NULL else. errno will be set accordingly
+ */
+struct HistoryEncoder *initHistoryEncoder(int fd);
+
+/**
+ * add a record of STORE_RECORD_SIZE bytes
+ *
+ * \return 0 on success, -1 if a block could not be written
+ */
+int historyAppend(struct HistoryEncoder *encoder, unsigned char const *record);
+
+/**
+ * write the pending records of all controllers as blocks
+ *
+ * \return 0 on success, -1 else
+ */
+int flushHistoryEncoder(struct HistoryEncoder *encoder);
+
+/**
+ * flush and free the encoder
+ */
+void cleanupHistoryEncoder(struct HistoryEncoder *encoder);
+
+/**
+ * start reading a history file
+ *
+ * \return 0 on success, -1 if the data is not a history file
+ */
+int openHistoryReader(struct HistoryReader *reader, unsigned char const *data, size_t size);
+
+/**
+ * get the next block
+ *
+ * \return 1 if a block was found, 0 at the end of the file or of its complete blocks
+ */
+int nextHistoryBlock(struct HistoryReader *reader, struct HistoryBlock *block);
+
+/**
+ * decode the records of a block
+ *
+ * \param records receives block->count records of STORE_RECORD_SIZE bytes
+ * \return 0 on success, -1 if the block is corrupt
+ */
+int decodeHistoryBlock(struct HistoryBlock const *block, unsigned char *records);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HISTORY_H */
@@ -0,0 +1,141 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <time.h>
+
+#include "latency.h"
+#include "logging.h"
+
+struct LatencyHistogram stageHistograms[STAGE_COUNT];
+
+static char const * const stageNames[STAGE_COUNT] = {
+    "send",
+    "roundtrip",
+    "read",
+    "parse",
+    "delivery",
+    "end_to_end"
+};
+
+long long stageClock()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((long long)now.tv_sec) * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * get the bucket of a duration: the position of the highest bit selects the
+ * power of two, the bits below it the sub-bucket
+ */
+static unsigned int bucketOf(unsigned long long duration)
+{
+    unsigned int msb;
+    if (duration < HISTOGRAM_SUB_BUCKETS) {
+        return (unsigned int)duration;
+    }
+    msb = 63 - __builtin_clzll(duration);
+    return msb * HISTOGRAM_SUB_BUCKETS + (unsigned int)((duration >> (msb - 2)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/**
+ * get the largest duration falling into a bucket
+ */
+static long long bucketLimit(unsigned int bucket)
+{
+    unsigned int msb = bucket / HISTOGRAM_SUB_BUCKETS;
+    unsigned long long sub = bucket % HISTOGRAM_SUB_BUCKETS;
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    return (long long)(((HISTOGRAM_SUB_BUCKETS + sub + 1) << (msb - 2)) - 1);
+}
+
+void recordStage(int stage, long long duration)
+{
+    struct LatencyHistogram *histogram = &(stageHistograms[stage]);
+    long long max;
+    if (duration < 0) {
+        duration = 0;
+    }
+    __atomic_add_fetch(&(histogram->buckets[bucketOf(duration)]), 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(histogram->count), 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(histogram->sum), duration, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&(histogram->max), __ATOMIC_RELAXED);
+    while (duration > max &&
+           !__atomic_compare_exchange_n(&(histogram->max), &max, duration, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void recordStageSince(int stage, long long start)
+{
+    recordStage(stage, stageClock() - start);
+}
+
+long long histogramPercentile(struct LatencyHistogram const *histogram, double percentile)
+{
+    unsigned long count = __atomic_load_n(&(histogram->count), __ATOMIC_RELAXED);
+    unsigned long rank;
+    unsigned long seen = 0;
+    unsigned int i;
+    if (count == 0) {
+        return 0;
+    }
+    rank = (unsigned long)(count * percentile / 100.0);
+    if (rank >= count) {
+        rank = count - 1;
+    }
+    for (i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += __atomic_load_n(&(histogram->buckets[i]), __ATOMIC_RELAXED);
+        if (seen > rank) {
+            long long limit = bucketLimit(i);
+            long long max = __atomic_load_n(&(histogram->max), __ATOMIC_RELAXED);
+            return limit < max ? limit : max;
+        }
+    }
+    return __atomic_load_n(&(histogram->max), __ATOMIC_RELAXED);
+}
+
+int formatStageStatistics(char *buffer, size_t size, int stage)
+{
+    struct LatencyHistogram const *histogram = &(stageHistograms[stage]);
+    unsigned long count = __atomic_load_n(&(histogram->count), __ATOMIC_RELAXED);
+    long long sum = __atomic_load_n(&(histogram->sum), __ATOMIC_RELAXED);
+    return snprintf(buffer, size, "stage=%s count=%lu p50_us=%.1f p99_us=%.1f max_us=%.1f avg_us=%.1f",
+                    stageNames[stage], count,
+                    histogramPercentile(histogram, 50) / 1000.0,
+                    histogramPercentile(histogram, 99) / 1000.0,
+                    __atomic_load_n(&(histogram->max), __ATOMIC_RELAXED) / 1000.0,
+                    count > 0 ? sum / (double)count / 1000.0 : 0.0);
+}
+
+void logStageStatistics()
+{
+    char line[256];
+    int stage;
+    for (stage = 0; stage < STAGE_COUNT; ++stage) {
+        if (__atomic_load_n(&(stageHistograms[stage].count), __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        formatStageStatistics(line, sizeof(line), stage);
+        log_output(LOG_INFO, "%s\n", line);
+    }
+}
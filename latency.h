@@ -0,0 +1,108 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * the instrumented stages of a sample
+ */
+#define STAGE_SEND        0  /* writing a command to the device */
+#define STAGE_ROUNDTRIP   1  /* request sent to complete frame received */
+#define STAGE_READ        2  /* a blocking readBuffer() */
+#define STAGE_PARSE       3  /* decoding the values of one controller */
+#define STAGE_DELIVERY    4  /* handing a sample to the sink, e.g. running the -s program */
+#define STAGE_END_TO_END  5  /* frame received to sample delivered */
+#define STAGE_COUNT       6
+
+/**
+ * every power of two is split into this many buckets, so a percentile is
+ * off by at most 1/HISTOGRAM_SUB_BUCKETS
+ */
+#define HISTOGRAM_SUB_BUCKETS 4
+#define HISTOGRAM_BUCKETS     (64 * HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * a histogram of durations with fixed, logarithmically growing buckets.
+ * Recording is a handful of relaxed atomic additions, so any thread may
+ * record while another one reads.
+ */
+struct LatencyHistogram
+{
+    unsigned long buckets[HISTOGRAM_BUCKETS];
+    unsigned long count;
+    long long sum;  /* ns */
+    long long max;  /* ns */
+};
+
+/**
+ * the histograms of all stages, indexed by STAGE_*
+ */
+extern struct LatencyHistogram stageHistograms[STAGE_COUNT];
+
+/**
+ * the current time of the monotonic clock in ns, for timing a stage
+ */
+long long stageClock();
+
+/**
+ * record the duration of a stage
+ *
+ * \param stage one of STAGE_*
+ * \param duration the duration in ns
+ */
+void recordStage(int stage, long long duration);
+
+/**
+ * record the duration of a stage which started at the given stageClock() time
+ */
+void recordStageSince(int stage, long long start);
+
+/**
+ * estimate a percentile of the histogram
+ *
+ * \param percentile between 0 and 100
+ * \return the upper bound of the bucket holding the percentile in ns, 0 if the histogram is empty
+ */
+long long histogramPercentile(struct LatencyHistogram const *histogram, double percentile);
+
+/**
+ * format one line "stage=<name> count=... p50_us=... p99_us=... max_us=... avg_us=..."
+ *
+ * \return the length of the line without the terminating 0
+ */
+int formatStageStatistics(char *buffer, size_t size, int stage);
+
+/**
+ * log the statistics of all stages which were recorded at least once
+ */
+void logStageStatistics();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LATENCY_H */
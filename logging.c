@@ -1,13 +1,41 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include "logging.h"
 
 int isDaemon;
-int debug = 0;
+int log_debug = 0;
+
+/**
+ * a message in the ring of the asynchronous mode. The sequence tells who
+ * owns the slot: it equals the position of the next message to be written
+ * into it while the slot is free and position+1 once the message is there.
+ */
+struct LogSlot
+{
+    unsigned long sequence;
+    int priority;
+    char text[LOG_MESSAGE_SIZE];
+};
+
+static struct LogSlot *slots = NULL;
+static unsigned long capacity = 0;
+static unsigned long head = 0;     /* next position to be claimed by a writer */
+static unsigned long tail = 0;     /* next position to be drained */
+static unsigned long dropped = 0;
+static int async = 0;
+static int stopping = 0;
+static sem_t pending;
+static pthread_t drainer;
 
 void enable_debug()
 {
-    debug = 1;
+    log_debug = 1;
 }
 
 void initlog(int daemon)
@@ -18,24 +46,154 @@ void initlog(int daemon)
     }
 }
 
-void log_output ( int priority, char* format, ... )
+static void writeMessage(int priority, char const *text)
+{
+    if (isDaemon) {
+        syslog(priority, "%s", text);
+    }
+    else {
+        fputs(text, stderr);
+    }
+}
+
+/**
+ * format a message into the next free slot of the ring
+ */
+static void queueMessage(int priority, char const *format, va_list ap)
+{
+    unsigned long position = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    struct LogSlot *slot;
+    for (;;) {
+        long difference;
+        slot = &(slots[position % capacity]);
+        difference = (long)(__atomic_load_n(&(slot->sequence), __ATOMIC_ACQUIRE) - position);
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&head, &position, position+1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (difference < 0) {
+            // the drain thread did not free the slot yet -> the ring is full
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else {
+            position = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->priority = priority;
+    vsnprintf(slot->text, LOG_MESSAGE_SIZE, format, ap);
+    __atomic_store_n(&(slot->sequence), position+1, __ATOMIC_RELEASE);
+    sem_post(&pending);
+}
+
+/**
+ * write all complete messages at the start of the ring
+ */
+static void drainMessages()
+{
+    for (;;) {
+        struct LogSlot *slot = &(slots[tail % capacity]);
+        if (__atomic_load_n(&(slot->sequence), __ATOMIC_ACQUIRE) != tail+1) {
+            return;
+        }
+        writeMessage(slot->priority, slot->text);
+        __atomic_store_n(&(slot->sequence), tail+capacity, __ATOMIC_RELEASE);
+        ++tail;
+    }
+}
+
+static void *drainThread(void *arg)
 {
-    if (!debug && priority == LOG_DEBUG) {
-        return; // switch of debugging output if not needed
+    sigset_t signals;
+    (void)arg;
+    // signals are handled by the other threads
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        while (sem_wait(&pending) != 0 && errno == EINTR) {
+        }
+        drainMessages();
+        if (!isDaemon) {
+            fflush(stderr);
+        }
     }
+    drainMessages();
+    return NULL;
+}
+
+int startAsyncLog(unsigned int messages)
+{
+    unsigned long i;
+    int error;
+    if (async || messages == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    slots = malloc(messages * sizeof(struct LogSlot));
+    if (slots == NULL) {
+        return -1;
+    }
+    capacity = messages;
+    head = 0;
+    tail = 0;
+    dropped = 0;
+    stopping = 0;
+    for (i = 0; i < capacity; ++i) {
+        slots[i].sequence = i;
+    }
+    sem_init(&pending, 0, 0);
+    error = pthread_create(&drainer, NULL, drainThread, NULL);
+    if (error != 0) {
+        sem_destroy(&pending);
+        free(slots);
+        slots = NULL;
+        errno = error;
+        return -1;
+    }
+    __atomic_store_n(&async, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void stopAsyncLog()
+{
+    char text[LOG_MESSAGE_SIZE];
+    if (!async) {
+        return;
+    }
+    // messages logged from now on are written directly, writers still in the ring are waited for
+    __atomic_store_n(&async, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    sem_post(&pending);
+    pthread_join(drainer, NULL);
+    sem_destroy(&pending);
+    free(slots);
+    slots = NULL;
+    if (dropped > 0) {
+        snprintf(text, sizeof(text), "%lu log messages were dropped because the log was too slow\n", dropped);
+        writeMessage(LOG_INFO, text);
+    }
+}
+
+void log_message(int priority, char const *format, ...)
+{
     va_list ap;
     va_start(ap, format);
-    if (isDaemon) {
+    if (__atomic_load_n(&async, __ATOMIC_ACQUIRE)) {
+        queueMessage(priority, format, ap);
+    }
+    else if (isDaemon) {
         vsyslog(priority, format, ap);
     }
     else {
         vfprintf(stderr, format, ap);
     }
-    va_end(ap);    
+    va_end(ap);
 }
 
 void endlog()
 {
+    stopAsyncLog();
     if (isDaemon) {
         closelog();
     }
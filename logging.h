@@ -22,12 +22,68 @@
 
 #include <syslog.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * the least important priority compiled into the program. log_output()
+ * statements of a lower priority (a higher value) are removed by the
+ * compiler, e.g. -DLOG_COMPILE_LEVEL=LOG_INFO drops all debug output.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+/**
+ * the size of a message in the asynchronous mode, longer messages are cut
+ */
+#define LOG_MESSAGE_SIZE 256
+
+extern int log_debug;
+
+/**
+ * check whether messages of the given priority are written at all
+ */
+#define log_enabled(priority) ((priority) <= LOG_COMPILE_LEVEL && ((priority) != LOG_DEBUG || log_debug))
+
+/**
+ * log a message with printf-like arguments. Disabled debug messages only
+ * cost a test of a global flag, the arguments are not evaluated.
+ */
+#define log_output(priority, ...) \
+    do { \
+        if (log_enabled(priority)) { \
+            log_message((priority), __VA_ARGS__); \
+        } \
+    } while (0)
+
 void initlog(int daemon);
 
-void log_output(int priority, char *format, ...);
+/**
+ * switch to the asynchronous mode: messages are formatted into a lock-free
+ * ring and written to syslog or stderr by a background thread. If the ring
+ * is full, messages are dropped instead of blocking the caller.
+ *
+ * \param capacity the number of messages the ring holds
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+int startAsyncLog(unsigned int capacity);
+
+/**
+ * write the queued messages and return to writing synchronously. The other
+ * threads must be done logging by then.
+ */
+void stopAsyncLog();
+
+void log_message(int priority, char const *format, ...);
 
 void enable_debug();
 
 void endlog();
 
-#endif // LOGGING_H
\ No newline at end of file
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LOGGING_H
@@ -0,0 +1,529 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#include "output.h"
+#include "logging.h"
+
+/**
+ * a record under construction. Appending past the end only sets overflow,
+ * so the formatters need no checks of their own.
+ */
+struct Record
+{
+    char *buffer;
+    size_t size;
+    size_t length;
+    int overflow;
+};
+
+static void appendBytes(struct Record *record, char const *bytes, size_t length)
+{
+    if (record->overflow || record->length + length >= record->size) {
+        record->overflow = 1;
+        return;
+    }
+    memcpy(record->buffer + record->length, bytes, length);
+    record->length += length;
+}
+
+static void appendString(struct Record *record, char const *string)
+{
+    appendBytes(record, string, strlen(string));
+}
+
+static void appendChar(struct Record *record, char c)
+{
+    appendBytes(record, &c, 1);
+}
+
+static void appendUnsigned(struct Record *record, unsigned long long value)
+{
+    char digits[24];
+    int i = sizeof(digits);
+    do {
+        digits[--i] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    appendBytes(record, digits+i, sizeof(digits)-i);
+}
+
+/**
+ * append a number with leading zeros up to the given width
+ */
+static void appendPadded(struct Record *record, unsigned long value, int width)
+{
+    char digits[24];
+    int i;
+    for (i = width - 1; i >= 0; --i) {
+        digits[i] = '0' + value % 10;
+        value /= 10;
+    }
+    appendBytes(record, digits, width);
+}
+
+static void appendInteger(struct Record *record, long long value)
+{
+    if (value < 0) {
+        appendChar(record, '-');
+        appendUnsigned(record, -(unsigned long long)value);
+    }
+    else {
+        appendUnsigned(record, value);
+    }
+}
+
+/**
+ * append a number with a fixed number of decimals (at most 3), rounded half away from zero
+ */
+static void appendFixed(struct Record *record, double value, int decimals)
+{
+    static long long const scales[] = { 1, 10, 100, 1000 };
+    long long scale = scales[decimals];
+    long long scaled;
+    unsigned long long magnitude;
+    unsigned long long fraction;
+    int i;
+    scaled = (long long)(value * scale + (value < 0 ? -0.5 : 0.5));
+    if (scaled < 0) {
+        appendChar(record, '-');
+        magnitude = -(unsigned long long)scaled;
+    }
+    else {
+        magnitude = scaled;
+    }
+    appendUnsigned(record, magnitude / scale);
+    if (decimals == 0) {
+        return;
+    }
+    appendChar(record, '.');
+    fraction = magnitude % scale;
+    for (i = decimals - 1; i >= 0; --i) {
+        appendChar(record, '0' + (fraction / scales[i]) % 10);
+    }
+}
+
+/**
+ * append a timestamp as seconds with milliseconds
+ */
+static void appendTimestamp(struct Record *record, struct timespec const *timestamp)
+{
+    appendInteger(record, timestamp->tv_sec);
+    appendChar(record, '.');
+    appendPadded(record, timestamp->tv_nsec / 1000000, 3);
+}
+
+static char const *typeName(int type)
+{
+    switch (type) {
+        case UNUSED:
+            return "UNUSED";
+        case DIGITAL:
+            return "DIGITAL";
+        case TEMPERATURE:
+            return "TEMPERATURE";
+        case FLOW:
+            return "FLOW";
+        case ROTATION:
+            return "ROTATION";
+        case HEAT:
+            return "HEAT";
+    }
+    return "UNKNOWN";
+}
+
+/**
+ * append the plain number of a value which is not a heat register
+ */
+static void appendNumber(struct Record *record, struct Value const *value)
+{
+    switch (value->valueType) {
+        case DIGITAL:
+            appendChar(record, value->value.enabled ? '1' : '0');
+            break;
+        case TEMPERATURE:
+            appendFixed(record, value->value.temperature, 1);
+            break;
+        case FLOW:
+            appendInteger(record, value->value.flow);
+            break;
+        case ROTATION:
+            appendInteger(record, value->value.rotation);
+            break;
+    }
+}
+
+static void appendJSONArray(struct Record *record, char const *name, struct Value const *values, unsigned int count, unsigned int changed)
+{
+    struct ValueIterator it;
+    struct Value *value;
+    int first = 1;
+    appendString(record, ",\"");
+    appendString(record, name);
+    appendString(record, "\":[");
+    initChangedValueIterator(&it, (struct Value *)values, count, changed);
+    while ((value = nextValue(&it)) != NULL) {
+        if (!first) {
+            appendChar(record, ',');
+        }
+        first = 0;
+        appendString(record, "{\"id\":");
+        appendUnsigned(record, value->valueID);
+        appendString(record, ",\"type\":\"");
+        appendString(record, typeName(value->valueType));
+        appendChar(record, '"');
+        if (value->valueType == HEAT) {
+            appendString(record, ",\"power\":");
+            appendFixed(record, value->value.heat.current, 2);
+            appendString(record, ",\"energy\":");
+            appendFixed(record, value->value.heat.total, 1);
+        }
+        else if (value->valueType != UNUSED) {
+            appendString(record, ",\"value\":");
+            appendNumber(record, value);
+        }
+        appendChar(record, '}');
+    }
+    appendChar(record, ']');
+}
+
+static void formatJSON(struct Record *record, struct Sample const *sample)
+{
+    struct SystemState const *state = &(sample->state);
+    appendString(record, "{\"timestamp\":");
+    appendTimestamp(record, &(sample->timestamp));
+    appendString(record, ",\"device\":");
+    appendUnsigned(record, sample->deviceID);
+    appendString(record, ",\"controller\":");
+    appendUnsigned(record, sample->controllerID);
+    appendJSONArray(record, "inputs", state->inputs, state->inputCount, state->inputsChanged);
+    appendJSONArray(record, "outputs", state->outputs, state->outputCount, state->outputsChanged);
+    appendJSONArray(record, "rotations", state->rotations, state->rotationCount, state->rotationsChanged);
+    appendJSONArray(record, "heat_registers", state->heatRegisters, state->heatRegisterCount, state->heatRegistersChanged);
+    appendString(record, "}\n");
+}
+
+/**
+ * append the CSV cells of a value group. Every value has a fixed column
+ * given by its id, missing and unchanged values leave their cells empty.
+ */
+static void appendCSVCells(struct Record *record, struct Value const *values, unsigned int count, unsigned int changed,
+                           unsigned int columns, int heat)
+{
+    struct Value const *cells[UVR1611_INPUTS];
+    struct ValueIterator it;
+    struct Value *value;
+    unsigned int i;
+    memset(cells, 0, sizeof(cells));
+    initChangedValueIterator(&it, (struct Value *)values, count, changed);
+    while ((value = nextValue(&it)) != NULL) {
+        if (value->valueID >= 1 && value->valueID <= columns) {
+            cells[value->valueID-1] = value;
+        }
+    }
+    for (i = 0; i < columns; ++i) {
+        if (cells[i] == NULL) {
+            // a heat register has two columns
+            appendString(record, heat ? ",," : ",");
+            continue;
+        }
+        appendChar(record, ',');
+        if (cells[i]->valueType == HEAT) {
+            appendFixed(record, cells[i]->value.heat.current, 2);
+            appendChar(record, ',');
+            appendFixed(record, cells[i]->value.heat.total, 1);
+        }
+        else {
+            appendNumber(record, cells[i]);
+        }
+    }
+}
+
+static void formatCSV(struct Record *record, struct Sample const *sample)
+{
+    struct SystemState const *state = &(sample->state);
+    appendTimestamp(record, &(sample->timestamp));
+    appendChar(record, ',');
+    appendUnsigned(record, sample->deviceID);
+    appendChar(record, ',');
+    appendUnsigned(record, sample->controllerID);
+    appendCSVCells(record, state->inputs, state->inputCount, state->inputsChanged, UVR1611_INPUTS, 0);
+    appendCSVCells(record, state->outputs, state->outputCount, state->outputsChanged, UVR1611_OUTPUTS, 0);
+    appendCSVCells(record, state->rotations, state->rotationCount, state->rotationsChanged, UVR1611_ROTATIONS, 0);
+    appendCSVCells(record, state->heatRegisters, state->heatRegisterCount, state->heatRegistersChanged, UVR1611_HEAT_REGISTERS, 1);
+    appendChar(record, '\n');
+}
+
+static void appendCSVColumns(struct Record *record, char const *prefix, unsigned int columns, int heat)
+{
+    unsigned int i;
+    for (i = 1; i <= columns; ++i) {
+        appendChar(record, ',');
+        appendString(record, prefix);
+        appendUnsigned(record, i);
+        if (heat) {
+            appendString(record, "_POWER,");
+            appendString(record, prefix);
+            appendUnsigned(record, i);
+            appendString(record, "_ENERGY");
+        }
+    }
+}
+
+/**
+ * append the line protocol fields of a value group
+ *
+ * \return the number of fields appended
+ */
+static int appendInfluxFields(struct Record *record, char const *prefix, struct Value const *values, unsigned int count, unsigned int changed, int fields)
+{
+    struct ValueIterator it;
+    struct Value *value;
+    initChangedValueIterator(&it, (struct Value *)values, count, changed);
+    while ((value = nextValue(&it)) != NULL) {
+        if (value->valueType == UNUSED) {
+            continue;
+        }
+        if (fields++ > 0) {
+            appendChar(record, ',');
+        }
+        appendString(record, prefix);
+        appendUnsigned(record, value->valueID);
+        switch (value->valueType) {
+            case HEAT:
+                appendString(record, "_power=");
+                appendFixed(record, value->value.heat.current, 2);
+                appendChar(record, ',');
+                appendString(record, prefix);
+                appendUnsigned(record, value->valueID);
+                appendString(record, "_energy=");
+                appendFixed(record, value->value.heat.total, 1);
+                break;
+            case TEMPERATURE:
+                appendChar(record, '=');
+                appendNumber(record, value);
+                break;
+            default:
+                // digital values, flows and speed steps are integers
+                appendChar(record, '=');
+                appendNumber(record, value);
+                appendChar(record, 'i');
+                break;
+        }
+    }
+    return fields;
+}
+
+static void formatInflux(struct Record *record, struct Sample const *sample)
+{
+    struct SystemState const *state = &(sample->state);
+    int fields = 0;
+    appendString(record, "uvr1611,device=");
+    appendUnsigned(record, sample->deviceID);
+    appendString(record, ",controller=");
+    appendUnsigned(record, sample->controllerID);
+    appendChar(record, ' ');
+    fields = appendInfluxFields(record, "S", state->inputs, state->inputCount, state->inputsChanged, fields);
+    fields = appendInfluxFields(record, "O", state->outputs, state->outputCount, state->outputsChanged, fields);
+    fields = appendInfluxFields(record, "R", state->rotations, state->rotationCount, state->rotationsChanged, fields);
+    fields = appendInfluxFields(record, "H", state->heatRegisters, state->heatRegisterCount, state->heatRegistersChanged, fields);
+    if (fields == 0) {
+        // a line without fields is invalid
+        record->length = 0;
+        return;
+    }
+    appendChar(record, ' ');
+    // nanoseconds since the epoch
+    appendInteger(record, sample->timestamp.tv_sec);
+    appendPadded(record, sample->timestamp.tv_nsec, 9);
+    appendChar(record, '\n');
+}
+
+void printValue(FILE *out, char const *prefix, struct Value const *value)
+{
+    fprintf(out, "%s%d: ", prefix, value->valueID);
+    switch (value->valueType) {
+        case UNUSED:
+            fputs("---", out);
+            break;
+        case DIGITAL:
+            fputs(value->value.enabled ? "on" : "off", out);
+            break;
+        case TEMPERATURE:
+            fprintf(out, "%.1f °C", value->value.temperature);
+            break;
+        case FLOW:
+            fprintf(out, "%d l/h", value->value.flow);
+            break;
+        case HEAT:
+            fprintf(out, "%.2f kW (total: %.1f kWh)", value->value.heat.current, value->value.heat.total);
+            break;
+        case ROTATION:
+            fprintf(out, "step %d", value->value.rotation);
+            break;
+        default:
+            fputs("UNKNOWN", out);
+            break;
+    }
+}
+
+void printValueList(FILE *out, char const *prefix, struct Value const *values, unsigned int count, unsigned int changed)
+{
+    struct ValueIterator it;
+    struct Value *value;
+    initChangedValueIterator(&it, (struct Value *)values, count, changed);
+    while ((value = nextValue(&it)) != NULL) {
+        printValue(out, prefix, value);
+        putc('\n', out);
+    }
+}
+
+void printSample(FILE *out, struct Sample const *sample, int labelled)
+{
+    struct SystemState const *result = &(sample->state);
+    if (labelled) {
+        fprintf(out, "Device %u, controller %u\n", sample->deviceID, sample->controllerID);
+    }
+    fputs("Inputs\n", out);
+    printValueList(out, "S", result->inputs, result->inputCount, result->inputsChanged);
+    fputs("Outputs\n", out);
+    printValueList(out, "O", result->outputs, result->outputCount, result->outputsChanged);
+    fputs("Rotations\n", out);
+    printValueList(out, "R", result->rotations, result->rotationCount, result->rotationsChanged);
+    fputs("Heat registers\n", out);
+    printValueList(out, "", result->heatRegisters, result->heatRegisterCount, result->heatRegistersChanged);
+}
+
+int outputFormat(char const *name)
+{
+    if (strcmp(name, "json") == 0) {
+        return OUTPUT_JSON;
+    }
+    if (strcmp(name, "csv") == 0) {
+        return OUTPUT_CSV;
+    }
+    if (strcmp(name, "influx") == 0) {
+        return OUTPUT_INFLUX;
+    }
+    return -1;
+}
+
+size_t formatOutputHeader(int format, char *buffer, size_t size)
+{
+    struct Record record;
+    if (format != OUTPUT_CSV) {
+        return 0;
+    }
+    record.buffer = buffer;
+    record.size = size;
+    record.length = 0;
+    record.overflow = 0;
+    appendString(&record, "timestamp,device,controller");
+    appendCSVColumns(&record, "S", UVR1611_INPUTS, 0);
+    appendCSVColumns(&record, "O", UVR1611_OUTPUTS, 0);
+    appendCSVColumns(&record, "R", UVR1611_ROTATIONS, 0);
+    appendCSVColumns(&record, "H", UVR1611_HEAT_REGISTERS, 1);
+    appendChar(&record, '\n');
+    return record.overflow ? 0 : record.length;
+}
+
+size_t formatOutputRecord(int format, char *buffer, size_t size, struct Sample const *sample)
+{
+    struct Record record;
+    record.buffer = buffer;
+    record.size = size;
+    record.length = 0;
+    record.overflow = 0;
+    switch (format) {
+        case OUTPUT_JSON:
+            formatJSON(&record, sample);
+            break;
+        case OUTPUT_CSV:
+            formatCSV(&record, sample);
+            break;
+        case OUTPUT_INFLUX:
+            formatInflux(&record, sample);
+            break;
+    }
+    return record.overflow ? 0 : record.length;
+}
+
+struct OutputWriter *initOutputWriter(int format, int fd)
+{
+    struct OutputWriter *writer = malloc(sizeof(struct OutputWriter));
+    if (writer == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return NULL;
+    }
+    writer->format = format;
+    writer->fd = fd;
+    writer->headerWritten = 0;
+    writer->records = 0;
+    writer->errors = 0;
+    return writer;
+}
+
+/**
+ * write the buffer, normally in one go
+ */
+static int writeBuffer(struct OutputWriter *writer, size_t length)
+{
+    size_t offset = 0;
+    while (offset < length) {
+        ssize_t ret = write(writer->fd, writer->buffer+offset, length-offset);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ++writer->errors;
+            return -1;
+        }
+        offset += ret;
+    }
+    return 0;
+}
+
+int writeOutputRecord(struct OutputWriter *writer, struct Sample const *sample)
+{
+    size_t length = 0;
+    size_t record;
+    if (!writer->headerWritten) {
+        // the header goes out together with the first record
+        length = formatOutputHeader(writer->format, writer->buffer, OUTPUT_BUFFER_SIZE);
+        writer->headerWritten = 1;
+    }
+    record = formatOutputRecord(writer->format, writer->buffer + length, OUTPUT_BUFFER_SIZE - length, sample);
+    if (record == 0 && length == 0) {
+        return 0;
+    }
+    ++writer->records;
+    return writeBuffer(writer, length + record);
+}
+
+void cleanupOutputWriter(struct OutputWriter *writer)
+{
+    free(writer);
+}
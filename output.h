@@ -0,0 +1,116 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "datatypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define OUTPUT_JSON   0  /* one object per sample */
+#define OUTPUT_CSV    1  /* one row per sample, one column per value */
+#define OUTPUT_INFLUX 2  /* InfluxDB line protocol */
+
+#define OUTPUT_BUFFER_SIZE 8192
+
+/**
+ * print a value in the human readable format, e.g. "S1: 21.5 °C"
+ */
+void printValue(FILE *out, char const *prefix, struct Value const *value);
+
+/**
+ * print the changed values of a group, one per line
+ */
+void printValueList(FILE *out, char const *prefix, struct Value const *values, unsigned int count, unsigned int changed);
+
+/**
+ * print a sample in the human readable format
+ *
+ * \param labelled start with the device and controller of the sample
+ */
+void printSample(FILE *out, struct Sample const *sample, int labelled);
+
+/**
+ * get the format for a name: json, csv or influx
+ *
+ * \return the format, -1 for an unknown name
+ */
+int outputFormat(char const *name);
+
+/**
+ * format the header of a document in the given format, i.e. the column
+ * names of CSV. The other formats have no header.
+ *
+ * \return the length of the header, 0 if there is none or it did not fit
+ */
+size_t formatOutputHeader(int format, char *buffer, size_t size);
+
+/**
+ * format a sample as one record terminated by a newline. Only the changed
+ * values of the delta mode are formatted, CSV leaves the other cells empty.
+ * Numbers are formatted with fixed precision without going through printf.
+ *
+ * \return the length of the record, 0 if it did not fit into the buffer or there was nothing to format
+ */
+size_t formatOutputRecord(int format, char *buffer, size_t size, struct Sample const *sample);
+
+/**
+ * writes the records of the samples to a file descriptor, one write() per sample
+ */
+struct OutputWriter
+{
+    int format;
+    int fd;
+    int headerWritten;
+    char buffer[OUTPUT_BUFFER_SIZE];  /* reused for every record */
+    unsigned long records;
+    unsigned long errors;
+};
+
+/**
+ * create a writer
+ *
+ * \return a pointer to the writer on success, NULL else. errno will be set accordingly
+ */
+struct OutputWriter *initOutputWriter(int format, int fd);
+
+/**
+ * write the record of a sample
+ *
+ * \return 0 on success, -1 on error
+ */
+int writeOutputRecord(struct OutputWriter *writer, struct Sample const *sample);
+
+/**
+ * clean up the writer. The file descriptor is not closed.
+ */
+void cleanupOutputWriter(struct OutputWriter *writer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OUTPUT_H */
@@ -20,82 +20,83 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <time.h>
 
 #include "parsing.h"
+#include "latency.h"
 #include "logging.h"
 
 #define GETBIT(byte, bit) ((byte & (0x01 << bit)) >> bit)
 
-struct ValueListNode *parseInput(unsigned char *buffer)
+/**
+ * parse a single input value
+ *
+ * \param value the value to fill
+ * \param buffer the two bytes encoding the input
+ * \return 0 on success, -1 if the sensor type is not supported
+ */
+int parseInput(struct Value *value, unsigned char *buffer)
 {
-    struct ValueListNode *node;
-    int value;
-    node = createValueListNode();
-    if (node != NULL) {
-        node->value.valueType = (buffer[1] & 0x70) >> 4;  // bits 6, 5, and 4 of the high byte indicate the sensor type
-        value = buffer[1] & 0x0F;
-        value <<= 8;
-        value += buffer[0];
-	log_output(LOG_DEBUG, "Binary value: %x\n", value);
-	if (value & 0x0800) {
-		// negative temperature
-		value = -(0x1000 - value);
-	}
-        switch (node->value.valueType) {
-            case UNUSED:
-                break;
-            case DIGITAL:
-                if ((buffer[1] & 0x80) != 0) {
-                    node->value.value.enabled = 1;
-                }
-                else {
-                    node->value.value.enabled = 0;
-                }
-                break;
-            case TEMPERATURE:
-                node->value.value.temperature = ((float)value) / 10.0;
-                break;
-            case FLOW:
-                node->value.value.flow = value * 4;
-                break;
-            default:
-                log_output(LOG_ERR, "Unsupported sensor type so far\n");
-                free(node);
-                node = NULL;
-                break;
-        }
+    int raw;
+    value->valueType = (buffer[1] & 0x70) >> 4;  // bits 6, 5, and 4 of the high byte indicate the sensor type
+    raw = buffer[1] & 0x0F;
+    raw <<= 8;
+    raw += buffer[0];
+    log_output(LOG_DEBUG, "Binary value: %x\n", raw);
+    if (raw & 0x0800) {
+        // negative temperature
+        raw = -(0x1000 - raw);
     }
-    return node;
+    switch (value->valueType) {
+        case UNUSED:
+            break;
+        case DIGITAL:
+            if ((buffer[1] & 0x80) != 0) {
+                value->value.enabled = 1;
+            }
+            else {
+                value->value.enabled = 0;
+            }
+            break;
+        case TEMPERATURE:
+            value->value.temperature = ((float)raw) / 10.0;
+            break;
+        case FLOW:
+            value->value.flow = raw * 4;
+            break;
+        default:
+            log_output(LOG_ERR, "Unsupported sensor type so far\n");
+            return -1;
+    }
+    return 0;
 }
 
+/**
+ * parse the input information from the buffer
+ *
+ * \param state the system state where to put the inputs
+ * \param buffer the buffer where the binary encoding is located
+ * \param number the number of inputs to parse
+ */
 int parseInputs(struct SystemState *state, unsigned char *buffer, unsigned int number)
 {
     log_output(LOG_DEBUG, "Parsing %d inputs\n", number);
     if (state != NULL && buffer != NULL) {
         unsigned int i;
-        struct ValueListNode *head;
-        struct ValueListNode *last;
-        head = last = NULL;
-        for (i = 0; i < number; ++i) { 
-            struct ValueListNode *node;
-            node = parseInput(buffer+2*i); // every input takes 2 bytes
-            if (node != NULL) {
-                node->value.valueID = i+1;  // inputs are 1-based
-                if (head == NULL) {
-                    head = node;
-                }
-                if (last != NULL) {
-                    last->next = node;
-                }
-                last = node;
-            }
-            else {
-                log_output(LOG_ERR, "Could not create new list node instance\n");
+        if (number > UVR1611_INPUTS) {
+            number = UVR1611_INPUTS;
+        }
+        for (i = 0; i < number; ++i) {
+            struct Value *value = &(state->inputs[i]);
+            if (parseInput(value, buffer+2*i) != 0) { // every input takes 2 bytes
+                log_output(LOG_ERR, "Could not parse input %u\n", i+1);
                 return -1;
             }
+            value->valueID = i+1;  // inputs are 1-based
         }
-        state->inputs = head;
+        state->inputCount = number;
     }
     log_output(LOG_DEBUG, "Done parsing inputs\n");
     return 0;
@@ -112,29 +113,20 @@ int parseOutputs(struct SystemState *state, unsigned char *buffer, unsigned int
 {
     log_output(LOG_DEBUG, "Parsing %u outputs\n", number);
     if (state != NULL && buffer != NULL) {
-        struct ValueListNode *currentLast = NULL;
         unsigned int i;
+        if (number > UVR1611_OUTPUTS) {
+            number = UVR1611_OUTPUTS;
+        }
         for (i = 0; i < number; ++i) {
             unsigned char currentByte;
-            struct ValueListNode *node;
-            log_output(LOG_DEBUG, "Parsing input %u\n", i);
-            node = createValueListNode();
-            if (node == NULL) {
-                log_output(LOG_ERR, "Could not create new list node instance\n");
-                return -1;
-            }
+            struct Value *value = &(state->outputs[i]);
+            log_output(LOG_DEBUG, "Parsing output %u\n", i);
             currentByte = buffer[(int)(i / 8)]; // get the correct byte in the buffer containing our output bit
-            node->value.valueType = DIGITAL;
-            node->value.valueID = i+1; // outputs are 1-based
-            node->value.value.enabled = GETBIT(currentByte, i % 8);
-            if (state->outputs == NULL) {
-                state->outputs = node;
-            }
-            else {
-                currentLast->next = node;
-            }
-            currentLast = node;
+            value->valueType = DIGITAL;
+            value->valueID = i+1; // outputs are 1-based
+            value->value.enabled = GETBIT(currentByte, i % 8);
         }
+        state->outputCount = number;
     }
     log_output(LOG_DEBUG, "Done parsing outputs\n");
     return 0;
@@ -142,10 +134,30 @@ int parseOutputs(struct SystemState *state, unsigned char *buffer, unsigned int
 
 /**
  * parse the rotation entries in the buffer
+ *
+ * Every byte describes the speed step (0-30) of one of the speed controlled
+ * outputs. Bit 7 being set marks the speed control as inactive, those
+ * outputs are skipped.
  */
 int parseRotations(struct SystemState *state, unsigned char *buffer, unsigned int number)
 {
-    // TODO implement
+    log_output(LOG_DEBUG, "Parsing %u rotations\n", number);
+    if (state != NULL && buffer != NULL) {
+        unsigned int i;
+        if (number > UVR1611_ROTATIONS) {
+            number = UVR1611_ROTATIONS;
+        }
+        state->rotationCount = 0;
+        for (i = 0; i < number; ++i) {
+            if (!GETBIT(buffer[i], 7)) {
+                struct Value *value = &(state->rotations[state->rotationCount++]);
+                value->valueID = i+1;
+                value->valueType = ROTATION;
+                value->value.rotation = buffer[i] & 0x1F;
+            }
+        }
+    }
+    log_output(LOG_DEBUG, "Done parsing rotations\n");
     return 0;
 }
 
@@ -157,18 +169,16 @@ int parseHeat(struct SystemState *state, unsigned char *buffer, unsigned int num
     log_output(LOG_DEBUG, "Parsing %d heat registers\n", number);
     if (state != NULL && buffer != NULL)
     {
-        struct ValueListNode *currentLast = NULL;
         unsigned int i;
+        if (number > UVR1611_HEAT_REGISTERS) {
+            number = UVR1611_HEAT_REGISTERS;
+        }
+        state->heatRegisterCount = 0;
         for (i = 0; i < number; ++i) {
             if (GETBIT(buffer[0], i)) {
                 // only parse the register if the corresponding counter is enabled
                 int value = 0;
-                struct ValueListNode *node;
-                node = createValueListNode();
-                if (node == NULL) {
-                    log_output(LOG_ERR, "Could not create new list node instance\n");
-                    return -1;
-                }
+                struct Value *node = &(state->heatRegisters[state->heatRegisterCount++]);
                 // current value
                 value = ((int)(buffer[i*4+1+3])) << 16;
                 value += ((int)buffer[i*4+1+2]) << 8;
@@ -183,21 +193,14 @@ int parseHeat(struct SystemState *state, unsigned char *buffer, unsigned int num
                 else {
                     value += ((int)buffer[i*4+1]) * 10 / 256;
                 }
-                node->value.valueID = i+1;
-                node->value.valueType = HEAT;
-                node->value.value.heat.current = ((float)value) / 100;
+                node->valueID = i+1;
+                node->valueType = HEAT;
+                node->value.heat.current = ((float)value) / 100;
                 // the total value
                 value = (((unsigned int)buffer[i*4+1+7]) << 8) + buffer[i*4+1+6];
-                node->value.value.heat.total = value * 1000; // the high bytes give the value in MWh, we save kWh
+                node->value.heat.total = value * 1000; // the high bytes give the value in MWh, we save kWh
                 value = (((unsigned int)buffer[i*4+1+5]) << 8) + buffer[i*4+1+4];
-                node->value.value.heat.total += ((float)value) / 10;
-                if (state->heatRegisters == NULL) {
-                    state->heatRegisters = node;
-                }
-                else {
-                    currentLast->next = node;
-                }
-                currentLast = node;
+                node->value.heat.total += ((float)value) / 10;
             }
         }
     }
@@ -205,36 +208,128 @@ int parseHeat(struct SystemState *state, unsigned char *buffer, unsigned int num
     return 0;
 }
 
+/**
+ * parse the 55 value bytes of a UVR1611. They are the same in a current
+ * data frame (following the device byte) and in a data logger record.
+ *
+ * \param data the first value byte
+ * \param state the caller owned state to fill
+ * \return 0 on success, -1 on error
+ */
+int parseUVR1611Values(unsigned char *data, struct SystemState *state)
+{
+    long long start = stageClock();
+    clearSystemState(state);
+    if (parseInputs(state, data, UVR1611_INPUTS) != 0) {
+        log_output(LOG_ERR, "Could not parse input list.\n");
+        return -1;
+    }
+    if (parseOutputs(state, data+32, UVR1611_OUTPUTS) != 0) {
+        log_output(LOG_ERR, "Could not parse output list.\n");
+        return -1;
+    }
+    if (parseRotations(state, data+34, UVR1611_ROTATIONS) != 0) {
+        log_output(LOG_ERR, "Could not parse rotation list.\n");
+        return -1;
+    }
+    if (parseHeat(state, data+38, UVR1611_HEAT_REGISTERS) != 0) {
+        log_output(LOG_ERR, "Could not parse heat register list.\n");
+        return -1;
+    }
+    recordStageSince(STAGE_PARSE, start);
+    return 0;
+}
+
 /**
  * parse the buffer from a UVR1611
  * 
- * \return NULL on error, a system state structure else
+ * \param buffer the frame as received from the device
+ * \param state the caller owned state to fill
+ * \return 0 on success, -1 on error
  */
-struct SystemState *parseUVR1611(unsigned char *buffer)
+int parseUVR1611(unsigned char *buffer, struct SystemState *state)
 {
     log_output(LOG_DEBUG, "Parsing message from UVR1611\n");
-    struct SystemState *state;
-    state = initSystemState();
-    if (state != NULL) {
-        if (parseInputs(state, buffer+1, 16) != 0) {
-            log_output(LOG_ERR, "Could not parse input list.\n");
-            freeSystemState(state);
-            state = NULL;
-        }
+    return parseUVR1611Values(buffer+1, state);
+}
+
+/**
+ * get the number of controllers contained in a GET_CURRENT_DATA frame
+ *
+ * \param length the length of the frame in bytes
+ */
+unsigned int dataFrameControllerCount(int length)
+{
+    return length == UVR1611_DUAL_FRAME_SIZE ? 2 : 1;
+}
+
+/**
+ * parse the values of one controller from a GET_CURRENT_DATA frame
+ *
+ * \param frame the frame as received from the device
+ * \param length the length of the frame in bytes
+ * \param controller the 0-based index of the controller in the frame
+ * \param state the caller owned state to fill
+ * \return 0 on success, -1 otherwise. errno will be set accordingly.
+ */
+int parseDataFrame(unsigned char *frame, int length, unsigned int controller, struct SystemState *state)
+{
+    unsigned char *block;
+    if (controller >= dataFrameControllerCount(length) || length < (int)((controller+1) * UVR1611_FRAME_SIZE)) {
+        errno = EINVAL;
+        return -1;
     }
-    if (state != NULL) {
-        if (parseOutputs(state, buffer+1+32, 13) != 0) {
-            log_output(LOG_ERR, "Could not parse input list.\n");
-            freeSystemState(state);
-            state = NULL;
-        }
+    block = frame + controller * UVR1611_FRAME_SIZE;
+    switch (block[0]) {
+        case UVR1611:
+            return parseUVR1611(block, state);
+        default:
+            log_output(LOG_ERR, "Unsupported device %x for controller %u\n", block[0], controller+1);
+            errno = EINVAL;
+            return -1;
     }
-    if (state != NULL) {
-        if (parseHeat(state, buffer+1+38, 2) != 0) {
-            log_output(LOG_ERR, "Could not parse input list.\n");
-            freeSystemState(state);
-            state = NULL;
-        }
+}
+
+/**
+ * parse a record of the data logger memory
+ *
+ * \param record the record as read from the device
+ * \param recordSize the size of a record as given in the logger header
+ * \param controller the 0-based index of the controller in the record
+ * \param state the caller owned state to fill
+ * \param timestamp receives the time the record was logged at
+ * \return 0 on success, -1 on error. errno will be set accordingly
+ */
+int parseLoggerRecord(unsigned char *record, unsigned int recordSize, unsigned int controller,
+                      struct SystemState *state, struct timespec *timestamp)
+{
+    unsigned char *block;
+    unsigned char checksum = 0;
+    struct tm logged;
+    unsigned int i;
+    if ((controller+1) * LOGGER_BLOCK_SIZE > recordSize) {
+        errno = EINVAL;
+        return -1;
+    }
+    block = record + controller * LOGGER_BLOCK_SIZE;
+    for (i = 0; i < LOGGER_BLOCK_SIZE-1; ++i) {
+        checksum += block[i];
+    }
+    if (checksum != block[LOGGER_BLOCK_SIZE-1]) {
+        log_output(LOG_ERR, "Checksum error in logger record\n");
+        errno = EIO;
+        return -1;
     }
-    return state;
+    // the D-LOGG stores the local time of the controller
+    memset(&logged, 0, sizeof(struct tm));
+    logged.tm_sec = block[LOGGER_TIME_OFFSET];
+    logged.tm_min = block[LOGGER_TIME_OFFSET+1];
+    logged.tm_hour = block[LOGGER_TIME_OFFSET+2];
+    logged.tm_mday = block[LOGGER_TIME_OFFSET+3];
+    logged.tm_mon = block[LOGGER_TIME_OFFSET+4] - 1;
+    logged.tm_year = block[LOGGER_TIME_OFFSET+5] + 100;
+    logged.tm_isdst = -1;
+    timestamp->tv_sec = mktime(&logged);
+    timestamp->tv_nsec = 0;
+    return parseUVR1611Values(block, state);
 }
@@ -28,11 +28,89 @@ extern "C" {
 #endif
 
 /**
- * parse the buffer from a UVR1611
+ * parse the buffer from a UVR1611 into a caller owned state. The function
+ * does not allocate any memory.
  * 
- * \return NULL on error, a sensor node else
+ * \param buffer the frame as received from the device
+ * \param state the state to fill. Any previous content is discarded.
+ * \return 0 on success, -1 on error
  */
-struct SystemState *parseUVR1611(unsigned char *buffer);
+int parseUVR1611(unsigned char *buffer, struct SystemState *state);
+
+/**
+ * parse the 55 value bytes of a UVR1611. They are the same in a current
+ * data frame (following the device byte) and in a data logger record.
+ *
+ * \param data the first value byte
+ * \param state the caller owned state to fill
+ * \return 0 on success, -1 on error
+ */
+int parseUVR1611Values(unsigned char *data, struct SystemState *state);
+
+/**
+ * parse the input group of the value bytes
+ *
+ * \param state the system state where to put the inputs
+ * \param buffer the first value byte
+ * \param number the number of inputs to parse
+ * \return 0 on success, -1 on error
+ */
+int parseInputs(struct SystemState *state, unsigned char *buffer, unsigned int number);
+
+/**
+ * parse the output group of the value bytes
+ *
+ * \param buffer the two output bytes
+ * \return 0 on success, -1 on error
+ */
+int parseOutputs(struct SystemState *state, unsigned char *buffer, unsigned int number);
+
+/**
+ * parse the speed steps of the speed controlled outputs
+ *
+ * \param buffer the four rotation bytes
+ * \return 0 on success, -1 on error
+ */
+int parseRotations(struct SystemState *state, unsigned char *buffer, unsigned int number);
+
+/**
+ * parse the heat registers
+ *
+ * \param buffer the heat register enable byte followed by the registers
+ * \return 0 on success, -1 on error
+ */
+int parseHeat(struct SystemState *state, unsigned char *buffer, unsigned int number);
+
+/**
+ * get the number of controllers contained in a GET_CURRENT_DATA frame
+ *
+ * \param length the length of the frame in bytes
+ */
+unsigned int dataFrameControllerCount(int length);
+
+/**
+ * parse the values of one controller from a GET_CURRENT_DATA frame
+ *
+ * \param frame the frame as received from the device
+ * \param length the length of the frame in bytes
+ * \param controller the 0-based index of the controller in the frame
+ * \param state the caller owned state to fill
+ * \return 0 on success, -1 otherwise. errno will be set accordingly.
+ */
+int parseDataFrame(unsigned char *frame, int length, unsigned int controller, struct SystemState *state);
+
+/**
+ * parse a record of the data logger memory
+ *
+ * \param record the record as read from the device
+ * \param recordSize the size of a record as given in the logger header
+ * \param controller the 0-based index of the controller in the record
+ * \param state the caller owned state to fill
+ * \param timestamp receives the time the record was logged at
+ * \return 0 on success, -1 on error. errno will be set accordingly
+ */
+int parseLoggerRecord(unsigned char *record, unsigned int recordSize, unsigned int controller,
+                      struct SystemState *state, struct timespec *timestamp);
 
 #ifdef __cplusplus
 }
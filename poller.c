@@ -0,0 +1,451 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "poller.h"
+#include "communication.h"
+#include "logging.h"
+
+#define MAX_EVENTS 16
+
+/**
+ * the epoll data of an event tells its source: 0 is the scheduler, watches
+ * have WATCH_TAG set and the index of the watch in the low bits, devices
+ * give their index + 1.
+ */
+#define SCHEDULER_EVENT 0
+#define WATCH_TAG (1ULL << 32)
+
+/**
+ * make sure epoll watches the current fd of the device. The fd changes when
+ * the device is reopened, the old one vanishes from epoll when it is closed.
+ */
+static void registerDevice(struct DevicePoller *poller, struct PolledDevice *device)
+{
+    struct epoll_event event;
+    if (device->registeredFd == device->conn->fd) {
+        return;
+    }
+    device->registeredFd = -1;
+    if (device->conn->fd < 0) {
+        return;
+    }
+    event.events = EPOLLIN;
+    event.data.u64 = (device - poller->devices) + 1;
+    if (epoll_ctl(poller->epfd, EPOLL_CTL_ADD, device->conn->fd, &event) != 0) {
+        log_output(LOG_ERR, "Could not watch device %s. %s\n", device->conn->device, strerror(errno));
+        return;
+    }
+    device->registeredFd = device->conn->fd;
+}
+
+/**
+ * the request of the device is finished, successful or not
+ */
+static void finishRequest(struct PolledDevice *device)
+{
+    device->state = DEVICE_IDLE;
+    device->attempt = 0;
+    ++device->transactions;
+}
+
+/**
+ * the device could not be reopened -> wait before the next request tries again.
+ * The device stays closed during the backoff.
+ */
+static void reopenFailed(struct PolledDevice *device)
+{
+    device->state = DEVICE_BACKOFF;
+    device->attempt = MAX_RETRIES;
+    device->retryAt = monotonicNanoseconds() + retryBackoff(MAX_RETRIES);
+}
+
+/**
+ * close the device and open it again. The reply to the mode query arrives
+ * through epoll like a frame, so the loop does not block meanwhile. The
+ * request ends when the reopen finished.
+ */
+static void startReopen(struct DevicePoller *poller, struct PolledDevice *device)
+{
+    // closing removed the old fd from epoll, the new one may get the same number
+    device->registeredFd = -1;
+    if (beginReopen(device->conn) != 0) {
+        reopenFailed(device);
+        return;
+    }
+    registerDevice(poller, device);
+    device->state = DEVICE_OPENING;
+}
+
+/**
+ * the current attempt of the request failed -> repeat it later or give up
+ */
+static void attemptFailed(struct DevicePoller *poller, struct PolledDevice *device)
+{
+    if (device->attempt < MAX_RETRIES) {
+        ++device->attempt;
+        device->state = DEVICE_BACKOFF;
+        device->retryAt = monotonicNanoseconds() + retryBackoff(device->attempt);
+        log_output(LOG_DEBUG, "Retrying request to device %u in %lld ms\n", device->id, retryBackoff(device->attempt) / 1000000LL);
+    }
+    else {
+        if (requestAbandoned(device->conn)) {
+            startReopen(poller, device);
+        }
+        else {
+            finishRequest(device);
+        }
+    }
+}
+
+/**
+ * send a new request to the device
+ */
+static void startDevice(struct DevicePoller *poller, struct PolledDevice *device)
+{
+    if (!device->conn->_success) {
+        // the device went away, try to get it back
+        startReopen(poller, device);
+        return;
+    }
+    device->attempt = 0;
+    if (startRequest(device->conn) == 0) {
+        device->state = DEVICE_WAITING;
+    }
+    else {
+        attemptFailed(poller, device);
+    }
+}
+
+/**
+ * the device has data to read
+ */
+static void deviceReadable(struct DevicePoller *poller, struct PolledDevice *device)
+{
+    struct Sample sample;
+    int ret;
+    if (device->state == DEVICE_OPENING) {
+        if (finishReopen(device->conn) == 0) {
+            // the reopen takes the place of the request which found the device gone
+            finishRequest(device);
+        }
+        else if (errno != EAGAIN) {
+            reopenFailed(device);
+        }
+        return;
+    }
+    if (device->state != DEVICE_WAITING) {
+        // nobody asked, probably a late reply -> get rid of it
+        unsigned char buffer[128];
+        while (read(device->conn->fd, buffer, sizeof(buffer)) > 0) {
+        }
+        return;
+    }
+    ret = receiveFrame(device->conn);
+    if (ret == FRAME_INCOMPLETE) {
+        return;
+    }
+    if (ret == FRAME_COMPLETE) {
+        unsigned int i;
+        finishRequest(device);
+        clock_gettime(CLOCK_REALTIME, &(sample.timestamp));
+        if (poller->scheduler != NULL) {
+            recordJitter(poller->scheduler, &(sample.timestamp));
+        }
+        sample.deviceID = device->id;
+        // an unchanged frame is still published, only its delivery is suppressed by the delta filter
+        deltaFrameUnchanged(poller->delta, device->id, device->conn->frame, device->conn->frameBytes, sample.timestamp.tv_sec);
+        // in 2DL mode the frame carries two controllers, each one becomes a sample of its own
+        for (i = 0; i < frameControllerCount(device->conn); ++i) {
+            sample.controllerID = i+1;
+            if (parseFrameController(device->conn, i, &(sample.state)) == 0) {
+                poller->handler(poller->context, &sample);
+            }
+        }
+    }
+    else if (errno == EAGAIN) {
+        // no new data is a valid answer
+        finishRequest(device);
+    }
+    else {
+        attemptFailed(poller, device);
+    }
+}
+
+/**
+ * handle passed deadlines and due retries
+ *
+ * \return the time until the next deadline in ms, -1 if there is none
+ */
+static int checkDeadlines(struct DevicePoller *poller)
+{
+    long long now = monotonicNanoseconds();
+    long long next = -1;
+    unsigned int i;
+    for (i = 0; i < poller->count; ++i) {
+        struct PolledDevice *device = &(poller->devices[i]);
+        if (device->state == DEVICE_WAITING && device->conn->deadline <= now) {
+            requestTimedOut(device->conn);
+            attemptFailed(poller, device);
+        }
+        if (device->state == DEVICE_OPENING && device->conn->deadline <= now) {
+            reopenTimedOut(device->conn);
+            reopenFailed(device);
+        }
+        if (device->state == DEVICE_BACKOFF && device->retryAt <= now) {
+            if (!device->conn->_success) {
+                // the reopen failed, the next request tries again
+                finishRequest(device);
+            }
+            else if (retryRequest(device->conn) == 0) {
+                device->state = DEVICE_WAITING;
+            }
+            else {
+                attemptFailed(poller, device);
+            }
+        }
+        if ((device->state == DEVICE_WAITING || device->state == DEVICE_OPENING) &&
+            (next < 0 || device->conn->deadline < next)) {
+            next = device->conn->deadline;
+        }
+        if (device->state == DEVICE_BACKOFF && (next < 0 || device->retryAt < next)) {
+            next = device->retryAt;
+        }
+    }
+    if (next < 0) {
+        return -1;
+    }
+    return next <= now ? 0 : (int)((next - now + 999999) / 1000000);
+}
+
+struct DevicePoller *initDevicePoller(struct USBConnection **connections, unsigned int count,
+                                      struct Scheduler *scheduler, SampleHandler handler, void *context)
+{
+    struct DevicePoller *poller;
+    unsigned int i;
+    poller = malloc(sizeof(struct DevicePoller));
+    if (poller == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return NULL;
+    }
+    poller->devices = malloc(count * sizeof(struct PolledDevice));
+    if (poller->devices == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        free(poller);
+        return NULL;
+    }
+    poller->count = count;
+    poller->scheduler = scheduler;
+    poller->handler = handler;
+    poller->context = context;
+    poller->delta = NULL;
+    poller->stop = 0;
+    for (i = 0; i < MAX_WATCHES; ++i) {
+        poller->watches[i].fd = -1;
+    }
+    poller->epfd = epoll_create(count + 1);
+    if (poller->epfd < 0) {
+        log_output(LOG_ERR, "Could not create epoll instance. %s\n", strerror(errno));
+        free(poller->devices);
+        free(poller);
+        return NULL;
+    }
+    if (scheduler != NULL) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = SCHEDULER_EVENT;
+        if (epoll_ctl(poller->epfd, EPOLL_CTL_ADD, scheduler->fd, &event) != 0) {
+            log_output(LOG_ERR, "Could not watch timer. %s\n", strerror(errno));
+            cleanupDevicePoller(poller);
+            return NULL;
+        }
+    }
+    for (i = 0; i < count; ++i) {
+        struct PolledDevice *device = &(poller->devices[i]);
+        device->conn = connections[i];
+        device->id = i+1;
+        device->state = DEVICE_IDLE;
+        device->attempt = 0;
+        device->retryAt = 0;
+        device->registeredFd = -1;
+        device->transactions = 0;
+        registerDevice(poller, device);
+    }
+    return poller;
+}
+
+int runDevicePoller(struct DevicePoller *poller, unsigned long rounds)
+{
+    struct epoll_event events[MAX_EVENTS];
+    unsigned long ticks = 0;
+    for (;;) {
+        int timeout;
+        int ret;
+        int i;
+        unsigned int busy = 0;
+        unsigned int done = 0;
+        unsigned int j;
+        if (poller->stop) {
+            return 0;
+        }
+        for (j = 0; j < poller->count; ++j) {
+            struct PolledDevice *device = &(poller->devices[j]);
+            if (device->state != DEVICE_IDLE) {
+                ++busy;
+            }
+            else if (rounds > 0 && device->transactions >= rounds) {
+                ++done;
+            }
+            else if (poller->scheduler == NULL) {
+                startDevice(poller, device);
+                ++busy;
+            }
+        }
+        if (done == poller->count || (poller->scheduler != NULL && rounds > 0 && ticks >= rounds && busy == 0)) {
+            return 0;
+        }
+        timeout = checkDeadlines(poller);
+        ret = epoll_wait(poller->epfd, events, MAX_EVENTS, timeout);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_output(LOG_ERR, "Could not wait for events. %s\n", strerror(errno));
+            return -1;
+        }
+        for (i = 0; i < ret; ++i) {
+            struct PolledDevice *device;
+            if (events[i].data.u64 & WATCH_TAG) {
+                struct PollerWatch *watch = &(poller->watches[events[i].data.u64 & ~WATCH_TAG]);
+                if (watch->fd >= 0) {
+                    watch->handler(watch->context, watch->fd, events[i].events);
+                }
+                continue;
+            }
+            if (events[i].data.u64 == SCHEDULER_EVENT) {
+                int tick = waitForTick(poller->scheduler, NULL);
+                if (tick == SCHEDULER_NO_TICK) {
+                    continue;
+                }
+                if (tick < 0) {
+                    return -1;
+                }
+                if (rounds > 0 && ticks >= rounds) {
+                    continue;
+                }
+                ++ticks;
+                for (j = 0; j < poller->count; ++j) {
+                    if (poller->devices[j].state == DEVICE_IDLE) {
+                        startDevice(poller, &(poller->devices[j]));
+                    }
+                    else {
+                        log_output(LOG_INFO, "Device %u is still busy with the previous request\n", poller->devices[j].id);
+                    }
+                }
+                continue;
+            }
+            device = &(poller->devices[events[i].data.u64 - 1]);
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                // the USB-serial link went away
+                log_output(LOG_ERR, "Lost connection to device %s\n", device->conn->device);
+                if (device->state == DEVICE_OPENING) {
+                    reopenTimedOut(device->conn);
+                    reopenFailed(device);
+                }
+                else {
+                    startReopen(poller, device);
+                }
+            }
+            else {
+                deviceReadable(poller, device);
+            }
+        }
+    }
+}
+
+void stopDevicePoller(struct DevicePoller *poller)
+{
+    poller->stop = 1;
+}
+
+int pollerWatch(struct DevicePoller *poller, int fd, unsigned int events, WatchHandler handler, void *context)
+{
+    struct epoll_event event;
+    unsigned int i;
+    for (i = 0; i < MAX_WATCHES && poller->watches[i].fd >= 0; ++i) {
+    }
+    if (i == MAX_WATCHES) {
+        errno = ENOSPC;
+        return -1;
+    }
+    event.events = events;
+    event.data.u64 = WATCH_TAG | i;
+    if (epoll_ctl(poller->epfd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        return -1;
+    }
+    poller->watches[i].fd = fd;
+    poller->watches[i].handler = handler;
+    poller->watches[i].context = context;
+    return 0;
+}
+
+int pollerModify(struct DevicePoller *poller, int fd, unsigned int events)
+{
+    struct epoll_event event;
+    unsigned int i;
+    for (i = 0; i < MAX_WATCHES; ++i) {
+        if (poller->watches[i].fd == fd) {
+            event.events = events;
+            event.data.u64 = WATCH_TAG | i;
+            return epoll_ctl(poller->epfd, EPOLL_CTL_MOD, fd, &event);
+        }
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+void pollerUnwatch(struct DevicePoller *poller, int fd)
+{
+    unsigned int i;
+    for (i = 0; i < MAX_WATCHES; ++i) {
+        if (poller->watches[i].fd == fd) {
+            epoll_ctl(poller->epfd, EPOLL_CTL_DEL, fd, NULL);
+            // events of this round which are still to be handled are ignored
+            poller->watches[i].fd = -1;
+        }
+    }
+}
+
+void cleanupDevicePoller(struct DevicePoller *poller)
+{
+    if (poller != NULL) {
+        if (poller->epfd >= 0) {
+            close(poller->epfd);
+        }
+        free(poller->devices);
+        free(poller);
+    }
+}
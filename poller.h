@@ -0,0 +1,153 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef POLLER_H
+#define POLLER_H
+
+#include "datatypes.h"
+#include "scheduler.h"
+#include "delta.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * states of a device in the poller
+ */
+#define DEVICE_IDLE     0   /* no request pending */
+#define DEVICE_WAITING  1   /* request sent, waiting for the frame */
+#define DEVICE_BACKOFF  2   /* request failed, waiting before repeating it */
+#define DEVICE_OPENING  3   /* device reopened, waiting for the reply to the mode query */
+
+/**
+ * a device driven by the poller
+ */
+struct PolledDevice
+{
+    struct USBConnection *conn;
+    unsigned int id;            /* 1-based device id the samples are tagged with */
+    int state;
+    int attempt;                /* number of the current attempt of the request, 0 for the first */
+    long long retryAt;          /* monotonic time to repeat the request or the reopen at in ns */
+    int registeredFd;           /* the fd registered with epoll, -1 if none */
+    unsigned long transactions; /* number of finished requests */
+};
+
+#define MAX_WATCHES 32
+
+/**
+ * callback of a watched file descriptor
+ *
+ * \param context as given to pollerWatch()
+ * \param fd the file descriptor
+ * \param events the epoll events which occurred
+ */
+typedef void (*WatchHandler)(void *context, int fd, unsigned int events);
+
+/**
+ * a file descriptor of another component served by the epoll loop of the poller
+ */
+struct PollerWatch
+{
+    int fd;                     /* -1 for a free entry */
+    WatchHandler handler;
+    void *context;
+};
+
+/**
+ * drives any number of D-LOGG connections from a single epoll loop. On every
+ * tick of the scheduler a request is sent to every idle device, the replies
+ * are collected as they arrive. Without a scheduler every device is polled
+ * again as soon as its previous request finished.
+ */
+struct DevicePoller
+{
+    int epfd;
+    struct PolledDevice *devices;
+    unsigned int count;
+    struct Scheduler *scheduler;
+    SampleHandler handler;
+    void *context;
+    struct DeltaFilter *delta;  /* notes frames identical to the previous one, NULL to compare every sample */
+    struct PollerWatch watches[MAX_WATCHES];
+    int stop;                   /* set by stopDevicePoller() */
+};
+
+/**
+ * create a poller for the given connections
+ *
+ * \param connections the connections to drive. The poller does not take the ownership.
+ * \param count the number of connections
+ * \param scheduler the scheduler giving the ticks or NULL to poll as fast as possible
+ * \param handler the callback receiving the samples
+ * \param context passed to the callback
+ * \return a pointer to the poller on success, NULL else. errno will be set accordingly
+ */
+struct DevicePoller *initDevicePoller(struct USBConnection **connections, unsigned int count,
+                                      struct Scheduler *scheduler, SampleHandler handler, void *context);
+
+/**
+ * run the poller
+ *
+ * \param rounds the number of requests to send to each device, 0 means infinitely
+ * \return 0 on success, -1 on error. errno will be set accordingly
+ */
+int runDevicePoller(struct DevicePoller *poller, unsigned long rounds);
+
+/**
+ * make runDevicePoller() return after the events at hand. Requests still
+ * pending are abandoned. Only to be called from the thread running the
+ * poller, e.g. from a watch handler.
+ */
+void stopDevicePoller(struct DevicePoller *poller);
+
+/**
+ * serve a file descriptor from the epoll loop. The handler runs in the
+ * thread running the poller.
+ *
+ * \param events the epoll events to wait for, e.g. EPOLLIN
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+int pollerWatch(struct DevicePoller *poller, int fd, unsigned int events, WatchHandler handler, void *context);
+
+/**
+ * change the events a watched file descriptor waits for
+ *
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+int pollerModify(struct DevicePoller *poller, int fd, unsigned int events);
+
+/**
+ * stop watching a file descriptor. This has to happen before it is closed.
+ */
+void pollerUnwatch(struct DevicePoller *poller, int fd);
+
+/**
+ * clean up the poller
+ */
+void cleanupDevicePoller(struct DevicePoller *poller);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POLLER_H */
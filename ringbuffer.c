@@ -0,0 +1,167 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ringbuffer.h"
+#include "logging.h"
+
+struct SampleRing *initSampleRing(unsigned int capacity, int policy)
+{
+    struct SampleRing *ring;
+    if (capacity == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    ring = malloc(sizeof(struct SampleRing));
+    if (ring == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return NULL;
+    }
+    ring->slots = malloc(capacity * sizeof(struct Sample));
+    if (ring->slots == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        free(ring);
+        return NULL;
+    }
+    ring->capacity = capacity;
+    ring->policy = policy;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dropped = 0;
+    ring->closed = 0;
+    sem_init(&(ring->items), 0, 0);
+    sem_init(&(ring->spaces), 0, 0);
+    return ring;
+}
+
+/**
+ * sem_wait which is not interrupted by signals
+ */
+static void waitSemaphore(sem_t *sem)
+{
+    while (sem_wait(sem) != 0 && errno == EINTR) {
+    }
+}
+
+/**
+ * wake up the other side. A post only tells the waiter to look at the ring
+ * again, so the semaphore does not count beyond 1 while nobody waits.
+ */
+static void signalSemaphore(sem_t *sem)
+{
+    int value;
+    if (sem_getvalue(sem, &value) == 0 && value > 0) {
+        return;
+    }
+    sem_post(sem);
+}
+
+int ringPush(struct SampleRing *ring, struct Sample const *sample)
+{
+    unsigned long head;
+    unsigned long tail;
+    int ret = 0;
+    if (__atomic_load_n(&(ring->closed), __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    head = ring->head; // we are the only writer
+    tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+    while (head - tail >= ring->capacity) {
+        if (ring->policy == RING_BLOCK) {
+            waitSemaphore(&(ring->spaces));
+            tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+        }
+        else if (__atomic_compare_exchange_n(&(ring->tail), &tail, tail+1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            // we took the oldest sample away from the consumer
+            __atomic_add_fetch(&(ring->dropped), 1, __ATOMIC_RELAXED);
+            ret = 1;
+            ++tail;
+        }
+    }
+    memcpy(&(ring->slots[head % ring->capacity]), sample, sizeof(struct Sample));
+    __atomic_store_n(&(ring->head), head+1, __ATOMIC_RELEASE);
+    signalSemaphore(&(ring->items));
+    return ret;
+}
+
+int ringPop(struct SampleRing *ring, struct Sample *sample)
+{
+    return ringPopUntil(ring, sample, NULL);
+}
+
+int ringPopUntil(struct SampleRing *ring, struct Sample *sample, struct timespec const *deadline)
+{
+    for (;;) {
+        unsigned long tail;
+        unsigned long head;
+        tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+        if (tail == head) {
+            if (__atomic_load_n(&(ring->closed), __ATOMIC_ACQUIRE)
+                && tail == __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE)) {
+                return -1;
+            }
+            if (deadline == NULL) {
+                waitSemaphore(&(ring->items));
+            }
+            else if (sem_timedwait(&(ring->items), deadline) != 0 && errno == ETIMEDOUT) {
+                return 1;
+            }
+            continue;
+        }
+        memcpy(sample, &(ring->slots[tail % ring->capacity]), sizeof(struct Sample));
+        // if the producer dropped the sample while we copied it, the copy is worthless -> retry
+        if (__atomic_compare_exchange_n(&(ring->tail), &tail, tail+1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            if (ring->policy == RING_BLOCK) {
+                signalSemaphore(&(ring->spaces));
+            }
+            return 0;
+        }
+    }
+}
+
+unsigned long ringDropped(struct SampleRing *ring)
+{
+    return __atomic_load_n(&(ring->dropped), __ATOMIC_RELAXED);
+}
+
+int ringClosed(struct SampleRing *ring)
+{
+    return __atomic_load_n(&(ring->closed), __ATOMIC_ACQUIRE);
+}
+
+void closeSampleRing(struct SampleRing *ring)
+{
+    __atomic_store_n(&(ring->closed), 1, __ATOMIC_RELEASE);
+    sem_post(&(ring->items));
+}
+
+void cleanupSampleRing(struct SampleRing *ring)
+{
+    if (ring != NULL) {
+        sem_destroy(&(ring->items));
+        sem_destroy(&(ring->spaces));
+        free(ring->slots);
+        free(ring);
+    }
+}
@@ -0,0 +1,119 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <semaphore.h>
+#include <time.h>
+
+#include "datatypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * what to do if a sample is pushed into a full ring
+ */
+#define RING_DROP_OLDEST 0  /* discard the oldest sample in the ring */
+#define RING_BLOCK       1  /* wait until the consumer made room */
+
+/**
+ * lock-free ring of samples for exactly one producer and one consumer thread.
+ *
+ * The positions are free running counters, the slot is the position modulo
+ * the capacity. Only the producer writes head. tail is advanced by the
+ * consumer and, with RING_DROP_OLDEST, by the producer dropping the oldest
+ * sample. Both use a compare-and-swap, so a sample the consumer copied while
+ * the producer dropped it is detected and discarded.
+ */
+struct SampleRing
+{
+    struct Sample *slots;
+    unsigned int capacity;
+    int policy;
+    unsigned long head;     /* position of the next sample to write */
+    unsigned long tail;     /* position of the next sample to read */
+    unsigned long dropped;  /* number of samples dropped because the ring was full */
+    int closed;
+    sem_t items;            /* wakes up the consumer, never counts beyond 1 */
+    sem_t spaces;           /* wakes up a blocked producer, never counts beyond 1 */
+};
+
+/**
+ * create a new ring
+ *
+ * \param capacity the number of samples the ring can hold
+ * \param policy RING_DROP_OLDEST or RING_BLOCK
+ * \return a pointer to the ring on success, NULL else. errno will be set accordingly
+ */
+struct SampleRing *initSampleRing(unsigned int capacity, int policy);
+
+/**
+ * push a copy of the sample into the ring. Must only be called from the producer thread.
+ *
+ * \return 0 on success, 1 if the oldest sample had to be dropped, -1 if the ring is closed
+ */
+int ringPush(struct SampleRing *ring, struct Sample const *sample);
+
+/**
+ * pop the oldest sample from the ring. Waits until a sample is available.
+ * Must only be called from the consumer thread.
+ *
+ * \return 0 on success, -1 if the ring was closed and all samples are consumed
+ */
+int ringPop(struct SampleRing *ring, struct Sample *sample);
+
+/**
+ * pop the oldest sample from the ring, but wait no longer than the deadline.
+ * Must only be called from the consumer thread.
+ *
+ * \param deadline the CLOCK_REALTIME time to give up at, NULL to wait forever
+ * \return 0 on success, 1 if the deadline passed, -1 if the ring was closed and all samples are consumed
+ */
+int ringPopUntil(struct SampleRing *ring, struct Sample *sample, struct timespec const *deadline);
+
+/**
+ * get the number of samples dropped so far
+ */
+unsigned long ringDropped(struct SampleRing *ring);
+
+/**
+ * check whether the ring was closed, samples may still be left in it
+ */
+int ringClosed(struct SampleRing *ring);
+
+/**
+ * mark the ring as closed. The consumer still gets the remaining samples.
+ */
+void closeSampleRing(struct SampleRing *ring);
+
+/**
+ * clean up the ring. No thread may use it anymore.
+ */
+void cleanupSampleRing(struct SampleRing *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RINGBUFFER_H */
@@ -0,0 +1,531 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "rollup.h"
+#include "logging.h"
+
+long long const rollupPeriods[ROLLUP_TIERS] = { 60000LL, 3600000LL, 86400000LL };
+
+char const *const rollupTierNames[ROLLUP_TIERS] = { "1m", "1h", "1d" };
+
+static void putNumber(unsigned char *buffer, unsigned long long value, int bytes)
+{
+    int i;
+    for (i = 0; i < bytes; ++i) {
+        buffer[i] = (value >> (8*i)) & 0xFF;
+    }
+}
+
+static unsigned long long getNumber(unsigned char const *buffer, int bytes)
+{
+    unsigned long long value = 0;
+    int i;
+    for (i = bytes-1; i >= 0; --i) {
+        value = (value << 8) | buffer[i];
+    }
+    return value;
+}
+
+static long long getSigned(unsigned char const *buffer, int bytes)
+{
+    unsigned long long value = getNumber(buffer, bytes);
+    if (value & (1ULL << (8*bytes - 1))) {
+        return (long long)value - (1LL << (8*bytes));
+    }
+    return (long long)value;
+}
+
+/**
+ * the start of the window of the given period a time falls into
+ */
+static long long windowStart(long long time, long long period)
+{
+    long long offset = time % period;
+    return time - (offset < 0 ? offset + period : offset);
+}
+
+void encodeRollupRow(struct RollupWindow const *window, unsigned char *row)
+{
+    unsigned int i;
+    memset(row, 0, ROLLUP_ROW_SIZE);
+    putNumber(row, (unsigned long long)window->start, 8);
+    row[8] = window->device;
+    row[9] = window->controller;
+    putNumber(row + 12, window->samples, 4);
+    putNumber(row + 16, (unsigned long long)window->covered, 4);
+    putNumber(row + 24, window->types, 8);
+    for (i = 0; i < UVR1611_INPUTS; ++i) {
+        unsigned char *input = row + 32 + 16*i;
+        struct RollupInput const *values = &(window->inputs[i]);
+        if (values->count == 0) {
+            continue;
+        }
+        putNumber(input, values->count, 4);
+        putNumber(input + 4, (unsigned long long)values->min, 2);
+        putNumber(input + 6, (unsigned long long)values->max, 2);
+        putNumber(input + 8, (unsigned long long)values->sum, 8);
+    }
+    for (i = 0; i < UVR1611_OUTPUTS; ++i) {
+        putNumber(row + 288 + 4*i, (unsigned long long)window->onTime[i], 4);
+    }
+    for (i = 0; i < UVR1611_HEAT_REGISTERS; ++i) {
+        putNumber(row + 344 + 8*i, (unsigned long long)window->energy[i], 8);
+    }
+}
+
+void decodeRollupRow(unsigned char const *row, struct RollupWindow *window)
+{
+    unsigned int i;
+    memset(window, 0, sizeof(struct RollupWindow));
+    window->start = (long long)getNumber(row, 8);
+    window->device = row[8];
+    window->controller = row[9];
+    window->samples = getNumber(row + 12, 4);
+    window->covered = (long long)getNumber(row + 16, 4);
+    window->types = getNumber(row + 24, 8);
+    for (i = 0; i < UVR1611_INPUTS; ++i) {
+        unsigned char const *input = row + 32 + 16*i;
+        window->inputs[i].count = getNumber(input, 4);
+        window->inputs[i].min = getSigned(input + 4, 2);
+        window->inputs[i].max = getSigned(input + 6, 2);
+        window->inputs[i].sum = getSigned(input + 8, 8);
+    }
+    for (i = 0; i < UVR1611_OUTPUTS; ++i) {
+        window->onTime[i] = (long long)getNumber(row + 288 + 4*i, 4);
+    }
+    for (i = 0; i < UVR1611_HEAT_REGISTERS; ++i) {
+        window->energy[i] = getSigned(row + 344 + 8*i, 8);
+    }
+}
+
+void mergeRollupWindow(struct RollupWindow *into, struct RollupWindow const *from)
+{
+    unsigned int i;
+    if (from->samples > 0) {
+        into->types = from->types;
+    }
+    into->samples += from->samples;
+    into->covered += from->covered;
+    for (i = 0; i < UVR1611_INPUTS; ++i) {
+        struct RollupInput *target = &(into->inputs[i]);
+        struct RollupInput const *source = &(from->inputs[i]);
+        if (source->count == 0) {
+            continue;
+        }
+        if (target->count == 0 || source->min < target->min) {
+            target->min = source->min;
+        }
+        if (target->count == 0 || source->max > target->max) {
+            target->max = source->max;
+        }
+        target->count += source->count;
+        target->sum += source->sum;
+    }
+    for (i = 0; i < UVR1611_OUTPUTS; ++i) {
+        into->onTime[i] += from->onTime[i];
+    }
+    for (i = 0; i < UVR1611_HEAT_REGISTERS; ++i) {
+        into->energy[i] += from->energy[i];
+    }
+}
+
+int parseRollupTier(char const *name)
+{
+    int tier;
+    for (tier = 0; tier < ROLLUP_TIERS; ++tier) {
+        if (strcmp(name, rollupTierNames[tier]) == 0) {
+            return tier;
+        }
+    }
+    return -1;
+}
+
+char *rollupPath(char const *directory, int tier)
+{
+    char *path = malloc(strlen(directory) + 16);
+    if (path != NULL) {
+        sprintf(path, "%s/rollup-%s.dat", directory, rollupTierNames[tier]);
+    }
+    return path;
+}
+
+/**
+ * write a buffer completely
+ */
+static int writeAll(int fd, unsigned char const *buffer, size_t length)
+{
+    while (length > 0) {
+        ssize_t ret = write(fd, buffer, length);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += ret;
+        length -= ret;
+    }
+    return 0;
+}
+
+/**
+ * open the file of a tier for appending. A new file gets the header, a row
+ * cut off by a crash is removed.
+ */
+static int openRollupFile(char const *path)
+{
+    unsigned char header[ROLLUP_HEADER_SIZE];
+    struct stat info;
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (info.st_size == 0) {
+        memset(header, 0, sizeof(header));
+        memcpy(header, ROLLUP_MAGIC, 8);
+        putNumber(header + 8, ROLLUP_VERSION, 4);
+        putNumber(header + 12, ROLLUP_ROW_SIZE, 4);
+        if (writeAll(fd, header, sizeof(header)) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    if (pread(fd, header, sizeof(header), 0) != sizeof(header) || memcmp(header, ROLLUP_MAGIC, 8) != 0
+        || getNumber(header + 12, 4) != ROLLUP_ROW_SIZE) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    if ((info.st_size - ROLLUP_HEADER_SIZE) % ROLLUP_ROW_SIZE != 0
+        && ftruncate(fd, info.st_size - (info.st_size - ROLLUP_HEADER_SIZE) % ROLLUP_ROW_SIZE) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * get the windows of a controller, a new source is created on first use
+ */
+static struct RollupSource *findSource(struct Rollups *rollups, unsigned int device, unsigned int controller)
+{
+    struct RollupSource **grown;
+    struct RollupSource *source;
+    unsigned int i;
+    for (i = 0; i < rollups->sourceCount; ++i) {
+        if (rollups->sources[i]->device == device && rollups->sources[i]->controller == controller) {
+            return rollups->sources[i];
+        }
+    }
+    grown = realloc(rollups->sources, (rollups->sourceCount+1) * sizeof(struct RollupSource *));
+    if (grown == NULL) {
+        return NULL;
+    }
+    rollups->sources = grown;
+    source = malloc(sizeof(struct RollupSource));
+    if (source == NULL) {
+        return NULL;
+    }
+    memset(source, 0, sizeof(struct RollupSource));
+    source->device = device;
+    source->controller = controller;
+    rollups->sources[rollups->sourceCount++] = source;
+    return source;
+}
+
+/**
+ * take the rows of the windows still open at the previous exit off the end
+ * of the file of a tier and continue these windows
+ *
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+static int restoreWindows(struct Rollups *rollups, int tier)
+{
+    unsigned char row[ROLLUP_ROW_SIZE];
+    struct stat info;
+    off_t end;
+    if (fstat(rollups->fds[tier], &info) != 0) {
+        return -1;
+    }
+    end = info.st_size;
+    while (end - ROLLUP_ROW_SIZE >= ROLLUP_HEADER_SIZE) {
+        struct RollupSource *source;
+        if (pread(rollups->fds[tier], row, sizeof(row), end - ROLLUP_ROW_SIZE) != sizeof(row)) {
+            return -1;
+        }
+        if (!(row[10] & ROLLUP_ROW_OPEN)) {
+            break;
+        }
+        source = findSource(rollups, row[8], row[9]);
+        if (source == NULL) {
+            return -1;
+        }
+        decodeRollupRow(row, &(source->windows[tier]));
+        source->windows[tier].open = 1;
+        source->restored[tier] = source->windows[tier];
+        end -= ROLLUP_ROW_SIZE;
+    }
+    if (end < info.st_size) {
+        log_output(LOG_DEBUG, "Continuing %ld %s rollup windows\n", (long)((info.st_size - end) / ROLLUP_ROW_SIZE), rollupTierNames[tier]);
+        return ftruncate(rollups->fds[tier], end);
+    }
+    return 0;
+}
+
+struct Rollups *initRollups(char const *directory)
+{
+    struct Rollups *rollups;
+    int tier;
+    rollups = malloc(sizeof(struct Rollups));
+    if (rollups == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return NULL;
+    }
+    memset(rollups, 0, sizeof(struct Rollups));
+    for (tier = 0; tier < ROLLUP_TIERS; ++tier) {
+        rollups->fds[tier] = -1;
+    }
+    for (tier = 0; tier < ROLLUP_TIERS; ++tier) {
+        char *path = rollupPath(directory, tier);
+        if (path == NULL) {
+            log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+            cleanupRollups(rollups);
+            return NULL;
+        }
+        rollups->fds[tier] = openRollupFile(path);
+        if (rollups->fds[tier] < 0) {
+            int error = errno;
+            log_output(LOG_ERR, "Could not open rollup file %s. %s\n", path, strerror(errno));
+            free(path);
+            cleanupRollups(rollups);
+            errno = error;
+            return NULL;
+        }
+        free(path);
+        if (restoreWindows(rollups, tier) != 0) {
+            int error = errno;
+            log_output(LOG_ERR, "Could not continue the %s rollups. %s\n", rollupTierNames[tier], strerror(errno));
+            cleanupRollups(rollups);
+            errno = error;
+            return NULL;
+        }
+    }
+    return rollups;
+}
+
+static void openWindow(struct RollupSource *source, int tier, long long start)
+{
+    struct RollupWindow *window = &(source->windows[tier]);
+    memset(window, 0, sizeof(struct RollupWindow));
+    window->start = start;
+    window->device = source->device;
+    window->controller = source->controller;
+    window->open = 1;
+}
+
+/**
+ * the part of a window which is not in the next tier yet: a continued window
+ * brought its restored part along. Minimum and maximum are kept, merging them
+ * again does no harm.
+ */
+static void addedPart(struct RollupWindow *added, struct RollupWindow const *window, struct RollupWindow const *restored)
+{
+    unsigned int i;
+    *added = *window;
+    added->samples -= restored->samples;
+    added->covered -= restored->covered;
+    for (i = 0; i < UVR1611_INPUTS; ++i) {
+        added->inputs[i].count -= restored->inputs[i].count;
+        added->inputs[i].sum -= restored->inputs[i].sum;
+    }
+    for (i = 0; i < UVR1611_OUTPUTS; ++i) {
+        added->onTime[i] -= restored->onTime[i];
+    }
+    for (i = 0; i < UVR1611_HEAT_REGISTERS; ++i) {
+        added->energy[i] -= restored->energy[i];
+    }
+}
+
+/**
+ * write a window and merge it into the window of the next tier
+ *
+ * \param exiting the window is written because the reader exits, the next start continues it
+ */
+static void closeWindow(struct Rollups *rollups, struct RollupSource *source, int tier, int exiting)
+{
+    struct RollupWindow *window = &(source->windows[tier]);
+    unsigned char row[ROLLUP_ROW_SIZE];
+    if (!window->open) {
+        return;
+    }
+    encodeRollupRow(window, row);
+    if (exiting) {
+        row[10] |= ROLLUP_ROW_OPEN;
+    }
+    if (writeAll(rollups->fds[tier], row, sizeof(row)) != 0) {
+        log_output(LOG_ERR, "Could not write %s rollup. %s\n", rollupTierNames[tier], strerror(errno));
+        ++rollups->errors;
+    }
+    else {
+        ++rollups->rows;
+    }
+    if (tier + 1 < ROLLUP_TIERS) {
+        struct RollupWindow *next = &(source->windows[tier+1]);
+        long long start = windowStart(window->start, rollupPeriods[tier+1]);
+        struct RollupWindow added;
+        if (next->open && next->start != start) {
+            closeWindow(rollups, source, tier+1, 0);
+        }
+        if (!next->open) {
+            openWindow(source, tier+1, start);
+        }
+        addedPart(&added, window, &(source->restored[tier]));
+        mergeRollupWindow(next, &added);
+    }
+    memset(&(source->restored[tier]), 0, sizeof(struct RollupWindow));
+    window->open = 0;
+}
+
+/**
+ * add the time from the previous sample to the given time with the values
+ * of the previous sample, split at the minute boundaries
+ */
+static void integrate(struct Rollups *rollups, struct RollupSource *source, long long to)
+{
+    struct RollupWindow *window = &(source->windows[0]);
+    unsigned char const *last = source->last;
+    long long from = (long long)getNumber(last, 8);
+    unsigned int outputs = getNumber(last + 18, 2);
+    unsigned int i;
+    while (from < to) {
+        long long length;
+        if (!window->open || from >= window->start + rollupPeriods[0]) {
+            closeWindow(rollups, source, 0, 0);
+            openWindow(source, 0, windowStart(from, rollupPeriods[0]));
+        }
+        length = (to < window->start + rollupPeriods[0] ? to : window->start + rollupPeriods[0]) - from;
+        window->covered += length;
+        for (i = 0; i < UVR1611_OUTPUTS; ++i) {
+            if (outputs & (1u << i)) {
+                window->onTime[i] += length;
+            }
+        }
+        for (i = 0; i < UVR1611_HEAT_REGISTERS; ++i) {
+            if (last[56] & (1 << i)) {
+                window->energy[i] += getSigned(last + 60 + 4*i, 4) * length;
+            }
+        }
+        from += length;
+    }
+}
+
+void rollupSample(struct Rollups *rollups, struct Sample const *sample)
+{
+    unsigned char record[STORE_RECORD_SIZE];
+    struct RollupSource *source;
+    struct RollupWindow *window;
+    long long time;
+    long long previous;
+    unsigned int i;
+    if (rollups == NULL) {
+        return;
+    }
+    source = findSource(rollups, sample->deviceID, sample->controllerID);
+    if (source == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return;
+    }
+    encodeStoreRecord(sample, record);
+    time = storeRecordTime(record);
+    previous = storeRecordTime(source->last);
+    window = &(source->windows[0]);
+    if (time < previous || (window->open && time < window->start)) {
+        // the clock went back, the windows of this time are written already
+        log_output(LOG_DEBUG, "Ignoring sample of device %u controller %u older than the rollup window\n",
+                   sample->deviceID, sample->controllerID);
+        return;
+    }
+    if (previous != 0 && time > previous && time - previous <= ROLLUP_MAX_GAP) {
+        integrate(rollups, source, time);
+    }
+    if (!window->open || time >= window->start + rollupPeriods[0]) {
+        closeWindow(rollups, source, 0, 0);
+        openWindow(source, 0, windowStart(time, rollupPeriods[0]));
+    }
+    ++window->samples;
+    window->types = getNumber(record + 10, 8);
+    for (i = 0; i < UVR1611_INPUTS; ++i) {
+        struct RollupInput *input = &(window->inputs[i]);
+        int value;
+        if (((record[10 + i/2] >> (4 * (i % 2))) & 0x0F) == UNUSED) {
+            continue;
+        }
+        value = getSigned(record + 20 + 2*i, 2);
+        if (input->count == 0 || value < input->min) {
+            input->min = value;
+        }
+        if (input->count == 0 || value > input->max) {
+            input->max = value;
+        }
+        ++input->count;
+        input->sum += value;
+    }
+    memcpy(source->last, record, STORE_RECORD_SIZE);
+}
+
+void cleanupRollups(struct Rollups *rollups)
+{
+    unsigned int i;
+    int tier;
+    if (rollups != NULL) {
+        for (i = 0; i < rollups->sourceCount; ++i) {
+            // closing a tier merges it into the next one, so they are closed in order
+            for (tier = 0; tier < ROLLUP_TIERS; ++tier) {
+                closeWindow(rollups, rollups->sources[i], tier, 1);
+            }
+            free(rollups->sources[i]);
+        }
+        if (rollups->sourceCount > 0) {
+            log_output(LOG_INFO, "Rollup statistics: %lu rows, %lu errors\n", rollups->rows, rollups->errors);
+        }
+        for (tier = 0; tier < ROLLUP_TIERS; ++tier) {
+            if (rollups->fds[tier] >= 0) {
+                close(rollups->fds[tier]);
+            }
+        }
+        free(rollups->sources);
+        free(rollups);
+    }
+}
@@ -0,0 +1,189 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include "datatypes.h"
+#include "store.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Rollups aggregate the samples of every controller into windows of one
+ * minute, one hour and one day (UTC). A window keeps, per input, the
+ * number of values and their minimum, maximum and sum, the time every
+ * output was on, and the heat register power integrated over time. The
+ * minute windows are fed by the samples, every closed minute is merged
+ * into its hour and every closed hour into its day, so a sample costs the
+ * same no matter how long the windows are.
+ *
+ * Between two samples the values of the first one are assumed to hold, a
+ * gap of more than ROLLUP_MAX_GAP is not integrated. Samples older than
+ * the previous one of their controller, e.g. after the clock was set back,
+ * are ignored.
+ *
+ * The windows still open at exit are written as well, flagged with
+ * ROLLUP_ROW_OPEN. The next start takes these rows off the end of the
+ * files and continues the windows, so a window interrupted by a restart
+ * still ends up as one row.
+ *
+ * Closed windows are appended to one file per tier, rollup-1m.dat,
+ * rollup-1h.dat and rollup-1d.dat. A file starts with "DLOGGRUP", the
+ * version and the row size (4 bytes each), followed by the rows:
+ *   0   start of the window in ms since the epoch (8 bytes)
+ *   8   device, controller, flags (1 byte each), 1 reserved byte
+ *   12  number of samples (4 bytes)
+ *   16  time covered by the integration in ms (4 bytes), 4 reserved bytes
+ *   24  sensor types of the last sample as in the store records (8 bytes)
+ *   32  inputs: number of values (4 bytes), minimum, maximum (2 bytes
+ *       signed each) and sum (8 bytes signed) in the fixed point units of
+ *       the store records, 16 bytes per input
+ *   288 time every output was on in ms (4 bytes each), 4 reserved bytes
+ *   344 heat register energy integrated from the power in 0.01 kW * ms
+ *       (8 bytes signed each)
+ * All numbers are little endian.
+ */
+#define ROLLUP_MAGIC       "DLOGGRUP"
+#define ROLLUP_VERSION     1
+#define ROLLUP_HEADER_SIZE 16
+#define ROLLUP_ROW_SIZE    360
+#define ROLLUP_TIERS       3
+#define ROLLUP_MAX_GAP     600000LL     /* ms */
+#define ROLLUP_KWH         360000000.0  /* 0.01 kW * ms per kWh */
+#define ROLLUP_ROW_OPEN    0x01         /* flag: the window was still open when the row was written */
+
+/**
+ * the values of one input in a window
+ */
+struct RollupInput
+{
+    unsigned long count;
+    int min;
+    int max;
+    long long sum;
+};
+
+/**
+ * an aggregation window of one controller
+ */
+struct RollupWindow
+{
+    long long start;            /* ms since the epoch */
+    unsigned int device;
+    unsigned int controller;
+    unsigned long samples;
+    long long covered;          /* ms integrated */
+    unsigned long long types;   /* sensor type of input i in bits 4i to 4i+3 */
+    struct RollupInput inputs[UVR1611_INPUTS];
+    long long onTime[UVR1611_OUTPUTS];              /* ms */
+    long long energy[UVR1611_HEAT_REGISTERS];       /* 0.01 kW * ms */
+    int open;
+};
+
+/**
+ * the running windows of a controller
+ */
+struct RollupSource
+{
+    unsigned int device;
+    unsigned int controller;
+    unsigned char last[STORE_RECORD_SIZE];  /* the previous sample, its time is 0 before the first one */
+    struct RollupWindow windows[ROLLUP_TIERS];
+    struct RollupWindow restored[ROLLUP_TIERS]; /* what the windows continued from the files already held */
+};
+
+/**
+ * maintains the rollups of all controllers
+ */
+struct Rollups
+{
+    int fds[ROLLUP_TIERS];
+    struct RollupSource **sources;
+    unsigned int sourceCount;
+    unsigned long rows;
+    unsigned long errors;
+};
+
+/**
+ * the length of the windows of a tier in ms
+ */
+extern long long const rollupPeriods[ROLLUP_TIERS];
+
+/**
+ * the names of the tiers: 1m, 1h and 1d
+ */
+extern char const *const rollupTierNames[ROLLUP_TIERS];
+
+/**
+ * open or create the rollup files of a directory. The windows written at the
+ * previous exit are continued.
+ *
+ * \return a pointer to the rollups on success, NULL else. errno will be set accordingly
+ */
+struct Rollups *initRollups(char const *directory);
+
+/**
+ * add a sample to the windows of its controller, the windows it closes are
+ * written. Rollups of NULL are ignored.
+ */
+void rollupSample(struct Rollups *rollups, struct Sample const *sample);
+
+/**
+ * write the open windows flagged with ROLLUP_ROW_OPEN and free the rollups
+ */
+void cleanupRollups(struct Rollups *rollups);
+
+/**
+ * add the values of a window to another one of a longer or the same period
+ */
+void mergeRollupWindow(struct RollupWindow *into, struct RollupWindow const *from);
+
+/**
+ * encode a window as a row of ROLLUP_ROW_SIZE bytes
+ */
+void encodeRollupRow(struct RollupWindow const *window, unsigned char *row);
+
+/**
+ * decode a row
+ */
+void decodeRollupRow(unsigned char const *row, struct RollupWindow *window);
+
+/**
+ * get the tier of a name as in rollupTierNames
+ *
+ * \return the tier, -1 for an unknown name
+ */
+int parseRollupTier(char const *name);
+
+/**
+ * build the path of the file of a tier
+ *
+ * \return the heap allocated path, NULL if out of memory
+ */
+char *rollupPath(char const *directory, int tier);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ROLLUP_H */
@@ -0,0 +1,168 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "scheduler.h"
+#include "logging.h"
+
+#define NSEC_PER_SEC 1000000000LL
+
+static long long toNanoseconds(struct timespec const *ts)
+{
+    return ((long long)ts->tv_sec) * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static void fromNanoseconds(struct timespec *ts, long long ns)
+{
+    ts->tv_sec = ns / NSEC_PER_SEC;
+    ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+/**
+ * arm the timer for the next aligned tick after now
+ *
+ * \return 0 on success, -1 else
+ */
+static int armScheduler(struct Scheduler *scheduler)
+{
+    struct itimerspec spec;
+    struct timespec now;
+    long long period;
+    long long next;
+    clock_gettime(CLOCK_REALTIME, &now);
+    period = toNanoseconds(&(scheduler->period));
+    next = (toNanoseconds(&now) / period + 1) * period;
+    fromNanoseconds(&(spec.it_value), next);
+    spec.it_interval = scheduler->period;
+    // the first tick is reported as the one right before the first scheduled one
+    fromNanoseconds(&(scheduler->scheduled), next - period);
+    // if somebody sets the clock, we want to know to realign the ticks
+    if (timerfd_settime(scheduler->fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, NULL) != 0) {
+        log_output(LOG_ERR, "Could not arm timer. %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+struct Scheduler *initScheduler(double period)
+{
+    struct Scheduler *scheduler;
+    if (period < MIN_SCHEDULER_PERIOD) {
+        errno = EINVAL;
+        return NULL;
+    }
+    scheduler = malloc(sizeof(struct Scheduler));
+    if (scheduler == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return NULL;
+    }
+    memset(scheduler, 0, sizeof(struct Scheduler));
+    fromNanoseconds(&(scheduler->period), llround(period * NSEC_PER_SEC));
+    scheduler->fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (scheduler->fd < 0) {
+        log_output(LOG_ERR, "Could not create timer. %s\n", strerror(errno));
+        free(scheduler);
+        return NULL;
+    }
+    if (armScheduler(scheduler) != 0) {
+        cleanupScheduler(scheduler);
+        return NULL;
+    }
+    return scheduler;
+}
+
+int waitForTick(struct Scheduler *scheduler, struct timespec *scheduled)
+{
+    uint64_t expirations;
+    ssize_t ret;
+    for (;;) {
+        ret = read(scheduler->fd, &expirations, sizeof(expirations));
+        if (ret == sizeof(expirations)) {
+            break;
+        }
+        if (ret < 0 && errno == ECANCELED) {
+            log_output(LOG_INFO, "System clock changed, realigning the schedule\n");
+            if (armScheduler(scheduler) != 0) {
+                return -1;
+            }
+            return SCHEDULER_NO_TICK;
+        }
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return SCHEDULER_NO_TICK;
+        }
+        log_output(LOG_ERR, "Could not wait for timer. %s\n", strerror(errno));
+        return -1;
+    }
+    fromNanoseconds(&(scheduler->scheduled),
+                    toNanoseconds(&(scheduler->scheduled)) + ((long long)expirations) * toNanoseconds(&(scheduler->period)));
+    ++scheduler->ticks;
+    if (expirations > 1) {
+        scheduler->missed += expirations - 1;
+        log_output(LOG_INFO, "Missed %lu deadline(s)\n", (unsigned long)(expirations - 1));
+    }
+    if (scheduled != NULL) {
+        *scheduled = scheduler->scheduled;
+    }
+    return (int)(expirations - 1);
+}
+
+long long recordJitter(struct Scheduler *scheduler, struct timespec const *received)
+{
+    long long jitter;
+    jitter = toNanoseconds(received) - toNanoseconds(&(scheduler->scheduled));
+    if (jitter > scheduler->maxJitter) {
+        scheduler->maxJitter = jitter;
+    }
+    scheduler->sumJitter += jitter;
+    ++scheduler->jitterCount;
+    log_output(LOG_DEBUG, "Frame received %lld us after its deadline\n", jitter / 1000);
+    return jitter;
+}
+
+void logSchedulerStatistics(struct Scheduler *scheduler)
+{
+    if (scheduler != NULL) {
+        log_output(LOG_INFO, "Scheduler statistics: %lu ticks, %lu missed deadlines, jitter avg %lld us, max %lld us\n",
+                   scheduler->ticks, scheduler->missed,
+                   scheduler->jitterCount > 0 ? scheduler->sumJitter / (long long)scheduler->jitterCount / 1000 : 0LL,
+                   scheduler->maxJitter / 1000);
+    }
+}
+
+void cleanupScheduler(struct Scheduler *scheduler)
+{
+    if (scheduler != NULL) {
+        if (scheduler->fd >= 0) {
+            close(scheduler->fd);
+        }
+        free(scheduler);
+    }
+}
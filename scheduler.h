@@ -0,0 +1,99 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the shortest period in seconds, shorter ones would round to nothing */
+#define MIN_SCHEDULER_PERIOD 0.001
+
+/* waitForTick() found no tick, e.g. after the schedule was realigned */
+#define SCHEDULER_NO_TICK -2
+
+/**
+ * a periodic timer firing on wall-clock aligned ticks, i.e. at times which
+ * are a multiple of the period since the epoch. A 10 s period thus fires at
+ * hh:mm:00, hh:mm:10, ... independently of how long the work between two
+ * ticks takes, so the sampling does not drift.
+ */
+struct Scheduler
+{
+    int fd;                      /* the timerfd driving the ticks */
+    struct timespec period;
+    struct timespec scheduled;   /* the time the last tick was scheduled for */
+    unsigned long ticks;         /* number of ticks delivered */
+    unsigned long missed;        /* number of ticks which passed while we were busy */
+    long long maxJitter;         /* maximum delay between scheduled time and frame reception in ns */
+    long long sumJitter;         /* sum of all jitter values in ns */
+    unsigned long jitterCount;   /* number of jitter values recorded */
+};
+
+/**
+ * create a new scheduler
+ *
+ * \param period the period between two ticks in seconds. Fractions of a second down to
+ *        MIN_SCHEDULER_PERIOD are allowed.
+ * \return a pointer to the scheduler on success, NULL else. errno will be set accordingly
+ */
+struct Scheduler *initScheduler(double period);
+
+/**
+ * consume the tick signalled by the timer fd. The fd is non-blocking, so
+ * this is meant to be called when epoll reports it readable.
+ *
+ * \param scheduler the scheduler to wait for
+ * \param scheduled if not NULL, receives the time the tick was scheduled for
+ * \return the number of ticks missed since the last call (0 normally), SCHEDULER_NO_TICK if
+ *         there was no tick or the clock was set and the schedule realigned, -1 on error.
+ *         errno will be set accordingly
+ */
+int waitForTick(struct Scheduler *scheduler, struct timespec *scheduled);
+
+/**
+ * record the time the frame requested on a tick was actually received
+ *
+ * \param scheduler the scheduler which delivered the tick
+ * \param received the time the frame was received (CLOCK_REALTIME)
+ * \return the jitter, i.e. the delay between the scheduled and the actual time, in ns
+ */
+long long recordJitter(struct Scheduler *scheduler, struct timespec const *received);
+
+/**
+ * log the deadline statistics of the scheduler
+ */
+void logSchedulerStatistics(struct Scheduler *scheduler);
+
+/**
+ * clean up the scheduler
+ */
+void cleanupScheduler(struct Scheduler *scheduler);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SCHEDULER_H */
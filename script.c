@@ -0,0 +1,389 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+
+#include <spawn.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#include "script.h"
+#include "logging.h"
+
+extern char **environ;
+
+/* characters a command line needs the shell for */
+#define SHELL_CHARACTERS "|&;<>()$`\\\"'*?[]#~=%{}\n"
+
+static void initNames(struct ScriptNames *names, char const *prefix)
+{
+    int i;
+    for (i = 0; i < UVR1611_INPUTS; ++i) {
+        snprintf(names->type[i], SCRIPT_NAME_SIZE, "%s_%d_TYPE=", prefix, i+1);
+        snprintf(names->value[i], SCRIPT_NAME_SIZE, "%s_%d_VALUE=", prefix, i+1);
+        snprintf(names->current[i], SCRIPT_NAME_SIZE, "%s_%d_VALUE_CURRENT=", prefix, i+1);
+        snprintf(names->total[i], SCRIPT_NAME_SIZE, "%s_%d_VALUE_TOTAL=", prefix, i+1);
+    }
+    snprintf(names->count, SCRIPT_NAME_SIZE, "%sS=", prefix);
+}
+
+/**
+ * split the command line at blanks
+ *
+ * \return 0 on success, -1 if there are too many arguments
+ */
+static int splitCommandLine(struct ScriptRunner *runner)
+{
+    char *saveptr = NULL;
+    char *arg;
+    int argc = 0;
+    for (arg = strtok_r(runner->commandLine, " \t", &saveptr); arg != NULL; arg = strtok_r(NULL, " \t", &saveptr)) {
+        if (argc == SCRIPT_MAX_ARGS) {
+            return -1;
+        }
+        runner->argv[argc++] = arg;
+    }
+    runner->argv[argc] = NULL;
+    return argc > 0 ? 0 : -1;
+}
+
+int initSpawnAttributes(posix_spawnattr_t *attributes)
+{
+    sigset_t signals;
+    int ret = posix_spawnattr_init(attributes);
+    if (ret != 0) {
+        return ret;
+    }
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(attributes, &signals);
+    sigaddset(&signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(attributes, &signals);
+    return posix_spawnattr_setflags(attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+}
+
+struct ScriptRunner *initScriptRunner(char const * const program, int shell)
+{
+    struct ScriptRunner *runner;
+    unsigned int count = 0;
+    unsigned int i;
+    runner = calloc(1, sizeof(struct ScriptRunner));
+    if (runner == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return NULL;
+    }
+    errno = initSpawnAttributes(&(runner->attributes));
+    if (errno != 0) {
+        log_output(LOG_ERR, "Could not prepare running %s. %s\n", program, strerror(errno));
+        free(runner);
+        return NULL;
+    }
+    runner->program = strdup(program);
+    runner->commandLine = strdup(program);
+    while (environ[count] != NULL) {
+        ++count;
+    }
+    runner->envp = malloc((count + SCRIPT_MAX_VARS + 1) * sizeof(char *));
+    if (runner->program == NULL || runner->commandLine == NULL || runner->envp == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        cleanupScriptRunner(runner);
+        return NULL;
+    }
+    if (shell) {
+        runner->argv[0] = "/bin/sh";
+        runner->argv[1] = "-c";
+        runner->argv[2] = runner->program;
+        runner->argv[3] = NULL;
+    }
+    else {
+        if (strpbrk(program, SHELL_CHARACTERS) != NULL) {
+            log_output(LOG_WARNING, "%s looks like a shell command, it is executed without a shell unless -S is given\n", program);
+        }
+        if (splitCommandLine(runner) != 0) {
+            log_output(LOG_ERR, "Invalid command line %s\n", program);
+            cleanupScriptRunner(runner);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+    runner->timeout = DEFAULT_SCRIPT_TIMEOUT * 1000;
+    runner->usePath = strchr(runner->argv[0], '/') == NULL;
+    // the environment is taken over once, stale UVR_* variables would confuse the program
+    for (i = 0; environ[i] != NULL; ++i) {
+        if (strncmp(environ[i], "UVR_", 4) != 0) {
+            runner->envp[runner->inherited++] = environ[i];
+        }
+    }
+    initNames(&(runner->inputs), "UVR_INPUT");
+    initNames(&(runner->outputs), "UVR_OUTPUT");
+    initNames(&(runner->heatRegisters), "UVR_HEATREG");
+    initNames(&(runner->rotations), "UVR_ROTATION");
+    return runner;
+}
+
+/**
+ * builds the environment of one run in the arena
+ */
+struct EnvironmentBuilder
+{
+    struct ScriptRunner *runner;
+    size_t used;
+    unsigned int count;
+    int overflow;
+};
+
+/**
+ * add a variable with a precomputed "NAME=" prefix
+ */
+static void addVariable(struct EnvironmentBuilder *builder, char const *name, char const *format, ...)
+{
+    struct ScriptRunner *runner = builder->runner;
+    char *entry = runner->arena + builder->used;
+    size_t space = SCRIPT_ARENA_SIZE - builder->used;
+    size_t nameLength = strlen(name);
+    va_list args;
+    int length;
+    if (builder->overflow || nameLength >= space || builder->count == SCRIPT_MAX_VARS) {
+        builder->overflow = 1;
+        return;
+    }
+    memcpy(entry, name, nameLength);
+    va_start(args, format);
+    length = vsnprintf(entry + nameLength, space - nameLength, format, args);
+    va_end(args);
+    if (length < 0 || (size_t)length >= space - nameLength) {
+        builder->overflow = 1;
+        return;
+    }
+    runner->envp[runner->inherited + builder->count++] = entry;
+    builder->used += nameLength + length + 1;
+}
+
+static char const *typeName(int type)
+{
+    switch (type) {
+        case UNUSED:
+            return "UNUSED";
+        case DIGITAL:
+            return "DIGITAL";
+        case TEMPERATURE:
+            return "TEMPERATURE";
+        case FLOW:
+            return "FLOW";
+        case ROTATION:
+            return "ROTATION";
+        case HEAT:
+            return "HEAT";
+    }
+    return "UNKNOWN";
+}
+
+static void addValueList(struct EnvironmentBuilder *builder, struct ScriptNames *names, struct Value *values, unsigned int count, unsigned int changed)
+{
+    struct ValueIterator it;
+    struct Value *value;
+    int delivered = 0;
+    initChangedValueIterator(&it, values, count, changed);
+    while ((value = nextValue(&it)) != NULL) {
+        int index = (int)(value->valueID) - 1;
+        ++delivered;
+        if (index < 0 || index >= UVR1611_INPUTS) {
+            continue;
+        }
+        addVariable(builder, names->type[index], "%s", typeName(value->valueType));
+        switch (value->valueType) {
+            case UNUSED:
+                addVariable(builder, names->value[index], "UNUSED");
+                break;
+            case DIGITAL:
+                addVariable(builder, names->value[index], "%d", value->value.enabled ? 1 : 0);
+                break;
+            case TEMPERATURE:
+                addVariable(builder, names->value[index], "%.1f", value->value.temperature);
+                break;
+            case FLOW:
+                addVariable(builder, names->value[index], "%d", value->value.flow);
+                break;
+            case ROTATION:
+                addVariable(builder, names->value[index], "%d", value->value.rotation);
+                break;
+            case HEAT:
+                addVariable(builder, names->current[index], "%.2f", value->value.heat.current);
+                addVariable(builder, names->total[index], "%.1f", value->value.heat.total);
+                break;
+        }
+    }
+    addVariable(builder, names->count, "%d", delivered);
+}
+
+int buildScriptEnvironment(struct ScriptRunner *runner, struct Sample *sample)
+{
+    struct SystemState *state = &(sample->state);
+    struct EnvironmentBuilder builder;
+    builder.runner = runner;
+    builder.used = 0;
+    builder.count = 0;
+    builder.overflow = 0;
+    addVariable(&builder, "UVR_TIMESTAMP=", "%ld.%03ld", (long)sample->timestamp.tv_sec, sample->timestamp.tv_nsec / 1000000);
+    addVariable(&builder, "UVR_DEVICE=", "%u", sample->deviceID);
+    addVariable(&builder, "UVR_CONTROLLER=", "%u", sample->controllerID);
+    addValueList(&builder, &(runner->inputs), state->inputs, state->inputCount, state->inputsChanged);
+    addValueList(&builder, &(runner->outputs), state->outputs, state->outputCount, state->outputsChanged);
+    addValueList(&builder, &(runner->heatRegisters), state->heatRegisters, state->heatRegisterCount, state->heatRegistersChanged);
+    addValueList(&builder, &(runner->rotations), state->rotations, state->rotationCount, state->rotationsChanged);
+    if (builder.overflow) {
+        log_output(LOG_ERR, "The environment of %s does not fit into %d bytes\n", runner->program, SCRIPT_ARENA_SIZE);
+        return -1;
+    }
+    runner->envp[runner->inherited + builder.count] = NULL;
+    return (int)builder.count;
+}
+
+static long long monotonicMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * A pidfd tells when the child exited, without one the child is polled with
+ * growing delays.
+ */
+int waitForChild(pid_t child, int *status, int timeout)
+{
+    long long deadline = monotonicMs() + timeout;
+    int delay = 1;
+    int fd = -1;
+#ifdef SYS_pidfd_open
+    fd = syscall(SYS_pidfd_open, child, 0);
+#endif
+    for (;;) {
+        long long remaining;
+        pid_t ret = waitpid(child, status, WNOHANG);
+        if (ret == child) {
+            break;
+        }
+        if (ret < 0 && errno != EINTR) {
+            int error = errno;
+            if (fd >= 0) {
+                close(fd);
+            }
+            errno = error;
+            return -1;
+        }
+        remaining = deadline - monotonicMs();
+        if (remaining <= 0) {
+            kill(child, SIGKILL);
+            while (waitpid(child, status, 0) < 0 && errno == EINTR) {
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (fd >= 0) {
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            poll(&pfd, 1, (int)remaining);
+        }
+        else {
+            struct timespec pause;
+            if (delay > remaining) {
+                delay = (int)remaining;
+            }
+            pause.tv_sec = delay / 1000;
+            pause.tv_nsec = (delay % 1000) * 1000000L;
+            nanosleep(&pause, NULL);
+            delay = delay < 64 ? delay * 2 : delay;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return 0;
+}
+
+int runScript(struct ScriptRunner *runner, struct Sample *sample)
+{
+    pid_t child;
+    int status;
+    int ret;
+    if (buildScriptEnvironment(runner, sample) < 0) {
+        ++runner->failures;
+        return -1;
+    }
+    log_output(LOG_DEBUG, "Executing %s\n", runner->program);
+    if (runner->usePath) {
+        ret = posix_spawnp(&child, runner->argv[0], NULL, &(runner->attributes), runner->argv, runner->envp);
+    }
+    else {
+        ret = posix_spawn(&child, runner->argv[0], NULL, &(runner->attributes), runner->argv, runner->envp);
+    }
+    ++runner->runs;
+    if (ret != 0) {
+        log_output(LOG_ERR, "Could not execute %s. %s\n", runner->program, strerror(ret));
+        ++runner->failures;
+        return -1;
+    }
+    if (waitForChild(child, &status, runner->timeout) != 0) {
+        if (errno == ETIMEDOUT) {
+            log_output(LOG_ERR, "%s did not finish within %d ms, killed it\n", runner->program, runner->timeout);
+            ++runner->timeouts;
+        }
+        ++runner->failures;
+        return -1;
+    }
+    log_output(LOG_DEBUG, "%s finished\n", runner->program);
+    if (!WIFEXITED(status)) {
+        ++runner->failures;
+        return -1;
+    }
+    if (WEXITSTATUS(status) != 0) {
+        ++runner->failures;
+    }
+    return WEXITSTATUS(status);
+}
+
+void cleanupScriptRunner(struct ScriptRunner *runner)
+{
+    if (runner == NULL) {
+        return;
+    }
+    if (runner->runs > 0) {
+        log_output(LOG_INFO, "Ran %s %lu times, %lu runs failed, %lu timed out\n",
+                   runner->program, runner->runs, runner->failures, runner->timeouts);
+    }
+    posix_spawnattr_destroy(&(runner->attributes));
+    free(runner->program);
+    free(runner->commandLine);
+    free(runner->envp);
+    free(runner);
+}
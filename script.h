@@ -0,0 +1,131 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stddef.h>
+#include <spawn.h>
+#include <sys/types.h>
+
+#include "datatypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SCRIPT_MAX_ARGS    32
+#define SCRIPT_ARENA_SIZE  8192
+/* timestamp, device, controller, four counts and type plus up to two values per value */
+#define SCRIPT_MAX_VARS    (7 + 2 * (UVR1611_INPUTS + UVR1611_OUTPUTS + UVR1611_ROTATIONS) + 3 * UVR1611_HEAT_REGISTERS)
+#define SCRIPT_NAME_SIZE   32
+#define DEFAULT_SCRIPT_TIMEOUT 60   /* seconds */
+
+/**
+ * the precomputed "NAME=" prefixes of one value group, indexed by value id - 1
+ */
+struct ScriptNames
+{
+    char type[UVR1611_INPUTS][SCRIPT_NAME_SIZE];
+    char value[UVR1611_INPUTS][SCRIPT_NAME_SIZE];
+    char current[UVR1611_INPUTS][SCRIPT_NAME_SIZE];
+    char total[UVR1611_INPUTS][SCRIPT_NAME_SIZE];
+    char count[SCRIPT_NAME_SIZE];
+};
+
+/**
+ * runs the -s program once per sample.
+ *
+ * The program is started with posix_spawn() and gets its environment in a
+ * single envp array built per sample in a fixed arena: the environment of
+ * the reader as it was at startup followed by the UVR_* variables, whose
+ * names are computed once. Unless shell mode is requested, the command line
+ * is split at blanks and executed directly without /bin/sh.
+ */
+struct ScriptRunner
+{
+    char *program;
+    char *commandLine;                  /* copy of the program split into argv */
+    char *argv[SCRIPT_MAX_ARGS+1];
+    int usePath;                        /* argv[0] has no slash -> search PATH */
+    char **envp;                        /* inherited variables followed by room for the UVR_* variables */
+    unsigned int inherited;             /* number of inherited variables at the start of envp */
+    char arena[SCRIPT_ARENA_SIZE];      /* storage of the UVR_* variables of the current sample */
+    struct ScriptNames inputs;
+    struct ScriptNames outputs;
+    struct ScriptNames heatRegisters;
+    struct ScriptNames rotations;
+    posix_spawnattr_t attributes;
+    int timeout;                        /* ms a run may take before the program is killed */
+    unsigned long runs;
+    unsigned long failures;
+    unsigned long timeouts;
+};
+
+/**
+ * prepare spawn attributes which give the child the default signal mask and
+ * the default SIGPIPE handling, whatever the reader blocks or ignores
+ *
+ * \return 0 on success, an error number else
+ */
+int initSpawnAttributes(posix_spawnattr_t *attributes);
+
+/**
+ * wait for a child to exit and kill it if it takes longer than the timeout
+ *
+ * \param timeout the time the child may take in ms
+ * \return 0 if the child exited and status is set, -1 else. errno is ETIMEDOUT if the child was killed
+ */
+int waitForChild(pid_t child, int *status, int timeout);
+
+/**
+ * prepare running the program
+ *
+ * \param program the command line
+ * \param shell run the command line via /bin/sh -c, needed for pipes, quoting and the like
+ * \return a pointer to the runner on success, NULL else. errno will be set accordingly
+ */
+struct ScriptRunner *initScriptRunner(char const * const program, int shell);
+
+/**
+ * build the environment of the program for a sample in runner->envp
+ *
+ * \return the number of UVR_* variables, -1 if they did not fit into the arena
+ */
+int buildScriptEnvironment(struct ScriptRunner *runner, struct Sample *sample);
+
+/**
+ * run the program for a sample and wait for it to finish. A program still
+ * running after runner->timeout is killed, which counts as a failure.
+ *
+ * \return the exit status of the program, -1 if it could not be run, was killed or timed out
+ */
+int runScript(struct ScriptRunner *runner, struct Sample *sample);
+
+/**
+ * clean up the runner
+ */
+void cleanupScriptRunner(struct ScriptRunner *runner);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SCRIPT_H */
@@ -0,0 +1,165 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sharedstate.h"
+#include "logging.h"
+
+static struct SharedState *mapSharedState(char const * const name, int fd, int writable)
+{
+    struct SharedState *shared;
+    void *mapping;
+    mapping = mmap(NULL, sizeof(struct SharedStateSegment), writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        log_output(LOG_ERR, "Could not map shared memory %s. %s\n", name, strerror(errno));
+        return NULL;
+    }
+    shared = malloc(sizeof(struct SharedState));
+    if (shared != NULL) {
+        shared->name = strdup(name);
+    }
+    if (shared == NULL || shared->name == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        free(shared);
+        munmap(mapping, sizeof(struct SharedStateSegment));
+        return NULL;
+    }
+    shared->segment = mapping;
+    shared->writable = writable;
+    return shared;
+}
+
+struct SharedState *createSharedState(char const * const name)
+{
+    struct SharedState *shared;
+    struct SharedStateSegment *segment;
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        log_output(LOG_ERR, "Could not open shared memory %s. %s\n", name, strerror(errno));
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(struct SharedStateSegment)) != 0) {
+        log_output(LOG_ERR, "Could not size shared memory %s. %s\n", name, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    shared = mapSharedState(name, fd, 1);
+    if (shared == NULL) {
+        return NULL;
+    }
+    segment = shared->segment;
+    // invalidate the magic first, so nobody trusts a segment left over by an older writer while it is reset
+    __atomic_store_n(&(segment->version), 0, __ATOMIC_RELEASE);
+    memset(segment->slots, 0, sizeof(segment->slots));
+    memcpy(segment->magic, SHARED_STATE_MAGIC, sizeof(segment->magic));
+    segment->slotCount = SHARED_STATE_SLOTS;
+    segment->sampleSize = sizeof(struct Sample);
+    segment->reserved = 0;
+    __atomic_store_n(&(segment->version), SHARED_STATE_VERSION, __ATOMIC_RELEASE);
+    return shared;
+}
+
+void publishSample(struct SharedState *shared, struct Sample const *sample)
+{
+    struct SharedStateSlot *slot;
+    unsigned long sequence;
+    if (shared == NULL || sample->deviceID < 1 || sample->deviceID > SHARED_STATE_DEVICES ||
+        sample->controllerID < 1 || sample->controllerID > MAX_CONTROLLERS) {
+        return;
+    }
+    slot = &(shared->segment->slots[(sample->deviceID-1) * MAX_CONTROLLERS + sample->controllerID-1]);
+    sequence = slot->sequence; // we are the only writer
+    __atomic_store_n(&(slot->sequence), sequence+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&(slot->sample), sample, sizeof(struct Sample));
+    __atomic_store_n(&(slot->sequence), sequence+2, __ATOMIC_RELEASE);
+}
+
+struct SharedState *attachSharedState(char const * const name)
+{
+    struct SharedState *shared;
+    struct SharedStateSegment *segment;
+    struct stat info;
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(struct SharedStateSegment)) {
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+    shared = mapSharedState(name, fd, 0);
+    if (shared == NULL) {
+        return NULL;
+    }
+    segment = shared->segment;
+    if (memcmp(segment->magic, SHARED_STATE_MAGIC, sizeof(segment->magic)) != 0 ||
+        __atomic_load_n(&(segment->version), __ATOMIC_ACQUIRE) != SHARED_STATE_VERSION ||
+        segment->slotCount != SHARED_STATE_SLOTS || segment->sampleSize != sizeof(struct Sample)) {
+        releaseSharedState(shared);
+        errno = EPROTO;
+        return NULL;
+    }
+    return shared;
+}
+
+int readSharedSample(struct SharedState *shared, unsigned int deviceID, unsigned int controllerID, struct Sample *sample)
+{
+    struct SharedStateSlot *slot;
+    unsigned long before;
+    unsigned long after;
+    if (shared == NULL || deviceID < 1 || deviceID > SHARED_STATE_DEVICES || controllerID < 1 || controllerID > MAX_CONTROLLERS) {
+        return -1;
+    }
+    slot = &(shared->segment->slots[(deviceID-1) * MAX_CONTROLLERS + controllerID-1]);
+    do {
+        before = __atomic_load_n(&(slot->sequence), __ATOMIC_ACQUIRE);
+        if (before == 0) {
+            return 0;
+        }
+        memcpy(sample, &(slot->sample), sizeof(struct Sample));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&(slot->sequence), __ATOMIC_RELAXED);
+    } while ((before & 1) != 0 || before != after);
+    return 1;
+}
+
+void releaseSharedState(struct SharedState *shared)
+{
+    if (shared == NULL) {
+        return;
+    }
+    munmap(shared->segment, sizeof(struct SharedStateSegment));
+    if (shared->writable) {
+        shm_unlink(shared->name);
+    }
+    free(shared->name);
+    free(shared);
+}
@@ -0,0 +1,115 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef SHAREDSTATE_H
+#define SHAREDSTATE_H
+
+#include "datatypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHARED_STATE_NAME    "/dlogg-reader"
+#define SHARED_STATE_MAGIC   "DLOGGSHM"
+#define SHARED_STATE_VERSION 1
+#define SHARED_STATE_DEVICES 8
+#define SHARED_STATE_SLOTS   (SHARED_STATE_DEVICES * MAX_CONTROLLERS)
+
+/**
+ * the latest sample of one controller, guarded by a seqlock.
+ *
+ * The writer makes sequence odd, copies the sample and makes sequence even
+ * again. A reader copies the sample and retries if sequence was odd or
+ * changed in the meantime, so readers never block the writer and need no
+ * system call at all.
+ */
+struct SharedStateSlot
+{
+    unsigned long sequence;  /* odd while the sample is being written, 0 if there never was a sample */
+    struct Sample sample;
+};
+
+/**
+ * the layout of the shared memory segment. The slot of a controller is
+ * (deviceID-1) * MAX_CONTROLLERS + controllerID-1.
+ */
+struct SharedStateSegment
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int slotCount;
+    unsigned int sampleSize;          /* sizeof(struct Sample) of the writer, guards against layout changes */
+    unsigned int reserved;
+    struct SharedStateSlot slots[SHARED_STATE_SLOTS];
+};
+
+/**
+ * a mapping of the segment
+ */
+struct SharedState
+{
+    struct SharedStateSegment *segment;
+    char *name;
+    int writable;
+};
+
+/**
+ * create (or reuse) the segment and map it for writing. There must be only
+ * one writer.
+ *
+ * \param name the POSIX shared memory name, starting with a slash
+ * \return a pointer to the mapping on success, NULL else. errno will be set accordingly
+ */
+struct SharedState *createSharedState(char const * const name);
+
+/**
+ * publish a sample in its controller's slot. Samples of devices beyond
+ * SHARED_STATE_DEVICES are ignored.
+ */
+void publishSample(struct SharedState *shared, struct Sample const *sample);
+
+/**
+ * map an existing segment read-only
+ *
+ * \return a pointer to the mapping on success, NULL else. errno will be set accordingly
+ */
+struct SharedState *attachSharedState(char const * const name);
+
+/**
+ * copy the latest sample of a controller
+ *
+ * \param deviceID the device number, starting with 1
+ * \param controllerID the controller number, starting with 1
+ * \return 1 if a sample was copied, 0 if the controller never published one, -1 on invalid parameters
+ */
+int readSharedSample(struct SharedState *shared, unsigned int deviceID, unsigned int controllerID, struct Sample *sample);
+
+/**
+ * unmap the segment. The writer also removes the name, readers keep
+ * their mapping until they release it themselves.
+ */
+void releaseSharedState(struct SharedState *shared);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SHAREDSTATE_H */
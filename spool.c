@@ -0,0 +1,595 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "spool.h"
+#include "logging.h"
+
+#define SPOOL_PATH_MAX  4096
+#define SPOOL_NAME_SIZE 28      /* "/", 20 digits, ".spool" and the terminator */
+
+static void putNumber(unsigned char *buffer, unsigned long long value, int bytes)
+{
+    int i;
+    for (i = 0; i < bytes; ++i) {
+        buffer[i] = (value >> (8*i)) & 0xFF;
+    }
+}
+
+static unsigned long long getNumber(unsigned char const *buffer, int bytes)
+{
+    unsigned long long value = 0;
+    int i;
+    for (i = bytes-1; i >= 0; --i) {
+        value = (value << 8) | buffer[i];
+    }
+    return value;
+}
+
+/**
+ * write a buffer completely
+ */
+static int writeAll(int fd, unsigned char const *buffer, size_t length)
+{
+    while (length > 0) {
+        ssize_t ret = write(fd, buffer, length);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += ret;
+        length -= ret;
+    }
+    return 0;
+}
+
+static long long realtimeMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static unsigned long long pendingCount(struct Spool const *spool)
+{
+    return spool->next - spool->cursor;
+}
+
+static void segmentPath(struct Spool *spool, unsigned long long first, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%020llu.spool", spool->directory, first);
+}
+
+static unsigned long long segmentSize(struct SpoolSegment const *segment)
+{
+    return SPOOL_HEADER_SIZE + (unsigned long long)segment->count * SPOOL_RECORD_SIZE;
+}
+
+/**
+ * add a segment at the end of the list
+ */
+static int addSegment(struct Spool *spool, unsigned long long first, unsigned long count)
+{
+    if (spool->segmentCount == spool->capacity) {
+        unsigned int capacity = spool->capacity == 0 ? 16 : spool->capacity * 2;
+        struct SpoolSegment *grown = realloc(spool->segments, capacity * sizeof(struct SpoolSegment));
+        if (grown == NULL) {
+            log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+            return -1;
+        }
+        spool->segments = grown;
+        spool->capacity = capacity;
+    }
+    spool->segments[spool->segmentCount].first = first;
+    spool->segments[spool->segmentCount].count = count;
+    ++spool->segmentCount;
+    spool->bytes += segmentSize(&(spool->segments[spool->segmentCount-1]));
+    return 0;
+}
+
+/**
+ * delete the oldest segment
+ */
+static void removeOldest(struct Spool *spool)
+{
+    char path[SPOOL_PATH_MAX];
+    struct SpoolSegment *oldest = &(spool->segments[0]);
+    segmentPath(spool, oldest->first, path, sizeof(path));
+    if (unlink(path) != 0) {
+        log_output(LOG_ERR, "Could not delete %s. %s\n", path, strerror(errno));
+    }
+    if (spool->readFd >= 0 && spool->readFirst == oldest->first) {
+        close(spool->readFd);
+        spool->readFd = -1;
+    }
+    if (spool->segmentCount == 1 && spool->writeFd >= 0) {
+        close(spool->writeFd);
+        spool->writeFd = -1;
+    }
+    spool->bytes -= segmentSize(oldest);
+    --spool->segmentCount;
+    memmove(spool->segments, spool->segments + 1, spool->segmentCount * sizeof(struct SpoolSegment));
+}
+
+/**
+ * delete the segments behind the cursor. The newest segment is kept while
+ * samples are still appended to it.
+ */
+static void removeDelivered(struct Spool *spool)
+{
+    while (spool->segmentCount > 0 && spool->segments[0].first + spool->segments[0].count <= spool->cursor
+           && (spool->segmentCount > 1 || spool->segments[0].count >= SPOOL_SEGMENT_RECORDS)) {
+        removeOldest(spool);
+    }
+}
+
+/**
+ * sync the segments and write the cursor. The lock is not held, the
+ * descriptors are private copies, so the poller keeps appending meanwhile.
+ *
+ * \return the number of failed writes
+ */
+static unsigned long syncFiles(int writeFd, int retiredFd, int cursorFd, unsigned long long position)
+{
+    unsigned char cursor[8];
+    unsigned long errors = 0;
+    if ((retiredFd >= 0 && fsync(retiredFd) != 0) || (writeFd >= 0 && fsync(writeFd) != 0)) {
+        log_output(LOG_ERR, "Could not sync the spool. %s\n", strerror(errno));
+        ++errors;
+    }
+    putNumber(cursor, position, 8);
+    if (pwrite(cursorFd, cursor, sizeof(cursor), 0) != sizeof(cursor) || fsync(cursorFd) != 0) {
+        log_output(LOG_ERR, "Could not write the spool cursor. %s\n", strerror(errno));
+        ++errors;
+    }
+    return errors;
+}
+
+void spoolCheckSync(struct Spool *spool)
+{
+    unsigned long long position;
+    unsigned long errors;
+    int writeFd = -1;
+    int retiredFd;
+    pthread_mutex_lock(&(spool->lock));
+    if (spool->unsynced == 0
+        || (spool->unsynced < SPOOL_SYNC_RECORDS && realtimeMs() - spool->lastSync < SPOOL_SYNC_INTERVAL)) {
+        pthread_mutex_unlock(&(spool->lock));
+        return;
+    }
+    // the poller may close or replace the newest segment while the sync runs
+    if (spool->writeFd >= 0) {
+        writeFd = dup(spool->writeFd);
+    }
+    retiredFd = spool->retiredFd;
+    spool->retiredFd = -1;
+    position = spool->cursor;
+    spool->unsynced = 0;
+    spool->lastSync = realtimeMs();
+    pthread_mutex_unlock(&(spool->lock));
+    errors = syncFiles(writeFd, retiredFd, spool->cursorFd, position);
+    if (writeFd >= 0) {
+        close(writeFd);
+    }
+    if (retiredFd >= 0) {
+        close(retiredFd);
+    }
+    if (errors > 0) {
+        pthread_mutex_lock(&(spool->lock));
+        spool->errors += errors;
+        pthread_mutex_unlock(&(spool->lock));
+    }
+}
+
+static int compareSegments(void const *a, void const *b)
+{
+    unsigned long long first = ((struct SpoolSegment const *)a)->first;
+    unsigned long long second = ((struct SpoolSegment const *)b)->first;
+    return first < second ? -1 : first > second;
+}
+
+/**
+ * find the segments left over from an earlier run. A record cut off by a
+ * crash is removed.
+ */
+static int loadSegments(struct Spool *spool)
+{
+    DIR *dir;
+    struct dirent *entry;
+    dir = opendir(spool->directory);
+    if (dir == NULL) {
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned char header[SPOOL_HEADER_SIZE];
+        char path[SPOOL_PATH_MAX];
+        unsigned long long first;
+        struct stat info;
+        char *end;
+        int fd;
+        first = strtoull(entry->d_name, &end, 10);
+        if (end == entry->d_name || strcmp(end, ".spool") != 0) {
+            continue;
+        }
+        segmentPath(spool, first, path, sizeof(path));
+        fd = open(path, O_RDWR);
+        if (fd < 0 || fstat(fd, &info) != 0 || pread(fd, header, sizeof(header), 0) != sizeof(header)
+            || memcmp(header, SPOOL_MAGIC, 8) != 0 || getNumber(header + 12, 4) != SPOOL_RECORD_SIZE) {
+            log_output(LOG_WARNING, "Ignoring spool segment %s\n", path);
+            if (fd >= 0) {
+                close(fd);
+            }
+            continue;
+        }
+        if ((info.st_size - SPOOL_HEADER_SIZE) % SPOOL_RECORD_SIZE != 0) {
+            info.st_size -= (info.st_size - SPOOL_HEADER_SIZE) % SPOOL_RECORD_SIZE;
+            if (ftruncate(fd, info.st_size) != 0) {
+                log_output(LOG_ERR, "Could not truncate %s. %s\n", path, strerror(errno));
+            }
+        }
+        close(fd);
+        if (addSegment(spool, first, (info.st_size - SPOOL_HEADER_SIZE) / SPOOL_RECORD_SIZE) != 0) {
+            closedir(dir);
+            return -1;
+        }
+    }
+    closedir(dir);
+    qsort(spool->segments, spool->segmentCount, sizeof(struct SpoolSegment), compareSegments);
+    return 0;
+}
+
+struct Spool *initSpool(char const *directory, unsigned long long maxBytes)
+{
+    struct Spool *spool;
+    struct SpoolSegment *newest;
+    unsigned char cursor[8];
+    char path[SPOOL_PATH_MAX];
+    struct stat info;
+    if (stat(directory, &info) != 0) {
+        log_output(LOG_ERR, "Could not access spool %s. %s\n", directory, strerror(errno));
+        return NULL;
+    }
+    if (!S_ISDIR(info.st_mode)) {
+        errno = ENOTDIR;
+        return NULL;
+    }
+    if (strlen(directory) + SPOOL_NAME_SIZE > SPOOL_PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    spool = malloc(sizeof(struct Spool));
+    if (spool == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return NULL;
+    }
+    memset(spool, 0, sizeof(struct Spool));
+    errno = pthread_mutex_init(&(spool->lock), NULL);
+    if (errno != 0) {
+        log_output(LOG_ERR, "Could not create the spool lock. %s\n", strerror(errno));
+        free(spool);
+        return NULL;
+    }
+    spool->maxBytes = maxBytes;
+    spool->writeFd = -1;
+    spool->retiredFd = -1;
+    spool->readFd = -1;
+    spool->cursorFd = -1;
+    spool->directory = malloc(strlen(directory)+1);
+    if (spool->directory == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        cleanupSpool(spool);
+        return NULL;
+    }
+    strcpy(spool->directory, directory);
+    snprintf(path, sizeof(path), "%s/cursor", directory);
+    spool->cursorFd = open(path, O_RDWR | O_CREAT, 0644);
+    if (spool->cursorFd < 0 || loadSegments(spool) != 0) {
+        int error = errno;
+        cleanupSpool(spool);
+        errno = error;
+        return NULL;
+    }
+    if (spool->segmentCount > 0) {
+        newest = &(spool->segments[spool->segmentCount-1]);
+        spool->next = newest->first + newest->count;
+        spool->cursor = spool->segments[0].first;
+    }
+    if (pread(spool->cursorFd, cursor, sizeof(cursor), 0) == sizeof(cursor)) {
+        unsigned long long saved = getNumber(cursor, 8);
+        if (saved > spool->cursor) {
+            spool->cursor = saved;
+        }
+    }
+    if (spool->cursor > spool->next) {
+        // all segments were delivered and deleted, continue the numbering
+        spool->next = spool->cursor;
+    }
+    removeDelivered(spool);
+    if (spool->segmentCount > 0 && spool->segments[spool->segmentCount-1].count < SPOOL_SEGMENT_RECORDS) {
+        segmentPath(spool, spool->segments[spool->segmentCount-1].first, path, sizeof(path));
+        spool->writeFd = open(path, O_WRONLY | O_APPEND);
+    }
+    spool->lastSync = realtimeMs();
+    if (pendingCount(spool) > 0) {
+        log_output(LOG_INFO, "The spool holds %llu samples of an earlier run\n", pendingCount(spool));
+    }
+    return spool;
+}
+
+/**
+ * start a new segment with the next sequence number
+ */
+static int startSegment(struct Spool *spool)
+{
+    unsigned char header[SPOOL_HEADER_SIZE];
+    char path[SPOOL_PATH_MAX];
+    if (spool->writeFd >= 0) {
+        // the next sync still covers the finished segment. If the last one
+        // was not synced yet, the delivery thread is far behind and the
+        // older one is left to the kernel.
+        if (spool->retiredFd >= 0) {
+            close(spool->retiredFd);
+        }
+        spool->retiredFd = spool->writeFd;
+    }
+    segmentPath(spool, spool->next, path, sizeof(path));
+    spool->writeFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (spool->writeFd < 0) {
+        log_output(LOG_ERR, "Could not create spool segment %s. %s\n", path, strerror(errno));
+        return -1;
+    }
+    memset(header, 0, sizeof(header));
+    memcpy(header, SPOOL_MAGIC, 8);
+    putNumber(header + 8, SPOOL_VERSION, 4);
+    putNumber(header + 12, SPOOL_RECORD_SIZE, 4);
+    if (writeAll(spool->writeFd, header, sizeof(header)) != 0 || addSegment(spool, spool->next, 0) != 0) {
+        log_output(LOG_ERR, "Could not write spool segment %s. %s\n", path, strerror(errno));
+        close(spool->writeFd);
+        spool->writeFd = -1;
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * delete the oldest segments until the spool fits into its size limit again
+ */
+static void evict(struct Spool *spool)
+{
+    while (spool->bytes > spool->maxBytes && spool->segmentCount > 1) {
+        struct SpoolSegment *oldest = &(spool->segments[0]);
+        unsigned long long end = oldest->first + oldest->count;
+        if (spool->cursor < end) {
+            unsigned long long lost = end - (spool->cursor > oldest->first ? spool->cursor : oldest->first);
+            log_output(LOG_WARNING, "The spool is full, dropped the %llu oldest samples\n", lost);
+            spool->evicted += lost;
+            spool->cursor = end;
+        }
+        removeOldest(spool);
+    }
+}
+
+int spoolAppend(struct Spool *spool, struct Sample const *sample)
+{
+    unsigned char record[SPOOL_RECORD_SIZE];
+    struct SystemState const *state = &(sample->state);
+    encodeStoreRecord(sample, record);
+    putNumber(record + STORE_RECORD_SIZE, state->inputsChanged, 2);
+    putNumber(record + STORE_RECORD_SIZE + 2, state->outputsChanged, 2);
+    record[STORE_RECORD_SIZE + 4] = state->heatRegistersChanged;
+    record[STORE_RECORD_SIZE + 5] = state->rotationsChanged;
+    record[STORE_RECORD_SIZE + 6] = 0;
+    record[STORE_RECORD_SIZE + 7] = 0;
+    pthread_mutex_lock(&(spool->lock));
+    if ((spool->writeFd < 0 || spool->segments[spool->segmentCount-1].count >= SPOOL_SEGMENT_RECORDS)
+        && startSegment(spool) != 0) {
+        ++spool->errors;
+        pthread_mutex_unlock(&(spool->lock));
+        return -1;
+    }
+    if (writeAll(spool->writeFd, record, sizeof(record)) != 0) {
+        log_output(LOG_ERR, "Could not write to the spool. %s\n", strerror(errno));
+        ++spool->errors;
+        pthread_mutex_unlock(&(spool->lock));
+        return -1;
+    }
+    ++spool->segments[spool->segmentCount-1].count;
+    spool->bytes += SPOOL_RECORD_SIZE;
+    ++spool->next;
+    ++spool->appended;
+    evict(spool);
+    ++spool->unsynced;
+    pthread_mutex_unlock(&(spool->lock));
+    return 0;
+}
+
+/**
+ * read the sample at the cursor, the lock is held
+ */
+static int peekRecord(struct Spool *spool, struct Sample *sample)
+{
+    unsigned char record[SPOOL_RECORD_SIZE];
+    struct SpoolSegment *segment = NULL;
+    unsigned int i;
+    if (spool->cursor >= spool->next) {
+        return 0;
+    }
+    for (i = 0; i < spool->segmentCount; ++i) {
+        if (spool->cursor < spool->segments[i].first + spool->segments[i].count) {
+            segment = &(spool->segments[i]);
+            break;
+        }
+    }
+    if (segment == NULL) {
+        return 0;
+    }
+    if (spool->cursor < segment->first) {
+        // the segment holding the cursor could not be created
+        spool->cursor = segment->first;
+    }
+    if (spool->readFd < 0 || spool->readFirst != segment->first) {
+        char path[SPOOL_PATH_MAX];
+        if (spool->readFd >= 0) {
+            close(spool->readFd);
+        }
+        segmentPath(spool, segment->first, path, sizeof(path));
+        spool->readFd = open(path, O_RDONLY);
+        if (spool->readFd < 0) {
+            log_output(LOG_ERR, "Could not open spool segment %s. %s\n", path, strerror(errno));
+            return -1;
+        }
+        spool->readFirst = segment->first;
+    }
+    if (pread(spool->readFd, record, sizeof(record),
+              SPOOL_HEADER_SIZE + (off_t)(spool->cursor - segment->first) * SPOOL_RECORD_SIZE) != sizeof(record)) {
+        log_output(LOG_ERR, "Could not read from the spool. %s\n", strerror(errno));
+        return -1;
+    }
+    decodeStoreRecord(record, sample);
+    sample->state.inputsChanged = getNumber(record + STORE_RECORD_SIZE, 2);
+    sample->state.outputsChanged = getNumber(record + STORE_RECORD_SIZE + 2, 2);
+    sample->state.heatRegistersChanged = record[STORE_RECORD_SIZE + 4];
+    sample->state.rotationsChanged = record[STORE_RECORD_SIZE + 5];
+    spool->peeked = spool->cursor;
+    return 1;
+}
+
+int spoolPeek(struct Spool *spool, struct Sample *sample)
+{
+    int ret;
+    pthread_mutex_lock(&(spool->lock));
+    ret = peekRecord(spool, sample);
+    pthread_mutex_unlock(&(spool->lock));
+    return ret;
+}
+
+void spoolAdvance(struct Spool *spool)
+{
+    pthread_mutex_lock(&(spool->lock));
+    if (spool->backoff > 0) {
+        log_output(LOG_INFO, "Delivery works again, %llu spooled samples pending\n", pendingCount(spool));
+        spool->backoff = 0;
+    }
+    ++spool->delivered;
+    // an eviction may have moved the cursor past the delivered sample already
+    if (spool->cursor == spool->peeked) {
+        ++spool->cursor;
+        removeDelivered(spool);
+        ++spool->unsynced;
+    }
+    pthread_mutex_unlock(&(spool->lock));
+}
+
+void spoolFailed(struct Spool *spool)
+{
+    pthread_mutex_lock(&(spool->lock));
+    if (spool->backoff == 0) {
+        spool->backoff = SPOOL_RETRY_MIN;
+        log_output(LOG_WARNING, "Delivery failed, spooling the samples\n");
+    }
+    else if (spool->backoff < SPOOL_RETRY_MAX) {
+        spool->backoff = spool->backoff * 2 > SPOOL_RETRY_MAX ? SPOOL_RETRY_MAX : spool->backoff * 2;
+    }
+    spool->retryAt = realtimeMs() + spool->backoff;
+    ++spool->failures;
+    pthread_mutex_unlock(&(spool->lock));
+}
+
+int spoolReady(struct Spool *spool)
+{
+    int ready;
+    pthread_mutex_lock(&(spool->lock));
+    ready = spool->cursor < spool->next && (spool->backoff == 0 || realtimeMs() >= spool->retryAt);
+    pthread_mutex_unlock(&(spool->lock));
+    return ready;
+}
+
+int spoolDeadline(struct Spool *spool, struct timespec *deadline)
+{
+    long long when;
+    pthread_mutex_lock(&(spool->lock));
+    if (spool->cursor < spool->next) {
+        when = spool->backoff > 0 ? spool->retryAt : 0;
+    }
+    else if (spool->unsynced > 0) {
+        when = spool->lastSync + SPOOL_SYNC_INTERVAL;
+    }
+    else {
+        pthread_mutex_unlock(&(spool->lock));
+        return 0;
+    }
+    if (spool->unsynced > 0 && spool->lastSync + SPOOL_SYNC_INTERVAL < when) {
+        when = spool->lastSync + SPOOL_SYNC_INTERVAL;
+    }
+    pthread_mutex_unlock(&(spool->lock));
+    deadline->tv_sec = when / 1000;
+    deadline->tv_nsec = (when % 1000) * 1000000;
+    return 1;
+}
+
+unsigned long long spoolPending(struct Spool *spool)
+{
+    unsigned long long pending;
+    pthread_mutex_lock(&(spool->lock));
+    pending = pendingCount(spool);
+    pthread_mutex_unlock(&(spool->lock));
+    return pending;
+}
+
+void cleanupSpool(struct Spool *spool)
+{
+    if (spool == NULL) {
+        return;
+    }
+    if (spool->cursorFd >= 0) {
+        spool->errors += syncFiles(spool->writeFd, spool->retiredFd, spool->cursorFd, spool->cursor);
+        close(spool->cursorFd);
+    }
+    if (spool->appended > 0 || spool->delivered > 0) {
+        log_output(LOG_INFO, "Spool statistics: %lu samples appended, %lu delivered, %lu failed deliveries, %lu evicted, %llu pending\n",
+                   spool->appended, spool->delivered, spool->failures, spool->evicted, pendingCount(spool));
+    }
+    if (spool->writeFd >= 0) {
+        close(spool->writeFd);
+    }
+    if (spool->retiredFd >= 0) {
+        close(spool->retiredFd);
+    }
+    if (spool->readFd >= 0) {
+        close(spool->readFd);
+    }
+    pthread_mutex_destroy(&(spool->lock));
+    free(spool->directory);
+    free(spool->segments);
+    free(spool);
+}
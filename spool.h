@@ -0,0 +1,177 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <time.h>
+#include <pthread.h>
+
+#include "datatypes.h"
+#include "store.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The spool is a write-ahead log of the samples handed to the -s program.
+ * Every sample is appended before the program runs and only consumed when
+ * the program exits with status 0, so samples survive a failing program,
+ * an unavailable database behind it and restarts of the reader.
+ *
+ * The log consists of segment files in a directory, named by the sequence
+ * number of their first sample, e.g. 00000000000000004096.spool. A segment
+ * starts with "DLOGGSPL", the version and the record size (4 bytes each),
+ * followed by one record per sample: the sample as a store record (see
+ * store.h) and the change masks of the delta mode, inputs and outputs
+ * (2 bytes each), heat registers and speed steps (1 byte each) and 2
+ * reserved bytes. The file "cursor" holds the sequence number of the next
+ * sample to deliver (8 bytes). All numbers are little endian.
+ *
+ * Appends and cursor updates are synced together by spoolCheckSync(), once
+ * SPOOL_SYNC_RECORDS of them are pending or SPOOL_SYNC_INTERVAL ms passed,
+ * so a crash delivers at most the samples of one sync interval twice. Segments behind the
+ * cursor are deleted. When the segments exceed the size limit, the oldest
+ * one is deleted even if it was not delivered.
+ *
+ * The functions may be called from different threads: the reader appends
+ * in the poller thread, so a hanging program never holds up the log, and
+ * delivers and syncs in the delivery thread. Appends never wait for a sync.
+ */
+#define SPOOL_MAGIC            "DLOGGSPL"
+#define SPOOL_VERSION          1
+#define SPOOL_HEADER_SIZE      16
+#define SPOOL_RECORD_SIZE      (STORE_RECORD_SIZE + 8)
+#define SPOOL_SEGMENT_RECORDS  4096
+#define SPOOL_SYNC_RECORDS     64
+#define SPOOL_SYNC_INTERVAL    1000     /* ms */
+#define SPOOL_RETRY_MIN        1000     /* ms */
+#define SPOOL_RETRY_MAX        60000    /* ms */
+#define DEFAULT_SPOOL_SIZE     64       /* MB */
+
+/**
+ * a segment of the spool
+ */
+struct SpoolSegment
+{
+    unsigned long long first;   /* sequence number of the first record */
+    unsigned long count;        /* number of records */
+};
+
+struct Spool
+{
+    pthread_mutex_t lock;
+    char *directory;
+    unsigned long long maxBytes;
+    struct SpoolSegment *segments;  /* oldest first */
+    unsigned int segmentCount;
+    unsigned int capacity;
+    unsigned long long bytes;       /* size of all segments */
+    int writeFd;                    /* the newest segment, -1 if a new one is to be started */
+    int retiredFd;                  /* the segment before, until the next sync covered it, -1 if none */
+    int readFd;                     /* the segment at the cursor, -1 if none is open */
+    unsigned long long readFirst;   /* first sequence number of the segment of readFd */
+    int cursorFd;
+    unsigned long long cursor;      /* sequence number of the next sample to deliver */
+    unsigned long long peeked;      /* sequence number of the sample spoolPeek() returned last */
+    unsigned long long next;        /* sequence number of the next sample to append */
+    unsigned int unsynced;          /* appends and cursor updates since the last sync */
+    long long lastSync;             /* CLOCK_REALTIME in ms */
+    long long retryAt;              /* CLOCK_REALTIME in ms the delivery may be retried at */
+    long long backoff;              /* ms, 0 while the delivery works */
+    unsigned long appended;
+    unsigned long delivered;
+    unsigned long evicted;
+    unsigned long failures;         /* failed deliveries */
+    unsigned long errors;           /* failed writes */
+};
+
+/**
+ * open the spool in a directory. Samples left over from an earlier run are
+ * kept and delivered first.
+ *
+ * \param maxBytes the size limit of the segments
+ * \return a pointer to the spool on success, NULL else. errno will be set accordingly
+ */
+struct Spool *initSpool(char const *directory, unsigned long long maxBytes);
+
+/**
+ * append a sample
+ *
+ * \return 0 on success, -1 else
+ */
+int spoolAppend(struct Spool *spool, struct Sample const *sample);
+
+/**
+ * get the sample at the cursor without consuming it
+ *
+ * \return 1 if there was a sample, 0 if all samples are delivered, -1 on error
+ */
+int spoolPeek(struct Spool *spool, struct Sample *sample);
+
+/**
+ * consume the sample spoolPeek() returned after it was delivered. Nothing
+ * happens if the sample was evicted meanwhile.
+ */
+void spoolAdvance(struct Spool *spool);
+
+/**
+ * note that the delivery of the sample at the cursor failed. The delivery
+ * is retried with exponential backoff.
+ */
+void spoolFailed(struct Spool *spool);
+
+/**
+ * check if samples may be delivered now, i.e. some are pending and the
+ * delivery is not backing off
+ */
+int spoolReady(struct Spool *spool);
+
+/**
+ * get the time the spool needs attention at: the next retry or the next sync
+ *
+ * \param deadline set to the CLOCK_REALTIME time
+ * \return 1 if deadline was set, 0 if the spool is idle
+ */
+int spoolDeadline(struct Spool *spool, struct timespec *deadline);
+
+/**
+ * sync the segments and the cursor if enough changes are pending or the
+ * sync interval passed. The lock is not held during the sync. Only one
+ * thread may call it.
+ */
+void spoolCheckSync(struct Spool *spool);
+
+/**
+ * get the number of samples not delivered yet
+ */
+unsigned long long spoolPending(struct Spool *spool);
+
+/**
+ * sync and close the spool
+ */
+void cleanupSpool(struct Spool *spool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SPOOL_H */
@@ -0,0 +1,605 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "store.h"
+#include "history.h"
+#include "logging.h"
+
+static void putNumber(unsigned char *buffer, unsigned long long value, int bytes)
+{
+    int i;
+    for (i = 0; i < bytes; ++i) {
+        buffer[i] = (value >> (8*i)) & 0xFF;
+    }
+}
+
+static unsigned long long getNumber(unsigned char const *buffer, int bytes)
+{
+    unsigned long long value = 0;
+    int i;
+    for (i = bytes-1; i >= 0; --i) {
+        value = (value << 8) | buffer[i];
+    }
+    return value;
+}
+
+static long getSigned(unsigned char const *buffer, int bytes)
+{
+    unsigned long long value = getNumber(buffer, bytes);
+    if (value & (1ULL << (8*bytes - 1))) {
+        return (long)((long long)value - (1LL << (8*bytes)));
+    }
+    return (long)value;
+}
+
+/**
+ * round to the nearest integer of the fixed point representation
+ */
+static long fixedPoint(double value, int scale)
+{
+    value *= scale;
+    return (long)(value < 0 ? value - 0.5 : value + 0.5);
+}
+
+void encodeStoreRecord(struct Sample const *sample, unsigned char *record)
+{
+    struct SystemState const *state = &(sample->state);
+    long long time = (long long)sample->timestamp.tv_sec * 1000 + sample->timestamp.tv_nsec / 1000000;
+    unsigned int i;
+    memset(record, 0, STORE_RECORD_SIZE);
+    putNumber(record, (unsigned long long)time, 8);
+    record[8] = sample->deviceID;
+    record[9] = sample->controllerID;
+    for (i = 0; i < state->inputCount; ++i) {
+        struct Value const *value = &(state->inputs[i]);
+        unsigned int n = value->valueID - 1;
+        long encoded = 0;
+        if (n >= UVR1611_INPUTS) {
+            continue;
+        }
+        record[10 + n/2] |= (value->valueType & 0x0F) << (4 * (n % 2));
+        switch (value->valueType) {
+            case DIGITAL:
+                encoded = value->value.enabled ? 1 : 0;
+                break;
+            case TEMPERATURE:
+                encoded = fixedPoint(value->value.temperature, 10);
+                break;
+            case FLOW:
+                encoded = value->value.flow;
+                break;
+        }
+        putNumber(record + 20 + 2*n, (unsigned long long)encoded, 2);
+    }
+    for (i = 0; i < state->outputCount; ++i) {
+        unsigned int n = state->outputs[i].valueID - 1;
+        if (n < UVR1611_OUTPUTS && state->outputs[i].value.enabled) {
+            record[18 + n/8] |= 1 << (n % 8);
+        }
+    }
+    memset(record + 52, 0xFF, UVR1611_ROTATIONS);
+    for (i = 0; i < state->rotationCount; ++i) {
+        unsigned int n = state->rotations[i].valueID - 1;
+        if (n < UVR1611_ROTATIONS) {
+            record[52 + n] = state->rotations[i].value.rotation;
+        }
+    }
+    for (i = 0; i < state->heatRegisterCount; ++i) {
+        struct Value const *value = &(state->heatRegisters[i]);
+        unsigned int n = value->valueID - 1;
+        if (n >= UVR1611_HEAT_REGISTERS) {
+            continue;
+        }
+        record[56] |= 1 << n;
+        putNumber(record + 60 + 4*n, (unsigned long long)fixedPoint(value->value.heat.current, 100), 4);
+        putNumber(record + 68 + 4*n, (unsigned long long)fixedPoint(value->value.heat.total, 10), 4);
+    }
+}
+
+void decodeStoreRecord(unsigned char const *record, struct Sample *sample)
+{
+    struct SystemState *state = &(sample->state);
+    long long time = storeRecordTime(record);
+    unsigned int i;
+    clearSystemState(state);
+    sample->timestamp.tv_sec = time / 1000;
+    sample->timestamp.tv_nsec = (time % 1000) * 1000000;
+    sample->deviceID = record[8];
+    sample->controllerID = record[9];
+    for (i = 0; i < UVR1611_INPUTS; ++i) {
+        struct Value *value = &(state->inputs[i]);
+        long encoded = getSigned(record + 20 + 2*i, 2);
+        value->valueID = i+1;
+        value->valueType = (record[10 + i/2] >> (4 * (i % 2))) & 0x0F;
+        switch (value->valueType) {
+            case DIGITAL:
+                value->value.enabled = encoded != 0;
+                break;
+            case TEMPERATURE:
+                value->value.temperature = encoded / 10.0;
+                break;
+            case FLOW:
+                value->value.flow = encoded;
+                break;
+        }
+    }
+    state->inputCount = UVR1611_INPUTS;
+    for (i = 0; i < UVR1611_OUTPUTS; ++i) {
+        state->outputs[i].valueID = i+1;
+        state->outputs[i].valueType = DIGITAL;
+        state->outputs[i].value.enabled = (record[18 + i/8] >> (i % 8)) & 0x01;
+    }
+    state->outputCount = UVR1611_OUTPUTS;
+    for (i = 0; i < UVR1611_ROTATIONS; ++i) {
+        if (record[52 + i] != 0xFF) {
+            struct Value *value = &(state->rotations[state->rotationCount++]);
+            value->valueID = i+1;
+            value->valueType = ROTATION;
+            value->value.rotation = record[52 + i];
+        }
+    }
+    for (i = 0; i < UVR1611_HEAT_REGISTERS; ++i) {
+        if (record[56] & (1 << i)) {
+            struct Value *value = &(state->heatRegisters[state->heatRegisterCount++]);
+            value->valueID = i+1;
+            value->valueType = HEAT;
+            value->value.heat.current = getSigned(record + 60 + 4*i, 4) / 100.0;
+            value->value.heat.total = getSigned(record + 68 + 4*i, 4) / 10.0;
+        }
+    }
+}
+
+long long storeRecordTime(unsigned char const *record)
+{
+    return (long long)getNumber(record, 8);
+}
+
+struct StoreWriter *initStoreWriter(char const *directory, int compressed)
+{
+    struct StoreWriter *writer;
+    struct stat info;
+    if (stat(directory, &info) != 0) {
+        log_output(LOG_ERR, "Could not access store %s. %s\n", directory, strerror(errno));
+        return NULL;
+    }
+    if (!S_ISDIR(info.st_mode)) {
+        errno = ENOTDIR;
+        return NULL;
+    }
+    writer = malloc(sizeof(struct StoreWriter));
+    if (writer == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return NULL;
+    }
+    memset(writer, 0, sizeof(struct StoreWriter));
+    writer->compressed = compressed;
+    writer->fd = -1;
+    writer->directory = malloc(strlen(directory)+1);
+    writer->capacity = STORE_SEGMENT_RECORDS / STORE_INDEX_INTERVAL + 1;
+    writer->index = malloc(writer->capacity * STORE_INDEX_ENTRY);
+    if (writer->directory == NULL || writer->index == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        cleanupStoreWriter(writer);
+        return NULL;
+    }
+    strcpy(writer->directory, directory);
+    return writer;
+}
+
+/**
+ * write a buffer completely
+ */
+static int writeAll(int fd, unsigned char const *buffer, size_t length)
+{
+    while (length > 0) {
+        ssize_t ret = write(fd, buffer, length);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += ret;
+        length -= ret;
+    }
+    return 0;
+}
+
+/**
+ * create a new segment starting at the given time
+ */
+static int startSegment(struct StoreWriter *writer, long long time)
+{
+    unsigned char header[STORE_HEADER_SIZE];
+    unsigned int attempt;
+    size_t size = strlen(writer->directory) + 32;
+    writer->path = malloc(size);
+    if (writer->path == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return -1;
+    }
+    // several segments may start in the same ms, e.g. when a download ends and polling starts
+    for (attempt = 0; attempt < 100; ++attempt) {
+        snprintf(writer->path, size, "%s/%013lld-%02u.%s", writer->directory, time, attempt, writer->compressed ? "hst" : "seg");
+        writer->fd = open(writer->path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (writer->fd >= 0 || errno != EEXIST) {
+            break;
+        }
+    }
+    if (writer->fd < 0) {
+        log_output(LOG_ERR, "Could not create segment %s. %s\n", writer->path, strerror(errno));
+        free(writer->path);
+        writer->path = NULL;
+        return -1;
+    }
+    memset(header, 0, sizeof(header));
+    memcpy(header, STORE_SEGMENT_MAGIC, 8);
+    putNumber(header + 8, STORE_VERSION, 4);
+    putNumber(header + 12, STORE_RECORD_SIZE, 4);
+    putNumber(header + 16, STORE_INDEX_INTERVAL, 4);
+    if (writer->compressed) {
+        writer->history = initHistoryEncoder(writer->fd);
+    }
+    if (writer->compressed ? writer->history == NULL : writeAll(writer->fd, header, sizeof(header)) != 0) {
+        log_output(LOG_ERR, "Could not write segment %s. %s\n", writer->path, strerror(errno));
+        close(writer->fd);
+        writer->fd = -1;
+        free(writer->path);
+        writer->path = NULL;
+        return -1;
+    }
+    writer->records = 0;
+    writer->entries = 0;
+    ++writer->segments;
+    log_output(LOG_DEBUG, "Started segment %s\n", writer->path);
+    return 0;
+}
+
+/**
+ * write the footer and close the current segment
+ */
+static void finishSegment(struct StoreWriter *writer)
+{
+    unsigned char trailer[STORE_TRAILER_SIZE];
+    if (writer->fd < 0) {
+        return;
+    }
+    if (writer->compressed) {
+        cleanupHistoryEncoder(writer->history);
+        writer->history = NULL;
+        close(writer->fd);
+        writer->fd = -1;
+        free(writer->path);
+        writer->path = NULL;
+        return;
+    }
+    memset(trailer, 0, sizeof(trailer));
+    memcpy(trailer, STORE_INDEX_MAGIC, 8);
+    putNumber(trailer + 8, writer->records, 8);
+    putNumber(trailer + 16, writer->entries, 8);
+    if (writeAll(writer->fd, writer->index, writer->entries * STORE_INDEX_ENTRY) != 0
+        || writeAll(writer->fd, trailer, sizeof(trailer)) != 0) {
+        log_output(LOG_ERR, "Could not write the index of segment %s. %s\n", writer->path, strerror(errno));
+    }
+    close(writer->fd);
+    writer->fd = -1;
+    free(writer->path);
+    writer->path = NULL;
+}
+
+int storeSample(struct StoreWriter *writer, struct Sample const *sample)
+{
+    unsigned char record[STORE_RECORD_SIZE];
+    long long time;
+    if (writer == NULL) {
+        return 0;
+    }
+    encodeStoreRecord(sample, record);
+    time = storeRecordTime(record);
+    // the readers rely on the times of a segment never decreasing, e.g. after the clock was set back
+    if (writer->fd >= 0 && (writer->records >= STORE_SEGMENT_RECORDS || time < writer->last)) {
+        finishSegment(writer);
+    }
+    if (writer->fd < 0 && startSegment(writer, time) != 0) {
+        ++writer->errors;
+        return -1;
+    }
+    if (writer->compressed) {
+        if (historyAppend(writer->history, record) != 0) {
+            log_output(LOG_ERR, "Could not write history %s. %s\n", writer->path, strerror(errno));
+            ++writer->errors;
+            return -1;
+        }
+        ++writer->records;
+        ++writer->written;
+        writer->last = time;
+        return 0;
+    }
+    if (writer->records % STORE_INDEX_INTERVAL == 0 && writer->entries < writer->capacity) {
+        unsigned char *entry = writer->index + writer->entries * STORE_INDEX_ENTRY;
+        putNumber(entry, (unsigned long long)time, 8);
+        putNumber(entry + 8, writer->records, 8);
+        ++writer->entries;
+    }
+    if (writeAll(writer->fd, record, STORE_RECORD_SIZE) != 0) {
+        log_output(LOG_ERR, "Could not write segment %s. %s\n", writer->path, strerror(errno));
+        ++writer->errors;
+        return -1;
+    }
+    ++writer->records;
+    ++writer->written;
+    writer->last = time;
+    return 0;
+}
+
+void cleanupStoreWriter(struct StoreWriter *writer)
+{
+    if (writer != NULL) {
+        if (writer->fd >= 0) {
+            finishSegment(writer);
+            log_output(LOG_INFO, "Store statistics: %lu records in %lu segments, %lu errors\n",
+                       writer->written, writer->segments, writer->errors);
+        }
+        free(writer->directory);
+        free(writer->index);
+        free(writer);
+    }
+}
+
+int openStoreSegment(char const *path, struct StoreSegment *segment)
+{
+    struct stat info;
+    unsigned char const *trailer;
+    void *map;
+    int fd;
+    memset(segment, 0, sizeof(struct StoreSegment));
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (info.st_size < STORE_HEADER_SIZE) {
+        // the writer died right after creating the segment
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    segment->map = map;
+    segment->size = info.st_size;
+    if (memcmp(segment->map, STORE_SEGMENT_MAGIC, 8) != 0 || getNumber(segment->map + 8, 4) != STORE_VERSION
+        || getNumber(segment->map + 12, 4) != STORE_RECORD_SIZE) {
+        closeStoreSegment(segment);
+        errno = EINVAL;
+        return -1;
+    }
+    segment->records = segment->map + STORE_HEADER_SIZE;
+    segment->count = (segment->size - STORE_HEADER_SIZE) / STORE_RECORD_SIZE;
+    if (segment->size >= STORE_HEADER_SIZE + STORE_TRAILER_SIZE) {
+        trailer = segment->map + segment->size - STORE_TRAILER_SIZE;
+        if (memcmp(trailer, STORE_INDEX_MAGIC, 8) == 0) {
+            unsigned long records = getNumber(trailer + 8, 8);
+            unsigned long entries = getNumber(trailer + 16, 8);
+            if (STORE_HEADER_SIZE + records * STORE_RECORD_SIZE + entries * STORE_INDEX_ENTRY + STORE_TRAILER_SIZE == segment->size) {
+                segment->count = records;
+                segment->entries = entries;
+                segment->index = segment->records + records * STORE_RECORD_SIZE;
+            }
+        }
+    }
+    return 0;
+}
+
+unsigned long findStoreRecord(struct StoreSegment const *segment, long long time)
+{
+    unsigned long low = 0;
+    unsigned long high = segment->count;
+    if (segment->index != NULL && segment->entries > 0) {
+        // binary search the last index entry before the time, the records from there are scanned
+        unsigned long first = 0;
+        unsigned long last = segment->entries;
+        while (first < last) {
+            unsigned long middle = first + (last - first) / 2;
+            if ((long long)getNumber(segment->index + middle * STORE_INDEX_ENTRY, 8) < time) {
+                first = middle + 1;
+            }
+            else {
+                last = middle;
+            }
+        }
+        if (first > 0) {
+            low = getNumber(segment->index + (first-1) * STORE_INDEX_ENTRY + 8, 8);
+        }
+        for (; low < segment->count; ++low) {
+            if (storeRecordTime(segment->records + low * STORE_RECORD_SIZE) >= time) {
+                break;
+            }
+        }
+        return low;
+    }
+    while (low < high) {
+        unsigned long middle = low + (high - low) / 2;
+        if (storeRecordTime(segment->records + middle * STORE_RECORD_SIZE) < time) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+void closeStoreSegment(struct StoreSegment *segment)
+{
+    if (segment->map != NULL) {
+        munmap((void *)segment->map, segment->size);
+    }
+    memset(segment, 0, sizeof(struct StoreSegment));
+}
+
+static int compareNames(void const *a, void const *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+int listStoreSegments(char const *directory, char ***paths)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char **list = NULL;
+    int count = 0;
+    int capacity = 0;
+    dir = opendir(directory);
+    if (dir == NULL) {
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        char *path;
+        if (length < 5 || (strcmp(entry->d_name + length - 4, ".seg") != 0 && strcmp(entry->d_name + length - 4, ".hst") != 0)) {
+            continue;
+        }
+        if (count == capacity) {
+            char **grown;
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            grown = realloc(list, capacity * sizeof(char *));
+            if (grown == NULL) {
+                freeStoreSegmentList(list, count);
+                closedir(dir);
+                return -1;
+            }
+            list = grown;
+        }
+        path = malloc(strlen(directory) + length + 2);
+        if (path == NULL) {
+            freeStoreSegmentList(list, count);
+            closedir(dir);
+            return -1;
+        }
+        sprintf(path, "%s/%s", directory, entry->d_name);
+        list[count++] = path;
+    }
+    closedir(dir);
+    // the names start with the zero padded time of the first record
+    qsort(list, count, sizeof(char *), compareNames);
+    *paths = list;
+    return count;
+}
+
+void freeStoreSegmentList(char **paths, int count)
+{
+    int i;
+    for (i = 0; i < count; ++i) {
+        free(paths[i]);
+    }
+    free(paths);
+}
+
+int parseStoreChannel(char const *name, struct StoreChannel *channel)
+{
+    char *end;
+    unsigned long number;
+    if (name[0] == '\0' || strlen(name) >= sizeof(channel->name) || strchr("SORH", name[0]) == NULL) {
+        return -1;
+    }
+    number = strtoul(name+1, &end, 10);
+    strcpy(channel->name, name);
+    channel->group = name[0];
+    channel->number = number;
+    channel->energy = 0;
+    switch (channel->group) {
+        case 'S':
+            return *end == '\0' && number >= 1 && number <= UVR1611_INPUTS ? 0 : -1;
+        case 'O':
+            return *end == '\0' && number >= 1 && number <= UVR1611_OUTPUTS ? 0 : -1;
+        case 'R':
+            return *end == '\0' && number >= 1 && number <= UVR1611_ROTATIONS ? 0 : -1;
+        default:
+            if (number < 1 || number > UVR1611_HEAT_REGISTERS) {
+                return -1;
+            }
+            if (strcmp(end, "_ENERGY") == 0) {
+                channel->energy = 1;
+                return 0;
+            }
+            return strcmp(end, "_POWER") == 0 ? 0 : -1;
+    }
+}
+
+int storeChannelValue(unsigned char const *record, struct StoreChannel const *channel, double *value, int *decimals)
+{
+    unsigned int n = channel->number - 1;
+    int type;
+    *decimals = 0;
+    switch (channel->group) {
+        case 'S':
+            type = (record[10 + n/2] >> (4 * (n % 2))) & 0x0F;
+            if (type == UNUSED) {
+                return 0;
+            }
+            *value = getSigned(record + 20 + 2*n, 2);
+            if (type == TEMPERATURE) {
+                *value /= 10;
+                *decimals = 1;
+            }
+            return 1;
+        case 'O':
+            *value = (record[18 + n/8] >> (n % 8)) & 0x01;
+            return 1;
+        case 'R':
+            if (record[52 + n] == 0xFF) {
+                return 0;
+            }
+            *value = record[52 + n];
+            return 1;
+        default:
+            if (!(record[56] & (1 << n))) {
+                return 0;
+            }
+            if (channel->energy) {
+                *value = getSigned(record + 68 + 4*n, 4) / 10.0;
+                *decimals = 1;
+            }
+            else {
+                *value = getSigned(record + 60 + 4*n, 4) / 100.0;
+                *decimals = 2;
+            }
+            return 1;
+    }
+}
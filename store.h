@@ -0,0 +1,213 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stddef.h>
+
+#include "datatypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The store keeps the samples in segment files of a directory, named by the
+ * time of their first record in ms since the epoch (13 digits), a dash and a
+ * two digit counter from 00 to 99 which tells apart segments starting in the
+ * same ms, e.g. 1792248718500-00.seg. Compressed segments end in .hst.
+ *
+ * A segment consists of
+ *   - the header: "DLOGGSEG", version (4 bytes), record size (4 bytes),
+ *     index interval (4 bytes) and 12 reserved bytes
+ *   - the records, one fixed width record per sample in the order received.
+ *     Their times never decrease, a sample older than the previous one
+ *     starts a new segment.
+ *   - the footer, written when the segment is finished: one index entry of
+ *     time (8 bytes) and record number (8 bytes) for every STORE_INDEX_INTERVAL
+ *     records, followed by the trailer "DLOGGIDX", the number of records and
+ *     the number of index entries (8 bytes each) and 8 reserved bytes
+ * A segment without footer, e.g. after a crash, stays readable, it is just
+ * searched without the index.
+ *
+ * In the compressed mode the records go to history files (.hst) instead,
+ * see history.h.
+ *
+ * A record holds the values as the fixed point numbers the controller sends:
+ *   0  time in ms since the epoch (8 bytes)
+ *   8  device, controller (1 byte each)
+ *   10 sensor types of the 16 inputs, 4 bits each, input 1 in the low bits
+ *   18 outputs, bit i is output i+1 (2 bytes)
+ *   20 inputs: 0.1 °C, l/h or 0/1 (2 bytes signed each)
+ *   52 speed steps of the 4 speed controlled outputs, 0xFF if inactive
+ *   56 heat registers present, bit i is register i+1
+ *   60 heat register power in 0.01 kW (4 bytes signed each)
+ *   68 heat register energy in 0.1 kWh (4 bytes signed each)
+ * All numbers are little endian.
+ */
+#define STORE_SEGMENT_MAGIC   "DLOGGSEG"
+#define STORE_INDEX_MAGIC     "DLOGGIDX"
+#define STORE_VERSION         1
+#define STORE_HEADER_SIZE     32
+#define STORE_TRAILER_SIZE    32
+#define STORE_INDEX_ENTRY     16
+#define STORE_RECORD_SIZE     80
+#define STORE_INDEX_INTERVAL  256
+#define STORE_SEGMENT_RECORDS 65536   /* a new segment is started after this many records */
+
+struct HistoryEncoder;
+
+/**
+ * appends the samples to the segments of a directory
+ */
+struct StoreWriter
+{
+    char *directory;
+    int compressed;             /* write history files instead of plain segments */
+    int fd;                     /* the current segment, -1 if none is open */
+    struct HistoryEncoder *history;
+    char *path;                 /* path of the current segment */
+    unsigned long records;      /* records in the current segment */
+    long long last;             /* time of the last record in the current segment */
+    unsigned char *index;       /* index entries of the current segment */
+    unsigned long entries;
+    unsigned long capacity;     /* of the index in entries */
+    unsigned long segments;
+    unsigned long written;
+    unsigned long errors;
+};
+
+/**
+ * a segment mapped for reading
+ */
+struct StoreSegment
+{
+    unsigned char const *map;
+    size_t size;
+    unsigned char const *records;   /* the first record */
+    unsigned long count;            /* number of records */
+    unsigned char const *index;     /* the index entries, NULL if the segment has no footer */
+    unsigned long entries;
+};
+
+/**
+ * a value in a record, named like the CSV columns: S1-S16, O1-O13, R1-R4,
+ * H1_POWER, H1_ENERGY, H2_POWER, H2_ENERGY
+ */
+struct StoreChannel
+{
+    char name[16];
+    char group;                 /* 'S', 'O', 'R' or 'H' */
+    unsigned int number;        /* 1-based */
+    int energy;                 /* for 'H': the energy instead of the power */
+};
+
+/**
+ * prepare writing to a directory. The first segment is created with the first sample.
+ *
+ * \param compressed write compressed history files. Their records are kept in memory
+ *                   until a block is complete, covers HISTORY_FLUSH_INTERVAL or the
+ *                   writer is cleaned up.
+ * \return a pointer to the writer on success, NULL else. errno will be set accordingly
+ */
+struct StoreWriter *initStoreWriter(char const *directory, int compressed);
+
+/**
+ * append a sample. A writer of NULL is ignored.
+ *
+ * \return 0 on success, -1 else
+ */
+int storeSample(struct StoreWriter *writer, struct Sample const *sample);
+
+/**
+ * finish the current segment and free the writer
+ */
+void cleanupStoreWriter(struct StoreWriter *writer);
+
+/**
+ * encode a sample as a record of STORE_RECORD_SIZE bytes
+ */
+void encodeStoreRecord(struct Sample const *sample, unsigned char *record);
+
+/**
+ * decode a record into a sample. All values are marked as changed.
+ */
+void decodeStoreRecord(unsigned char const *record, struct Sample *sample);
+
+/**
+ * get the time of a record in ms since the epoch
+ */
+long long storeRecordTime(unsigned char const *record);
+
+/**
+ * map a segment file
+ *
+ * \return 0 on success, -1 else. errno will be set accordingly
+ */
+int openStoreSegment(char const *path, struct StoreSegment *segment);
+
+/**
+ * get the number of the first record at or after the given time
+ *
+ * \param time the time in ms since the epoch
+ * \return the record number, segment->count if all records are older
+ */
+unsigned long findStoreRecord(struct StoreSegment const *segment, long long time);
+
+/**
+ * unmap a segment
+ */
+void closeStoreSegment(struct StoreSegment *segment);
+
+/**
+ * list the segment and history files of a directory ordered by time
+ *
+ * \param paths receives a heap allocated array of heap allocated paths
+ * \return the number of segments, -1 on error. errno will be set accordingly
+ */
+int listStoreSegments(char const *directory, char ***paths);
+
+/**
+ * free the list obtained by listStoreSegments()
+ */
+void freeStoreSegmentList(char **paths, int count);
+
+/**
+ * parse a channel name
+ *
+ * \return 0 on success, -1 for an unknown channel
+ */
+int parseStoreChannel(char const *name, struct StoreChannel *channel);
+
+/**
+ * get the value of a channel from a record
+ *
+ * \param value receives the value
+ * \param decimals receives the number of meaningful decimals
+ * \return 1 if the record has a value for the channel, 0 else
+ */
+int storeChannelValue(unsigned char const *record, struct StoreChannel const *channel, double *value, int *decimals);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STORE_H */
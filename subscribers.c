@@ -0,0 +1,355 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "subscribers.h"
+#include "logging.h"
+
+#define SUBSCRIBER_BACKLOG 8
+
+static void closeSubscriber(struct SubscriberServer *server, struct Subscriber *subscriber)
+{
+    pollerUnwatch(server->poller, subscriber->fd);
+    close(subscriber->fd);
+    subscriber->fd = -1;
+}
+
+static struct Subscriber *findSubscriber(struct SubscriberServer *server, int fd)
+{
+    unsigned int i;
+    for (i = 0; i < MAX_SUBSCRIBERS; ++i) {
+        if (server->subscribers[i].fd == fd) {
+            return &(server->subscribers[i]);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * write as much of the queue as the socket takes
+ *
+ * \return 0 on success, -1 if the subscriber is gone
+ */
+static int flushQueue(struct SubscriberServer *server, struct Subscriber *subscriber)
+{
+    while (subscriber->length > 0) {
+        ssize_t ret = send(subscriber->fd, subscriber->queue + subscriber->offset, subscriber->length, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        subscriber->offset += ret;
+        subscriber->length -= ret;
+    }
+    if (subscriber->length == 0) {
+        subscriber->offset = 0;
+    }
+    // only wait for the socket to become writable while something is pending
+    if ((subscriber->length > 0) != subscriber->writing) {
+        subscriber->writing = subscriber->length > 0;
+        pollerModify(server->poller, subscriber->fd, subscriber->writing ? EPOLLIN | EPOLLOUT : EPOLLIN);
+    }
+    return 0;
+}
+
+/**
+ * append a record to the queue of a subscriber
+ *
+ * \return 0 if it was queued, 1 if the queue is full
+ */
+static int queueRecord(struct Subscriber *subscriber, char const *record, size_t length)
+{
+    if (subscriber->length + length > SUBSCRIBER_QUEUE_SIZE) {
+        return 1;
+    }
+    if (subscriber->offset + subscriber->length + length > SUBSCRIBER_QUEUE_SIZE) {
+        memmove(subscriber->queue, subscriber->queue + subscriber->offset, subscriber->length);
+        subscriber->offset = 0;
+    }
+    memcpy(subscriber->queue + subscriber->offset + subscriber->length, record, length);
+    subscriber->length += length;
+    return 0;
+}
+
+static void subscriberReady(void *context, int fd, unsigned int events)
+{
+    struct SubscriberServer *server = context;
+    struct Subscriber *subscriber = findSubscriber(server, fd);
+    char discard[256];
+    if (subscriber == NULL) {
+        return;
+    }
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        closeSubscriber(server, subscriber);
+        return;
+    }
+    if (events & EPOLLIN) {
+        // subscribers have nothing to say, we only notice them going away
+        for (;;) {
+            ssize_t ret = read(fd, discard, sizeof(discard));
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (ret <= 0) {
+                closeSubscriber(server, subscriber);
+                return;
+            }
+        }
+    }
+    if ((events & EPOLLOUT) && flushQueue(server, subscriber) != 0) {
+        closeSubscriber(server, subscriber);
+    }
+}
+
+/**
+ * queue the header of the format and the latest sample of every controller
+ */
+static void sendSnapshot(struct SubscriberServer *server, struct Subscriber *subscriber)
+{
+    size_t length;
+    unsigned int slot;
+    length = formatOutputHeader(server->format, server->record, sizeof(server->record));
+    if (length > 0) {
+        queueRecord(subscriber, server->record, length);
+    }
+    for (slot = 0; slot < server->slots; ++slot) {
+        if (server->present[slot]) {
+            length = formatOutputRecord(server->format, server->record, sizeof(server->record), &(server->latest[slot]));
+            if (length > 0) {
+                queueRecord(subscriber, server->record, length);
+            }
+        }
+    }
+}
+
+static void listenReady(void *context, int fd, unsigned int events)
+{
+    struct SubscriberServer *server = context;
+    (void)events;
+    for (;;) {
+        struct Subscriber *subscriber;
+        int clientFd = accept(fd, NULL, NULL);
+        if (clientFd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_output(LOG_ERR, "Could not accept subscriber. %s\n", strerror(errno));
+            }
+            return;
+        }
+        subscriber = findSubscriber(server, -1);
+        if (subscriber == NULL) {
+            log_output(LOG_WARNING, "Too many subscribers, rejected one\n");
+            close(clientFd);
+            continue;
+        }
+        fcntl(clientFd, F_SETFL, fcntl(clientFd, F_GETFL) | O_NONBLOCK);
+        fcntl(clientFd, F_SETFD, FD_CLOEXEC);
+        if (pollerWatch(server->poller, clientFd, EPOLLIN, subscriberReady, server) != 0) {
+            log_output(LOG_ERR, "Could not watch subscriber. %s\n", strerror(errno));
+            close(clientFd);
+            continue;
+        }
+        subscriber->fd = clientFd;
+        subscriber->offset = 0;
+        subscriber->length = 0;
+        subscriber->writing = 0;
+        subscriber->skipped = 0;
+        ++server->connects;
+        log_output(LOG_DEBUG, "New subscriber on %s\n", server->path);
+        sendSnapshot(server, subscriber);
+        if (flushQueue(server, subscriber) != 0) {
+            closeSubscriber(server, subscriber);
+        }
+    }
+}
+
+struct SubscriberServer *initSubscriberServer(char const *path, int format, struct DevicePoller *poller, unsigned int count)
+{
+    struct SubscriberServer *server;
+    struct sockaddr_un address;
+    struct stat info;
+    unsigned int i;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    server = malloc(sizeof(struct SubscriberServer));
+    if (server == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        return NULL;
+    }
+    memset(server, 0, sizeof(struct SubscriberServer));
+    server->fd = -1;
+    server->format = format;
+    server->poller = poller;
+    server->slots = count * MAX_CONTROLLERS;
+    for (i = 0; i < MAX_SUBSCRIBERS; ++i) {
+        server->subscribers[i].fd = -1;
+    }
+    server->path = malloc(strlen(path)+1);
+    server->latest = malloc(server->slots * sizeof(struct Sample));
+    server->present = calloc(server->slots, 1);
+    if (server->path == NULL || server->latest == NULL || server->present == NULL) {
+        log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+        cleanupSubscriberServer(server);
+        return NULL;
+    }
+    strcpy(server->path, path);
+    for (i = 0; i < MAX_SUBSCRIBERS; ++i) {
+        server->subscribers[i].queue = malloc(SUBSCRIBER_QUEUE_SIZE);
+        if (server->subscribers[i].queue == NULL) {
+            log_output(LOG_ERR, "Could not allocate memory. %s\n", strerror(errno));
+            cleanupSubscriberServer(server);
+            return NULL;
+        }
+    }
+    server->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server->fd < 0) {
+        log_output(LOG_ERR, "Could not create socket. %s\n", strerror(errno));
+        cleanupSubscriberServer(server);
+        return NULL;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    // a socket left over by a previous run would make bind() fail, but anything else is not ours to remove
+    if (lstat(path, &info) == 0) {
+        if (!S_ISSOCK(info.st_mode)) {
+            log_output(LOG_ERR, "Could not listen at %s. It exists and is not a socket.\n", path);
+            close(server->fd);
+            server->fd = -1;
+            cleanupSubscriberServer(server);
+            errno = EEXIST;
+            return NULL;
+        }
+        unlink(path);
+    }
+    if (bind(server->fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(server->fd, SUBSCRIBER_BACKLOG) != 0) {
+        log_output(LOG_ERR, "Could not listen at %s. %s\n", path, strerror(errno));
+        close(server->fd);
+        server->fd = -1;
+        cleanupSubscriberServer(server);
+        return NULL;
+    }
+    fcntl(server->fd, F_SETFL, fcntl(server->fd, F_GETFL) | O_NONBLOCK);
+    fcntl(server->fd, F_SETFD, FD_CLOEXEC);
+    if (pollerWatch(poller, server->fd, EPOLLIN, listenReady, server) != 0) {
+        log_output(LOG_ERR, "Could not watch socket %s. %s\n", path, strerror(errno));
+        cleanupSubscriberServer(server);
+        return NULL;
+    }
+    return server;
+}
+
+void storeSnapshot(struct SubscriberServer *server, struct Sample const *sample)
+{
+    unsigned int slot;
+    if (server == NULL || sample->deviceID < 1 || sample->controllerID < 1 || sample->controllerID > MAX_CONTROLLERS) {
+        return;
+    }
+    slot = (sample->deviceID-1) * MAX_CONTROLLERS + sample->controllerID-1;
+    if (slot >= server->slots) {
+        return;
+    }
+    memcpy(&(server->latest[slot]), sample, sizeof(struct Sample));
+    server->present[slot] = 1;
+}
+
+void broadcastSample(struct SubscriberServer *server, struct Sample const *sample)
+{
+    size_t length;
+    unsigned int i;
+    if (server == NULL) {
+        return;
+    }
+    length = formatOutputRecord(server->format, server->record, sizeof(server->record), sample);
+    if (length == 0) {
+        return;
+    }
+    ++server->records;
+    for (i = 0; i < MAX_SUBSCRIBERS; ++i) {
+        struct Subscriber *subscriber = &(server->subscribers[i]);
+        if (subscriber->fd < 0) {
+            continue;
+        }
+        if (queueRecord(subscriber, server->record, length) != 0) {
+            ++server->skipped;
+            if (++subscriber->skipped >= SUBSCRIBER_MAX_SKIPPED) {
+                log_output(LOG_WARNING, "Subscriber on %s does not read its samples, disconnecting it\n", server->path);
+                ++server->disconnects;
+                closeSubscriber(server, subscriber);
+            }
+            continue;
+        }
+        subscriber->skipped = 0;
+        if (flushQueue(server, subscriber) != 0) {
+            closeSubscriber(server, subscriber);
+        }
+    }
+}
+
+void cleanupSubscriberServer(struct SubscriberServer *server)
+{
+    unsigned int i;
+    if (server != NULL) {
+        for (i = 0; i < MAX_SUBSCRIBERS; ++i) {
+            if (server->subscribers[i].fd >= 0) {
+                // hand over what is still queued as far as the socket takes it
+                flushQueue(server, &(server->subscribers[i]));
+                closeSubscriber(server, &(server->subscribers[i]));
+            }
+            free(server->subscribers[i].queue);
+        }
+        if (server->fd >= 0) {
+            pollerUnwatch(server->poller, server->fd);
+            close(server->fd);
+            unlink(server->path);
+            log_output(LOG_INFO, "Subscriber statistics: %lu connects, %lu records, %lu skipped, %lu disconnected for not reading\n",
+                       server->connects, server->records, server->skipped, server->disconnects);
+        }
+        free(server->path);
+        free(server->latest);
+        free(server->present);
+        free(server);
+    }
+}
@@ -0,0 +1,109 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef SUBSCRIBERS_H
+#define SUBSCRIBERS_H
+
+#include <stddef.h>
+
+#include "datatypes.h"
+#include "poller.h"
+#include "output.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAX_SUBSCRIBERS       16
+#define SUBSCRIBER_QUEUE_SIZE 65536
+/* a subscriber which had to skip this many records in a row is disconnected */
+#define SUBSCRIBER_MAX_SKIPPED 64
+
+/**
+ * a connected subscriber with its own send queue
+ */
+struct Subscriber
+{
+    int fd;                 /* -1 for a free entry */
+    char *queue;            /* SUBSCRIBER_QUEUE_SIZE bytes, the pending bytes start at offset */
+    size_t offset;
+    size_t length;
+    int writing;            /* waiting for the socket to become writable */
+    unsigned int skipped;   /* records skipped in a row because the queue was full */
+};
+
+/**
+ * streams every sample to any number of clients of a Unix domain socket,
+ * one record per sample in one of the output formats.
+ *
+ * The server runs in the epoll loop of the device poller. A sample is
+ * formatted once and appended to the queue of every subscriber, the queues
+ * are written without blocking. If a queue is full, the record is skipped
+ * for that subscriber, a subscriber that stops reading is disconnected. A
+ * new subscriber gets the latest sample of every controller right away.
+ */
+struct SubscriberServer
+{
+    int fd;
+    char *path;
+    int format;
+    struct DevicePoller *poller;
+    struct Sample *latest;          /* snapshot sent to new subscribers */
+    unsigned char *present;
+    unsigned int slots;
+    char record[OUTPUT_BUFFER_SIZE];
+    struct Subscriber subscribers[MAX_SUBSCRIBERS];
+    unsigned long connects;
+    unsigned long records;
+    unsigned long skipped;
+    unsigned long disconnects;     /* subscribers dropped for not reading */
+};
+
+/**
+ * listen at a Unix domain socket. An existing socket file is replaced.
+ *
+ * \param path the path of the socket
+ * \param format the record format, OUTPUT_JSON, OUTPUT_CSV or OUTPUT_INFLUX
+ * \param poller the poller whose epoll loop serves the subscribers
+ * \param count the number of devices
+ * \return a pointer to the server on success, NULL else. errno will be set accordingly
+ */
+struct SubscriberServer *initSubscriberServer(char const *path, int format, struct DevicePoller *poller, unsigned int count);
+
+/**
+ * remember the complete state of a sample for new subscribers. A server of NULL is ignored.
+ */
+void storeSnapshot(struct SubscriberServer *server, struct Sample const *sample);
+
+/**
+ * send a sample to all subscribers. A server of NULL is ignored.
+ */
+void broadcastSample(struct SubscriberServer *server, struct Sample const *sample);
+
+/**
+ * disconnect all subscribers, remove the socket and free the server
+ */
+void cleanupSubscriberServer(struct SubscriberServer *server);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SUBSCRIBERS_H */
@@ -22,3 +22,9 @@ for i in `seq 1 $UVR_HEATREGS`; do
 	REG_TOTAL="UVR_HEATREG_${i}_VALUE_TOTAL"
 	echo "HEATREG $i: current=${!REG_CURRENT}, value=${!REG_TOTAL}";
 done
+
+echo "ROTATIONS: $UVR_ROTATIONS"
+for i in `seq 1 $UVR_ROTATIONS`; do
+	ROTATION_VALUE="UVR_ROTATION_${i}_VALUE"
+	echo "ROTATION $i: step=${!ROTATION_VALUE}";
+done
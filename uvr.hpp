@@ -0,0 +1,342 @@
+/*
+    UVR-Linux - a collection of programs to access data on 
+    Technische Alternative UVR-type devices.
+    Copyright (C) 2012  Markus Brueckner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef UVR_HPP
+#define UVR_HPP
+
+#include <array>
+#include <cerrno>
+#include <string>
+#include <system_error>
+
+#include "datatypes.h"
+#include "communication.h"
+#include "parsing.h"
+
+/**
+ * C++ interface of libuvr for programs embedding the device access instead
+ * of running dlogg-reader. It is header only and adds no allocations to the
+ * C functions: a Connection owns the USBConnection and restores the serial
+ * line when it is destroyed, a SystemState is a plain value holding the
+ * fixed size C state. Errors of the C functions are thrown as
+ * std::system_error with their errno.
+ *
+ * \code
+ * uvr::Connection connection("/dev/ttyUSB0");
+ * std::array<uvr::SystemState, MAX_CONTROLLERS> states;
+ * unsigned int count = connection.read(states);
+ * for (Value const &input : states[0].inputs()) {
+ *     ...
+ * }
+ * \endcode
+ */
+namespace uvr
+{
+
+/**
+ * one value group of a system state, e.g. its inputs. It points into the
+ * state and is valid as long as the state is.
+ */
+class ValueRange
+{
+public:
+    ValueRange(Value const *first, unsigned int count, unsigned int changed) noexcept
+        : first_(first), count_(count), changed_(changed)
+    {
+    }
+
+    Value const *begin() const noexcept
+    {
+        return first_;
+    }
+
+    Value const *end() const noexcept
+    {
+        return first_ + count_;
+    }
+
+    unsigned int size() const noexcept
+    {
+        return count_;
+    }
+
+    bool empty() const noexcept
+    {
+        return count_ == 0;
+    }
+
+    Value const &operator[](unsigned int i) const noexcept
+    {
+        return first_[i];
+    }
+
+    /**
+     * check if the i-th value is to be delivered, see the delta mode of dlogg-reader
+     */
+    bool changed(unsigned int i) const noexcept
+    {
+        return i < 32 && (changed_ & (1u << i)) != 0;
+    }
+
+    /**
+     * get a value by its 1-based id
+     *
+     * \return the value, nullptr if the group has no value with that id
+     */
+    Value const *find(unsigned int id) const noexcept
+    {
+        for (Value const &value : *this) {
+            if (value.valueID == id) {
+                return &value;
+            }
+        }
+        return nullptr;
+    }
+
+private:
+    Value const *first_;
+    unsigned int count_;
+    unsigned int changed_;
+};
+
+/**
+ * the values of a controller. Copying it copies the fixed size C state.
+ */
+class SystemState
+{
+public:
+    SystemState() noexcept
+    {
+        clearSystemState(&state_);
+    }
+
+    explicit SystemState(::SystemState const &state) noexcept
+        : state_(state)
+    {
+    }
+
+    /**
+     * parse one controller of a GET_CURRENT_DATA frame
+     *
+     * \param controller the 0-based index of the controller in the frame
+     */
+    static SystemState fromFrame(unsigned char const *frame, int length, unsigned int controller = 0)
+    {
+        SystemState state;
+        // the parser only reads the frame
+        if (parseDataFrame(const_cast<unsigned char *>(frame), length, controller, &state.state_) != 0) {
+            throw std::system_error(errno, std::generic_category(), "Could not parse the frame");
+        }
+        return state;
+    }
+
+    ValueRange inputs() const noexcept
+    {
+        return ValueRange(state_.inputs, state_.inputCount, state_.inputsChanged);
+    }
+
+    ValueRange outputs() const noexcept
+    {
+        return ValueRange(state_.outputs, state_.outputCount, state_.outputsChanged);
+    }
+
+    ValueRange heatRegisters() const noexcept
+    {
+        return ValueRange(state_.heatRegisters, state_.heatRegisterCount, state_.heatRegistersChanged);
+    }
+
+    ValueRange rotations() const noexcept
+    {
+        return ValueRange(state_.rotations, state_.rotationCount, state_.rotationsChanged);
+    }
+
+    void clear() noexcept
+    {
+        clearSystemState(&state_);
+    }
+
+    /**
+     * the C state, e.g. for the functions of parsing.h
+     */
+    ::SystemState &get() noexcept
+    {
+        return state_;
+    }
+
+    ::SystemState const &get() const noexcept
+    {
+        return state_;
+    }
+
+private:
+    ::SystemState state_;
+};
+
+/**
+ * a connection to a D-LOGG. It can be moved but not copied, the device is
+ * closed and its serial settings are restored when the owning object is
+ * destroyed. Using a connection that was moved from or released throws
+ * std::system_error with EBADF.
+ */
+class Connection
+{
+public:
+    /**
+     * open the device and query its mode
+     */
+    explicit Connection(std::string const &device)
+        : conn_(initUSBConnection(device.c_str()))
+    {
+        if (conn_ == nullptr) {
+            throw std::system_error(errno, std::generic_category(), "Could not open " + device);
+        }
+    }
+
+    /**
+     * take over a connection obtained by initUSBConnection()
+     */
+    explicit Connection(USBConnection *conn) noexcept
+        : conn_(conn)
+    {
+    }
+
+    Connection(Connection &&other) noexcept
+        : conn_(other.conn_)
+    {
+        other.conn_ = nullptr;
+    }
+
+    Connection &operator=(Connection &&other) noexcept
+    {
+        if (this != &other) {
+            cleanupUSBConnection(conn_);
+            conn_ = other.conn_;
+            other.conn_ = nullptr;
+        }
+        return *this;
+    }
+
+    Connection(Connection const &) = delete;
+    Connection &operator=(Connection const &) = delete;
+
+    ~Connection()
+    {
+        cleanupUSBConnection(conn_);
+    }
+
+    /**
+     * read the current values of all controllers of the device. Failed
+     * requests are repeated and the device is reopened as by readCurrentData().
+     *
+     * \return the number of states filled
+     */
+    unsigned int read(std::array<SystemState, MAX_CONTROLLERS> &states)
+    {
+        ::SystemState raw[MAX_CONTROLLERS];
+        int count = readCurrentData(checked(), raw, MAX_CONTROLLERS);
+        if (count < 0) {
+            throw std::system_error(errno, std::generic_category(), "Could not read from " + device());
+        }
+        for (int i = 0; i < count; ++i) {
+            states[i] = SystemState(raw[i]);
+        }
+        return count;
+    }
+
+    /**
+     * close and reopen the device, e.g. after the USB-serial link went away
+     */
+    void reopen()
+    {
+        if (reopenUSBConnection(checked()) != 0) {
+            throw std::system_error(errno, std::generic_category(), "Could not reopen " + device());
+        }
+    }
+
+    std::string device() const
+    {
+        return checked()->device;
+    }
+
+    /**
+     * the file descriptor of the device, e.g. for poll(). It changes when the device is reopened.
+     */
+    int fd() const
+    {
+        return checked()->fd;
+    }
+
+    /**
+     * the mode of the D-LOGG, MODE_1DL or MODE_2DL
+     */
+    unsigned char mode() const
+    {
+        return checked()->uvr_mode;
+    }
+
+    ConnectionStatistics const &statistics() const
+    {
+        return checked()->stats;
+    }
+
+    /**
+     * the C connection, e.g. for the step by step requests of communication.h
+     */
+    USBConnection *get() const noexcept
+    {
+        return conn_;
+    }
+
+    /**
+     * give up the ownership, the caller has to call cleanupUSBConnection()
+     */
+    USBConnection *release() noexcept
+    {
+        USBConnection *conn = conn_;
+        conn_ = nullptr;
+        return conn;
+    }
+
+    /**
+     * false for a connection that was moved from or released
+     */
+    explicit operator bool() const noexcept
+    {
+        return conn_ != nullptr;
+    }
+
+private:
+    /**
+     * the C connection, throws if there is none
+     */
+    USBConnection *checked() const
+    {
+        if (conn_ == nullptr) {
+            throw std::system_error(EBADF, std::generic_category(), "Connection was moved from or released");
+        }
+        return conn_;
+    }
+
+    USBConnection *conn_;
+};
+
+} // namespace uvr
+
+#endif /* UVR_HPP */